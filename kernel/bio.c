@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,7 +12,20 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
-
+// * To read a block into the cache without waiting, call
+//     bprefetch; the bprefetch kernel process reads it.
+// * To keep the disk busy with many requests at once, start
+//     each with bsubmit, or a batch with bsubmitv, then bwait
+//     for them. bsubmitv merges consecutive blocks.
+//
+// binit() sizes the cache to a fraction of physical memory.
+// Each buffer is on the hash chain of the bucket its block
+// hashes to, and that bucket's lock protects its refcnt, used
+// bit and chain link, so lookups of blocks in different buckets
+// don't contend. A block that isn't cached takes a free buffer
+// chosen by a CLOCK sweep over all buffers: one used since the
+// hand last passed gets a second chance. bcache.lock serializes
+// that, so that two misses on the same block can't both add it.
 
 #include "types.h"
 #include "param.h"
@@ -23,71 +36,228 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define BCACHEFRAC 16    // give the cache 1/BCACHEFRAC of memory
+#define MAXNBUF    16384 // but no more buffers than this
+#define NPREFETCH  32    // queued bprefetch() blocks
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;  // hash chain through next
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  struct spinlock lock;  // held while giving buffers new blocks
+  struct buf *buf;       // nbuf of them
+  int nbuf;
+  struct bucket *bucket; // nbucket of them
+  int nbucket;
+  int hand;              // next buffer the CLOCK sweep looks at
 } bcache;
 
+// Blocks for the bprefetch process to read: q[r % NPREFETCH]
+// up to q[w % NPREFETCH].
+struct {
+  struct spinlock lock;
+  struct {
+    uint dev;
+    uint blockno;
+  } q[NPREFETCH];
+  uint r;
+  uint w;
+} prefetch;
+
+// Allocate zeroed, physically contiguous memory for n bytes.
+static void*
+balloczeroed(uint64 n)
+{
+  void *p;
+  int order = 0;
+
+  while(((uint64)PGSIZE << order) < n)
+    order++;
+  if((p = kalloc_pages(order)) == 0)
+    panic("binit: out of memory");
+  memset(p, 0, (uint64)PGSIZE << order);
+  return p;
+}
+
+static struct bucket*
+bhash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 31 + blockno) % bcache.nbucket];
+}
+
+// Take b off bk's chain. Caller must hold bk->lock.
+static void
+bremove(struct bucket *bk, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bk->head; *pp != b; pp = &(*pp)->next)
+    if(*pp == 0)
+      panic("bremove");
+  *pp = b->next;
+}
+
+static void
+binsert(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head;
+  bk->head = b;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
+  char *data = 0;
+  int i;
+
+  initfairlock(&bcache.lock, "bcache");
+  initlock(&prefetch.lock, "prefetch");
 
-  initlock(&bcache.lock, "bcache");
+  bcache.nbuf = kfreepages() * (PGSIZE / BSIZE) / BCACHEFRAC;
+  if(bcache.nbuf > MAXNBUF)
+    bcache.nbuf = MAXNBUF;
+  if(bcache.nbuf < NBUF)
+    bcache.nbuf = NBUF;
+  // chains of about two buffers; odd, so block numbers spread out.
+  bcache.nbucket = bcache.nbuf / 2 | 1;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  bcache.buf = balloczeroed(bcache.nbuf * sizeof(struct buf));
+  bcache.bucket = balloczeroed(bcache.nbucket * sizeof(struct bucket));
+  for(bk = bcache.bucket; bk < bcache.bucket+bcache.nbucket; bk++)
+    initfairlock(&bk->lock, "bcache.bucket");
+
+  // Spread the buffers over the buckets, as blocks of device 0,
+  // which is never used; they move on demand.
+  for(i = 0; i < bcache.nbuf; i++){
+    b = &bcache.buf[i];
+    if(i % (PGSIZE / BSIZE) == 0 && (data = kalloc()) == 0)
+      panic("binit: out of memory");
+    b->data = (uchar*)data + (i % (PGSIZE / BSIZE)) * BSIZE;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->blockno = i;
+    binsert(bhash(0, i), b);
   }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Return the buffer for dev and blockno in bk, with another
+// reference, or 0 if it isn't cached. Caller must hold bk->lock.
 static struct buf*
-bget(uint dev, uint blockno)
+blookup(struct bucket *bk, uint dev, uint blockno)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bk->head; b != 0; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+      b->used = 1;
       return b;
     }
   }
+  return 0;
+}
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+// Take a free buffer off its chain for recycling, sweeping the
+// CLOCK hand over the buffers: a free one with its used bit set
+// has the bit cleared and is passed over this time round.
+// Caller must hold bcache.lock and bk->lock, and only the
+// holder of bcache.lock takes more than one bucket lock, so
+// this can't deadlock. Buffers only change buckets with
+// bcache.lock held, so each one's bucket is stable here.
+static struct buf*
+bclock(struct bucket *bk)
+{
+  struct bucket *obk;
+  struct buf *b;
+  int n, found;
+
+  // the second time round, every free buffer's bit is clear.
+  for(n = 0; n < 2 * bcache.nbuf; n++){
+    b = &bcache.buf[bcache.hand];
+    bcache.hand = (bcache.hand + 1) % bcache.nbuf;
+    obk = bhash(b->dev, b->blockno);
+    if(obk != bk)
+      acquire(&obk->lock);
+    found = 0;
+    if(b->refcnt == 0){
+      if(b->used){
+        b->used = 0;
+      } else {
+        bremove(obk, b);
+        found = 1;
+      }
     }
+    if(obk != bk)
+      release(&obk->lock);
+    if(found)
+      return b;
   }
   panic("bget: no buffers");
 }
 
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer, unless onlynew
+// is set and the block is cached, when return 0.
+static struct buf*
+bget1(uint dev, uint blockno, int onlynew)
+{
+  struct bucket *bk = bhash(dev, blockno);
+  struct buf *b;
+
+  acquire(&bk->lock);
+
+  // Is the block already cached?
+  if((b = blookup(bk, dev, blockno)) != 0){
+    if(onlynew){
+      b->refcnt--;
+      release(&bk->lock);
+      return 0;
+    }
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&bk->lock);
+
+  // Not cached. Look again with bcache.lock held, in case
+  // another miss added the block meanwhile.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = blookup(bk, dev, blockno)) != 0){
+    if(onlynew){
+      b->refcnt--;
+      b = 0;
+    }
+    goto out;
+  }
+
+  // Recycle a buffer no one is using.
+  b = bclock(bk);
+  binsert(bk, b);
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  b->used = 1;
+
+out:
+  release(&bk->lock);
+  release(&bcache.lock);
+  if(b)
+    acquiresleep(&b->lock);
+  return b;
+}
+
+static struct buf*
+bget(uint dev, uint blockno)
+{
+  return bget1(dev, blockno, 0);
+}
+
 // Return a locked buf with the contents of the indicated block.
 struct buf*
 bread(uint dev, uint blockno)
@@ -96,7 +266,10 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    if(dev == RAMDEV)
+      ramdiskrw(b, 0);
+    else
+      virtio_disk_rw(b, 0);
     b->valid = 1;
   }
   return b;
@@ -108,46 +281,210 @@ bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  if(b->dev == RAMDEV)
+    ramdiskrw(b, 1);
+  else
+    virtio_disk_rw(b, 1);
+}
+
+// Start reading (write = 0) or writing b's block without
+// waiting for the disk, so that many requests can be in
+// flight at once; bwait() waits for one to finish. b must be
+// locked, or a buf of the caller's own that isn't in the
+// cache, such as one for writing a copy of a block to disk
+// without touching the cached block.
+void
+bsubmit(struct buf *b, int write)
+{
+  if(b->dev == RAMDEV)
+    ramdiskrw(b, write);   // done at once
+  else
+    virtio_disk_submit(b, write);
+}
+
+// Start reading or writing the blocks of the n bufs at bs,
+// as bsubmit() would, but sorted by block number (bs is
+// sorted in place) so that the disk driver can merge runs
+// of consecutive blocks into single requests.
+void
+bsubmitv(struct buf **bs, int n, int write)
+{
+  struct buf *b;
+  int i, j;
+
+  for(i = 1; i < n; i++){
+    b = bs[i];
+    for(j = i; j > 0 && bs[j-1]->blockno > b->blockno; j--)
+      bs[j] = bs[j-1];
+    bs[j] = b;
+  }
+  for(i = 0; i < n && bs[i]->dev != RAMDEV; i++)
+    ;
+  if(i == n){
+    virtio_disk_submitv(bs, n, write);
+    return;
+  }
+  for(i = 0; i < n; i++)
+    bsubmit(bs[i], write);
+}
+
+void
+bwait(struct buf *b)
+{
+  if(b->dev != RAMDEV)
+    virtio_disk_wait(b);
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  release(&bk->lock);
+}
+
+// Drop the cached copy of block blockno of dev, if any, so
+// that the block is read from disk next time, for a caller
+// that has changed or is about to change the disk's copy
+// without going through the cache. If the copy is in use,
+// wait for it if wait is set, else leave it and return -1.
+// The caller must not have the copy pinned.
+int
+binval(uint dev, uint blockno, int wait)
+{
+  struct bucket *bk = bhash(dev, blockno);
+  struct buf *b;
+
+  acquire(&bk->lock);
+  for(b = bk->head; b != 0; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  if(b == 0 || b->refcnt == 0){
+    if(b)
+      b->valid = 0;
+    release(&bk->lock);
+    return 0;
   }
-  
-  release(&bcache.lock);
+  if(!wait){
+    release(&bk->lock);
+    return -1;
+  }
+  b->refcnt++;
+  release(&bk->lock);
+  acquiresleep(&b->lock);
+  b->valid = 0;
+  brelse(b);
+  return 0;
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
+// Ask the bprefetch process to read block blockno of dev into
+// the cache, without waiting for it. It's only a hint: it's
+// dropped if the block is cached or too many are queued.
+void
+bprefetch(uint dev, uint blockno)
+{
+  struct bucket *bk = bhash(dev, blockno);
+  struct buf *b;
+
+  acquire(&bk->lock);
+  for(b = bk->head; b != 0; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      break;
+  release(&bk->lock);
+  if(b)
+    return;
+
+  acquire(&prefetch.lock);
+  if(prefetch.w - prefetch.r < NPREFETCH){
+    prefetch.q[prefetch.w % NPREFETCH].dev = dev;
+    prefetch.q[prefetch.w % NPREFETCH].blockno = blockno;
+    prefetch.w++;
+    wakeup(&prefetch);
+  }
+  release(&prefetch.lock);
+}
+
+// The disk interrupt's completion of a prefetch read:
+// release the buffer for bprefetcher, which didn't wait.
+static void
+bprefetchdone(struct buf *b)
+{
+  struct bucket *bk = bhash(b->dev, b->blockno);
 
+  b->valid = 1;
+  b->iodone = 0;
+  releasesleep(&b->lock);
+  acquire(&bk->lock);
+  b->refcnt--;
+  release(&bk->lock);
+}
+
+// Body of the bprefetch kernel process: take all the queued
+// blocks that aren't cached, and start reading them as one
+// batch without waiting, so that the disk driver can merge
+// consecutive ones.
+static void
+bprefetcher(void)
+{
+  uint dev, blockno;
+  struct buf *bs[NPREFETCH];
+  int n;
+
+  acquire(&prefetch.lock);
+  for(;;){
+    if(prefetch.r == prefetch.w){
+      sleep(&prefetch, &prefetch.lock);
+      continue;
+    }
+    n = 0;
+    while(prefetch.r != prefetch.w){
+      dev = prefetch.q[prefetch.r % NPREFETCH].dev;
+      blockno = prefetch.q[prefetch.r % NPREFETCH].blockno;
+      prefetch.r++;
+      release(&prefetch.lock);
+      // only a buffer no one else has: waiting for one while
+      // holding others could deadlock with bread()ers.
+      if((bs[n] = bget1(dev, blockno, 1)) != 0){
+        bs[n]->iodone = bprefetchdone;
+        n++;
+      }
+      acquire(&prefetch.lock);
+    }
+    release(&prefetch.lock);
+    bsubmitv(bs, n, 0);
+    acquire(&prefetch.lock);
+  }
+}
+
+void
+bprefetchinit(void)
+{
+  kproc("bprefetch", bprefetcher);
+}
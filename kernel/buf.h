@@ -5,8 +5,10 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
-  uchar data[BSIZE];
+  int used;     // used since the CLOCK hand last passed?
+  struct buf *next; // hash chain
+  uchar *data;  // BSIZE bytes
+  void (*iodone)(struct buf*); // if set, called when the disk is done
+  struct buf *ionext; // next buf of the same disk request
 };
 
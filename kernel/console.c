@@ -75,17 +75,21 @@ consolewrite(int user_src, uint64 src, int n)
 // copy (up to) a whole input line to dst.
 // user_dist indicates whether dst is a user
 // or kernel address.
+// the bytes are taken out of cons.buf a batch at a time and
+// copied to dst after releasing cons.lock, since faulting in
+// the pages of dst may sleep.
 //
 int
 consoleread(int user_dst, uint64 dst, int n)
 {
   uint target;
-  int c;
-  char cbuf;
+  int c, m, eol;
+  char cbuf[INPUT_BUF];
 
   target = n;
-  acquire(&cons.lock);
-  while(n > 0){
+  eol = 0;
+  while(n > 0 && !eol){
+    acquire(&cons.lock);
     // wait until interrupt handler has put some
     // input into cons.buffer.
     while(cons.r == cons.w){
@@ -96,32 +100,37 @@ consoleread(int user_dst, uint64 dst, int n)
       sleep(&cons.r, &cons.lock);
     }
 
-    c = cons.buf[cons.r++ % INPUT_BUF];
+    for(m = 0; m < n && m < sizeof(cbuf) && cons.r != cons.w; ){
+      c = cons.buf[cons.r++ % INPUT_BUF];
+
+      if(c == C('D')){  // end-of-file
+        if(n - m < target){
+          // Save ^D for next time, to make sure
+          // caller gets a 0-byte result.
+          cons.r--;
+        }
+        eol = 1;
+        break;
+      }
+
+      cbuf[m++] = c;
 
-    if(c == C('D')){  // end-of-file
-      if(n < target){
-        // Save ^D for next time, to make sure
-        // caller gets a 0-byte result.
-        cons.r--;
+      if(c == '\n'){
+        // a whole line has arrived, return to
+        // the user-level read().
+        eol = 1;
+        break;
       }
-      break;
     }
+    release(&cons.lock);
 
-    // copy the input byte to the user-space buffer.
-    cbuf = c;
-    if(either_copyout(user_dst, dst, &cbuf, 1) == -1)
+    // copy the input bytes to the user-space buffer.
+    if(either_copyout(user_dst, dst, cbuf, m) == -1)
       break;
 
-    dst++;
-    --n;
-
-    if(c == '\n'){
-      // a whole line has arrived, return to
-      // the user-level read().
-      break;
-    }
+    dst += m;
+    n -= m;
   }
-  release(&cons.lock);
 
   return target - n;
 }
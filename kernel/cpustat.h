@@ -0,0 +1,7 @@
+// Filled in by cpustat(), one for each CPU that has started.
+// Times are in CLINT_MTIME cycles, ten million a second in qemu.
+struct cpustat {
+  uint64 uptime;   // since the CPU began scheduling
+  uint64 idle;     // of that, halted with nothing to run
+  uint64 nipi;     // wakeups from other CPUs
+};
@@ -0,0 +1,176 @@
+// Directory name cache.
+//
+// The name cache remembers the results of dirlookup(): which
+// inode, if any, a name in a directory refers to, and where in
+// the directory its entry is. A name that isn't there is cached
+// too, with inum 0, since path searches and creates look up
+// missing names as often as present ones.
+//
+// Interface:
+// * dirlookup() calls dclookup before scanning the directory,
+//     and dcenter with what the scan found.
+// * dirlink() calls dcenter for the name it adds, and unlink
+//     calls dcinval for the name it removes.
+// * When a directory inode is freed, iput() calls dcpurge so
+//     that a new directory with the same inum starts afresh.
+//
+// Entries are found by a hash of (dev, directory inum, name)
+// and recycled with the CLOCK algorithm. The caller holds the
+// directory's lock, so no one changes the directory between
+// a lookup and the dcenter that records it; dcache.lock
+// protects the entries.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+#define NDHASH 127
+
+struct dentry {
+  uint dev;
+  uint dir;           // directory inum; 0 if the entry is free
+  char name[DIRSIZ];
+  uint inum;          // 0 if name isn't in dir
+  uint off;           // offset of name's entry in dir
+  int used;           // looked up since the clock hand passed
+  struct dentry *next; // hash chain
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dentry[NDCACHE];
+  struct dentry *hash[NDHASH];
+  int hand;           // next entry the clock looks at
+} dcache;
+
+void
+dcinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static int
+dhash(uint dev, uint dir, char *name)
+{
+  uint h = dev * 31 + dir;
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDHASH;
+}
+
+// Return the entry for name in directory dir, or 0.
+// Caller must hold dcache.lock.
+static struct dentry*
+dfind(uint dev, uint dir, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.hash[dhash(dev, dir, name)]; d; d = d->next)
+    if(d->dev == dev && d->dir == dir && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// Take entry d off its hash chain and mark it free.
+// Caller must hold dcache.lock.
+static void
+dremove(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = &dcache.hash[dhash(d->dev, d->dir, d->name)]; *pp != d; pp = &(*pp)->next)
+    ;
+  *pp = d->next;
+  d->dir = 0;
+}
+
+// Look up name in directory dp. If the cache knows, return 1
+// with the name's inum in *inum, 0 if it isn't there, and if
+// it is, its entry's offset in *poff. Returns 0 if the cache
+// doesn't know. Caller must hold dp->lock.
+int
+dclookup(struct inode *dp, char *name, uint *inum, uint *poff)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp->dev, dp->inum, name)) == 0){
+    release(&dcache.lock);
+    return 0;
+  }
+  d->used = 1;
+  *inum = d->inum;
+  if(poff)
+    *poff = d->off;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name in directory dp refers to inode inum,
+// whose entry is at offset off, or isn't there if inum is 0.
+// Caller must hold dp->lock.
+void
+dcenter(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+  int i, h;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp->dev, dp->inum, name)) == 0){
+    // recycle the first entry the clock finds
+    // free or not looked up since it last passed.
+    for(i = 0; ; i++){
+      d = &dcache.dentry[dcache.hand];
+      dcache.hand = (dcache.hand + 1) % NDCACHE;
+      if(d->dir == 0 || !d->used || i >= NDCACHE)
+        break;
+      d->used = 0;
+    }
+    if(d->dir)
+      dremove(d);
+    d->dev = dp->dev;
+    d->dir = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    h = dhash(d->dev, d->dir, d->name);
+    d->next = dcache.hash[h];
+    dcache.hash[h] = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  d->used = 1;
+  release(&dcache.lock);
+}
+
+// Forget what the cache knows about name in directory dp.
+// Caller must hold dp->lock.
+void
+dcinval(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp->dev, dp->inum, name)) != 0)
+    dremove(d);
+  release(&dcache.lock);
+}
+
+// Forget every name cached for directory dir,
+// which has just been freed.
+void
+dcpurge(uint dev, uint dir)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.dentry; d < dcache.dentry + NDCACHE; d++)
+    if(d->dir == dir && d->dev == dev)
+      dremove(d);
+  release(&dcache.lock);
+}
@@ -2,20 +2,32 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct memstat;
+struct page;
 struct pipe;
 struct proc;
+struct lockstat;
 struct spinlock;
 struct sleeplock;
+struct slabcache;
 struct stat;
 struct superblock;
+struct timer;
+struct vma;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bsubmit(struct buf*, int);
+void            bsubmitv(struct buf**, int, int);
+void            bwait(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             binval(uint, uint, int);
+void            bprefetch(uint, uint);
+void            bprefetchinit(void);
 
 // console.c
 void            consoleinit(void);
@@ -24,16 +36,27 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execfault(struct proc*, uint64);
 
 // file.c
 struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
-struct file*    fileundup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filepread(struct file*, uint64, int, uint);
+int             filepwrite(struct file*, uint64, int, uint);
+int             filesend(struct file*, struct file*, int, int);
+int             filesync(struct file*);
+
+// dcache.c
+void            dcinit(void);
+int             dclookup(struct inode*, char*, uint*, uint*);
+void            dcenter(struct inode*, char*, uint, uint);
+void            dcinval(struct inode*, char*);
+void            dcpurge(uint, uint);
 
 // fs.c
 void            fsinit(int);
@@ -46,47 +69,84 @@ void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
+void            ilockshared(struct inode*);
+void            iunlockshared(struct inode*);
 void            iupdate(struct inode*);
+void            ireserve(struct inode*, uint, uint);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
+int             directi(struct inode*, int, uint64, uint, uint);
+struct buf*     iblock(struct inode*, uint);
+int             fsmount(int, char*);
+int             ismountpoint(struct inode*);
 void            itrunc(struct inode*);
 
 // ramdisk.c
 void            ramdiskinit(void);
-void            ramdiskintr(void);
-void            ramdiskrw(struct buf*);
+void            ramdiskrw(struct buf*, int);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_zeroed(void);
+int             kzeroidle(void);
 void            kfree(void *);
 void            kinit(void);
+void            kdup(void *);
+int             krefcnt(void *);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+void*           kallocmega(void);
+void            kfreemega(void *);
+uint64          ksteals(void);
+uint64          ktotalpages(void);
+uint64          kfreepages(void);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+void            log_sync(void);
+
+// pcache.c
+void            pcinit(void);
+struct page*    pcget(struct inode*, uint);
+void            pcdup(uint64);
+void            pcput(uint64);
+void            pcupdate(struct inode*, uint, uint);
+void            pcinval(struct inode*);
+void            pcqueue(struct inode*, uint64);
+void            pcprefetch(struct inode*, uint, uint);
+int             pcshrink(void);
+void            pcflushinit(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             piperead(struct pipe*, int, uint64, int);
+int             pipewrite(struct pipe*, int, uint64, int);
+int             pipewaitroom(struct pipe*);
+int             pipeput(struct pipe*, char*, int);
+int             pipesize(struct pipe*);
+int             piperesize(struct pipe*, int);
 
 // printf.c
 void            printf(char*, ...);
 void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
+int             klogget(void);
 
 // proc.c
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
 int             growproc(int);
+void            kproc(char*, void (*)(void));
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
@@ -102,26 +162,50 @@ void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
+int             schedtick(void);
+int             setpriority(int, int);
+int             clone(uint64, uint64, uint64);
+int             spawn(char*, char**, int*);
+void            killthreads(struct proc*);
+int             wakeupn(void*, int);
+int             futexwait(uint64, int);
+int             futexwake(uint64, int);
+void            ipi(int);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+int             procmemstat(int, struct memstat*);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// slab.c
+void            slabinit(struct slabcache*, char*, uint);
+void*           slaballoc(struct slabcache*);
+void            slabfree(struct slabcache*, void*);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+void            initfairlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
+struct lockstat* lockstatof(char*, int);
+void            lockstatacquire(struct lockstat*, int);
+void            lockstatrelease(struct lockstat*, uint64);
+int             lockstatcopy(uint64, int);
+void            lockstatreset(void);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
+void            acquiresleepshared(struct sleeplock*);
+void            releasesleepshared(struct sleeplock*);
+int             holdingsleepshared(struct sleeplock*);
 
 // string.c
 int             memcmp(const void*, const void*, uint);
@@ -139,15 +223,50 @@ int             argaddr(int, uint64 *);
 int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
+int             sysstatcopy(uint64, int);
+void            sysstatreset(void);
 
 // sysfile.c
+int             fdclose(int);
+int             mmapfault(uint64, int);
 uint64          munmap(uint64, int);
+int             msync(uint64, int, int);
+void            munmapall(void);
+int             mmapreclaim(void);
+int             mmapfork(struct proc*, struct proc*);
 
-// trap.c
+// timer.c
 extern uint     ticks;
-void            trapinit(void);
+void            timersinit(void);
+void            timeradd(struct timer*);
+void            timerdel(struct timer*);
+void            timerarm(void);
+int             timerintr(void);
+void            timertick(void);
+int             sleepuntil(uint64);
+
+// prof.c
+extern uint64   profcycles;
+void            profinit(void);
+void            profsample(void);
+int             profset(int);
+int             profcopy(uint64, int);
+
+// trace.c
+extern uint     tracemask;
+void            traceinit(void);
+void            traceev(int, uint64, uint64);
+int             traceset(int);
+int             tracecopy(uint64, int);
+
+// uring.c
+void            uringinit(void);
+uint64          uringsetup(void);
+int             uringenter(int, int);
+void            uringfree(struct proc*);
+
+// trap.c
 void            trapinithart(void);
-extern struct spinlock tickslock;
 void            usertrapret(void);
 
 // uart.c
@@ -156,6 +275,8 @@ void            uartintr(void);
 void            uartputc(int);
 void            uartputc_sync(int);
 int             uartgetc(void);
+void            uartkick(void);
+void            uartdrain(void);
 
 // vm.c
 void            kvminit(void);
@@ -166,12 +287,27 @@ pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, uint64);
+int             uvmasid(struct proc*);
+void            uvmstale(pagetable_t, uint64, uint64);
+void            tlbpoll(void);
+int             cowfault(pagetable_t, uint64);
+int             uvmshare(pagetable_t, pagetable_t, uint64, uint64);
+int             uvmsplit(pagetable_t, uint64);
+int             uvmmove(pagetable_t, uint64, uint64, uint64);
+int             uvmmega(pagetable_t, uint64, int);
+uint64          uvmresident(pagetable_t, uint64, uint64);
+int             lazyalloc(pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+pte_t*          walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
+uint64          uvmpa(pagetable_t, uint64, int);
+uint64          uvmhold(pagetable_t, uint64, int);
+void            uvmprefault(uint64, uint64, int);
+int             uvmfault(pagetable_t, uint64, uint64, int);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 
@@ -181,10 +317,26 @@ void            plicinithart(void);
 int             plic_claim(void);
 void            plic_complete(int);
 
+// vma.c
+void            vmainit(void);
+struct vma*     vmaalloc(void);
+void            vmafree(struct vma*);
+struct vma*     vmanext(struct proc*, uint64);
+struct vma*     vmalookup(struct proc*, uint64);
+int             vmainsert(struct proc*, struct vma*);
+void            vmaremove(struct proc*, struct vma*);
+struct vma*     vmasplit(struct proc*, struct vma*, uint64);
+void            vmamove(struct proc*, struct vma*, uint64);
+int             vmacopy(struct proc*, struct proc*);
+
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_submit(struct buf *, int);
+void            virtio_disk_submitv(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
+void            virtio_disk_stats(void);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -3,11 +3,15 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "fs.h"
+#include "file.h"
+#include "pcache.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
+#define min(a, b) ((a) < (b) ? (a) : (b))
 
 int
 exec(char *path, char **argv)
@@ -16,18 +20,25 @@ exec(char *path, char **argv)
   int i, off;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *oldexe;
   struct proghdr ph;
+  struct execseg seg[NEXECSEG];
+  int nseg = 0, locked;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
+  // only a process's first thread can replace its program.
+  if(p->mm != p)
+    return -1;
+
   begin_op();
 
   if((ip = namei(path)) == 0){
     end_op();
     return -1;
   }
-  ilock(ip);
+  ilockshared(ip);
+  locked = 1;
 
   // Check ELF header
   if(readi(ip, 0, (uint64)&elf, 0, sizeof(elf)) != sizeof(elf))
@@ -38,7 +49,8 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Note where the program's segments go. Their pages are
+  // read in from the file as they are touched; see execfault().
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -46,23 +58,30 @@ exec(char *path, char **argv)
       continue;
     if(ph.memsz < ph.filesz)
       goto bad;
-    if(ph.vaddr + ph.memsz < ph.vaddr)
-      goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr + ph.memsz < ph.vaddr || ph.vaddr + ph.memsz >= USERTOP)
       goto bad;
-    sz = sz1;
     if((ph.vaddr % PGSIZE) != 0)
       goto bad;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
       goto bad;
+    if(ph.memsz > 0 && ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
+    if(ph.filesz == 0)
+      continue;
+    if(nseg >= NEXECSEG)
+      goto bad;
+    seg[nseg].va = ph.vaddr;
+    seg[nseg].filesz = ph.filesz;
+    seg[nseg].off = ph.off;
+    nseg++;
   }
-  iunlockput(ip);
+  // keep ip for execfault().
+  iunlockshared(ip);
   end_op();
-  ip = 0;
+  locked = 0;
 
   p = myproc();
-  uint64 oldsz = p->sz;
+  uint64 oldsz = p->mm->sz;
 
   // Allocate two pages at the next page boundary.
   // Use the second as the user stack.
@@ -108,13 +127,34 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
     
+  // The other threads go with the old image,
+  // and so do its ring and mapped files.
+  killthreads(p);
+  uringfree(p);
+  // memstat() may be looking at the old image.
+  acquiresleep(&p->mm->vmlock);
+  munmapall();
+
   // Commit to the user image.
-  oldpagetable = p->pagetable;
-  p->pagetable = pagetable;
-  p->sz = sz;
+  oldpagetable = p->mm->pagetable;
+  oldexe = p->mm->exe;
+  p->mm->pagetable = pagetable;
+  p->mm->exe = ip;
+  p->mm->nexecseg = nseg;
+  memmove(p->mm->execseg, seg, sizeof(seg));
+  p->mm->sz = sz;
+  p->mm->ustack = stackbase;
+  // the TLBs may hold the old image's PTEs under p's ASID.
+  p->mm->asidgen = 0;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  releasesleep(&p->mm->vmlock);
+  if(oldexe){
+    begin_op();
+    iput(oldexe);
+    end_op();
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -122,33 +162,71 @@ exec(char *path, char **argv)
   if(pagetable)
     proc_freepagetable(pagetable, sz);
   if(ip){
-    iunlockput(ip);
+    if(locked)
+      iunlockshared(ip);
+    else
+      begin_op();
+    iput(ip);
     end_op();
   }
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+// The current process p touched page va of its heap, text or
+// stack for the first time. If the page holds bytes of the
+// program file, read it in: a whole page-aligned page of the
+// file maps the page cache's copy, copy-on-write, so that
+// processes running the same program share it until they store
+// to it; a partial page gets a private copy, zero-filled past
+// the file's bytes.
+// Returns 0 on success, -1 if out of memory or the file can't
+// be read, or 1 if va holds no bytes of the file, in which case
+// the caller zero-fills it.
+int
+execfault(struct proc *p, uint64 va)
 {
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
+  struct execseg *s;
+  struct page *pg;
+  uint64 a, n, pa;
+  char *mem;
+  int r = -1;
+
+  va = PGROUNDDOWN(va);
+  for(s = p->mm->execseg; s < &p->mm->execseg[p->mm->nexecseg]; s++)
+    if(va >= s->va && va < s->va + s->filesz)
+      break;
+  if(s == &p->mm->execseg[p->mm->nexecseg])
+    return 1;
+  a = va - s->va;
+  n = min(s->filesz - a, PGSIZE);
+
+  // the caller may hold the lock already, if it faulted
+  // copying to or from the program file itself.
+  ilockshared(p->mm->exe);
+  if(n == PGSIZE && (s->off + a) % PGSIZE == 0){
+    if((pg = pcget(p->mm->exe, (s->off + a) / PGSIZE)) == 0)
+      goto out;
+    // the mapping holds its own reference to the memory, so
+    // the cache can give the slot to another page meanwhile.
+    pa = (uint64)pg->data;
+    kdup((void*)pa);
+    pcput(pa);
+    if(mappages(p->mm->pagetable, va, PGSIZE, pa, PTE_R|PTE_X|PTE_U|PTE_COW) != 0){
+      kfree((void*)pa);
+      goto out;
+    }
+    r = 0;
+    goto out;
+  }
+  if((mem = kalloc_zeroed()) == 0)
+    goto out;
+  if(readi(p->mm->exe, 0, (uint64)mem, s->off + a, n) != n ||
+     mappages(p->mm->pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    goto out;
   }
-  
-  return 0;
+  r = 0;
+out:
+  iunlockshared(p->mm->exe);
+  return r;
 }
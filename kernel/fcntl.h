@@ -3,6 +3,18 @@
 #define O_RDWR    0x002
 #define O_CREATE  0x200
 #define O_TRUNC   0x400
+#define O_DIRECT  0x800
+
+// fcntl() commands
+#define F_SETPIPE_SZ 1031  // resize a pipe's buffer
+#define F_GETPIPE_SZ 1032
+
+// one buffer of a readv() or writev().
+struct iovec {
+  void *iov_base;
+  unsigned long iov_len;
+};
+#define IOV_MAX   64   // most buffers per call
 
 #ifdef LAB_MMAP
 #define PROT_NONE       0x0
@@ -12,4 +24,20 @@
 
 #define MAP_SHARED      0x01
 #define MAP_PRIVATE     0x02
+#define MAP_ANONYMOUS   0x20
+
+#define MS_ASYNC        0x1
+#define MS_SYNC         0x4
+
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
+
+#define MREMAP_MAYMOVE  0x1
 #endif
+
+// futex() operations
+#define FUTEX_WAIT      0
+#define FUTEX_WAKE      1
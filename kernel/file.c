@@ -10,37 +10,36 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "buf.h"
 #include "stat.h"
 #include "proc.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
 struct {
-  struct spinlock lock;
-  struct file file[NFILE];
+  struct spinlock lock; // protects ref counts
+  struct slabcache cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  slabinit(&ftable.cache, "file", sizeof(struct file));
 }
 
 // Allocate a file structure.
+// Returns 0 if out of memory.
 struct file*
 filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = slaballoc(&ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -55,17 +54,6 @@ filedup(struct file *f)
   return f;
 }
 
-struct file*
-fileundup(struct file *f)
-{
-  acquire(&ftable.lock);
-  if(f->ref < 1)
-    panic("fileundup");
-  f->ref--;
-  release(&ftable.lock);
-  return f;
-}
-
 // Close file f.  (Decrement ref count, close when reaches 0.)
 void
 fileclose(struct file *f)
@@ -83,6 +71,7 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  slabfree(&ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -102,16 +91,86 @@ filestat(struct file *f, uint64 addr)
   struct stat st;
   
   if(f->type == FD_INODE || f->type == FD_DEVICE){
-    ilock(f->ip);
+    ilockshared(f->ip);
     stati(f->ip, &st);
-    iunlock(f->ip);
-    if(copyout(p->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    iunlockshared(f->ip);
+    if(copyout(p->mm->pagetable, addr, (char *)&st, sizeof(st)) < 0)
       return -1;
     return 0;
   }
   return -1;
 }
 
+// Read from inode file f at *off, advancing *off.
+// addr is a user virtual address if user is set,
+// else a kernel one.
+static int
+inoderead(struct file *f, int user, uint64 addr, int n, uint *off)
+{
+  int r;
+
+  if(user)
+    uvmprefault(addr, n, 1);
+  ilockshared(f->ip);
+  if(user && f->direct && (r = directi(f->ip, 0, addr, *off, n)) == n)
+    *off += r;
+  else if((r = readi(f->ip, user, addr, *off, n)) > 0)
+    *off += r;
+  iunlockshared(f->ip);
+  return r;
+}
+
+// Write to inode file f at *off, advancing *off.
+// addr is as for inoderead().
+static int
+inodewrite(struct file *f, int user, uint64 addr, int n, uint *off)
+{
+  // write a few blocks at a time to avoid exceeding
+  // the maximum log transaction size, including
+  // i-node, up to three indirect blocks (a write can
+  // cross from one indirect block into the next),
+  // allocation blocks, and 2 blocks of slop for
+  // non-aligned writes. this really belongs lower down,
+  // since writei() might be writing a device like the console.
+  int max = ((MAXOPBLOCKS-1-3-2) / 2) * BSIZE;
+  int i = 0, r;
+
+  if(user)
+    uvmprefault(addr, n, 0);
+  // whole blocks the file already has can go straight to
+  // disk, outside any transaction; the rest go through
+  // the log as usual.
+  if(user && f->direct){
+    ilock(f->ip);
+    if((r = directi(f->ip, 1, addr, *off, n)) > 0){
+      *off += r;
+      i = r;
+    }
+    iunlock(f->ip);
+  }
+  while(i < n){
+    int n1 = n - i;
+    if(n1 > max)
+      n1 = max;
+
+    begin_op();
+    ilock(f->ip);
+    if(i == 0)
+      ireserve(f->ip, *off, n);
+    if ((r = writei(f->ip, user, addr + i, *off, n1)) > 0)
+      *off += r;
+    iunlock(f->ip);
+    end_op();
+
+    if(r != n1){
+      // error from writei
+      break;
+    }
+    i += r;
+  }
+  return i == n ? n : -1;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -123,16 +182,13 @@ fileread(struct file *f, uint64 addr, int n)
     return -1;
 
   if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
+    r = piperead(f->pipe, 1, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
+    r = inoderead(f, 1, addr, n, &f->off);
   } else {
     panic("fileread");
   }
@@ -145,45 +201,19 @@ fileread(struct file *f, uint64 addr, int n)
 int
 filewrite(struct file *f, uint64 addr, int n)
 {
-  int r, ret = 0;
+  int ret = 0;
 
   if(f->writable == 0)
     return -1;
 
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    ret = pipewrite(f->pipe, 1, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
-      iunlock(f->ip);
-      end_op();
-
-      if(r != n1){
-        // error from writei
-        break;
-      }
-      i += r;
-    }
-    ret = (i == n ? n : -1);
+    ret = inodewrite(f, 1, addr, n, &f->off);
   } else {
     panic("filewrite");
   }
@@ -191,3 +221,153 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Wait until file f's updates are on disk. The log holds
+// data and metadata alike, so that means all of them.
+int
+filesync(struct file *f)
+{
+  if(f->type == FD_PIPE)
+    return -1;
+  if(f->type == FD_INODE)
+    log_sync();
+  return 0;
+}
+
+// Read from file f at offset off, without using or
+// moving f's own offset. Only files have offsets.
+int
+filepread(struct file *f, uint64 addr, int n, uint off)
+{
+  if(f->readable == 0 || f->type != FD_INODE)
+    return -1;
+  return inoderead(f, 1, addr, n, &off);
+}
+
+// Write to file f at offset off, as filepread() reads.
+int
+filepwrite(struct file *f, uint64 addr, int n, uint off)
+{
+  if(f->writable == 0 || f->type != FD_INODE)
+    return -1;
+  return inodewrite(f, 1, addr, n, &off);
+}
+
+
+// Copy up to n bytes of inode ip's data at *off straight from
+// the buffer cache into pipe pi, advancing *off. Waits for
+// room in the pipe without holding the inode or a block, so
+// that the pipe's reader may use them meanwhile.
+static int
+sendpipe(struct inode *ip, struct pipe *pi, uint *off, int n)
+{
+  struct buf *bp;
+  int tot = 0, m, r = 0;
+
+  while(tot < n){
+    if(pipewaitroom(pi) < 0){
+      r = -1;
+      break;
+    }
+    ilockshared(ip);
+    if(*off >= ip->size){
+      iunlockshared(ip);
+      break;
+    }
+    m = n - tot;
+    if(m > ip->size - *off)
+      m = ip->size - *off;
+    if(m > BSIZE - *off % BSIZE)
+      m = BSIZE - *off % BSIZE;
+    bp = iblock(ip, *off);
+    if((r = pipeput(pi, (char*)bp->data + *off % BSIZE, m)) > 0){
+      *off += r;
+      tot += r;
+    }
+    brelse(bp);
+    iunlockshared(ip);
+    if(r < 0)
+      break;
+  }
+  return tot > 0 ? tot : r;
+}
+
+// Read up to n bytes of f into kernel memory at dst.
+static int
+kread(struct file *f, char *dst, int n, uint *off)
+{
+  if(f->type == FD_PIPE)
+    return piperead(f->pipe, 0, (uint64)dst, n);
+  if(f->type == FD_DEVICE){
+    if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
+      return -1;
+    return devsw[f->major].read(0, (uint64)dst, n);
+  }
+  return inoderead(f, 0, (uint64)dst, n, off);
+}
+
+// Write n bytes from kernel memory at src to f.
+static int
+kwrite(struct file *f, char *src, int n)
+{
+  if(f->type == FD_PIPE)
+    return pipewrite(f->pipe, 0, (uint64)src, n);
+  if(f->type == FD_DEVICE){
+    if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
+      return -1;
+    return devsw[f->major].write(0, (uint64)src, n);
+  }
+  return inodewrite(f, 0, (uint64)src, n, &f->off);
+}
+
+// Move up to n bytes from in to out inside the kernel, for
+// sendfile(). If off is -1, in is read at its own offset,
+// else at off, leaving its offset alone. A file's data goes
+// from the buffer cache straight into a pipe; otherwise it
+// passes through a kernel page, but never user memory. Stops
+// early at the end of in, or after a short read from a pipe
+// or device, which has given what it has for now.
+// Returns the number of bytes moved, or -1.
+int
+filesend(struct file *out, struct file *in, int off, int n)
+{
+  uint o, *offp = &in->off;
+  char *page;
+  int tot, m, r, w;
+
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+  if(off != -1){
+    if(in->type != FD_INODE || off < 0)
+      return -1;
+    o = off;
+    offp = &o;
+  }
+  if(in->type == FD_INODE && out->type == FD_PIPE)
+    return sendpipe(in->ip, out->pipe, offp, n);
+
+  if((page = kalloc()) == 0)
+    return -1;
+  for(tot = 0; tot < n; tot += w){
+    m = n - tot;
+    if(m > PGSIZE)
+      m = PGSIZE;
+    if((r = kread(in, page, m, offp)) <= 0){
+      if(r < 0 && tot == 0)
+        tot = -1;
+      break;
+    }
+    if((w = kwrite(out, page, r)) != r){
+      if(w > 0)
+        tot += w;
+      else if(tot == 0)
+        tot = -1;
+      break;
+    }
+    if(r < m && in->type != FD_INODE){
+      tot += w;
+      break;
+    }
+  }
+  kfree(page);
+  return tot;
+}
@@ -15,16 +15,56 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
-#include "proc.h"
 #include "sleeplock.h"
+#include "proc.h"
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "slab.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+
+// blocks readi() reads ahead of a sequential reader.
+#define RABLOCKS 8
+
+// least and most blocks ireserve() reserves at a time.
+#define RESVMIN 8
+#define RESVMAX 128
+
+// Most blocks directi() has in flight at once.
+#define DIRECTBATCH 16
+
 // there should be one superblock per disk device, but we run with
 // only one device
-struct superblock sb; 
+// Each mounted device's superblock, and an in-memory summary
+// of its free blocks and inodes, built by fsinit() and kept up
+// to date by the allocators, so that they can skip full parts
+// of the disk and go on from where they last allocated instead
+// of scanning from the start.
+struct fsdev {
+  uint dev;           // 0 if this slot is unused
+  struct superblock sb;
+  struct spinlock lock;
+  uint nblock;        // free blocks
+  uint ninode;        // free inodes
+  uint bcursor;       // where balloc() looks first
+  uint icursor;       // where ialloc() looks first
+  uint resvnext;      // where ireserve() looks for a new run
+  uint bmapfree[FSSIZE/BPB + 1]; // free blocks per bitmap block
+};
+static struct fsdev fsdev[NFSDEV];
+
+// Return dev's superblock and free-space summary.
+static struct fsdev*
+fsof(uint dev)
+{
+  struct fsdev *fs;
+
+  for(fs = fsdev; fs < fsdev + NFSDEV; fs++)
+    if(fs->dev == dev)
+      return fs;
+  panic("fsof: no file system");
+}
 
 // Read the super block.
 static void
@@ -37,13 +77,52 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
-// Init fs
+// Count the free blocks and inodes, after log recovery.
+static void
+fsfreeinit(struct fsdev *fs)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  uint b, bi, inum, dev = fs->dev;
+
+  initlock(&fs->lock, "fsfree");
+  if(fs->sb.size > FSSIZE)
+    panic("fsinit: file system too big");
+  for(b = 0; b < fs->sb.size; b += BPB){
+    bp = bread(dev, BBLOCK(b, fs->sb));
+    for(bi = 0; bi < BPB && b + bi < fs->sb.size; bi++){
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        fs->bmapfree[b / BPB]++;
+    }
+    fs->nblock += fs->bmapfree[b / BPB];
+    brelse(bp);
+  }
+  for(inum = 1; inum < fs->sb.ninodes; inum++){
+    bp = bread(dev, IBLOCK(inum, fs->sb));
+    dip = (struct dinode*)bp->data + inum%IPB;
+    if(dip->type == 0)
+      fs->ninode++;
+    brelse(bp);
+  }
+  fs->icursor = 1;
+}
+
+// Init fs on dev. Only the root device has a log;
+// updates to the others' blocks are written through.
 void
 fsinit(int dev) {
-  readsb(dev, &sb);
-  if(sb.magic != FSMAGIC)
+  struct fsdev *fs;
+
+  for(fs = fsdev; fs->dev != 0; fs++)
+    if(fs == fsdev + NFSDEV - 1)
+      panic("fsinit: too many file systems");
+  readsb(dev, &fs->sb);
+  if(fs->sb.magic != FSMAGIC)
     panic("invalid file system");
-  initlog(dev, &sb);
+  fs->dev = dev;
+  if(dev == ROOTDEV)
+    initlog(dev, &fs->sb);
+  fsfreeinit(fs);
 }
 
 // Zero a block.
@@ -60,21 +139,73 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Return the number of free blocks that the bitmap
+// block covering block b says it has.
 static uint
-balloc(uint dev)
+bmapfree(struct fsdev *fs, uint b)
 {
-  int b, bi, m;
-  struct buf *bp;
+  uint n;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
+  acquire(&fs->lock);
+  n = fs->bmapfree[b / BPB];
+  release(&fs->lock);
+  return n;
+}
+
+// Count block b as allocated (n = -1) or freed (n = 1).
+static void
+bcount(struct fsdev *fs, uint b, int n)
+{
+  acquire(&fs->lock);
+  fs->bmapfree[b / BPB] += n;
+  fs->nblock += n;
+  release(&fs->lock);
+}
+
+// Allocate a zeroed disk block: the first free one at or
+// after goal, or if goal is 0 after the last block that
+// was allocated without one.
+static uint
+balloc(uint dev, uint goal)
+{
+  int i, n, bi, m, next;
+  uint b;
+  struct buf *bp;
+  struct fsdev *fs = fsof(dev);
+
+  acquire(&fs->lock);
+  next = (goal == 0 || goal >= fs->sb.size);
+  if(fs->nblock == 0)
+    goal = fs->sb.size;   // nothing to find
+  else if(next)
+    goal = fs->bcursor % fs->sb.size;
+  release(&fs->lock);
+  if(goal == fs->sb.size)
+    panic("balloc: out of blocks");
+
+  // look at the rest of goal's bitmap block, then the
+  // others, then goal's again from its start.
+  n = (fs->sb.size + BPB - 1) / BPB;
+  for(i = 0; i <= n; i++){
+    b = ((goal / BPB + i) % n) * BPB;
+    if(bmapfree(fs, b) == 0)
+      continue;
+    bp = bread(dev, BBLOCK(b, fs->sb));
+    for(bi = (i == 0 ? goal % BPB : 0); bi < BPB && b + bi < fs->sb.size; bi++){
+      if(bi % 8 == 0 && bp->data[bi/8] == 0xff){
+        bi += 7;   // skip a full byte
+        continue;
+      }
       m = 1 << (bi % 8);
       if((bp->data[bi/8] & m) == 0){  // Is block free?
         bp->data[bi/8] |= m;  // Mark block in use.
         log_write(bp);
+        bcount(fs, b + bi, -1);
+        if(next){
+          acquire(&fs->lock);
+          fs->bcursor = b + bi + 1;
+          release(&fs->lock);
+        }
         brelse(bp);
         bzero(dev, b + bi);
         return b + bi;
@@ -85,20 +216,86 @@ balloc(uint dev)
   panic("balloc: out of blocks");
 }
 
+// Allocate block b, zeroed, if it is free.
+// Returns 1 if it was, 0 if it was in use.
+static int
+btake(uint dev, uint b)
+{
+  struct buf *bp;
+  int bi, m;
+  struct fsdev *fs = fsof(dev);
+
+  bp = bread(dev, BBLOCK(b, fs->sb));
+  bi = b % BPB;
+  m = 1 << (bi % 8);
+  if(bp->data[bi/8] & m){
+    brelse(bp);
+    return 0;
+  }
+  bp->data[bi/8] |= m;
+  log_write(bp);
+  bcount(fs, b, -1);
+  brelse(bp);
+  bzero(dev, b);
+  return 1;
+}
+
+// Look at span blocks starting at from, wrapping around the
+// disk, for a run of n free blocks. Returns the run's first
+// block, or 0 if there is none. Marks nothing in use.
+static uint
+bfindrun(uint dev, uint from, uint n, uint span)
+{
+  struct buf *bp;
+  uint b, i, run;
+  struct fsdev *fs = fsof(dev);
+
+  bp = 0;
+  run = 0;
+  for(i = 0; i < span; i++){
+    b = (from + i) % fs->sb.size;
+    if(b == 0)
+      run = 0;  // runs don't wrap
+    if(bp == 0 || bp->blockno != BBLOCK(b, fs->sb)){
+      if(bp)
+        brelse(bp);
+      bp = 0;
+      if(bmapfree(fs, b) == 0){
+        // skip the rest of a full bitmap block.
+        run = 0;
+        i += min(BPB - 1 - b % BPB, fs->sb.size - 1 - b);
+        continue;
+      }
+      bp = bread(dev, BBLOCK(b, fs->sb));
+    }
+    if(bp->data[(b % BPB) / 8] & (1 << (b % 8))){
+      run = 0;
+    } else if(++run == n){
+      brelse(bp);
+      return b - (n - 1);
+    }
+  }
+  if(bp)
+    brelse(bp);
+  return 0;
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
 {
   struct buf *bp;
   int bi, m;
+  struct fsdev *fs = fsof(dev);
 
-  bp = bread(dev, BBLOCK(b, sb));
+  bp = bread(dev, BBLOCK(b, fs->sb));
   bi = b % BPB;
   m = 1 << (bi % 8);
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  bcount(fs, b, 1);
   brelse(bp);
 }
 
@@ -110,7 +307,7 @@ bfree(int dev, uint b)
 // list of blocks holding the file's content.
 //
 // The inodes are laid out sequentially on disk at
-// sb.startinode. Each inode has a number, indicating its
+// fs->sb.startinode. Each inode has a number, indicating its
 // position on the disk.
 //
 // The kernel keeps a table of in-use inodes in memory
@@ -127,18 +324,21 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to a table entry (open files and
+//   current directories). iget() finds or creates a table
+//   entry and increments its ref; iput() decrements ref.
+//   An entry whose ref is zero stays in the table, on a
+//   list of unreferenced entries from least to most
+//   recently used, and iget() recycles the first of them
+//   when it needs a new entry and the table is full.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
-//   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ilock() reads the inode from the disk and sets
+//   ip->valid, while iput() clears ip->valid if it frees
+//   the inode. An unreferenced entry stays valid, so
+//   getting it again needn't read the disk.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -162,29 +362,38 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
+// The table finds entries through a hash of (dev, inum); the
+// entries themselves come from a slab cache, up to NINODE.
+//
 // The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// entries, the hash chains and the unreferenced list. Since
+// ip->ref indicates whether an entry is in use, and ip->dev and
+// ip->inum indicate which i-node an entry holds, one must hold
+// itable.lock while using any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 509
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIHASH)
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *hash[NIHASH];
+  struct inode lru;   // head of the unreferenced entries
+  int n;              // entries allocated
 } itable;
 
+struct slabcache inodecache;
+
 void
 iinit()
 {
-  int i = 0;
-  
-  initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  initfairlock(&itable.lock, "itable");
+  itable.lru.prev = &itable.lru;
+  itable.lru.next = &itable.lru;
+  slabinit(&inodecache, "inode", sizeof(struct inode));
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -195,17 +404,31 @@ static struct inode* iget(uint dev, uint inum);
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
+  int i, inum;
   struct buf *bp;
   struct dinode *dip;
-
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
+  struct fsdev *fs = fsof(dev);
+
+  // go on from the last inode allocated.
+  acquire(&fs->lock);
+  if(fs->ninode == 0)
+    panic("ialloc: no inodes");
+  inum = fs->icursor;
+  release(&fs->lock);
+
+  for(i = 1; i < fs->sb.ninodes; i++, inum++){
+    if(inum >= fs->sb.ninodes)
+      inum = 1;
+    bp = bread(dev, IBLOCK(inum, fs->sb));
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
       log_write(bp);   // mark it allocated on the disk
+      acquire(&fs->lock);
+      fs->ninode--;
+      fs->icursor = inum + 1;
+      release(&fs->lock);
       brelse(bp);
       return iget(dev, inum);
     }
@@ -224,7 +447,7 @@ iupdate(struct inode *ip)
   struct buf *bp;
   struct dinode *dip;
 
-  bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+  bp = bread(ip->dev, IBLOCK(ip->inum, fsof(ip->dev)->sb));
   dip = (struct dinode*)bp->data + ip->inum%IPB;
   dip->type = ip->type;
   dip->major = ip->major;
@@ -242,31 +465,47 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **pp;
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = itable.hash[IHASH(dev, inum)]; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0){
+        ip->prev->next = ip->next;
+        ip->next->prev = ip->prev;
+      }
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
+  // Allocate a new entry, or recycle the least recently
+  // used unreferenced one.
+  ip = 0;
+  if(itable.n < NINODE && (ip = slaballoc(&inodecache)) != 0){
+    itable.n++;
+    initsleeplock(&ip->lock, "inode");
+  } else if((ip = itable.lru.next) != &itable.lru){
+    ip->prev->next = ip->next;
+    ip->next->prev = ip->prev;
+    for(pp = &itable.hash[IHASH(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->hnext)
+      ;
+    *pp = ip->hnext;
+  } else
     panic("iget: no inodes");
 
-  ip = empty;
+  ip->hnext = itable.hash[IHASH(dev, inum)];
+  itable.hash[IHASH(dev, inum)] = ip;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->nextoff = 0;
+  ip->rablock = 0;
+  ip->resvblock = 0;
+  ip->nresv = 0;
   release(&itable.lock);
 
   return ip;
@@ -297,7 +536,7 @@ ilock(struct inode *ip)
   acquiresleep(&ip->lock);
 
   if(ip->valid == 0){
-    bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+    bp = bread(ip->dev, IBLOCK(ip->inum, fsof(ip->dev)->sb));
     dip = (struct dinode*)bp->data + ip->inum%IPB;
     ip->type = dip->type;
     ip->major = dip->major;
@@ -322,6 +561,35 @@ iunlock(struct inode *ip)
   releasesleep(&ip->lock);
 }
 
+// Lock the given inode shared with other readers, who may
+// look at it and read its content but not change either;
+// readi() is fine, writei() isn't. Reads the inode from disk
+// if necessary, which is done holding the lock alone.
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  for(;;){
+    acquiresleepshared(&ip->lock);
+    if(ip->valid)
+      return;
+    releasesleepshared(&ip->lock);
+    ilock(ip);
+    iunlock(ip);
+  }
+}
+
+void
+iunlockshared(struct inode *ip)
+{
+  if(ip == 0 || !holdingsleepshared(&ip->lock) || ip->ref < 1)
+    panic("iunlockshared");
+
+  releasesleepshared(&ip->lock);
+}
+
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
 // be recycled.
@@ -332,6 +600,8 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
+  struct fsdev *fs;
+
   acquire(&itable.lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
@@ -343,17 +613,35 @@ iput(struct inode *ip)
 
     release(&itable.lock);
 
+    if(ip->type == T_DIR)
+      dcpurge(ip->dev, ip->inum);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
+    fs = fsof(ip->dev);
+    acquire(&fs->lock);
+    fs->ninode++;
+    release(&fs->lock);
 
     releasesleep(&ip->lock);
 
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0){
+    // keep it cached, as the most recently used; an inode
+    // that was just freed has nothing worth keeping.
+    if(ip->valid){
+      ip->prev = itable.lru.prev;
+      ip->next = &itable.lru;
+    } else {
+      ip->prev = &itable.lru;
+      ip->next = itable.lru.next;
+    }
+    ip->prev->next = ip;
+    ip->next->prev = ip;
+  }
   release(&itable.lock);
 }
 
@@ -370,7 +658,78 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. The NDINDIRECT after
+// those are listed in the NINDIRECT blocks that are listed in
+// block ip->addrs[NDIRECT+1].
+//
+// To keep a file that grows by small writes contiguous on
+// disk, ireserve() sets aside a run of free blocks for the
+// blocks a write will append, and bmap() allocates from the
+// run. The run lives only in memory, in ip->resvblock and
+// ip->nresv: its blocks stay free in the bitmap until used,
+// so a crash loses nothing, and another file may take one
+// first, in which case bmap() skips it.
+
+// Reserve a run of free blocks for the blocks that a write of
+// n bytes at off will append to ip, so that bmap() lays them
+// out one after another. The run is sized to the write, and
+// continues the file's last run if the blocks after that are
+// free. Caller must hold ip->lock.
+void
+ireserve(struct inode *ip, uint off, uint n)
+{
+  uint need, b, from;
+  struct fsdev *fs = fsof(ip->dev);
+
+  if(off + n <= ip->size)
+    return;
+  need = (off + n + BSIZE - 1) / BSIZE - (ip->size + BSIZE - 1) / BSIZE;
+  if(need <= ip->nresv)
+    return;
+  if(need < RESVMIN)
+    need = RESVMIN;
+  if(need > RESVMAX)
+    need = RESVMAX;
+
+  b = ip->resvblock + ip->nresv;
+  if(ip->resvblock && bfindrun(ip->dev, b, need, need) == b){
+    ip->nresv += need;
+    return;
+  }
+
+  acquire(&fs->lock);
+  from = fs->resvnext;
+  release(&fs->lock);
+  for(; need > 0; need /= 2){
+    if((b = bfindrun(ip->dev, from, need, fs->sb.size)) != 0){
+      ip->resvblock = b;
+      ip->nresv = need;
+      acquire(&fs->lock);
+      fs->resvnext = b + need;
+      release(&fs->lock);
+      return;
+    }
+  }
+}
+
+// Allocate a zeroed disk block for ip: the next one of its
+// reserved run that is still free if any, else the nearest
+// free one after the last block it was given.
+static uint
+iballoc(struct inode *ip)
+{
+  uint b;
+
+  while(ip->nresv > 0){
+    b = ip->resvblock++;
+    ip->nresv--;
+    if(btake(ip->dev, b))
+      return b;
+  }
+  b = balloc(ip->dev, ip->resvblock);
+  ip->resvblock = b + 1;
+  return b;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
@@ -382,7 +741,7 @@ bmap(struct inode *ip, uint bn)
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = iballoc(ip);
     return addr;
   }
   bn -= NDIRECT;
@@ -390,11 +749,34 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+      ip->addrs[NDIRECT] = addr = iballoc(ip);
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
+      a[bn] = addr = iballoc(ip);
+      log_write(bp);
+    }
+    brelse(bp);
+    return addr;
+  }
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    // Load the double-indirect block, then the indirect
+    // block it lists, allocating either if necessary.
+    if((addr = ip->addrs[NDIRECT+1]) == 0)
+      ip->addrs[NDIRECT+1] = addr = iballoc(ip);
+    bp = bread(ip->dev, addr);
+    a = (uint*)bp->data;
+    if((addr = a[bn / NINDIRECT]) == 0){
+      a[bn / NINDIRECT] = addr = iballoc(ip);
+      log_write(bp);
+    }
+    brelse(bp);
+    bp = bread(ip->dev, addr);
+    a = (uint*)bp->data;
+    if((addr = a[bn % NINDIRECT]) == 0){
+      a[bn % NINDIRECT] = addr = iballoc(ip);
       log_write(bp);
     }
     brelse(bp);
@@ -409,9 +791,9 @@ bmap(struct inode *ip, uint bn)
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i, j, k;
+  struct buf *bp, *bp2;
+  uint *a, *a2;
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -432,7 +814,30 @@ itrunc(struct inode *ip)
     ip->addrs[NDIRECT] = 0;
   }
 
+  if(ip->addrs[NDIRECT+1]){
+    bp = bread(ip->dev, ip->addrs[NDIRECT+1]);
+    a = (uint*)bp->data;
+    for(j = 0; j < NINDIRECT; j++){
+      if(a[j] == 0)
+        continue;
+      bp2 = bread(ip->dev, a[j]);
+      a2 = (uint*)bp2->data;
+      for(k = 0; k < NINDIRECT; k++){
+        if(a2[k])
+          bfree(ip->dev, a2[k]);
+      }
+      brelse(bp2);
+      bfree(ip->dev, a[j]);
+    }
+    brelse(bp);
+    bfree(ip->dev, ip->addrs[NDIRECT+1]);
+    ip->addrs[NDIRECT+1] = 0;
+  }
+
+  pcinval(ip);
   ip->size = 0;
+  ip->resvblock = 0;
+  ip->nresv = 0;
   iupdate(ip);
 }
 
@@ -448,8 +853,27 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Ask for the RABLOCKS blocks of ip from bn on to be read into
+// the buffer cache in the background, skipping those already
+// asked for, so that the disk works on them while readi()
+// copies out the blocks before.
+// Caller must hold ip->lock, perhaps shared: ip->rablock is
+// only a hint, which racing readers can't make do harm.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint b;
+
+  b = ip->rablock > bn ? ip->rablock : bn;
+  for(; b < bn + RABLOCKS && b < MAXFILE && b * BSIZE < ip->size; b++)
+    bprefetch(ip->dev, bmap(ip, b));
+  ip->rablock = b;
+}
+
 // Read data from inode.
-// Caller must hold ip->lock.
+// Caller must hold ip->lock, perhaps shared: the blocks below
+// ip->size all exist, so bmap() allocates none, and
+// ip->nextoff is a hint like ip->rablock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
 int
@@ -463,6 +887,11 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  // a read that starts where the last one ended is sequential.
+  if(off == ip->nextoff)
+    readahead(ip, (off + n) / BSIZE);
+  ip->nextoff = off + n;
+
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
@@ -508,6 +937,10 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   if(off > ip->size)
     ip->size = off;
 
+  // let mappings of the file see the new data.
+  if(tot > 0)
+    pcupdate(ip, off - tot, tot);
+
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
   // block to ip->addrs[].
@@ -516,6 +949,101 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   return tot;
 }
 
+// Return a locked buf holding the block of ip's data that
+// contains byte off, which must be below ip->size, so that
+// callers can use the cached data in place. Caller must hold
+// ip->lock, and brelse() the buf.
+struct buf*
+iblock(struct inode *ip, uint off)
+{
+  return bread(ip->dev, bmap(ip, off / BSIZE));
+}
+
+// Start the batch of direct transfers in iov, wait for them,
+// and if they were writes, drop any copies of their blocks
+// that were read into the cache meanwhile. Then let go of the
+// user pages they used.
+static void
+directflush(struct buf **iov, int n, int write)
+{
+  int i;
+
+  if(n == 0)
+    return;
+  bsubmitv(iov, n, write);
+  for(i = 0; i < n; i++){
+    bwait(iov[i]);
+    if(write)
+      binval(iov[i]->dev, iov[i]->blockno, 1);
+    kfree((void*)PGROUNDDOWN((uint64)iov[i]->data));
+  }
+}
+
+// Read (write = 0) or write n bytes of ip's data at off
+// straight between the disk and user memory at addr, without
+// copying them through the buffer cache. Only for whole,
+// aligned blocks of data the file already has: off, n and
+// addr must be multiples of BSIZE and [off, off+n) within the
+// file, else returns -1 for the caller to go through the cache
+// with readi() or writei(). A write stops early at a block
+// whose cached copy is in use, which may hold changes not yet
+// on disk; a read copies such a block from the cache.
+// Returns the number of bytes moved.
+// Caller must hold ip->lock, and needn't be in a transaction:
+// no blocks are allocated and the inode doesn't change.
+int
+directi(struct inode *ip, int write, uint64 addr, uint off, uint n)
+{
+  struct proc *p = myproc();
+  struct buf *iob, **iov, *b, *bp;
+  uint tot, blockno;
+  uint64 pa;
+  int nb = 0;
+
+  if(off % BSIZE || n % BSIZE || addr % BSIZE)
+    return -1;
+  if(off + n < off || off + n > ip->size)
+    return -1;
+  if((iob = (struct buf*)kalloc()) == 0)
+    return -1;
+  iov = (struct buf**)(iob + DIRECTBATCH);
+
+  for(tot = 0; tot < n; tot += BSIZE){
+    blockno = bmap(ip, (off + tot) / BSIZE);
+    // hold the page, which another thread may unmap meanwhile.
+    if((pa = uvmhold(p->mm->pagetable, addr + tot, !write)) == 0)
+      break;
+    if(binval(ip->dev, blockno, 0) < 0){
+      if(write){
+        kfree((void*)PGROUNDDOWN(pa));
+        break;
+      }
+      bp = bread(ip->dev, blockno);
+      memmove((void*)pa, bp->data, BSIZE);
+      brelse(bp);
+      kfree((void*)PGROUNDDOWN(pa));
+      continue;
+    }
+    if(nb == DIRECTBATCH){
+      directflush(iov, nb, write);
+      nb = 0;
+    }
+    b = &iob[nb];
+    memset(b, 0, sizeof(*b));
+    b->dev = ip->dev;
+    b->blockno = blockno;
+    b->data = (uchar*)pa;
+    iov[nb++] = b;
+  }
+  directflush(iov, nb, write);
+  kfree(iob);
+
+  // let mappings of the file see the new data.
+  if(write && tot > 0)
+    pcupdate(ip, off, tot);
+  return tot;
+}
+
 // Directories
 
 int
@@ -535,6 +1063,9 @@ dirlookup(struct inode *dp, char *name, uint *poff)
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dclookup(dp, name, &inum, poff))
+    return inum ? iget(dp->dev, inum) : 0;
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -545,10 +1076,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcenter(dp, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcenter(dp, name, 0, 0);
   return 0;
 }
 
@@ -578,6 +1111,7 @@ dirlink(struct inode *dp, char *name, uint inum)
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcenter(dp, name, inum, off);
 
   return 0;
 }
@@ -621,6 +1155,93 @@ skipelem(char *path, char *name)
   return path;
 }
 
+// A file system mounted on a directory of another. fsmount()
+// sets the table up at boot, before any user process runs, so
+// path lookups read it without a lock. Each entry holds a
+// reference to both inodes, so they stay in the inode table
+// and can be compared by address.
+static struct {
+  struct inode *on;    // the directory it covers, or 0
+  struct inode *root;  // its root directory
+} mounts[NFSDEV];
+
+// Mount the file system on dev on the directory path.
+// Returns 0 on success, -1 if path isn't a directory.
+int
+fsmount(int dev, char *path)
+{
+  struct inode *ip;
+  int i;
+
+  begin_op();
+  if((ip = namei(path)) == 0){
+    end_op();
+    return -1;
+  }
+  ilock(ip);
+  if(ip->type != T_DIR){
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+  iunlock(ip);
+  end_op();
+
+  for(i = 0; mounts[i].on; i++)
+    if(i == NFSDEV - 1)
+      panic("fsmount: too many mounts");
+  fsinit(dev);
+  mounts[i].root = iget(dev, ROOTINO);
+  mounts[i].on = ip;
+  return 0;
+}
+
+// Return 1 if ip is a directory a file system is mounted on.
+int
+ismountpoint(struct inode *ip)
+{
+  int i;
+
+  for(i = 0; i < NFSDEV; i++)
+    if(mounts[i].on == ip)
+      return 1;
+  return 0;
+}
+
+// Going down into directory ip, which is unlocked: if a file
+// system is mounted on it, give up ip and return that file
+// system's root instead.
+static struct inode*
+mountdown(struct inode *ip)
+{
+  int i;
+
+  for(i = 0; i < NFSDEV; i++){
+    if(mounts[i].on && mounts[i].on == ip){
+      iput(ip);
+      return idup(mounts[i].root);
+    }
+  }
+  return ip;
+}
+
+// Going up out of directory ip, which is unlocked: if ip is a
+// mounted file system's root, give it up and return the
+// directory it is mounted on, whose ".." leads on up.
+static struct inode*
+mountup(struct inode *ip)
+{
+  int i;
+
+  for(i = 0; i < NFSDEV; i++){
+    if(mounts[i].on && mounts[i].root == ip){
+      iput(ip);
+      return idup(mounts[i].on);
+    }
+  }
+  return ip;
+}
+
 // Look up and return the inode for a path name.
 // If parent != 0, return the inode for the parent and copy the final
 // path element into name, which must have room for DIRSIZ bytes.
@@ -633,25 +1254,30 @@ namex(char *path, int nameiparent, char *name)
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
   else
-    ip = idup(myproc()->cwd);
+    ip = idup(myproc()->mm->cwd);
 
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
+    if(namecmp(name, "..") == 0)
+      ip = mountup(ip);
+    ilockshared(ip);
     if(ip->type != T_DIR){
-      iunlockput(ip);
+      iunlockshared(ip);
+      iput(ip);
       return 0;
     }
     if(nameiparent && *path == '\0'){
       // Stop one level early.
-      iunlock(ip);
+      iunlockshared(ip);
       return ip;
     }
     if((next = dirlookup(ip, name, 0)) == 0){
-      iunlockput(ip);
+      iunlockshared(ip);
+      iput(ip);
       return 0;
     }
-    iunlockput(ip);
-    ip = next;
+    iunlockshared(ip);
+    iput(ip);
+    ip = mountdown(next);
   }
   if(nameiparent){
     iput(ip);
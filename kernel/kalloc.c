@@ -1,6 +1,30 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or blocks of 2^order physically contiguous pages.
+// Each page has a reference count, so that copy-on-write
+// fork can share pages; kfree() frees a page only when
+// its last reference goes away.
+//
+// Free memory is kept by a buddy allocator: lists of free
+// blocks of 2^order pages, each aligned to its size. Freeing
+// a block merges it with its buddy whenever that is free too,
+// so that big blocks form again after small ones are freed.
+//
+// In front of that, each CPU has its own list of free single
+// pages, so that kalloc() and kfree() don't contend for
+// kmem.lock in the common case. A CPU's list refills from and
+// drains to the buddy lists in batches; if both are empty, it
+// steals half of another CPU's list.
+//
+// Idle CPUs keep a pool of pages already filled with zeroes
+// (see kzeroidle()), so that kalloc_zeroed() needn't clear
+// a page while a process waits for it.
+//
+// At boot, freerange() hands memory to the buddy lists as the
+// biggest aligned blocks that fit, which touches only the first
+// page of each, so boot needn't visit every page of RAM. Pages
+// are first written when they are allocated.
 
 #include "types.h"
 #include "param.h"
@@ -16,50 +40,341 @@ extern char end[]; // first address after kernel.
 
 struct run {
   struct run *next;
+  struct run *prev; // buddy lists only
 };
 
-struct {
+#define PA2IDX(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define NPAGE PA2IDX(PHYSTOP)
+
+#define MAXORDER 10  // biggest block: 2^MAXORDER pages
+#define MEGAORDER 9  // a megapage
+#define NOBLOCK 0xff // kmem.order[] of a page not heading a free block
+
+#define KBATCH 32    // pages moved between a CPU's list and the buddy lists
+#define KHIGH 128    // most pages a CPU's list keeps
+#define NZERO 256    // most pages in the zeroed pool
+
+// With make KDEBUG=1, fill n bytes at pa with junk, to catch
+// dangling references and reads of memory never written.
+static void
+kjunk(void *pa, int c, uint64 n)
+{
+#ifdef KDEBUG
+  memset(pa, c, n);
+#endif
+}
+
+struct kcpu {
   struct spinlock lock;
   struct run *freelist;
+  int nfree;
+};
+
+struct {
+  struct spinlock lock;          // protects free[] and order[]
+  struct run free[MAXORDER+1];   // circular lists of free blocks
+  uchar order[NPAGE];            // order of the free block a page heads
+  struct kcpu cpu[NCPU];
+  int ref[NPAGE];                // references to each page
+  uint64 nsteal;                 // times a CPU took pages from another
+  uint64 ntotal;                 // pages freerange() gave the allocator
+  uint64 nbuddy;                 // pages on the buddy lists
 } kmem;
 
+struct {
+  struct spinlock lock;
+  struct run *list; // allocated pages full of zeroes
+  int n;
+} kzero;
+
+// Add block r of 2^order pages to the free lists.
+// Caller must hold kmem.lock.
+static void
+bpush(struct run *r, int order)
+{
+  struct run *h = &kmem.free[order];
+
+  r->next = h->next;
+  r->prev = h;
+  h->next->prev = r;
+  h->next = r;
+  kmem.order[PA2IDX(r)] = order;
+  kmem.nbuddy += 1 << order;
+}
+
+// Take free block r off its list.
+// Caller must hold kmem.lock.
+static void
+bremove(struct run *r)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  kmem.nbuddy -= 1 << kmem.order[PA2IDX(r)];
+  kmem.order[PA2IDX(r)] = NOBLOCK;
+}
+
+// Free the block of 2^order pages at pa, merging it with
+// its buddy for as long as the buddy is free as a whole.
+// Caller must hold kmem.lock.
+static void
+bfree(uint64 pa, int order)
+{
+  uint64 buddy;
+
+  for(; order < MAXORDER; order++){
+    buddy = KERNBASE + ((pa - KERNBASE) ^ ((uint64)PGSIZE << order));
+    if(buddy + ((uint64)PGSIZE << order) > PHYSTOP)
+      break;
+    if(kmem.order[PA2IDX(buddy)] != order)
+      break;
+    bremove((struct run*)buddy);
+    if(buddy < pa)
+      pa = buddy;
+  }
+  bpush((struct run*)pa, order);
+}
+
+// Take a free block of 2^order pages, splitting a bigger
+// one if there's none that size. Returns 0 if none is free.
+// Caller must hold kmem.lock.
+static uint64
+balloc(int order)
+{
+  struct run *r;
+  int o;
+
+  for(o = order; o <= MAXORDER; o++)
+    if(kmem.free[o].next != &kmem.free[o])
+      break;
+  if(o > MAXORDER)
+    return 0;
+  r = kmem.free[o].next;
+  bremove(r);
+  // give back the upper halves.
+  while(o > order){
+    o--;
+    bpush((struct run*)((uint64)r + ((uint64)PGSIZE << o)), o);
+  }
+  return (uint64)r;
+}
+
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  int i;
+
+  initfairlock(&kmem.lock, "kmem");
+  for(i = 0; i <= MAXORDER; i++)
+    kmem.free[i].next = kmem.free[i].prev = &kmem.free[i];
+  memset(kmem.order, NOBLOCK, sizeof(kmem.order));
+  for(i = 0; i < NCPU; i++)
+    initlock(&kmem.cpu[i].lock, "kcpu");
+  initlock(&kzero.lock, "kzero");
   freerange(end, (void*)PHYSTOP);
 }
 
+// Give the allocator the pages in [pa_start, pa_end), each
+// run of them as the biggest aligned block that fits.
 void
 freerange(void *pa_start, void *pa_end)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  uint64 pa = PGROUNDUP((uint64)pa_start), size;
+  int order;
+
+  acquire(&kmem.lock);
+  while(pa + PGSIZE <= (uint64)pa_end){
+    for(order = MAXORDER; order > 0; order--){
+      size = (uint64)PGSIZE << order;
+      if((pa - KERNBASE) % size == 0 && pa + size <= (uint64)pa_end)
+        break;
+    }
+    bfree(pa, order);
+    kmem.ntotal += 1 << order;
+    pa += (uint64)PGSIZE << order;
+  }
+  release(&kmem.lock);
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Give up to n pages from the front of kc's list
+// back to the buddy lists.
+static void
+kdrain(struct kcpu *kc, int n)
+{
+  struct run *r, *list;
+  int i;
+
+  acquire(&kc->lock);
+  if(n > kc->nfree)
+    n = kc->nfree;
+  list = kc->freelist;
+  for(i = 0, r = list; i < n; i++)
+    r = r->next;
+  kc->freelist = r;
+  kc->nfree -= n;
+  release(&kc->lock);
+
+  acquire(&kmem.lock);
+  for(i = 0; i < n; i++){
+    r = list;
+    list = r->next;
+    bfree((uint64)r, 0);
+  }
+  release(&kmem.lock);
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct kcpu *kc;
+  int *ref, n, full;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
-  // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  ref = &kmem.ref[PA2IDX(pa)];
+  for(;;){
+    n = *ref;
+    if(n < 1)
+      panic("kfree: ref");
+    if(n == 1)
+      break;
+    if(__sync_bool_compare_and_swap(ref, n, n - 1))
+      return;
+  }
+
+  // the last reference, so no one else can be using the page.
+  kjunk(pa, 1, PGSIZE);
+  *ref = 0;
 
   r = (struct run*)pa;
 
+  push_off();
+  kc = &kmem.cpu[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  full = ++kc->nfree > KHIGH;
+  release(&kc->lock);
+  if(full)
+    kdrain(kc, KBATCH);
+  pop_off();
+}
+
+// Refill kc's list, which is empty, with up to KBATCH pages
+// from the buddy lists. Returns 0 if they are empty too.
+static int
+krefill(struct kcpu *kc)
+{
+  struct run *r, *list = 0;
+  uint64 pa;
+  int n;
+
   acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  for(n = 0; n < KBATCH && (pa = balloc(0)) != 0; n++){
+    r = (struct run*)pa;
+    r->next = list;
+    list = r;
+  }
   release(&kmem.lock);
+  if(n == 0)
+    return 0;
+
+  acquire(&kc->lock);
+  for(r = list; r->next; r = r->next)
+    ;
+  r->next = kc->freelist;
+  kc->freelist = list;
+  kc->nfree += n;
+  release(&kc->lock);
+  return 1;
+}
+
+// Move half of some other CPU's free pages to kc's list,
+// which is empty. Returns 0 if every list is empty.
+// Holds only one CPU's lock at a time, so that CPUs
+// stealing from each other can't deadlock.
+static int
+ksteal(struct kcpu *kc)
+{
+  struct kcpu *victim;
+  struct run *first, *last;
+  int i, n;
+
+  for(i = 0; i < NCPU; i++){
+    victim = &kmem.cpu[i];
+    if(victim == kc)
+      continue;
+    acquire(&victim->lock);
+    if(victim->nfree == 0){
+      release(&victim->lock);
+      continue;
+    }
+    n = (victim->nfree + 1) / 2;
+    first = last = victim->freelist;
+    for(int j = 1; j < n; j++)
+      last = last->next;
+    victim->freelist = last->next;
+    victim->nfree -= n;
+    release(&victim->lock);
+
+    acquire(&kc->lock);
+    last->next = kc->freelist;
+    kc->freelist = first;
+    kc->nfree += n;
+    release(&kc->lock);
+    __sync_fetch_and_add(&kmem.nsteal, 1);
+    return 1;
+  }
+  return 0;
+}
+
+// Take a page from the zeroed pool, or return 0 if it's empty.
+static struct run*
+kzeropop(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  r = kzero.list;
+  if(r){
+    kzero.list = r->next;
+    kzero.n--;
+  }
+  release(&kzero.lock);
+  return r;
+}
+
+// Allocate a page, with a reference count of one, without
+// filling it. Takes from the zeroed pool only as a last resort.
+static struct run*
+kget(void)
+{
+  struct run *r;
+  struct kcpu *kc;
+
+  push_off();
+  kc = &kmem.cpu[cpuid()];
+  for(;;){
+    acquire(&kc->lock);
+    r = kc->freelist;
+    if(r){
+      kc->freelist = r->next;
+      kc->nfree--;
+      kmem.ref[PA2IDX(r)] = 1;
+    }
+    release(&kc->lock);
+    if(r || !(krefill(kc) || ksteal(kc)))
+      break;
+  }
+  pop_off();
+
+  if(r == 0)
+    r = kzeropop();
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -70,13 +385,185 @@ kalloc(void)
 {
   struct run *r;
 
+  if((r = kget()) != 0)
+    kjunk(r, 5, PGSIZE);
+  return (void*)r;
+}
+
+// Allocate a page of zeroes. Usually comes from the
+// zeroed pool, without waiting to clear it.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  if((r = kzeropop()) != 0){
+    r->next = 0;
+    return (void*)r;
+  }
+  if((r = kget()) != 0)
+    memset((char*)r, 0, PGSIZE);
+  return (void*)r;
+}
+
+// Called by the scheduler when it has nothing to run:
+// zero one more free page for the pool, if it isn't full.
+// Returns 1 if it did.
+int
+kzeroidle(void)
+{
+  struct run *r;
+
+  if(__atomic_load_n(&kzero.n, __ATOMIC_RELAXED) >= NZERO)
+    return 0;
+  if((r = kget()) == 0)
+    return 0;
+  memset((char*)r, 0, PGSIZE);
+  acquire(&kzero.lock);
+  if(kzero.n >= NZERO){
+    release(&kzero.lock);
+    kfree(r);
+    return 0;
+  }
+  r->next = kzero.list;
+  kzero.list = r;
+  kzero.n++;
+  release(&kzero.lock);
+  return 1;
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size, each with a reference count of one. If no
+// block is that big, takes back the CPUs' free pages so
+// that they can merge, and tries again.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_pages(int order)
+{
+  uint64 pa;
+  int i;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
   acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  pa = balloc(order);
   release(&kmem.lock);
+  if(pa == 0){
+    for(i = 0; i < NCPU; i++)
+      kdrain(&kmem.cpu[i], NPAGE);
+    acquire(&kmem.lock);
+    pa = balloc(order);
+    release(&kmem.lock);
+  }
+  if(pa == 0)
+    return 0;
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
-  return (void*)r;
+  for(i = 0; i < (1 << order); i++)
+    kmem.ref[PA2IDX(pa) + i] = 1;
+  kjunk((void*)pa, 5, (uint64)PGSIZE << order);
+  return (void*)pa;
+}
+
+// Free the 2^order pages at pa, which kalloc_pages()
+// returned, and which must each have only one reference.
+void
+kfree_pages(void *pa, int order)
+{
+  int i;
+
+  if(order < 0 || order > MAXORDER || ((uint64)pa - KERNBASE) % ((uint64)PGSIZE << order) != 0 ||
+     (char*)pa < end || (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+  for(i = 0; i < (1 << order); i++){
+    if(kmem.ref[PA2IDX(pa) + i] != 1)
+      panic("kfree_pages: ref");
+    kmem.ref[PA2IDX(pa) + i] = 0;
+  }
+  kjunk(pa, 1, (uint64)PGSIZE << order);
+
+  acquire(&kmem.lock);
+  bfree((uint64)pa, order);
+  release(&kmem.lock);
+}
+
+// Allocate a 2-megabyte megapage: MEGAPGSIZE bytes of aligned,
+// physically contiguous memory, as 512 pages with a reference
+// each. Returns 0 if there is no such block.
+void *
+kallocmega(void)
+{
+  return kalloc_pages(MEGAORDER);
+}
+
+// Drop a reference to each of the 512 pages of megapage pa.
+// If this was its only mapping, free it whole.
+void
+kfreemega(void *pa)
+{
+  int i;
+
+  for(i = 0; i < 512; i++)
+    if(krefcnt((char*)pa + i*PGSIZE) != 1)
+      break;
+  if(i == 512){
+    kfree_pages(pa, MEGAORDER);
+    return;
+  }
+  for(i = 0; i < 512; i++)
+    kfree((char*)pa + i*PGSIZE);
+}
+
+// Add a reference to the allocated page pa,
+// which is being shared.
+void
+kdup(void *pa)
+{
+  if(__sync_fetch_and_add(&kmem.ref[PA2IDX(pa)], 1) < 1)
+    panic("kdup");
+}
+
+// Return the number of references to page pa.
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(&kmem.ref[PA2IDX(pa)], __ATOMIC_SEQ_CST);
+}
+
+// Return how many times a CPU has had to steal
+// free pages from another CPU's list.
+uint64
+ksteals(void)
+{
+  return __atomic_load_n(&kmem.nsteal, __ATOMIC_SEQ_CST);
+}
+
+// Return the number of pages the allocator manages.
+uint64
+ktotalpages(void)
+{
+  return kmem.ntotal;
+}
+
+// Return the number of free pages, counting those on
+// CPUs' lists and in the zeroed pool. Only a snapshot:
+// the lists are read one at a time.
+uint64
+kfreepages(void)
+{
+  uint64 n;
+  int i;
+
+  acquire(&kmem.lock);
+  n = kmem.nbuddy;
+  release(&kmem.lock);
+  for(i = 0; i < NCPU; i++){
+    acquire(&kmem.cpu[i].lock);
+    n += kmem.cpu[i].nfree;
+    release(&kmem.cpu[i].lock);
+  }
+  acquire(&kzero.lock);
+  n += kzero.n;
+  release(&kzero.lock);
+  return n;
 }
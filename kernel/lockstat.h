@@ -0,0 +1,14 @@
+// Filled in by lockstat(), one for each lock name.
+// Locks that share a name, like the per-process locks,
+// are counted together. Times are in CLINT_MTIME cycles.
+#define LOCKNAME 16
+
+struct lockstat {
+  char name[LOCKNAME];
+  int sleep;          // 1 for sleep locks, 0 for spinlocks
+  int nlock;          // how many locks have the name
+  uint64 acquires;
+  uint64 contended;   // acquires that found the lock held
+  uint64 spins;       // spin loops, or sleeps, while waiting
+  uint64 held;        // total time held
+};
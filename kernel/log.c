@@ -4,22 +4,36 @@
 #include "param.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "proc.h"
 #include "fs.h"
 #include "buf.h"
+#include "memlayout.h"
+#include "timer.h"
+#include "trace.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. The logging system only commits a transaction when
+// none of its FS system calls are active. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end. begin_op() reserves MAXOPBLOCKS of log
+// space for the call; the blocks it goes on to log come out of
+// that reservation, and end_op() hands back what is left. If
+// the open transaction is too full to promise the space,
+// begin_op() asks for it to be committed and sleeps.
+//
+// Commits are asynchronous: end_op() returns at once, and the
+// logflush kernel process commits the open transaction every
+// LOGDELAY ticks, when it fills, or when log_sync() (fsync())
+// asks. To commit, logflush keeps new calls out until the open
+// transaction's calls have ended, and closes it by copying its
+// blocks aside. A new transaction then opens, and system calls
+// carry on in it while the closed one is written to the log
+// and installed from the copies.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -28,7 +42,9 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// logflush writes a closed transaction's blocks to the log,
+// then the header, which commits it, then installs the blocks
+// and clears the header, before closing the next.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -42,18 +58,31 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks they may yet add.
+  int closereq;    // the open transaction is to be committed, please wait.
+  int seq;         // number of the open transaction.
+  int done;        // number of the last transaction on disk.
   int dev;
-  struct logheader lh;
+  struct logheader lh;  // the open transaction
+  struct logheader clh; // the transaction being committed
+  struct buf *cbuf[LOGSIZE]; // its blocks' pinned buffers
+  uchar *copy[LOGSIZE];      // and their contents
+  struct buf iob[LOGSIZE];   // for writing the copies
+  struct buf *iov[LOGSIZE];
 };
 struct log log;
+struct timer logtimer; // calls log_tick() every LOGDELAY ticks
 
 static void recover_from_log(void);
-static void commit();
+static void logflush(void);
+static void log_tick(void*);
 
 void
 initlog(int dev, struct superblock *sb)
 {
+  char *pg = 0;
+  int i;
+
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
 
@@ -61,7 +90,39 @@ initlog(int dev, struct superblock *sb)
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  log.seq = 1;
+  for (i = 0; i < LOGSIZE; i++) {
+    if (i % (PGSIZE/BSIZE) == 0 && (pg = kalloc()) == 0)
+      panic("initlog: kalloc");
+    log.copy[i] = (uchar*)pg + (i % (PGSIZE/BSIZE)) * BSIZE;
+  }
   recover_from_log();
+  kproc("logflush", logflush);
+  logtimer.period = LOGDELAY * TICKCYCLES;
+  logtimer.when = r_time() + logtimer.period;
+  logtimer.fn = log_tick;
+  timeradd(&logtimer);
+}
+
+// Write the committing transaction's copies to their home
+// locations (home = 1) or to the log, all at once.
+static void
+write_copies(int home)
+{
+  int tail;
+  struct buf *b;
+
+  for (tail = 0; tail < log.clh.n; tail++) {
+    b = &log.iob[tail];
+    memset(b, 0, sizeof(*b));
+    b->dev = log.dev;
+    b->blockno = home ? log.clh.block[tail] : log.start+tail+1;
+    b->data = log.copy[tail];
+    log.iov[tail] = b;
+  }
+  bsubmitv(log.iov, log.clh.n, 1);
+  for (tail = 0; tail < log.clh.n; tail++)
+    bwait(&log.iob[tail]);
 }
 
 // Copy committed blocks from log to their home location
@@ -70,13 +131,19 @@ install_trans(int recovering)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
+  if(!recovering){
+    // the cached blocks may already hold the next
+    // transaction's changes, so write the copies.
+    write_copies(1);
+    for (tail = 0; tail < log.clh.n; tail++)
+      bunpin(log.cbuf[tail]);
+    return;
+  }
+  for (tail = 0; tail < log.clh.n; tail++) {
     struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
+    struct buf *dbuf = bread(log.dev, log.clh.block[tail]); // read dst
     memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
     bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
     brelse(lbuf);
     brelse(dbuf);
   }
@@ -89,9 +156,9 @@ read_head(void)
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  log.clh.n = lh->n;
+  for (i = 0; i < log.clh.n; i++) {
+    log.clh.block[i] = lh->block[i];
   }
   brelse(buf);
 }
@@ -105,9 +172,9 @@ write_head(void)
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = log.clh.n;
+  for (i = 0; i < log.clh.n; i++) {
+    hb->block[i] = log.clh.block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -118,7 +185,7 @@ recover_from_log(void)
 {
   read_head();
   install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
+  log.clh.n = 0;
   write_head(); // clear the log
 }
 
@@ -126,15 +193,21 @@ recover_from_log(void)
 void
 begin_op(void)
 {
+  struct proc *p = myproc();
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closereq){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + log.reserved + MAXOPBLOCKS > LOGSIZE){
       // this op might exhaust log space; wait for commit.
+      log.closereq = 1;
+      wakeup(&log);
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += MAXOPBLOCKS;
+      p->logres = MAXOPBLOCKS;
       release(&log.lock);
       break;
     }
@@ -142,69 +215,128 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// the operation's updates reach the disk when
+// logflush next commits.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  struct proc *p = myproc();
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+  log.reserved -= p->logres;
+  p->logres = 0;
+  // begin_op() may be waiting for log space, and
+  // logflush for the last op to end.
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// Wait until the updates of every FS system call that
+// has ended are on disk.
+void
+log_sync(void)
+{
+  int seq;
+
+  acquire(&log.lock);
+  seq = log.seq;
+  if(log.lh.n == 0 && log.outstanding == 0){
+    seq--;   // the open transaction has nothing in it
   } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+    log.closereq = 1;
     wakeup(&log);
   }
+  while(log.done < seq)
+    sleep(&log, &log.lock);
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
+// Ask logflush to commit the open transaction if it has
+// anything in it. logtimer calls it every LOGDELAY ticks.
+static void
+log_tick(void *arg)
+{
+  acquire(&log.lock);
+  if(log.lh.n > 0 && !log.closereq){
+    log.closereq = 1;
     wakeup(&log);
-    release(&log.lock);
   }
+  release(&log.lock);
 }
 
-// Copy modified blocks from cache to log.
+// Copy modified blocks from their copies to the log.
 static void
 write_log(void)
+{
+  write_copies(0);
+}
+
+// Copy the open transaction's blocks aside, for logflush to
+// close it. No FS system call may be active, and none may
+// begin until the copy is done.
+static void
+copy_trans(void)
 {
   int tail;
+  struct buf *b;
 
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+    // the buffer is pinned, so this finds it cached.
+    b = bread(log.dev, log.lh.block[tail]);
+    memmove(log.copy[tail], b->data, BSIZE);
+    log.cbuf[tail] = b;
+    log.clh.block[tail] = log.lh.block[tail];
+    brelse(b);
   }
 }
 
+// Body of the logflush kernel process: each time a commit
+// is asked for, wait for the open transaction's calls to
+// end, close it, open the next, and commit the closed one.
 static void
-commit()
+logflush(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+  int seq;
+
+  acquire(&log.lock);
+  for(;;){
+    while(!log.closereq || log.outstanding > 0)
+      sleep(&log, &log.lock);
+    seq = log.seq;
+    release(&log.lock);
+    copy_trans();
+    acquire(&log.lock);
+    // close it and open the next at once, so that log_sync()
+    // can't see it empty yet still open.
+    log.clh.n = log.lh.n;
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    log.seq++;
+    log.closereq = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    if (log.clh.n > 0) {
+      if(tracemask & TR_LOG)
+        traceev(TE_LOGCOMMIT, seq, log.clh.n);
+      write_log();     // Write modified blocks from the copies to log
+      write_head();    // Write header to disk -- the real commit
+      install_trans(0); // Now install writes to home locations
+      log.clh.n = 0;
+      write_head();    // Erase the transaction from the log
+      if(tracemask & TR_LOG)
+        traceev(TE_LOGDONE, seq, 0);
+    }
+
+    acquire(&log.lock);
+    log.done = seq;
+    wakeup(&log);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// logflush will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -214,8 +346,15 @@ commit()
 void
 log_write(struct buf *b)
 {
+  struct proc *p = myproc();
   int i;
 
+  if (b->dev != log.dev) {
+    // not the root disk, so not worth logging.
+    bwrite(b);
+    return;
+  }
+
   acquire(&log.lock);
   if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
     panic("too big a transaction");
@@ -230,7 +369,10 @@ log_write(struct buf *b)
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
     log.lh.n++;
+    if (p->logres > 0) {  // out of the op's reservation
+      p->logres--;
+      log.reserved--;
+    }
   }
   release(&log.lock);
 }
-
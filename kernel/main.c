@@ -20,15 +20,25 @@ main()
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
-    trapinit();      // trap vectors
+    timersinit();    // kernel timers
+    traceinit();     // event trace rings
+    profinit();      // profiling sample rings
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
+    pcinit();        // page cache
+    vmainit();       // mapped region records
     iinit();         // inode table
+    dcinit();        // directory name cache
     fileinit();      // file table
+    pipeinit();      // pipe buffers
     virtio_disk_init(); // emulated hard disk
+    ramdiskinit();   // RAM disk for /tmp
     userinit();      // first user process
+    pcflushinit();   // page cache writeback process
+    bprefetchinit(); // buffer cache readahead process
+    uringinit();     // batched system call workers
     __sync_synchronize();
     started = 1;
   } else {
@@ -27,8 +27,11 @@
 
 // core local interruptor (CLINT), which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid)) // raises a software interrupt
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
+#define CLINT_FREQ 10000000L // CLINT_MTIME cycles a second, in qemu
+#define TICKCYCLES (CLINT_FREQ/100) // between a CPU's scheduling ticks
 
 // qemu puts platform-level interrupt controller (PLIC) here.
 #define PLIC 0x0c000000L
@@ -62,6 +65,23 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mapped regions, from USERTOP down
+//   URING (p->uring, once the program asks for it)
+//   USYSCALL (p->usyscall, read-only to the program)
+//   trapframes of the other threads (see clone())
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define THREADFRAME(i) (TRAPFRAME - (uint64)(i)*PGSIZE)
+#define USYSCALL (THREADFRAME(NTHREAD-1) - PGSIZE)
+#define URING (USYSCALL - PGSIZE)
+#define USERTOP URING
+
+#ifndef __ASSEMBLER__
+// What the USYSCALL page tells the program, so that it can
+// find these out without a system call; see user/ulib.c.
+struct usyscall {
+  int pid;       // the process's, which its threads don't share
+  int nthread;   // threads in the process
+};
+#endif
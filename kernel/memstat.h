@@ -0,0 +1,24 @@
+#define MSNVMA 16 // mapped regions reported per process
+
+struct vmastat {
+  uint64 addr;
+  uint64 len;      // bytes
+  int prot;
+  int flags;       // MAP_SHARED or MAP_PRIVATE, | MAP_ANONYMOUS
+  uint64 resident; // pages present
+};
+
+// Filled in by memstat(). Page counts are in PGSIZE pages.
+struct memstat {
+  uint64 total;    // physical pages the allocator manages
+  uint64 free;     // of those, free now
+  int pid;
+  char name[16];
+  uint64 sz;       // heap break
+  uint64 text;     // resident pages of program text and data,
+  uint64 stack;    //   the user stack and its guard page,
+  uint64 heap;     //   and sbrk()ed memory
+  uint64 faults;   // page faults taken since fork
+  int nvma;        // mapped regions the process has
+  struct vmastat vma[MSNVMA]; // the lowest MSNVMA of them
+};
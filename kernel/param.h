@@ -1,13 +1,28 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC       128  // maximum number of processes
+#define NTHREAD      16  // maximum threads per process
+#define NPRIO         4  // scheduling priority levels
 #define NCPU          8  // maximum number of CPUs
+#define NLOCKSTAT    64  // lock names whose use is counted
+#define NTRACE      512  // trace events kept per CPU
+#define NPROF      2048  // profiling samples kept per CPU
+#define NURWORKER     2  // kernel processes doing asynchronous ring requests
+#define NURWORK      32  // asynchronous ring requests queued at once
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NLOCKSHARED   4  // sleep locks a process may hold shared at once
+#define NINODE     2000  // maximum number of cached i-nodes
+#define NDCACHE     512  // cached directory name lookups
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
+#define RAMDEV        2  // device number of the RAM disk, mounted on /tmp
+#define NFSDEV        2  // maximum number of mounted file systems
+#define RAMDISKSIZE 4096 // size of the RAM disk in blocks
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
+#define MAXOPBLOCKS  12  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define LOGDELAY    100  // clock ticks between log commits
+#define NBUF         (MAXOPBLOCKS*3)  // min size of disk block cache
+#define NPCACHE      128  // size of page cache for mapped files
+#define FAULTAROUND  16   // max pages mapped per fault on a mapped file
+#define FSSIZE       200000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define DISKPOLL       1   // poll for synchronous disk reads
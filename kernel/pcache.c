@@ -0,0 +1,390 @@
+// Page cache.
+//
+// The page cache is a linked list of page structures holding
+// page-sized copies of file contents for memory-mapped files.
+// Every process that maps the same page of a file maps the same
+// physical page, so sharers don't each hold a copy, and a fault
+// on a page that is already cached doesn't go to the buffer cache.
+//
+// Interface:
+// * To get a page of a file for a mapping, call pcget.
+// * When the mapping goes away, call pcput with its physical address.
+// * writei() calls pcupdate so that mapped pages see write()s,
+//     and itrunc() calls pcinval to forget the file's pages.
+// * To write a page back without waiting, call pcqueue;
+//     the pcflush kernel process writes it later.
+// * To read pages ahead of their first faults, call pcprefetch;
+//     pcflush does that too.
+// * Under memory pressure, pcshrink frees the memory of
+//     pages no one maps.
+//
+// exec() maps whole pages of programs from the cache too, but
+// with references to the memory (kdup) rather than to the cache
+// pages, so a page that is recycled while a program maps it gets
+// new memory.
+//
+// The contents of an inode's cached pages are read and written
+// only with the inode locked; pcache.lock protects the rest.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+#include "pcache.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define NPREFETCH 8 // queued pcprefetch() requests
+
+struct prefetch {
+  struct inode *ip; // 0 if the slot is free
+  uint pgno;
+  uint n;
+};
+
+struct {
+  struct spinlock lock;
+  struct page page[NPCACHE];
+  struct prefetch prefetch[NPREFETCH];
+
+  // Linked list of all pages, through prev/next.
+  // Sorted by how recently the page was unmapped.
+  // head.next is most recent, head.prev is least.
+  struct page head;
+} pcache;
+
+void
+pcinit(void)
+{
+  struct page *pg;
+
+  initlock(&pcache.lock, "pcache");
+
+  pcache.head.prev = &pcache.head;
+  pcache.head.next = &pcache.head;
+  for(pg = pcache.page; pg < pcache.page+NPCACHE; pg++){
+    pg->next = pcache.head.next;
+    pg->prev = &pcache.head;
+    pcache.head.next->prev = pg;
+    pcache.head.next = pg;
+  }
+}
+
+// Return a referenced page holding page pgno of the file ip,
+// reading it in if it isn't cached. Bytes past the end of the
+// file read as zero. Returns 0 if no page is available.
+// Caller must hold ip->lock, perhaps shared, in which case
+// another reader may be reading the page in; wait for it.
+struct page*
+pcget(struct inode *ip, uint pgno)
+{
+  struct page *pg;
+
+  acquire(&pcache.lock);
+
+  // Is the page already cached?
+  for(pg = pcache.head.next; pg != &pcache.head; pg = pg->next){
+    if((pg->valid || pg->filling) && pg->dev == ip->dev &&
+       pg->inum == ip->inum && pg->pgno == pgno){
+      pg->refcnt++;
+      while(pg->filling)
+        sleep(pg, &pcache.lock);
+      if(!pg->valid){
+        pg->refcnt--;
+        pg = 0;
+      }
+      release(&pcache.lock);
+      return pg;
+    }
+  }
+
+  // Not cached.
+  // Recycle the least recently used unreferenced page.
+  for(pg = pcache.head.prev; pg != &pcache.head; pg = pg->prev){
+    if(pg->refcnt == 0)
+      goto found;
+  }
+  release(&pcache.lock);
+  return 0;
+
+found:
+  pg->dev = ip->dev;
+  pg->inum = ip->inum;
+  pg->pgno = pgno;
+  pg->valid = 0;
+  pg->filling = 1;
+  pg->refcnt = 1;
+  release(&pcache.lock);
+
+  // a program that mapped the old page keeps it.
+  if(pg->data && krefcnt(pg->data) > 1){
+    kfree(pg->data);
+    pg->data = 0;
+  }
+  if(pg->data == 0)
+    pg->data = kalloc();
+  if(pg->data == 0)
+    goto bad;
+  memset(pg->data, 0, PGSIZE);
+  if(readi(ip, 0, (uint64)pg->data, pgno*PGSIZE, PGSIZE) < 0)
+    goto bad;
+  acquire(&pcache.lock);
+  pg->valid = 1;
+  pg->filling = 0;
+  wakeup(pg);
+  release(&pcache.lock);
+  return pg;
+
+bad:
+  acquire(&pcache.lock);
+  pg->refcnt--;
+  pg->filling = 0;
+  wakeup(pg);
+  release(&pcache.lock);
+  return 0;
+}
+
+// Find the cached page at physical address pa.
+// Caller must hold pcache.lock.
+static struct page*
+pcfind(uint64 pa)
+{
+  struct page *pg;
+
+  for(pg = pcache.page; pg < pcache.page+NPCACHE; pg++)
+    if(pg->refcnt > 0 && (uint64)pg->data == pa)
+      return pg;
+  panic("pcfind");
+}
+
+// Take another reference to the cached page at pa,
+// for a new mapping of it.
+void
+pcdup(uint64 pa)
+{
+  acquire(&pcache.lock);
+  pcfind(pa)->refcnt++;
+  release(&pcache.lock);
+}
+
+// Drop a mapping's reference to the cached page at pa.
+// The page stays cached until it is recycled.
+void
+pcput(uint64 pa)
+{
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  pg = pcfind(pa);
+  pg->refcnt--;
+  if(pg->refcnt == 0){
+    // no one is mapping it now.
+    pg->next->prev = pg->prev;
+    pg->prev->next = pg->next;
+    pg->next = pcache.head.next;
+    pg->prev = &pcache.head;
+    pcache.head.next->prev = pg;
+    pcache.head.next = pg;
+  }
+  release(&pcache.lock);
+}
+
+// Bytes [off, off+n) of ip have just been written.
+// Copy them into the pages that are mapped, and forget
+// the unmapped ones, since they are now stale.
+// Caller must hold ip->lock.
+void
+pcupdate(struct inode *ip, uint off, uint n)
+{
+  struct page *pg;
+  uint a, b;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.page; pg < pcache.page+NPCACHE; pg++){
+    if(!pg->valid || pg->dev != ip->dev || pg->inum != ip->inum)
+      continue;
+    a = pg->pgno*PGSIZE;
+    b = a + PGSIZE;
+    if(off >= b || off + n <= a)
+      continue;
+    if(pg->refcnt == 0){
+      pg->valid = 0;
+      continue;
+    }
+    if(a < off)
+      a = off;
+    if(b > off + n)
+      b = off + n;
+    // hold a reference so that pg isn't recycled
+    // while pcache.lock is released for readi().
+    pg->refcnt++;
+    release(&pcache.lock);
+    readi(ip, 0, (uint64)pg->data + (a - pg->pgno*PGSIZE), a, b - a);
+    acquire(&pcache.lock);
+    pg->refcnt--;
+  }
+  release(&pcache.lock);
+}
+
+// Forget the unmapped cached pages of ip.
+// Caller must hold ip->lock.
+void
+pcinval(struct inode *ip)
+{
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.page; pg < pcache.page+NPCACHE; pg++)
+    if(pg->refcnt == 0 && pg->dev == ip->dev && pg->inum == ip->inum)
+      pg->valid = 0;
+  release(&pcache.lock);
+}
+
+// Free the memory of the cached pages that no one maps, so
+// that it can be used for something else. Pages that are
+// queued for writeback are still referenced, and stay.
+// Returns the number of pages freed.
+int
+pcshrink(void)
+{
+  struct page *pg;
+  int n = 0;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.page; pg < pcache.page+NPCACHE; pg++){
+    if(pg->refcnt == 0 && pg->data){
+      kfree(pg->data);
+      pg->data = 0;
+      pg->valid = 0;
+      n++;
+    }
+  }
+  release(&pcache.lock);
+  return n;
+}
+
+// Queue the cached page at pa, a page of ip, to be written
+// back to ip by the pcflush process. The queued page holds
+// references to itself and to ip until it is written.
+void
+pcqueue(struct inode *ip, uint64 pa)
+{
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  pg = pcfind(pa);
+  if(!pg->dirty){
+    pg->dirty = 1;
+    pg->refcnt++;
+    pg->ip = idup(ip);
+    wakeup(&pcache.head);
+  }
+  release(&pcache.lock);
+}
+
+// Ask pcflush to read pages [pgno, pgno+n) of ip into the
+// cache, without waiting for it. It's only a hint: it's
+// dropped if too many are already queued.
+void
+pcprefetch(struct inode *ip, uint pgno, uint n)
+{
+  struct prefetch *pf;
+
+  // don't push out more of the cache than half.
+  n = min(n, NPCACHE/2);
+  if(n == 0)
+    return;
+  acquire(&pcache.lock);
+  for(pf = pcache.prefetch; pf < pcache.prefetch+NPREFETCH; pf++){
+    if(pf->ip == 0){
+      pf->ip = idup(ip);
+      pf->pgno = pgno;
+      pf->n = n;
+      wakeup(&pcache.head);
+      break;
+    }
+  }
+  release(&pcache.lock);
+}
+
+// Read the pages that pf asks for into the cache.
+// They stay cached, unreferenced, until they're mapped or
+// recycled.
+static void
+pcreadahead(struct prefetch *pf)
+{
+  struct inode *ip = pf->ip;
+  struct page *pg;
+  uint i;
+
+  begin_op(); // for iput()
+  ilockshared(ip);
+  for(i = 0; i < pf->n && (pf->pgno + i)*PGSIZE < ip->size; i++){
+    if((pg = pcget(ip, pf->pgno + i)) == 0)
+      break;
+    pcput((uint64)pg->data);
+  }
+  iunlockshared(ip);
+  iput(ip);
+  end_op();
+}
+
+// Body of the pcflush kernel process: write queued
+// pages back to their files, one transaction each,
+// and read prefetched pages in.
+static void
+pcflush(void)
+{
+  struct page *pg;
+  struct prefetch pf, *q;
+  struct inode *ip;
+  uint off;
+
+  acquire(&pcache.lock);
+  for(;;){
+    for(pg = pcache.page; pg < pcache.page+NPCACHE; pg++)
+      if(pg->dirty)
+        break;
+    if(pg == pcache.page+NPCACHE){
+      for(q = pcache.prefetch; q < pcache.prefetch+NPREFETCH; q++)
+        if(q->ip)
+          break;
+      if(q == pcache.prefetch+NPREFETCH){
+        sleep(&pcache.head, &pcache.lock);
+        continue;
+      }
+      pf = *q;
+      q->ip = 0;
+      release(&pcache.lock);
+      pcreadahead(&pf);
+      acquire(&pcache.lock);
+      continue;
+    }
+    pg->dirty = 0;
+    ip = pg->ip;
+    pg->ip = 0;
+    release(&pcache.lock);
+
+    begin_op();
+    ilock(ip);
+    off = pg->pgno*PGSIZE;
+    if(off < ip->size)
+      writei(ip, 0, (uint64)pg->data, off, min(ip->size - off, PGSIZE));
+    iunlock(ip);
+    iput(ip);
+    end_op();
+    pcput((uint64)pg->data);
+
+    acquire(&pcache.lock);
+  }
+}
+
+void
+pcflushinit(void)
+{
+  kproc("pcflush", pcflush);
+}
@@ -0,0 +1,13 @@
+struct page {
+  int valid;   // has data been read from the file?
+  int filling; // being read in by pcget()?
+  uint dev;
+  uint inum;
+  uint pgno;   // page number within the file
+  uint refcnt; // number of mappings of this page
+  int dirty;   // queued for writeback by pcqueue()?
+  struct inode *ip; // file to write back to, if dirty
+  struct page *prev; // LRU cache list
+  struct page *next;
+  char *data;  // kalloc()ed page, 0 until first use
+};
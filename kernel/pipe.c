@@ -3,22 +3,39 @@
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "fs.h"
-#include "sleeplock.h"
 #include "file.h"
+#include "slab.h"
 
-#define PIPESIZE 512
+// A pipe's data is a ring of 2^order physically contiguous
+// pages, so that a transfer wraps around it in at most two
+// copies. fcntl(F_SETPIPE_SZ) changes its size.
+#define PIPEORDER    0   // a new pipe's ring: one page
+#define PIPEMAXORDER 4   // biggest ring: 16 pages
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;
+  uint size;      // bytes in the ring, PGSIZE << order
+  int order;
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int rwaiting;   // readers asleep waiting for data
+  uint wwant;     // room a writer asleep is waiting for, or 0
 };
 
+struct slabcache pipecache;
+
+void
+pipeinit(void)
+{
+  slabinit(&pipecache, "pipe", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,12 +45,21 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = (struct pipe*)slaballoc(&pipecache)) == 0)
     goto bad;
+  if((pi->data = kalloc_pages(PIPEORDER)) == 0){
+    slabfree(&pipecache, pi);
+    pi = 0;
+    goto bad;
+  }
+  pi->order = PIPEORDER;
+  pi->size = PGSIZE << PIPEORDER;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
+  pi->rwaiting = 0;
+  pi->wwant = 0;
   initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -47,7 +73,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    slabfree(&pipecache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,15 +94,71 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    kfree_pages(pi->data, pi->order);
+    slabfree(&pipecache, pi);
   } else
     release(&pi->lock);
 }
 
+// Wake the readers, if any are waiting for data.
+// Caller must hold pi->lock.
+static void
+wakereaders(struct pipe *pi)
+{
+  if(pi->rwaiting)
+    wakeup(&pi->nread);
+}
+
+// Wake the writers, if one is waiting and there is now
+// as much room as it asked for. Caller must hold pi->lock.
+static void
+wakewriters(struct pipe *pi)
+{
+  if(pi->wwant && pi->size - (pi->nwrite - pi->nread) >= pi->wwant){
+    pi->wwant = 0;
+    wakeup(&pi->nwrite);
+  }
+}
+
+// Sleep until there are want bytes of room in the full pipe,
+// or as much as half the ring, so that the writer then has
+// enough room to copy a useful amount. Caller must hold
+// pi->lock.
+static void
+waitroom(struct pipe *pi, uint want)
+{
+  if(want > pi->size / 2)
+    want = pi->size / 2;
+  if(pi->wwant == 0 || want < pi->wwant)
+    pi->wwant = want;
+  wakereaders(pi);
+  sleep(&pi->nwrite, &pi->lock);
+}
+
+// A copy of n bytes to (write = 1) or from user address addr,
+// made holding pi->lock, failed: fault the pages in, which may
+// sleep and so can't be done holding the lock, for the caller
+// to look at the pipe again and retry.
+// Returns 0, or -1 if the copy can't succeed.
+static int
+pipefault(struct pipe *pi, int user, uint64 addr, uint n, int write)
+{
+  int r = -1;
+
+  release(&pi->lock);
+  if(user)
+    r = uvmfault(myproc()->mm->pagetable, addr, n, write);
+  acquire(&pi->lock);
+  return r;
+}
+
+// Write n bytes from addr, a user address if user is set,
+// else a kernel one, waiting for room as needed.
 int
-pipewrite(struct pipe *pi, uint64 addr, int n)
+pipewrite(struct pipe *pi, int user, uint64 addr, int n)
 {
   int i = 0;
+  uint m, w;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
@@ -85,46 +167,166 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       release(&pi->lock);
       return -1;
     }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
-      sleep(&pi->nwrite, &pi->lock);
-    } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+    if(pi->nwrite == pi->nread + pi->size){ //DOC: pipewrite-full
+      waitroom(pi, n - i);
+      continue;
+    }
+    // copy as much as fits, up to the end of the ring.
+    w = pi->nwrite % pi->size;
+    m = n - i;
+    if(m > pi->size - (pi->nwrite - pi->nread))
+      m = pi->size - (pi->nwrite - pi->nread);
+    if(m > pi->size - w)
+      m = pi->size - w;
+    if(either_copyin(pi->data + w, user, addr + i, m) == -1){
+      if(pipefault(pi, user, addr + i, m, 0) < 0)
         break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      continue;
     }
+    pi->nwrite += m;
+    i += m;
   }
-  wakeup(&pi->nread);
+  wakereaders(pi);
   release(&pi->lock);
 
   return i;
 }
 
+// Read up to n bytes into addr, a user address if user is
+// set, else a kernel one, waiting until there are some.
 int
-piperead(struct pipe *pi, uint64 addr, int n)
+piperead(struct pipe *pi, int user, uint64 addr, int n)
 {
   int i;
+  uint m, r;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
+again:
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
     if(pr->killed){
       release(&pi->lock);
       return -1;
     }
+    pi->rwaiting++;
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
+    pi->rwaiting--;
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
-      break;
+  for(i = 0; i < n && pi->nread != pi->nwrite; i += m){  //DOC: piperead-copy
+    r = pi->nread % pi->size;
+    m = n - i;
+    if(m > pi->nwrite - pi->nread)
+      m = pi->nwrite - pi->nread;
+    if(m > pi->size - r)
+      m = pi->size - r;
+    if(either_copyout(user, addr + i, pi->data + r, m) == -1){
+      if(pipefault(pi, user, addr + i, m, 1) < 0)
+        break;
+      // another reader may have emptied the pipe meanwhile.
+      if(i == 0)
+        goto again;
+      m = 0;
+      continue;
+    }
+    pi->nread += m;
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  wakewriters(pi);  //DOC: piperead-wakeup
   release(&pi->lock);
   return i;
 }
+
+// Wait until pi has room to write into. Returns -1 if
+// its read end is closed or the caller has been killed.
+int
+pipewaitroom(struct pipe *pi)
+{
+  struct proc *pr = myproc();
+
+  acquire(&pi->lock);
+  while(pi->nwrite == pi->nread + pi->size && pi->readopen && !pr->killed)
+    waitroom(pi, BSIZE);
+  if(pi->readopen == 0 || pr->killed){
+    release(&pi->lock);
+    return -1;
+  }
+  release(&pi->lock);
+  return 0;
+}
+
+// Copy as many of the n bytes at kernel address src into pi
+// as fit, without waiting. Returns the number copied, or -1
+// if the read end is closed.
+int
+pipeput(struct pipe *pi, char *src, int n)
+{
+  int i;
+  uint m, w;
+
+  acquire(&pi->lock);
+  if(pi->readopen == 0){
+    release(&pi->lock);
+    return -1;
+  }
+  for(i = 0; i < n && pi->nwrite != pi->nread + pi->size; i += m){
+    w = pi->nwrite % pi->size;
+    m = n - i;
+    if(m > pi->size - (pi->nwrite - pi->nread))
+      m = pi->size - (pi->nwrite - pi->nread);
+    if(m > pi->size - w)
+      m = pi->size - w;
+    memmove(pi->data + w, src + i, m);
+    pi->nwrite += m;
+  }
+  wakereaders(pi);
+  release(&pi->lock);
+  return i;
+}
+
+// Return the size of pi's ring.
+int
+pipesize(struct pipe *pi)
+{
+  return pi->size;
+}
+
+// Give pi a ring of at least n bytes, rounded up to a power
+// of two pages, keeping the data in it. Returns the new size,
+// or -1 if n is too big or smaller than the data.
+int
+piperesize(struct pipe *pi, int n)
+{
+  char *data, *odata;
+  int order, oorder, size;
+  uint len, r, m;
+
+  if(n <= 0)
+    return -1;
+  for(order = 0; order < PIPEMAXORDER && (PGSIZE << order) < n; order++)
+    ;
+  if((PGSIZE << order) < n || (data = kalloc_pages(order)) == 0)
+    return -1;
+
+  acquire(&pi->lock);
+  len = pi->nwrite - pi->nread;
+  if(len > (PGSIZE << order)){
+    release(&pi->lock);
+    kfree_pages(data, order);
+    return -1;
+  }
+  r = pi->nread % pi->size;
+  m = len < pi->size - r ? len : pi->size - r;
+  memmove(data, pi->data + r, m);
+  memmove(data + m, pi->data, len - m);
+  odata = pi->data;
+  oorder = pi->order;
+  pi->data = data;
+  pi->order = order;
+  pi->size = size = PGSIZE << order;
+  pi->nread = 0;
+  pi->nwrite = len;
+  wakewriters(pi);
+  release(&pi->lock);
+
+  kfree_pages(odata, oorder);
+  return size;
+}
@@ -17,16 +17,50 @@
 
 volatile int panicked = 0;
 
-// lock to avoid interleaving concurrent printf's.
+extern struct spinlock uart_tx_lock; // from uart.c
+
+// printf() writes into its CPU's ring of kernel output, which
+// uartstart() drains a line at a time as the UART is ready, so
+// that printing doesn't wait for the UART and lines from
+// different CPUs don't interleave. Once panicking, printf()
+// writes straight to the UART instead.
 static struct {
-  struct spinlock lock;
-  int locking;
+  int locking;   // 0 once panicking: print synchronously
 } pr;
 
+#define KLOGSIZE 2048
+
+struct klog {
+  struct spinlock lock;
+  char buf[KLOGSIZE];
+  uint r;        // next to send
+  uint w;        // next to fill
+};
+static struct klog klog[NCPU];
+static int klogcur;  // ring being sent; protected by uart_tx_lock
+
 static char digits[] = "0123456789abcdef";
 
+// Output one character into ring k, or straight
+// to the console if k is 0. Caller holds k->lock.
+static void
+kputc(struct klog *k, int c)
+{
+  if(k == 0){
+    consputc(c);
+    return;
+  }
+  while(k->w == k->r + KLOGSIZE){
+    // full: wait for the UART to take some.
+    release(&k->lock);
+    uartdrain();
+    acquire(&k->lock);
+  }
+  k->buf[k->w++ % KLOGSIZE] = c;
+}
+
 static void
-printint(int xx, int base, int sign)
+printint(struct klog *k, int xx, int base, int sign)
 {
   char buf[16];
   int i;
@@ -46,17 +80,17 @@ printint(int xx, int base, int sign)
     buf[i++] = '-';
 
   while(--i >= 0)
-    consputc(buf[i]);
+    kputc(k, buf[i]);
 }
 
 static void
-printptr(uint64 x)
+printptr(struct klog *k, uint64 x)
 {
   int i;
-  consputc('0');
-  consputc('x');
+  kputc(k, '0');
+  kputc(k, 'x');
   for (i = 0; i < (sizeof(uint64) * 2); i++, x <<= 4)
-    consputc(digits[x >> (sizeof(uint64) * 8 - 4)]);
+    kputc(k, digits[x >> (sizeof(uint64) * 8 - 4)]);
 }
 
 // Print to the console. only understands %d, %x, %p, %s.
@@ -64,20 +98,25 @@ void
 printf(char *fmt, ...)
 {
   va_list ap;
-  int i, c, locking;
+  int i, c;
   char *s;
-
-  locking = pr.locking;
-  if(locking)
-    acquire(&pr.lock);
+  struct klog *k = 0;
 
   if (fmt == 0)
     panic("null fmt");
 
+  // print directly while panicking, and if called from
+  // the UART driver, which can't drain the ring.
+  push_off();
+  if(pr.locking && !holding(&uart_tx_lock)){
+    k = &klog[cpuid()];
+    acquire(&k->lock);
+  }
+
   va_start(ap, fmt);
   for(i = 0; (c = fmt[i] & 0xff) != 0; i++){
     if(c != '%'){
-      consputc(c);
+      kputc(k, c);
       continue;
     }
     c = fmt[++i] & 0xff;
@@ -85,39 +124,75 @@ printf(char *fmt, ...)
       break;
     switch(c){
     case 'd':
-      printint(va_arg(ap, int), 10, 1);
+      printint(k, va_arg(ap, int), 10, 1);
       break;
     case 'x':
-      printint(va_arg(ap, int), 16, 1);
+      printint(k, va_arg(ap, int), 16, 1);
       break;
     case 'p':
-      printptr(va_arg(ap, uint64));
+      printptr(k, va_arg(ap, uint64));
       break;
     case 's':
       if((s = va_arg(ap, char*)) == 0)
         s = "(null)";
       for(; *s; s++)
-        consputc(*s);
+        kputc(k, *s);
       break;
     case '%':
-      consputc('%');
+      kputc(k, '%');
       break;
     default:
       // Print unknown % sequence to draw attention.
-      consputc('%');
-      consputc(c);
+      kputc(k, '%');
+      kputc(k, c);
       break;
     }
   }
 
-  if(locking)
-    release(&pr.lock);
+  if(k){
+    release(&k->lock);
+    uartkick();
+  }
+  pop_off();
+}
+
+// Return the next character of kernel output for the UART
+// to send, or -1 if there is none. Takes a line at a time
+// from each CPU's ring in turn.
+// Called by uartstart() with uart_tx_lock held.
+int
+klogget(void)
+{
+  struct klog *k;
+  int i, c;
+
+  for(i = 0; i < NCPU; i++){
+    k = &klog[klogcur];
+    acquire(&k->lock);
+    if(k->r != k->w){
+      c = k->buf[k->r++ % KLOGSIZE];
+      release(&k->lock);
+      if(c == '\n')
+        klogcur = (klogcur + 1) % NCPU;
+      return c;
+    }
+    release(&k->lock);
+    klogcur = (klogcur + 1) % NCPU;
+  }
+  return -1;
 }
 
 void
 panic(char *s)
 {
+  struct klog *k;
+
   pr.locking = 0;
+  // send what is still buffered first, without locks,
+  // since the panic may be in the middle of a printf().
+  for(k = klog; k < klog + NCPU; k++)
+    while(k->r != k->w)
+      consputc(k->buf[k->r++ % KLOGSIZE]);
   printf("panic: ");
   printf(s);
   printf("\n");
@@ -129,6 +204,9 @@ panic(char *s)
 void
 printfinit(void)
 {
-  initlock(&pr.lock, "pr");
+  struct klog *k;
+
+  for(k = klog; k < klog + NCPU; k++)
+    initlock(&k->lock, "klog");
   pr.locking = 1;
 }
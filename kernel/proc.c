@@ -3,26 +3,89 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
+#include "fcntl.h"
+#include "memstat.h"
+#include "trace.h"
 
 struct cpu cpus[NCPU];
 
 struct proc proc[NPROC];
 
+// Each CPU has a queue of RUNNABLE processes, which its
+// scheduler() takes from, and when it's empty, steals from
+// the others'. A process woken or preempted goes back on the
+// queue of the CPU it last ran on, whose cache may still hold
+// its data. Lock order: p->lock, then a run queue's lock.
+//
+// A queue has NPRIO levels, and the scheduler runs the first
+// process of the highest non-empty one (a multi-level feedback
+// queue). A process runs for a time slice of SLICE(level)
+// ticks, or until something higher is waiting, and one that
+// uses up its slice moves a level down. Sleeping moves it back
+// to its base level, so processes that mostly wait for I/O or
+// input stay high, ahead of those that compute. Every
+// BOOSTTICKS ticks, everything queued goes back to its base
+// level, so a low level is never starved for long.
+//
+// While a process is queued, its queue's lock protects its
+// prio and slice; otherwise p->lock does.
+#define SLICE(l)   (1 << (l))
+#define BOOSTTICKS 100
+
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  int n;
+  uint boosted;              // ticks at the last boost
+} runq[NCPU];
+
+// Sleeping processes wait on queues hashed by channel, so
+// wakeup() looks only at those that might be sleeping on its
+// channel. A queue's lock comes before the p->lock of each
+// process on it: sleep() takes both before letting go of the
+// caller's lock, so it can't miss a wakeup.
+#define NSLEEPQ 61
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+} sleepq[NSLEEPQ];
+
+static struct sleepq*
+sleepqof(void *chan)
+{
+  return &sleepq[((uint64)chan >> 3) % NSLEEPQ];
+}
+
+// Taken by futexwait() and futexwake(), so that a wakeup
+// can't come between a waiter's look at the word and its sleep.
+struct spinlock futex_lock;
+
 struct proc *initproc;
 
 int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kprocstart(void);
 static void freeproc(struct proc *p);
+static void adopt(struct proc *p, struct proc *np);
+static void reap(struct proc *np);
+static void setrunnable(struct proc *p);
+static void resetprio(struct proc *p);
+static void threadexit(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
 // memory model when using p->parent.
+// protects the lists of children, p->kids
+// and p->zombies.
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
@@ -50,8 +113,14 @@ procinit(void)
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  initlock(&futex_lock, "futex");
+  for(int i = 0; i < NCPU; i++)
+    initfairlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
+      initsleeplock(&p->vmlock, "vmlock");
       p->kstack = KSTACK((int) (p - proc));
   }
 }
@@ -119,6 +188,10 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->mm = p;
+  p->nthread = 1;
+  p->tfslots = 1;
+  p->tfslot = 0;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -127,6 +200,16 @@ found:
     return 0;
   }
 
+  // And the page that its program reads its pid from.
+  if((p->usyscall = (struct usyscall *)kalloc()) == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+  memset(p->usyscall, 0, PGSIZE);
+  p->usyscall->pid = p->pid;
+  p->usyscall->nthread = 1;
+
   // An empty user page table.
   p->pagetable = proc_pagetable(p);
   if(p->pagetable == 0){
@@ -153,16 +236,39 @@ freeproc(struct proc *p)
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
+  if(p->usyscall)
+    kfree((void*)p->usyscall);
+  p->usyscall = 0;
+  p->ursqhead = p->urcqtail = 0;
+  // an exited thread has nothing of its own below.
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
+  p->asid = 0;
+  p->asidgen = 0;
+  p->tlbstale = 0;
   p->sz = 0;
+  p->ustack = 0;
+  p->nfault = 0;
+  p->clockhand = 0;
+  p->nexecseg = 0;
+  if(p->vmas)
+    kfree((void*)p->vmas);
+  p->vmas = 0;
+  p->nvma = 0;
   p->pid = 0;
   p->parent = 0;
+  p->sibnext = p->sibprev = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfn = 0;
+  p->base = 0;
+  p->mm = p;
+  p->nthread = 0;
+  p->tfslots = 0;
+  p->tfslot = 0;
   p->state = UNUSED;
 }
 
@@ -196,6 +302,16 @@ proc_pagetable(struct proc *p)
     return 0;
   }
 
+  // map the usyscall page below the thread frames,
+  // for the program to read.
+  if(mappages(pagetable, USYSCALL, PGSIZE,
+              (uint64)(p->usyscall), PTE_R | PTE_U) < 0){
+    uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+    uvmunmap(pagetable, TRAPFRAME, 1, 0);
+    uvmfree(pagetable, 0);
+    return 0;
+  }
+
   return pagetable;
 }
 
@@ -206,6 +322,7 @@ proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
   uvmunmap(pagetable, TRAPFRAME, 1, 0);
+  uvmunmap(pagetable, USYSCALL, 1, 0);
   uvmfree(pagetable, sz);
 }
 
@@ -242,28 +359,52 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  resetprio(p);
+  setrunnable(p);
 
   release(&p->lock);
 }
 
+// Start a kernel process that runs fn, which must never return.
+// A kernel process has no user memory and never enters user
+// space; it's for background work, such as writing back pages
+// queued by msync().
+void
+kproc(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kproc");
+  p->kfn = fn;
+  p->context.ra = (uint64)kprocstart;
+  safestrcpy(p->name, name, sizeof(p->name));
+  resetprio(p);
+  setrunnable(p);
+  release(&p->lock);
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz, limit;
   struct proc *p = myproc();
 
-  sz = p->sz;
+  sz = p->mm->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    // only reserve the address space: lazyalloc() allocates
+    // each page on first touch. don't grow into the lowest
+    // mapped region.
+    limit = p->mm->nvma > 0 ? p->mm->vmas[0]->addr : USERTOP;
+    if(PGROUNDUP(sz + n) > limit)
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    sz = uvmdealloc(p->mm->pagetable, sz, sz + n);
   }
-  p->sz = sz;
+  p->mm->sz = sz;
   return 0;
 }
 
@@ -282,12 +423,22 @@ fork(void)
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  if(uvmcopy(p->mm->pagetable, np->pagetable, 0, p->mm->sz) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->sz = p->mm->sz;
+  np->ustack = p->mm->ustack;
+  np->nexecseg = p->mm->nexecseg;
+  memmove(np->execseg, p->mm->execseg, sizeof(p->mm->execseg));
+
+  // Copy mapped regions.
+  if(mmapfork(p, np) < 0){
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -297,16 +448,103 @@ fork(void)
 
   // increment reference counts on open file descriptors.
   for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
-
-  for(int i = 0; i < MAXVMA; i++){
-    if(p->vma_table[i].mapped){
-      memmove(&np->vma_table[i], &p->vma_table[i], sizeof(struct vma));
-      filedup(np->vma_table[i].f);
-    }
+    if(p->mm->ofile[i])
+      np->ofile[i] = filedup(p->mm->ofile[i]);
+  np->cwd = idup(p->mm->cwd);
+  if(p->mm->exe)
+    np->exe = idup(p->mm->exe);
+
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  pid = np->pid;
+
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  adopt(p, np);
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  // start the child on our CPU; another may steal it.
+  np->cpu = cpuid();
+  np->base = p->base;
+  resetprio(np);
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// What spawn() asks its new process to exec, and the
+// outcome, on the kernel stack of spawn()'s caller.
+struct spawn {
+  char *path;
+  char **argv;
+  int r;
+};
+
+// A spawn()ed process's very first scheduling by scheduler()
+// will swtch to spawnret, which execs the program spawn() asked
+// for, tells spawn() how that went, and returns to user space
+// in the new program.
+static void
+spawnret(void)
+{
+  struct proc *p = myproc();
+  int r;
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  r = exec(p->spawn->path, p->spawn->argv);
+
+  acquire(&wait_lock);
+  p->spawn->r = r;
+  wakeup(p->spawn);
+  p->spawn = 0;
+  release(&wait_lock);
+
+  if(r < 0)
+    exit(-1);
+  p->trapframe->a0 = r;
+  usertrapret();
+}
+
+// Create a child process running path with arguments argv,
+// which are kernel addresses, without first copying the
+// caller's memory as fork() and exec() would. The child gets
+// the caller's open files, except that with fds, its
+// descriptor i is the caller's fds[i] for each of the three
+// that is not -1. Returns the child's pid, or -1 if the child
+// couldn't be made or the exec failed.
+int
+spawn(char *path, char **argv, int *fds)
+{
+  int i, pid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct file *f;
+  struct spawn sp;
+
+  for(i = 0; fds && i < 3; i++)
+    if(fds[i] >= NOFILE || (fds[i] >= 0 && p->mm->ofile[fds[i]] == 0))
+      return -1;
+
+  // Allocate process. exec() will give it memory.
+  if((np = allocproc()) == 0){
+    return -1;
+  }
+  np->context.ra = (uint64)spawnret;
+
+  for(i = 0; i < NOFILE; i++){
+    f = p->mm->ofile[i];
+    if(fds && i < 3 && fds[i] >= 0)
+      f = p->mm->ofile[fds[i]];
+    if(f)
+      np->ofile[i] = filedup(f);
   }
+  np->cwd = idup(p->mm->cwd);
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -314,17 +552,192 @@ fork(void)
 
   release(&np->lock);
 
+  sp.path = path;
+  sp.argv = argv;
+  sp.r = 0;
   acquire(&wait_lock);
-  np->parent = p;
+  adopt(p, np);
+  np->spawn = &sp;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->cpu = cpuid();
+  np->base = p->base;
+  resetprio(np);
+  setrunnable(np);
+  release(&np->lock);
+
+  // wait for the child to exec, since path and argv
+  // belong to the caller.
+  acquire(&wait_lock);
+  while(np->spawn)
+    sleep(&sp, &wait_lock);
+  if(sp.r >= 0){
+    release(&wait_lock);
+    return pid;
+  }
+
+  // the child exits; clear up after it, as wait() would.
+  for(;;){
+    acquire(&np->lock);
+    if(np->parent != p){
+      // another thread's wait() got to it first.
+      release(&np->lock);
+      break;
+    }
+    if(np->state == ZOMBIE){
+      reap(np);
+      release(&np->lock);
+      break;
+    }
+    release(&np->lock);
+    sleep(p, &wait_lock);
+  }
   release(&wait_lock);
+  return -1;
+}
+
+// Create a thread of the calling process that shares its
+// memory, open files and current directory, and starts in
+// user space at fn(arg) with stack pointer stack. It has a
+// trapframe and kernel stack of its own, and is the caller's
+// child, for wait(). Caller must hold p->mm->vmlock.
+// Returns the thread's pid, or -1.
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  struct proc *np, *p = myproc(), *mm = p->mm;
+  int slot, pid;
+
+  if((np = allocproc()) == 0)
+    return -1;
+  // threads use mm's page table, not one of their own.
+  proc_freepagetable(np->pagetable, 0);
+  np->pagetable = 0;
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  for(slot = 1; slot < NTHREAD; slot++)
+    if((mm->tfslots & (1 << slot)) == 0)
+      break;
+  if(slot == NTHREAD ||
+     mappages(mm->pagetable, THREADFRAME(slot), PGSIZE,
+              (uint64)np->trapframe, PTE_R | PTE_W) < 0){
+    release(&wait_lock);
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  mm->tfslots |= 1 << slot;
+  mm->nthread++;
+  mm->usyscall->nthread = mm->nthread;
+  np->mm = mm;
+  np->tfslot = slot;
+  adopt(p, np);
+  release(&wait_lock);
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->a0 = arg;
+  np->trapframe->sp = stack;
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  pid = np->pid;
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  np->cpu = cpuid();
+  np->base = p->base;
+  resetprio(np);
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
 }
 
+// Detach exiting thread p from its process: unmap its
+// trapframe and give up its slot.
+static void
+threadexit(struct proc *p)
+{
+  struct proc *mm = p->mm;
+  uint64 va = THREADFRAME(p->tfslot);
+
+  // the next thread in the slot may run on a hart whose
+  // TLB still maps va; uvmunmap() sees that it's flushed.
+  acquiresleep(&mm->vmlock);
+  uvmunmap(mm->pagetable, va, 1, 0);
+  releasesleep(&mm->vmlock);
+
+  acquire(&wait_lock);
+  mm->tfslots &= ~(1 << p->tfslot);
+  mm->nthread--;
+  mm->usyscall->nthread = mm->nthread;
+  wakeup(&mm->nthread);
+  p->mm = p;
+  p->tfslot = 0;
+  release(&wait_lock);
+}
+
+// Kill the other threads of process p, which must be the
+// calling thread, and wait until they have all exited.
+void
+killthreads(struct proc *p)
+{
+  struct proc *q;
+
+  acquire(&wait_lock);
+  while(p->nthread > 1){
+    // a uring worker acting for p isn't one of them.
+    for(q = proc; q < &proc[NPROC]; q++)
+      if(q != p && q->mm == p && q->kfn == 0)
+        kill(q->pid);
+    sleep(&p->nthread, &wait_lock);
+  }
+  release(&wait_lock);
+}
+
+// Put p at the head of list *head of a parent's children.
+// Caller must hold wait_lock.
+static void
+sibpush(struct proc **head, struct proc *p)
+{
+  p->sibprev = 0;
+  p->sibnext = *head;
+  if(*head)
+    (*head)->sibprev = p;
+  *head = p;
+}
+
+// Take p off list *head. Caller must hold wait_lock.
+static void
+sibremove(struct proc **head, struct proc *p)
+{
+  if(p->sibprev)
+    p->sibprev->sibnext = p->sibnext;
+  else
+    *head = p->sibnext;
+  if(p->sibnext)
+    p->sibnext->sibprev = p->sibprev;
+  p->sibnext = p->sibprev = 0;
+}
+
+// Make np a child of p. Caller must hold wait_lock.
+static void
+adopt(struct proc *p, struct proc *np)
+{
+  np->parent = p;
+  sibpush(&p->kids, np);
+}
+
+// Free zombie np, taking it off its parent's list.
+// Caller must hold wait_lock and np->lock.
+static void
+reap(struct proc *np)
+{
+  sibremove(&np->parent->zombies, np);
+  freeproc(np);
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void
@@ -332,11 +745,17 @@ reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    if(pp->parent == p){
+  while((pp = p->kids) != 0){
+    sibremove(&p->kids, pp);
+    adopt(initproc, pp);
+  }
+  if(p->zombies){
+    while((pp = p->zombies) != 0){
+      sibremove(&p->zombies, pp);
       pp->parent = initproc;
-      wakeup(initproc);
+      sibpush(&initproc->zombies, pp);
     }
+    wakeup(initproc);
   }
 }
 
@@ -351,31 +770,38 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
-    }
-  }
-
-  struct vma *pvma;
-  for(int i = 0; i < MAXVMA; i++){
-    pvma = &p->vma_table[i];
-    if(pvma->mapped){
-      //uvmunmap(p->pagetable, pvma->addr, pvma->len / PGSIZE, 0);
-      //memset(pvma, 0, sizeof(struct vma));
-      if(munmap(pvma->addr, pvma->len) < 0){
-        panic("exit munmap");
+  if(p->mm != p){
+    // a thread leaves its process's memory and files be.
+    threadexit(p);
+  } else {
+    // the process's other threads go first, and then
+    // its ring's requests.
+    killthreads(p);
+    uringfree(p);
+
+    // Close all open files.
+    for(int fd = 0; fd < NOFILE; fd++){
+      if(p->ofile[fd]){
+        struct file *f = p->ofile[fd];
+        fileclose(f);
+        p->ofile[fd] = 0;
       }
     }
-  }
 
-  begin_op();
-  iput(p->cwd);
-  end_op();
-  p->cwd = 0;
+    // Unmap mapped files, writing back shared pages.
+    acquiresleep(&p->vmlock);
+    munmapall();
+    releasesleep(&p->vmlock);
+
+    begin_op();
+    iput(p->cwd);
+    if(p->exe)
+      iput(p->exe);
+    end_op();
+    p->cwd = 0;
+    p->exe = 0;
+    p->nexecseg = 0;
+  }
 
   acquire(&wait_lock);
 
@@ -383,6 +809,8 @@ exit(int status)
   reparent(p);
 
   // Parent might be sleeping in wait().
+  sibremove(&p->parent->kids, p);
+  sibpush(&p->parent->zombies, p);
   wakeup(p->parent);
   
   acquire(&p->lock);
@@ -403,40 +831,35 @@ int
 wait(uint64 addr)
 {
   struct proc *np;
-  int havekids, pid;
+  int pid;
   struct proc *p = myproc();
 
   acquire(&wait_lock);
 
   for(;;){
-    // Scan through table looking for exited children.
-    havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
-      if(np->parent == p){
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&np->lock);
-
-        havekids = 1;
-        if(np->state == ZOMBIE){
-          // Found one.
-          pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(np);
-          release(&np->lock);
-          release(&wait_lock);
-          return pid;
-        }
+    if((np = p->zombies) != 0){
+      // make sure the child isn't still in exit() or swtch().
+      acquire(&np->lock);
+      pid = np->pid;
+      if(addr != 0 && copyout(p->mm->pagetable, addr, (char *)&np->xstate,
+                              sizeof(np->xstate)) < 0) {
+        // addr's page may just need faulting in, which can't
+        // be done holding the locks; do it, and look again.
         release(&np->lock);
+        release(&wait_lock);
+        if(uvmfault(p->mm->pagetable, addr, sizeof(np->xstate), 1) < 0)
+          return -1;
+        acquire(&wait_lock);
+        continue;
       }
+      reap(np);
+      release(&np->lock);
+      release(&wait_lock);
+      return pid;
     }
 
     // No point waiting if we don't have any children.
-    if(!havekids || p->killed){
+    if(p->kids == 0 || p->killed){
       release(&wait_lock);
       return -1;
     }
@@ -446,6 +869,223 @@ wait(uint64 addr)
   }
 }
 
+// If CPU id is halted in scheduler(), interrupt it, since
+// its queue now has work. Otherwise wake any halted CPU, to
+// steal the work. release() of the queue's lock has fenced
+// the work's arrival before this looks at the idle flags, and
+// idle() its flag before it looks at the queues.
+static void
+wakeidle(int id)
+{
+  int i;
+
+  if(!__atomic_load_n(&cpus[id].idle, __ATOMIC_RELAXED)){
+    for(i = 0; i < NCPU; i++)
+      if(__atomic_load_n(&cpus[i].idle, __ATOMIC_RELAXED))
+        break;
+    if(i == NCPU)
+      return;
+    id = i;
+  }
+  ipi(id);
+}
+
+// Interrupt CPU id. It takes a software interrupt, which
+// wakes it from wfi, and which, like any trap from user
+// space, stops it using stale TLB entries, see uvmasid().
+void
+ipi(int id)
+{
+  *(uint32*)CLINT_MSIP(id) = 1;
+}
+
+// Halt this CPU until an interrupt, unless some run queue has
+// work. Called by scheduler() when it found nothing to run.
+static void
+idle(struct cpu *c)
+{
+  uint64 t0;
+  int i;
+
+  // with interrupts off, wfi still returns when one is
+  // pending, so a wakeup after the check isn't lost.
+  intr_off();
+  c->idle = 1;
+  __sync_synchronize();
+  for(i = 0; i < NCPU; i++)
+    if(__atomic_load_n(&runq[i].n, __ATOMIC_RELAXED) > 0)
+      break;
+  if(i == NCPU){
+    t0 = r_time();
+    asm volatile("wfi");
+    c->idletime += r_time() - t0;
+  }
+  c->idle = 0;
+}
+
+// Put p at the tail of level l of run queue rq.
+// Caller must hold rq->lock.
+static void
+rqput(struct runq *rq, int l, struct proc *p)
+{
+  p->rqnext = 0;
+  if(rq->tail[l])
+    rq->tail[l]->rqnext = p;
+  else
+    rq->head[l] = p;
+  rq->tail[l] = p;
+}
+
+// Move p back to its base level with a fresh time slice.
+// Caller must hold p->lock, or p's queue's and p is queued.
+static void
+resetprio(struct proc *p)
+{
+  p->prio = p->base;
+  p->slice = SLICE(p->prio);
+}
+
+// Make p RUNNABLE and put it at the tail of its level of
+// its run queue. Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *rq = &runq[p->cpu];
+
+  p->state = RUNNABLE;
+  if(p->prio < p->base)
+    resetprio(p);   // setpriority() lowered it
+  acquire(&rq->lock);
+  rqput(rq, p->prio, p);
+  rq->n++;
+  release(&rq->lock);
+  wakeidle(p->cpu);
+}
+
+// Take the first process of the highest non-empty level of
+// run queue rq, or return 0 if it's empty.
+static struct proc*
+rqtake(struct runq *rq)
+{
+  struct proc *p = 0;
+  int l;
+
+  acquire(&rq->lock);
+  for(l = 0; l < NPRIO; l++){
+    if((p = rq->head[l]) != 0){
+      if((rq->head[l] = p->rqnext) == 0)
+        rq->tail[l] = 0;
+      rq->n--;
+      break;
+    }
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// Move everything queued on rq back to its base level.
+// Caller must hold rq->lock.
+static void
+rqboost(struct runq *rq)
+{
+  struct proc *p, *next;
+  int l;
+
+  for(l = 1; l < NPRIO; l++){
+    p = rq->head[l];
+    rq->head[l] = rq->tail[l] = 0;
+    for(; p; p = next){
+      next = p->rqnext;
+      resetprio(p);
+      rqput(rq, p->prio, p);
+    }
+  }
+}
+
+// Called on each timer interrupt, for the running process.
+// Charge it a tick of its slice; if that uses the slice up,
+// move it down a level. Boost this CPU's queue if it's time.
+// Returns 1 if the process should give up the CPU: because
+// its slice is over, or something higher is waiting.
+int
+schedtick(void)
+{
+  struct proc *p = myproc();
+  struct runq *rq = &runq[cpuid()];
+  int l, over = 0;
+
+  acquire(&p->lock);
+  if(--p->slice <= 0){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->slice = SLICE(p->prio);
+    over = 1;
+  }
+  acquire(&rq->lock);
+  if(ticks - rq->boosted >= BOOSTTICKS){
+    rq->boosted = ticks;
+    rqboost(rq);
+  }
+  for(l = 0; l < p->prio; l++)
+    if(rq->head[l])
+      over = 1;
+  release(&rq->lock);
+  release(&p->lock);
+  return over;
+}
+
+// Set the base priority level of process pid, or of the
+// caller if pid is 0, to prio. Returns the old level, or -1
+// if there is no such process.
+int
+setpriority(int pid, int prio)
+{
+  struct proc *p;
+  int old;
+
+  if(pid == 0)
+    pid = myproc()->pid;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      old = p->base;
+      p->base = prio;
+      // a queued process moves when it's next queued.
+      if(p->state != RUNNABLE)
+        resetprio(p);
+      release(&p->lock);
+      return old;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// Take a process for CPU id to run: from its own queue,
+// else from the longest of the others'. Returns 0 if
+// nothing is runnable.
+static struct proc*
+runnext(int id)
+{
+  struct proc *p;
+  int i, busiest, n;
+
+  if((p = rqtake(&runq[id])) != 0)
+    return p;
+  // read the lengths without locks: it's only a hint.
+  busiest = -1;
+  n = 0;
+  for(i = 0; i < NCPU; i++){
+    if(i != id && runq[i].n > n){
+      n = runq[i].n;
+      busiest = i;
+    }
+  }
+  if(busiest < 0)
+    return 0;
+  return rqtake(&runq[busiest]);
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -458,28 +1098,42 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
   
   c->proc = 0;
+  c->start = r_time();
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+    if((p = runnext(id)) == 0){
+      // nothing to run: do some background work,
+      // or if there's none, halt.
+      if(!kzeroidle())
+        idle(c);
+      continue;
     }
+    // p is off every queue, so no other CPU will choose it,
+    // but it may still be switching away on the CPU it was
+    // taken from, which holds p->lock until it's done.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->cpu = id;
+    c->proc = p;
+    if(tracemask & TR_SWITCH)
+      traceev(TE_RUN, 0, 0);
+    timertick();
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -505,6 +1159,8 @@ sched(void)
   if(intr_get())
     panic("sched interruptible");
 
+  if(tracemask & TR_SWITCH)
+    traceev(TE_SWITCH, p->state, 0);
   intena = mycpu()->intena;
   swtch(&p->context, &mycpu()->context);
   mycpu()->intena = intena;
@@ -516,7 +1172,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -537,31 +1193,64 @@ forkret(void)
     // be run from main().
     first = 0;
     fsinit(ROOTDEV);
+    if(fsmount(RAMDEV, "/tmp") < 0)
+      printf("no /tmp to mount the RAM disk on\n");
   }
 
   usertrapret();
 }
 
+// A kernel process's very first scheduling by scheduler()
+// will swtch to kprocstart.
+static void
+kprocstart(void)
+{
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  myproc()->kfn();
+  panic("kproc returned");
+}
+
+// Take p, which is SLEEPING, off its queue sq and make it
+// RUNNABLE. Caller must hold sq->lock and p->lock.
+static void
+unsleep(struct sleepq *sq, struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = &sq->head; *pp != p; pp = &(*pp)->sqnext)
+    ;
+  *pp = p->sqnext;
+  resetprio(p);
+  setrunnable(p);
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *sq = sleepqof(chan);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold chan's queue's lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks it),
   // so it's okay to release lk.
 
-  acquire(&p->lock);  //DOC: sleeplock1
+  acquire(&sq->lock);  //DOC: sleeplock1
+  acquire(&p->lock);
   release(lk);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->sqnext = sq->head;
+  sq->head = p;
+  release(&sq->lock);
 
   sched();
 
@@ -578,17 +1267,62 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  wakeupn(chan, NPROC);
+}
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
+// Wake up at most n of the processes sleeping on chan.
+// Returns how many it woke.
+// Must be called without any p->lock.
+int
+wakeupn(void *chan, int n)
+{
+  struct sleepq *sq = sleepqof(chan);
+  struct proc *p, *next;
+  int woken = 0;
+
+  acquire(&sq->lock);
+  for(p = sq->head; p && woken < n; p = next){
+    next = p->sqnext;
+    if(p->chan == chan){
+      // p may still be switching away on its CPU,
+      // which holds p->lock until it's done.
       acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
+      unsleep(sq, p);
       release(&p->lock);
+      woken++;
     }
   }
+  release(&sq->lock);
+  return woken;
+}
+
+// Sleep on the user word at physical address pa, if it still
+// holds val. Returns 0 when woken, or -1 if the word didn't hold
+// val or the caller has been killed.
+int
+futexwait(uint64 pa, int val)
+{
+  acquire(&futex_lock);
+  if(__atomic_load_n((int*)pa, __ATOMIC_SEQ_CST) != val || myproc()->killed){
+    release(&futex_lock);
+    return -1;
+  }
+  sleep((void*)pa, &futex_lock);
+  release(&futex_lock);
+  return 0;
+}
+
+// Wake at most n of those sleeping on the user word at
+// physical address pa. Returns how many it woke.
+int
+futexwake(uint64 pa, int n)
+{
+  int woken;
+
+  acquire(&futex_lock);
+  woken = wakeupn((void*)pa, n);
+  release(&futex_lock);
+  return woken;
 }
 
 // Kill the process with the given pid.
@@ -598,14 +1332,25 @@ int
 kill(int pid)
 {
   struct proc *p;
+  struct sleepq *sq;
+  void *chan;
 
   for(p = proc; p < &proc[NPROC]; p++){
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
       if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
+        // Wake process from sleep(). Its queue's lock comes
+        // first, so let go of p->lock, and check it's still
+        // asleep on the same channel once we have both.
+        chan = p->chan;
+        release(&p->lock);
+        sq = sleepqof(chan);
+        acquire(&sq->lock);
+        acquire(&p->lock);
+        if(p->state == SLEEPING && p->chan == chan)
+          unsleep(sq, p);
+        release(&sq->lock);
       }
       release(&p->lock);
       return 0;
@@ -623,7 +1368,7 @@ either_copyout(int user_dst, uint64 dst, void *src, uint64 len)
 {
   struct proc *p = myproc();
   if(user_dst){
-    return copyout(p->pagetable, dst, src, len);
+    return copyout(p->mm->pagetable, dst, src, len);
   } else {
     memmove((char *)dst, src, len);
     return 0;
@@ -638,7 +1383,7 @@ either_copyin(void *dst, int user_src, uint64 src, uint64 len)
 {
   struct proc *p = myproc();
   if(user_src){
-    return copyin(p->pagetable, dst, src, len);
+    return copyin(p->mm->pagetable, dst, src, len);
   } else {
     memmove(dst, (char*)src, len);
     return 0;
@@ -672,4 +1417,75 @@ procdump(void)
     printf("%d %s %s", p->pid, state, p->name);
     printf("\n");
   }
+  printf("kalloc: %d steals\n", (int)ksteals());
+  virtio_disk_stats();
+}
+
+// Fill in *ms for the live process with the smallest pid
+// that is at least pid, so that callers can step through
+// all processes. Its memory's vmlock keeps the page table and
+// mapped regions from changing while this looks, and its lock
+// keeps wait() from freeing them.
+// Returns 0, or -1 if there is no such process.
+int
+procmemstat(int pid, struct memstat *ms)
+{
+  struct proc *p, *q, *mm;
+  struct vma *v;
+  pagetable_t pt;
+  int i, qpid;
+
+  memset(ms, 0, sizeof(*ms));
+  for(;;){
+    q = 0;
+    for(p = proc; p < &proc[NPROC]; p++){
+      acquire(&p->lock);
+      if(p->state != UNUSED && p->pid >= pid && (q == 0 || p->pid < q->pid))
+        q = p;
+      release(&p->lock);
+    }
+    if(q == 0)
+      return -1;
+    acquire(&q->lock);
+    qpid = q->pid;
+    mm = q->mm;
+    release(&q->lock);
+    // vmlock comes before any p->lock.
+    acquiresleep(&mm->vmlock);
+    acquire(&q->lock);
+    if(q->state != UNUSED && q->pid == qpid && q->mm == mm && qpid >= pid)
+      break;
+    // it exited, or left or joined a process, meanwhile.
+    release(&q->lock);
+    releasesleep(&mm->vmlock);
+  }
+
+  ms->pid = q->pid;
+  safestrcpy(ms->name, q->name, sizeof(ms->name));
+  ms->sz = q->mm->sz;
+  ms->faults = q->mm->nfault;
+  if((pt = q->mm->pagetable) != 0){
+    if(q->mm->ustack >= PGSIZE){
+      ms->text = uvmresident(pt, 0, q->mm->ustack - PGSIZE);
+      ms->stack = uvmresident(pt, q->mm->ustack - PGSIZE, q->mm->ustack + PGSIZE);
+      ms->heap = uvmresident(pt, q->mm->ustack + PGSIZE, q->mm->sz);
+    } else {
+      ms->heap = uvmresident(pt, 0, q->mm->sz);
+    }
+    ms->nvma = q->mm->nvma;
+    for(i = 0; i < q->mm->nvma && i < MSNVMA; i++){
+      v = q->mm->vmas[i];
+      ms->vma[i].addr = v->addr;
+      ms->vma[i].len = v->len;
+      ms->vma[i].prot = v->prot;
+      ms->vma[i].flags = v->flags | (v->f ? 0 : MAP_ANONYMOUS);
+      ms->vma[i].resident = uvmresident(pt, v->addr, v->addr + v->len);
+    }
+  }
+  release(&q->lock);
+  releasesleep(&mm->vmlock);
+
+  ms->total = ktotalpages();
+  ms->free = kfreepages();
+  return 0;
 }
@@ -24,6 +24,15 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation this hart's TLB is in
+  int idle;                   // Halted in scheduler() for want of work?
+  uint64 start;               // r_time() when it began scheduling
+  uint64 idletime;            // r_time() cycles spent halted since
+  uint64 nipi;                // Wakeups from other CPUs
+  uint64 tickdue;             // r_time() of its next scheduling tick, or 0
+  uint64 profdue;             // r_time() of its next profiling sample, or 0
+  uint tlbreq;                // TLB flushes other harts asked of it
+  uint tlback;                // and how many of them it has done
 };
 
 extern struct cpu cpus[NCPU];
@@ -80,17 +89,32 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
-#define MAXVMA 16
+// A mapped region of a process's memory; see vma.c.
 struct vma {
-  int mapped;
   uint64 addr;
   int len;
   int prot;
   int flags;
   int offset;
   struct file *f;
+  uint64 nextfault; // where a sequential scan faults next
+  int window;       // pages to map on the next sequential fault
+  int advice;       // MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL
 };
 
+// max regions per process: p->vmas fills a page.
+#define MAXVMA (PGSIZE / sizeof(struct vma*))
+
+// The part of a program segment that holds bytes of the
+// program file, read in by execfault() on first touch.
+struct execseg {
+  uint64 va;     // page-aligned start
+  uint64 filesz; // bytes from the file
+  uint off;      // file offset of va
+};
+
+#define NEXECSEG 4 // max loadable segments per program
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -103,18 +127,59 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU it last ran on, whose run queue it joins
+  struct proc *rqnext;         // Next on its run queue
+  struct proc *sqnext;         // Next on its sleep queue
+  int prio;                    // Run queue level, 0 highest
+  int base;                    // Highest level it may run at (setpriority())
+  int slice;                   // Clock ticks left at this level
 
-  // wait_lock must be held when using this:
+  // wait_lock must be held when using these:
   struct proc *parent;         // Parent process
+  struct proc *kids;           // Children that haven't exited
+  struct proc *zombies;        // Children that have, for wait()
+  struct proc *sibnext;        // Next and previous in the parent's list
+  struct proc *sibprev;
+  int nthread;                 // Threads sharing its memory, itself included
+  struct spawn *spawn;         // what spawn() wants it to exec, until it has
+
+  // A thread made by clone() shares the memory, open files and
+  // current directory of the process that made it: those fields
+  // below are used only through p->mm, the process they belong
+  // to. mm is p itself for a process that isn't a thread.
+  struct proc *mm;
+  struct sleeplock vmlock;     // Serializes mm's threads' page faults
+                               // and changes to its address space
+  uint tfslots;                // Thread trapframe slots in use, see clone()
+  int tfslot;                  // This one's, mapped at THREADFRAME(tfslot)
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
+  uint64 ustack;               // Bottom of the user stack, above its guard page
+  uint64 nfault;               // Page faults taken
+  uint64 clockhand;            // Where mmapreclaim() looks next
+  struct inode *exe;           // Program file, or 0
+  int nexecseg;
+  struct execseg execseg[NEXECSEG]; // Parts of [0, sz) read from exe
   pagetable_t pagetable;       // User page table
-  struct trapframe *trapframe; // data page for trampoline.S
+  int asid;                    // Address-space ID of pagetable, see uvmasid()
+  uint64 asidgen;              // Generation asid belongs to
+  uint64 tlbstale;             // Harts whose TLBs may hold stale PTEs
+  struct trapframe *trapframe; // data page for trampoline.S, at THREADFRAME(tfslot)
+  struct usyscall *usyscall;   // page mapped read-only at USYSCALL
+  struct uring *uring;         // page mapped at URING, or 0, see uring.c
+  uint ursqhead;               // the kernel's own copies of uring's
+  uint urcqtail;               //   sqhead and cqtail
+  int urpending;               // ring requests taken but not completed
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  int logres;                  // Log blocks its FS op may yet add
+  struct sleeplock *shared[NLOCKSHARED]; // Sleep locks it holds shared
+  int nshared;
   char name[16];               // Process name (debugging)
-  struct vma vma_table[MAXVMA];// Table of mapped regions
+  struct vma **vmas;           // Mapped regions, sorted by address
+  int nvma;                    // Number of mapped regions
+  void (*kfn)(void);           // Body of a kernel process, or 0
 };
@@ -0,0 +1,112 @@
+// Sampling profiler.
+//
+// While profiling is on, each CPU running a process has its
+// timer interrupt it profhz times a second, besides its
+// scheduling ticks, and timerintr() calls profsample() to note
+// where the interrupted code was. A CPU that is idle takes no
+// samples, nor sets its timer for them.
+//
+// Each CPU keeps its samples in a ring of its own, written only
+// by it, with interrupts off. profread() drains the rings. A
+// sample that finds its ring full is dropped and counted rather
+// than overwriting one not yet read, so a profile is of the
+// first samples taken if it isn't read fast enough.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "prof.h"
+
+#define MAXPROFHZ 10000
+
+struct pring {
+  struct profsample s[NPROF];
+  uint r;        // next to read
+  uint w;        // next to fill; written only by its CPU
+  uint dropped;  // samples dropped since prof() last asked
+};
+
+static struct pring pring[NCPU];
+static struct sleeplock proflock;  // serializes readers
+uint64 profcycles;                 // between samples, or 0 if off
+
+void
+profinit(void)
+{
+  initsleeplock(&proflock, "prof");
+}
+
+// Note where this CPU was interrupted. Called by
+// timerintr(), so sepc and sstatus still describe the trap.
+void
+profsample(void)
+{
+  struct pring *r = &pring[cpuid()];
+  struct proc *p = mycpu()->proc;
+  struct profsample *s;
+
+  if(r->w - __atomic_load_n(&r->r, __ATOMIC_ACQUIRE) >= NPROF){
+    __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  s = &r->s[r->w % NPROF];
+  s->pc = r_sepc();
+  s->user = (r_sstatus() & SSTATUS_SPP) == 0;
+  s->cpu = cpuid();
+  if(p){
+    s->pid = p->pid;
+    safestrcpy(s->name, p->name, sizeof(s->name));
+  } else {
+    s->pid = 0;
+    safestrcpy(s->name, "-", sizeof(s->name));
+  }
+  __atomic_store_n(&r->w, r->w + 1, __ATOMIC_RELEASE);
+}
+
+// Take hz samples a second on each busy CPU from now on, or
+// none if hz is 0. Returns how many samples were dropped
+// since the last call, or -1 if hz is out of range.
+int
+profset(int hz)
+{
+  struct pring *r;
+  int dropped = 0;
+
+  if(hz < 0 || hz > MAXPROFHZ)
+    return -1;
+  __atomic_store_n(&profcycles, hz ? CLINT_FREQ / hz : 0, __ATOMIC_RELAXED);
+  for(r = pring; r < pring + NCPU; r++)
+    dropped += __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+  return dropped;
+}
+
+// Move up to n samples to user address addr.
+// Returns how many, or -1.
+int
+profcopy(uint64 addr, int n)
+{
+  struct pring *r;
+  uint w;
+  int i = 0;
+
+  acquiresleep(&proflock);
+  for(r = pring; r < pring + NCPU && i < n; r++){
+    w = __atomic_load_n(&r->w, __ATOMIC_ACQUIRE);
+    for(; r->r != w && i < n; i++){
+      if(copyout(myproc()->mm->pagetable, addr + i*sizeof(struct profsample),
+                 (char*)&r->s[r->r % NPROF], sizeof(struct profsample)) < 0){
+        releasesleep(&proflock);
+        return -1;
+      }
+      // hand the slot back to the writer.
+      __atomic_store_n(&r->r, r->r + 1, __ATOMIC_RELEASE);
+    }
+  }
+  releasesleep(&proflock);
+  return i;
+}
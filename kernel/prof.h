@@ -0,0 +1,9 @@
+// Filled in by profread(), one for each sample the
+// profiling timer took.
+struct profsample {
+  uint64 pc;          // where the CPU was interrupted
+  int pid;            // 0 if no process was running
+  short cpu;
+  short user;         // 1 if pc is a user address
+  char name[16];      // the process's name
+};
@@ -1,5 +1,9 @@
 //
-// ramdisk that uses the disk image loaded by qemu -initrd fs.img
+// RAM disk: a block device in kernel memory, for scratch files
+// that needn't survive a reboot. ramdiskinit() allocates it and
+// makes an empty file system on it, with no log: fs.c writes
+// its blocks through instead of logging them, and forkret()
+// mounts it on /tmp.
 //
 
 #include "types.h"
@@ -11,35 +15,77 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "stat.h"
 
+#define BPP (PGSIZE / BSIZE)   // blocks per page
+#define RAMNINODES 200
+
+static char *ramdisk[RAMDISKSIZE / BPP];
+
+static char*
+ramblock(uint blockno)
+{
+  if(blockno >= RAMDISKSIZE)
+    panic("ramdisk: blockno too big");
+  return ramdisk[blockno / BPP] + (blockno % BPP) * BSIZE;
+}
+
+// Allocate the disk and make an empty file system on it,
+// laid out as mkfs would but without a log:
+// [ boot block | super block | inode blocks | free bit map | data blocks ]
 void
 ramdiskinit(void)
 {
+  struct superblock *sb;
+  struct dinode *dip;
+  struct dirent *de;
+  uint i, ninodeblocks, nbitmap, nmeta;
+  uchar *bmap;
+
+  for(i = 0; i < RAMDISKSIZE / BPP; i++)
+    if((ramdisk[i] = kalloc_zeroed()) == 0)
+      panic("ramdiskinit: kalloc");
+
+  ninodeblocks = RAMNINODES / IPB + 1;
+  nbitmap = RAMDISKSIZE / BPB + 1;
+  nmeta = 2 + ninodeblocks + nbitmap;
+
+  sb = (struct superblock*)ramblock(1);
+  sb->magic = FSMAGIC;
+  sb->size = RAMDISKSIZE;
+  sb->nblocks = RAMDISKSIZE - nmeta;
+  sb->ninodes = RAMNINODES;
+  sb->nlog = 0;
+  sb->logstart = 2;
+  sb->inodestart = 2;
+  sb->bmapstart = 2 + ninodeblocks;
+
+  // the metadata and the root directory's block are in use.
+  bmap = (uchar*)ramblock(sb->bmapstart);
+  for(i = 0; i <= nmeta; i++)
+    bmap[i/8] |= 1 << (i % 8);
+
+  dip = (struct dinode*)ramblock(IBLOCK(ROOTINO, (*sb))) + ROOTINO % IPB;
+  dip->type = T_DIR;
+  dip->nlink = 1;
+  dip->size = 2 * sizeof(struct dirent);
+  dip->addrs[0] = nmeta;
+  de = (struct dirent*)ramblock(nmeta);
+  de[0].inum = ROOTINO;
+  safestrcpy(de[0].name, ".", DIRSIZ);
+  de[1].inum = ROOTINO;
+  safestrcpy(de[1].name, "..", DIRSIZ);
 }
 
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// Read (write = 0) or write b's block, at once, and call
+// b->iodone as the disk interrupt would.
 void
-ramdiskrw(struct buf *b)
+ramdiskrw(struct buf *b, int write)
 {
-  if(!holdingsleep(&b->lock))
-    panic("ramdiskrw: buf not locked");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("ramdiskrw: nothing to do");
-
-  if(b->blockno >= FSSIZE)
-    panic("ramdiskrw: blockno too big");
-
-  uint64 diskaddr = b->blockno * BSIZE;
-  char *addr = (char *)RAMDISK + diskaddr;
-
-  if(b->flags & B_DIRTY){
-    // write
-    memmove(addr, b->data, BSIZE);
-    b->flags &= ~B_DIRTY;
-  } else {
-    // read
-    memmove(b->data, addr, BSIZE);
-    b->flags |= B_VALID;
-  }
+  if(write)
+    memmove(ramblock(b->blockno), b->data, BSIZE);
+  else
+    memmove(b->data, ramblock(b->blockno), BSIZE);
+  if(b->iodone)
+    b->iodone(b);
 }
@@ -0,0 +1,152 @@
+// Slab allocator, for small kernel objects.
+//
+// Each kind of object (struct file, struct pipe, ...) has
+// a slabcache. A cache carves pages from kalloc() into slabs
+// of equal-sized objects, and hands them out again as they're
+// freed, without any initialization: callers set up every
+// object they get.
+//
+// Each CPU keeps a magazine of free objects per cache, so
+// slaballoc() and slabfree() usually just pop or push with
+// interrupts off, and take the cache's lock only to move
+// half a magazine's worth between it and the slabs.
+//
+// Interface:
+// * Set up a cache with slabinit, once, at boot.
+// * Get an object with slaballoc, give it back with slabfree.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "slab.h"
+
+// At the start of each slab page, followed by the objects.
+struct slab {
+  struct slab *next;     // cache's list of partial slabs
+  void *free;            // free objects, linked through their first word
+  uint nfree;
+};
+
+#define OBJ0 ((sizeof(struct slab) + 15) & ~15) // offset of the first object
+
+void
+slabinit(struct slabcache *sc, char *name, uint size)
+{
+  size = (size + 7) & ~7;
+  if(size < sizeof(void*))
+    size = sizeof(void*);
+  if(size > PGSIZE - OBJ0)
+    panic("slabinit: too big");
+  initlock(&sc->lock, name);
+  sc->name = name;
+  sc->size = size;
+  sc->perslab = (PGSIZE - OBJ0) / size;
+  sc->partial = 0;
+}
+
+// Make a new slab of free objects for sc.
+// Returns 0 if out of memory.
+// Caller must hold sc->lock.
+static struct slab*
+slabgrow(struct slabcache *sc)
+{
+  struct slab *s;
+  char *obj;
+  uint i;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->free = 0;
+  for(i = 0; i < sc->perslab; i++){
+    obj = (char*)s + OBJ0 + i*sc->size;
+    *(void**)obj = s->free;
+    s->free = obj;
+  }
+  s->nfree = sc->perslab;
+  s->next = sc->partial;
+  sc->partial = s;
+  return s;
+}
+
+// Fill magazine m, which is empty, halfway from sc's slabs.
+// Caller must have interrupts off.
+static void
+slabrefill(struct slabcache *sc, struct magazine *m)
+{
+  struct slab *s;
+
+  acquire(&sc->lock);
+  while(m->n < MAGSIZE/2){
+    if((s = sc->partial) == 0 && (s = slabgrow(sc)) == 0)
+      break;
+    m->obj[m->n++] = s->free;
+    s->free = *(void**)s->free;
+    if(--s->nfree == 0)
+      sc->partial = s->next; // now full
+  }
+  release(&sc->lock);
+}
+
+// Return the top n objects of magazine m to their slabs.
+// A slab whose objects are all free goes back to kalloc(),
+// unless it is the only partial slab left.
+// Caller must have interrupts off.
+static void
+slabflush(struct slabcache *sc, struct magazine *m, int n)
+{
+  struct slab *s, **sp;
+  void *obj;
+
+  acquire(&sc->lock);
+  while(n-- > 0){
+    obj = m->obj[--m->n];
+    s = (struct slab*)PGROUNDDOWN((uint64)obj);
+    *(void**)obj = s->free;
+    s->free = obj;
+    if(++s->nfree == 1){
+      // was full.
+      s->next = sc->partial;
+      sc->partial = s;
+    } else if(s->nfree == sc->perslab && (sc->partial != s || s->next != 0)){
+      for(sp = &sc->partial; *sp != s; sp = &(*sp)->next)
+        ;
+      *sp = s->next;
+      kfree((void*)s);
+    }
+  }
+  release(&sc->lock);
+}
+
+// Allocate an object from sc. Its contents are garbage.
+// Returns 0 if out of memory.
+void*
+slaballoc(struct slabcache *sc)
+{
+  struct magazine *m;
+  void *obj = 0;
+
+  push_off();
+  m = &sc->mag[cpuid()];
+  if(m->n == 0)
+    slabrefill(sc, m);
+  if(m->n > 0)
+    obj = m->obj[--m->n];
+  pop_off();
+  return obj;
+}
+
+// Free obj, which came from slaballoc(sc).
+void
+slabfree(struct slabcache *sc, void *obj)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &sc->mag[cpuid()];
+  if(m->n == MAGSIZE)
+    slabflush(sc, m, MAGSIZE/2);
+  m->obj[m->n++] = obj;
+  pop_off();
+}
@@ -0,0 +1,17 @@
+#define MAGSIZE 16 // objects a CPU keeps for itself
+
+// A CPU's stack of free objects of one cache.
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+// A cache of same-sized kernel objects, carved out of pages.
+struct slabcache {
+  struct spinlock lock; // protects the slabs
+  char *name;
+  uint size;            // bytes per object
+  uint perslab;         // objects per slab page
+  struct slab *partial; // slabs with free objects
+  struct magazine mag[NCPU];
+};
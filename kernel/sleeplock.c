@@ -6,8 +6,8 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
-#include "proc.h"
 #include "sleeplock.h"
+#include "proc.h"
 
 void
 initsleeplock(struct sleeplock *lk, char *name)
@@ -15,18 +15,30 @@ initsleeplock(struct sleeplock *lk, char *name)
   initlock(&lk->lk, "sleep lock");
   lk->name = name;
   lk->locked = 0;
+  lk->readers = 0;
+  lk->wwait = 0;
   lk->pid = 0;
+  lk->stat = lockstatof(name, 1);
 }
 
 void
 acquiresleep(struct sleeplock *lk)
 {
+  int sleeps = 0;
+
   acquire(&lk->lk);
-  while (lk->locked) {
+  lk->wwait++;
+  while (lk->locked || lk->readers) {
     sleep(lk, &lk->lk);
+    sleeps++;
   }
+  lk->wwait--;
   lk->locked = 1;
   lk->pid = myproc()->pid;
+  if(lk->stat){
+    lockstatacquire(lk->stat, sleeps);
+    lk->t0 = r_time();
+  }
   release(&lk->lk);
 }
 
@@ -34,12 +46,88 @@ void
 releasesleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
+  if(lk->stat)
+    lockstatrelease(lk->stat, lk->t0);
   lk->locked = 0;
   lk->pid = 0;
   wakeup(lk);
   release(&lk->lk);
 }
 
+// Does p hold lk already, alone or shared?
+// Caller must hold lk->lk.
+static int
+holder(struct sleeplock *lk, struct proc *p)
+{
+  int i;
+
+  if(lk->locked && lk->pid == p->pid)
+    return 1;
+  for(i = 0; i < p->nshared; i++)
+    if(p->shared[i] == lk)
+      return 1;
+  return 0;
+}
+
+// Acquire the lock shared with other readers. A process
+// waiting to acquire it alone keeps new readers out, so that
+// a stream of readers can't starve it. A process that holds
+// the lock already, alone or shared, gets in at once, since
+// the waiting one can't go before it anyway: a page fault
+// taken while copying to or from a file may need the lock
+// of the program file, which may be the same file.
+void
+acquiresleepshared(struct sleeplock *lk)
+{
+  struct proc *p = myproc();
+  int sleeps = 0;
+
+  acquire(&lk->lk);
+  if(!holder(lk, p)){
+    while (lk->locked || lk->wwait) {
+      sleep(lk, &lk->lk);
+      sleeps++;
+    }
+  }
+  if(p->nshared == NLOCKSHARED)
+    panic("acquiresleepshared: too many");
+  p->shared[p->nshared++] = lk;
+  lk->readers++;
+  if(lk->stat)
+    lockstatacquire(lk->stat, sleeps);
+  release(&lk->lk);
+}
+
+void
+releasesleepshared(struct sleeplock *lk)
+{
+  struct proc *p = myproc();
+  int i;
+
+  acquire(&lk->lk);
+  for(i = p->nshared - 1; i >= 0; i--)
+    if(p->shared[i] == lk)
+      break;
+  if(lk->readers < 1 || i < 0)
+    panic("releasesleepshared");
+  p->shared[i] = p->shared[--p->nshared];
+  if(--lk->readers == 0)
+    wakeup(lk);
+  release(&lk->lk);
+}
+
+// Is the lock held shared by anyone?
+int
+holdingsleepshared(struct sleeplock *lk)
+{
+  int r;
+
+  acquire(&lk->lk);
+  r = lk->readers > 0;
+  release(&lk->lk);
+  return r;
+}
+
 int
 holdingsleep(struct sleeplock *lk)
 {
@@ -1,10 +1,17 @@
-// Long-term locks for processes
+// Long-term locks for processes, held either by one process
+// or shared by readers (acquiresleepshared()).
 struct sleeplock {
   uint locked;       // Is the lock held?
   struct spinlock lk; // spinlock protecting this sleep lock
+  int readers;       // how many hold it shared
+  int wwait;         // how many wait to hold it alone
   
   // For debugging:
   char *name;        // Name of lock.
   int pid;           // Process holding lock
+
+  // For profiling:
+  struct lockstat *stat; // counts for locks of this name, or 0
+  uint64 t0;             // r_time() when acquired
 };
 
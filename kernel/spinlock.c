@@ -4,9 +4,100 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "riscv.h"
 #include "proc.h"
 #include "defs.h"
+#include "lockstat.h"
+
+// Counts of lock use, one entry per lock name and kind,
+// added to with atomic instructions since locks of one name
+// are taken at once on several CPUs. Entries are only ever
+// added, under statlock, a bare flag since initlock() can't
+// take a spinlock.
+static struct lockstat stats[NLOCKSTAT];
+static int nstat;
+static uint statlock;
+
+// Return the entry counting locks called name of the given
+// kind, adding one if need be, or 0 if the table is full.
+struct lockstat*
+lockstatof(char *name, int sleep)
+{
+  struct lockstat *s;
+  int i;
+
+  push_off();
+  while(__sync_lock_test_and_set(&statlock, 1) != 0)
+    ;
+  for(i = 0; i < nstat; i++){
+    s = &stats[i];
+    if(s->sleep == sleep && strncmp(s->name, name, LOCKNAME-1) == 0)
+      break;
+  }
+  if(i == nstat && nstat < NLOCKSTAT){
+    // fill the entry in before lockstatcopy() can see it.
+    s = &stats[nstat];
+    safestrcpy(s->name, name, LOCKNAME);
+    s->sleep = sleep;
+    __atomic_store_n(&nstat, nstat + 1, __ATOMIC_RELEASE);
+  }
+  if(i < nstat)
+    s->nlock++;
+  else
+    s = 0;
+  __sync_lock_release(&statlock);
+  pop_off();
+  return s;
+}
+
+// Count an acquire of a lock that took spins loops to get.
+void
+lockstatacquire(struct lockstat *s, int spins)
+{
+  __atomic_fetch_add(&s->acquires, 1, __ATOMIC_RELAXED);
+  if(spins > 0){
+    __atomic_fetch_add(&s->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->spins, spins, __ATOMIC_RELAXED);
+  }
+}
+
+// Count the release of a lock acquired at time t0.
+void
+lockstatrelease(struct lockstat *s, uint64 t0)
+{
+  __atomic_fetch_add(&s->held, r_time() - t0, __ATOMIC_RELAXED);
+}
+
+// Copy out up to n entries to user address addr.
+// Returns how many, or -1.
+int
+lockstatcopy(uint64 addr, int n)
+{
+  struct lockstat s;
+  int i;
+
+  for(i = 0; i < n && i < __atomic_load_n(&nstat, __ATOMIC_ACQUIRE); i++){
+    s = stats[i];
+    if(copyout(myproc()->mm->pagetable, addr + i*sizeof(s), (char*)&s, sizeof(s)) < 0)
+      return -1;
+  }
+  return i;
+}
+
+// Zero every entry's counts.
+void
+lockstatreset(void)
+{
+  struct lockstat *s;
+
+  for(s = stats; s < &stats[NLOCKSTAT]; s++){
+    __atomic_store_n(&s->acquires, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->contended, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->spins, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->held, 0, __ATOMIC_RELAXED);
+  }
+}
 
 void
 initlock(struct spinlock *lk, char *name)
@@ -14,6 +105,19 @@ initlock(struct spinlock *lk, char *name)
   lk->name = name;
   lk->locked = 0;
   lk->cpu = 0;
+  lk->fair = 0;
+  lk->next = lk->owner = 0;
+  lk->stat = lockstatof(name, 0);
+}
+
+// Initialize a ticket lock, which CPUs get in the order they
+// asked for it. Worth it for a lock contended enough that a
+// CPU may lose the race for it again and again.
+void
+initfairlock(struct spinlock *lk, char *name)
+{
+  initlock(lk, name);
+  lk->fair = 1;
 }
 
 // Acquire the lock.
@@ -21,16 +125,38 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  int spins = 0;
+  uint t;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
-  //   a5 = 1
-  //   s1 = &lk->locked
-  //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+  if(lk->fair){
+    // take a ticket and wait for it to be served, doing
+    // any TLB flush asked for meanwhile, as below.
+    t = __atomic_fetch_add(&lk->next, 1, __ATOMIC_RELAXED);
+    while(__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != t){
+      spins++;
+      tlbpoll();
+    }
+    lk->locked = 1;
+  } else {
+    // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
+    //   a5 = 1
+    //   s1 = &lk->locked
+    //   amoswap.w.aq a5, a5, (s1)
+    // Between tries, wait with plain loads, which leave the
+    // cache line shared, until the lock looks free. The
+    // holder may be in uvmstale(), waiting for this hart.
+    while(__sync_lock_test_and_set(&lk->locked, 1) != 0){
+      while(__atomic_load_n(&lk->locked, __ATOMIC_RELAXED)){
+        spins++;
+        tlbpoll();
+      }
+      spins++;
+    }
+  }
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,6 +166,11 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+
+  if(lk->stat){
+    lockstatacquire(lk->stat, spins);
+    lk->t0 = r_time();
+  }
 }
 
 // Release the lock.
@@ -49,6 +180,8 @@ release(struct spinlock *lk)
   if(!holding(lk))
     panic("release");
 
+  if(lk->stat)
+    lockstatrelease(lk->stat, lk->t0);
   lk->cpu = 0;
 
   // Tell the C compiler and the CPU to not move loads or stores
@@ -68,6 +201,10 @@ release(struct spinlock *lk)
   //   amoswap.w zero, zero, (s1)
   __sync_lock_release(&lk->locked);
 
+  // serve the next ticket, if a ticket lock.
+  if(lk->fair)
+    __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELEASE);
+
   pop_off();
 }
 
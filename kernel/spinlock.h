@@ -5,5 +5,14 @@ struct spinlock {
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
+
+  // For ticket locks (see initfairlock()):
+  int fair;          // 1 if a ticket lock
+  uint next;         // next ticket to hand out
+  uint owner;        // ticket being served
+
+  // For profiling:
+  struct lockstat *stat; // counts for locks of this name, or 0
+  uint64 t0;             // r_time() when acquired
 };
 
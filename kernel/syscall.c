@@ -3,18 +3,21 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "syscall.h"
 #include "defs.h"
+#include "trace.h"
+#include "sysstat.h"
 
 // Fetch the uint64 at addr from the current process.
 int
 fetchaddr(uint64 addr, uint64 *ip)
 {
   struct proc *p = myproc();
-  if(addr >= p->sz || addr+sizeof(uint64) > p->sz)
+  if(addr >= p->mm->sz || addr+sizeof(uint64) > p->mm->sz)
     return -1;
-  if(copyin(p->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
+  if(copyin(p->mm->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
     return -1;
   return 0;
 }
@@ -25,7 +28,7 @@ int
 fetchstr(uint64 addr, char *buf, int max)
 {
   struct proc *p = myproc();
-  int err = copyinstr(p->pagetable, buf, addr, max);
+  int err = copyinstr(p->mm->pagetable, buf, addr, max);
   if(err < 0)
     return err;
   return strlen(buf);
@@ -106,6 +109,34 @@ extern uint64 sys_write(void);
 extern uint64 sys_uptime(void);
 extern uint64 sys_mmap(void);
 extern uint64 sys_munmap(void);
+extern uint64 sys_msync(void);
+extern uint64 sys_madvise(void);
+extern uint64 sys_memstat(void);
+extern uint64 sys_mremap(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_fdatasync(void);
+extern uint64 sys_pread(void);
+extern uint64 sys_pwrite(void);
+extern uint64 sys_readv(void);
+extern uint64 sys_writev(void);
+extern uint64 sys_sendfile(void);
+extern uint64 sys_fcntl(void);
+extern uint64 sys_setpriority(void);
+extern uint64 sys_cpustat(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_futex(void);
+extern uint64 sys_lockstat(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_nanosleep(void);
+extern uint64 sys_nanotime(void);
+extern uint64 sys_trace(void);
+extern uint64 sys_traceread(void);
+extern uint64 sys_sysstat(void);
+extern uint64 sys_yield(void);
+extern uint64 sys_prof(void);
+extern uint64 sys_profread(void);
+extern uint64 sys_uringsetup(void);
+extern uint64 sys_uringenter(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -131,17 +162,125 @@ static uint64 (*syscalls[])(void) = {
 [SYS_close]   sys_close,
 [SYS_mmap]    sys_mmap,
 [SYS_munmap]  sys_munmap,
+[SYS_msync]   sys_msync,
+[SYS_madvise] sys_madvise,
+[SYS_memstat] sys_memstat,
+[SYS_mremap]  sys_mremap,
+[SYS_fsync]   sys_fsync,
+[SYS_fdatasync] sys_fdatasync,
+[SYS_pread]   sys_pread,
+[SYS_pwrite]  sys_pwrite,
+[SYS_readv]   sys_readv,
+[SYS_writev]  sys_writev,
+[SYS_sendfile] sys_sendfile,
+[SYS_fcntl]   sys_fcntl,
+[SYS_setpriority] sys_setpriority,
+[SYS_cpustat] sys_cpustat,
+[SYS_clone]   sys_clone,
+[SYS_futex]   sys_futex,
+[SYS_lockstat] sys_lockstat,
+[SYS_spawn]   sys_spawn,
+[SYS_nanosleep] sys_nanosleep,
+[SYS_nanotime] sys_nanotime,
+[SYS_trace]   sys_trace,
+[SYS_traceread] sys_traceread,
+[SYS_sysstat] sys_sysstat,
+[SYS_yield]   sys_yield,
+[SYS_prof]    sys_prof,
+[SYS_profread] sys_profread,
+[SYS_uringsetup] sys_uringsetup,
+[SYS_uringenter] sys_uringenter,
 };
 
+// System calls that read or change the address space, which
+// run one at a time among a process's threads, holding its
+// vmlock, as page faults do.
+static char vmcalls[] = {
+[SYS_fork]    1,
+[SYS_sbrk]    1,
+[SYS_mmap]    1,
+[SYS_munmap]  1,
+[SYS_msync]   1,
+[SYS_madvise] 1,
+[SYS_mremap]  1,
+[SYS_clone]   1,
+[SYS_uringsetup] 1,
+};
+
+// Counts and times of each system call. Each CPU adds to its
+// own, with interrupts off, so counting takes no lock.
+static struct sysstat sysstats[NCPU][NELEM(syscalls)];
+
+// Count a call of system call num that took t cycles.
+static void
+sysaccount(int num, uint64 t)
+{
+  struct sysstat *s;
+  int b;
+
+  b = t ? 63 - __builtin_clzl(t) : 0;
+  if(b >= NSYSHIST)
+    b = NSYSHIST-1;
+  push_off();
+  s = &sysstats[cpuid()][num];
+  s->calls++;
+  s->time += t;
+  s->hist[b]++;
+  pop_off();
+}
+
+// Copy out the counts, summed over the CPUs, of system calls
+// 0 up to n to user address addr. Returns how many, or -1.
+int
+sysstatcopy(uint64 addr, int n)
+{
+  struct sysstat s;
+  int i, c, b;
+
+  for(i = 0; i < n && i < NELEM(syscalls); i++){
+    memset(&s, 0, sizeof(s));
+    for(c = 0; c < NCPU; c++){
+      s.calls += sysstats[c][i].calls;
+      s.time += sysstats[c][i].time;
+      for(b = 0; b < NSYSHIST; b++)
+        s.hist[b] += sysstats[c][i].hist[b];
+    }
+    if(copyout(myproc()->mm->pagetable, addr + i*sizeof(s), (char*)&s, sizeof(s)) < 0)
+      return -1;
+  }
+  return i;
+}
+
+// Zero the counts. A call being counted meanwhile may
+// survive in part.
+void
+sysstatreset(void)
+{
+  memset(sysstats, 0, sizeof(sysstats));
+}
+
 void
 syscall(void)
 {
   int num;
   struct proc *p = myproc();
+  uint64 t0;
 
   num = p->trapframe->a7;
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
-    p->trapframe->a0 = syscalls[num]();
+    if(tracemask & TR_SYSCALL)
+      traceev(TE_SYSENTER, num, 0);
+    t0 = r_time();
+    if(num < NELEM(vmcalls) && vmcalls[num]){
+      acquiresleep(&p->mm->vmlock);
+      p->trapframe->a0 = syscalls[num]();
+      releasesleep(&p->mm->vmlock);
+    } else {
+      p->trapframe->a0 = syscalls[num]();
+    }
+    sysaccount(num, r_time() - t0);
+    if(tracemask & TR_SYSCALL)
+      traceev(TE_SYSEXIT, num, p->trapframe->a0);
   } else {
     printf("%d %s: unknown sys call %d\n",
             p->pid, p->name, num);
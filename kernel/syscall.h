@@ -22,3 +22,31 @@
 #define SYS_close  21
 #define SYS_mmap   22
 #define SYS_munmap 23
+#define SYS_msync  24
+#define SYS_madvise 25
+#define SYS_memstat 26
+#define SYS_mremap  27
+#define SYS_fsync  28
+#define SYS_fdatasync 29
+#define SYS_pread  30
+#define SYS_pwrite 31
+#define SYS_readv  32
+#define SYS_writev 33
+#define SYS_sendfile 34
+#define SYS_fcntl  35
+#define SYS_setpriority 36
+#define SYS_cpustat 37
+#define SYS_clone  38
+#define SYS_futex  39
+#define SYS_lockstat 40
+#define SYS_spawn  41
+#define SYS_nanosleep 42
+#define SYS_nanotime 43
+#define SYS_trace  44
+#define SYS_traceread 45
+#define SYS_sysstat 46
+#define SYS_yield  47
+#define SYS_prof   48
+#define SYS_profread 49
+#define SYS_uringsetup 50
+#define SYS_uringenter 51
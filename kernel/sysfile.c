@@ -6,17 +6,26 @@
 
 #include "types.h"
 #include "riscv.h"
+#include "memlayout.h"
 #include "defs.h"
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "fs.h"
-#include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "pcache.h"
 
 #define min(a,b) ((a) < (b) ? (a) : (b))
+
+// mapped pages written back per FS op: each
+// writes PGSIZE/BSIZE data blocks, plus the i-node.
+#define MMAPBATCH ((MAXOPBLOCKS-1) / (PGSIZE/BSIZE))
+
+// mapped pages mmapreclaim() tries to evict at a time.
+#define RECLAIMBATCH 16
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
 static int
@@ -27,7 +36,7 @@ argfd(int n, int *pfd, struct file **pf)
 
   if(argint(n, &fd) < 0)
     return -1;
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= NOFILE || (f=myproc()->mm->ofile[fd]) == 0)
     return -1;
   if(pfd)
     *pfd = fd;
@@ -38,18 +47,23 @@ argfd(int n, int *pfd, struct file **pf)
 
 // Allocate a file descriptor for the given file.
 // Takes over file reference from caller on success.
+// The process's lock keeps its threads from taking
+// the same descriptor.
 static int
 fdalloc(struct file *f)
 {
   int fd;
   struct proc *p = myproc();
 
+  acquire(&p->mm->lock);
   for(fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd] == 0){
-      p->ofile[fd] = f;
+    if(p->mm->ofile[fd] == 0){
+      p->mm->ofile[fd] = f;
+      release(&p->mm->lock);
       return fd;
     }
   }
+  release(&p->mm->lock);
   return -1;
 }
 
@@ -92,15 +106,141 @@ sys_write(void)
   return filewrite(f, p, n);
 }
 
+// Read or write n bytes at offset off, leaving
+// the descriptor's own offset alone.
+uint64
+sys_pread(void)
+{
+  struct file *f;
+  int n, off;
+  uint64 p;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &p) < 0 || argint(2, &n) < 0 ||
+     argint(3, &off) < 0 || off < 0)
+    return -1;
+  return filepread(f, p, n, off);
+}
+
+uint64
+sys_pwrite(void)
+{
+  struct file *f;
+  int n, off;
+  uint64 p;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &p) < 0 || argint(2, &n) < 0 ||
+     argint(3, &off) < 0 || off < 0)
+    return -1;
+  return filepwrite(f, p, n, off);
+}
+
+// Read (write = 0) or write each of the buffers listed
+// in the struct iovec array argument in turn, stopping
+// at the first short transfer. Returns the bytes moved,
+// or -1 if the first transfer fails.
+static uint64
+iovrw(int write)
+{
+  struct file *f;
+  struct iovec v;
+  uint64 uiov;
+  int cnt, i, r, tot = 0;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &uiov) < 0 || argint(2, &cnt) < 0)
+    return -1;
+  if(cnt < 0 || cnt > IOV_MAX)
+    return -1;
+  for(i = 0; i < cnt; i++){
+    if(copyin(myproc()->mm->pagetable, (char*)&v, uiov + i*sizeof(v), sizeof(v)) < 0 ||
+       v.iov_len > 0x7fffffff)
+      return tot > 0 ? tot : -1;
+    if(write)
+      r = filewrite(f, (uint64)v.iov_base, v.iov_len);
+    else
+      r = fileread(f, (uint64)v.iov_base, v.iov_len);
+    if(r < 0)
+      return tot > 0 ? tot : -1;
+    tot += r;
+    if(r < v.iov_len)
+      break;
+  }
+  return tot;
+}
+
+uint64
+sys_readv(void)
+{
+  return iovrw(0);
+}
+
+uint64
+sys_writev(void)
+{
+  return iovrw(1);
+}
+
+// sendfile(out, in, off, n): move up to n bytes from in to
+// out without copying them through user memory.
+uint64
+sys_sendfile(void)
+{
+  struct file *out, *in;
+  int off, n;
+
+  if(argfd(0, 0, &out) < 0 || argfd(1, 0, &in) < 0 ||
+     argint(2, &off) < 0 || argint(3, &n) < 0)
+    return -1;
+  return filesend(out, in, off, n);
+}
+
+// fcntl(fd, cmd, arg): only F_GETPIPE_SZ and F_SETPIPE_SZ
+// so far, which return the pipe's buffer size.
+uint64
+sys_fcntl(void)
+{
+  struct file *f;
+  int cmd, arg;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &cmd) < 0 || argint(2, &arg) < 0)
+    return -1;
+  if(f->type != FD_PIPE)
+    return -1;
+  switch(cmd){
+  case F_GETPIPE_SZ:
+    return pipesize(f->pipe);
+  case F_SETPIPE_SZ:
+    return piperesize(f->pipe, arg);
+  }
+  return -1;
+}
+
 uint64
 sys_close(void)
 {
   int fd;
+
+  if(argint(0, &fd) < 0)
+    return -1;
+  return fdclose(fd);
+}
+
+// Close the calling process's descriptor fd.
+int
+fdclose(int fd)
+{
   struct file *f;
+  struct proc *p = myproc();
 
-  if(argfd(0, &fd, &f) < 0)
+  if(fd < 0 || fd >= NOFILE)
+    return -1;
+  // only one of the process's threads gets to close it.
+  acquire(&p->mm->lock);
+  if((f = p->mm->ofile[fd]) == 0){
+    release(&p->mm->lock);
     return -1;
-  myproc()->ofile[fd] = 0;
+  }
+  p->mm->ofile[fd] = 0;
+  release(&p->mm->lock);
   fileclose(f);
   return 0;
 }
@@ -116,6 +256,25 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+// Wait until the file's updates are on disk.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filesync(f);
+}
+
+// The log holds data and metadata alike,
+// so there is nothing fsync() could skip.
+uint64
+sys_fdatasync(void)
+{
+  return sys_fsync();
+}
+
 // Create the path new as a link to the same inode as old.
 uint64
 sys_link(void)
@@ -211,7 +370,7 @@ sys_unlink(void)
 
   if(ip->nlink < 1)
     panic("unlink: nlink < 1");
-  if(ip->type == T_DIR && !isdirempty(ip)){
+  if(ip->type == T_DIR && (!isdirempty(ip) || ismountpoint(ip))){
     iunlockput(ip);
     goto bad;
   }
@@ -219,6 +378,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcinval(dp, name);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -341,6 +501,7 @@ sys_open(void)
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+  f->direct = (omode & O_DIRECT) && ip->type == T_FILE;
 
   if((omode & O_TRUNC) && ip->type == T_FILE){
     itrunc(ip);
@@ -407,25 +568,33 @@ sys_chdir(void)
     return -1;
   }
   iunlock(ip);
-  iput(p->cwd);
+  iput(p->mm->cwd);
   end_op();
-  p->cwd = ip;
+  p->mm->cwd = ip;
   return 0;
 }
 
-uint64
-sys_exec(void)
+static void
+freeargv(char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
 
-  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0){
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  for(i = 0; i < MAXARG && argv[i] != 0; i++)
+    kfree(argv[i]);
+}
+
+// Copy the user argument vector at uargv into argv[MAXARG],
+// one kalloc()ed page per string. Returns 0, or -1 having
+// freed what it copied.
+static int
+fetchargv(uint64 uargv, char **argv)
+{
+  int i;
+  uint64 uarg;
+
+  memset(argv, 0, MAXARG*sizeof(char*));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
+    if(i >= MAXARG){
       goto bad;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
@@ -441,18 +610,54 @@ sys_exec(void)
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
       goto bad;
   }
+  return 0;
 
-  int ret = exec(path, argv);
+ bad:
+  freeargv(argv);
+  return -1;
+}
 
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
+
+  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0){
+    return -1;
+  }
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+
+  int ret = exec(path, argv);
 
+  freeargv(argv);
   return ret;
+}
 
- bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
-  return -1;
+// spawn(path, argv, fds): run path in a new child process, as
+// fork() then exec() would, but without copying the caller's
+// memory. fds, if not 0, points to three descriptors for the
+// child's 0, 1 and 2, -1 for the caller's own.
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  int fds[3];
+  uint64 uargv, ufds;
+
+  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0 ||
+     argaddr(2, &ufds) < 0)
+    return -1;
+  if(ufds && copyin(myproc()->mm->pagetable, (char*)fds, ufds, sizeof(fds)) < 0)
+    return -1;
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+
+  int ret = spawn(path, argv, ufds ? fds : 0);
+
+  freeargv(argv);
+  return ret;
 }
 
 uint64
@@ -470,15 +675,15 @@ sys_pipe(void)
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
-      p->ofile[fd0] = 0;
+      p->mm->ofile[fd0] = 0;
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
-  if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
-     copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
+  if(copyout(p->mm->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
+     copyout(p->mm->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
+    p->mm->ofile[fd0] = 0;
+    p->mm->ofile[fd1] = 0;
     fileclose(rf);
     fileclose(wf);
     return -1;
@@ -486,87 +691,682 @@ sys_pipe(void)
   return 0;
 }
 
+// Give a shared anonymous region zeroed pages for all of
+// [addr, addr+len) right away: there is no file for the
+// processes sharing it to fault pages in from later.
+// Aligned 2-megabyte blocks get megapages where possible.
+// Returns 0 on success, -1 if out of memory.
+static int
+anonpopulate(pagetable_t pagetable, uint64 addr, int len, int prot)
+{
+  uint64 a;
+  char *mem;
+
+  // with no access allowed, it can't ever be touched.
+  if((prot & (PROT_READ|PROT_WRITE|PROT_EXEC)) == 0)
+    return 0;
+  for(a = addr; a < addr + len; a += PGSIZE){
+    if(a % MEGAPGSIZE == 0 && a + MEGAPGSIZE <= addr + len &&
+       uvmmega(pagetable, a, (prot << 1) | PTE_U) == 0){
+      a += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
+    if((mem = kalloc_zeroed()) == 0)
+      goto bad;
+    if(mappages(pagetable, a, PGSIZE, (uint64)mem, (prot << 1) | PTE_U) != 0){
+      kfree(mem);
+      goto bad;
+    }
+  }
+  return 0;
+
+bad:
+  uvmunmap(pagetable, addr, (a - addr) / PGSIZE, 1);
+  return -1;
+}
+
+// Find room for a new region of len bytes in p's address space.
+// Regions are placed top-down from just below the trapframes, in
+// the highest gap that fits, so that they stay out of the heap's
+// way: [0, p->mm->sz) is only heap, text and stack, as far as
+// uvmcopy() and uvmfree() know. Large anonymous regions are
+// aligned so that they can use megapages.
+// Returns the address, or 0 if there is no room.
+static uint64
+mmapplace(struct proc *p, uint64 len, int anon)
+{
+  struct vma *v;
+  uint64 top, addr;
+  int i;
+
+  top = USERTOP;
+  for(i = p->mm->nvma - 1; i >= 0; i--){
+    v = p->mm->vmas[i];
+    if(top - (v->addr + v->len) >= len)
+      break;
+    top = v->addr;
+  }
+  if(top < PGROUNDUP(p->mm->sz) + len)
+    return 0;
+  addr = top - len;
+  if(anon && len >= MEGAPGSIZE && MEGAPGROUNDDOWN(addr) >= PGROUNDUP(p->mm->sz))
+    addr = MEGAPGROUNDDOWN(addr);
+  return addr;
+}
+
 uint64
 sys_mmap(void)
 {
   struct proc *p = myproc();
+  struct vma *v;
   uint64 addr;
   int len;
   int prot;
   int flags;
   int offset;
   struct file *f;
-  if(argaddr(0, &addr) < 0 || argfd(4, 0, &f) < 0){
+
+  if(argaddr(0, &addr) < 0){
     return -1;
   }
   if(argint(1, &len) < 0 || argint(2, &prot) < 0 || argint(3, &flags) < 0 || argint(5, &offset) < 0){
     return -1;
   }
+  // an anonymous region has no file: f is 0, and fd and
+  // offset are ignored.
+  if(flags & MAP_ANONYMOUS){
+    f = 0;
+    offset = 0;
+  } else if(argfd(4, 0, &f) < 0 || f->type != FD_INODE){
+    return -1;
+  }
+  flags &= ~MAP_ANONYMOUS;
+  if(len <= 0 || offset < 0 || offset % PGSIZE != 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
   //check the mmaptest.c to solve
-  if(!f->writable && (prot & PROT_WRITE) && flags == MAP_SHARED) return -1;
-  for(int i = 0; i < MAXVMA; i++){
-    if(p->vma_table[i].mapped == 0){
-      p->vma_table[i].mapped = 1;
-      //if addr = 0, vma_table[i].addr is the top of heap (i.e. bottom of trapframe)
-      p->vma_table[i].addr = addr + p->sz;
-      p->vma_table[i].len = PGROUNDUP(len);
-      p->vma_table[i].prot = prot;
-      p->vma_table[i].flags = flags;
-      p->vma_table[i].offset = offset;
-      p->vma_table[i].f = filedup(f);
-      p->sz += PGROUNDUP(len);
-      return p->vma_table[i].addr;
-    }
+  if(f && !f->writable && (prot & PROT_WRITE) && flags == MAP_SHARED) return -1;
+  len = PGROUNDUP(len);
+  if(len <= 0)
+    return -1;
+
+  // the addr hint is ignored.
+  if((addr = mmapplace(p, len, f == 0)) == 0)
+    return -1;
+  if(f == 0 && flags == MAP_SHARED && anonpopulate(p->mm->pagetable, addr, len, prot) < 0)
+    return -1;
+
+  // extend the region above instead, if the new one continues it.
+  if((v = vmanext(p, addr)) != 0 && v->addr == addr + len && v->f == f &&
+     v->prot == prot && v->flags == flags && v->advice == MADV_NORMAL &&
+     (f == 0 || offset + len == v->offset)){
+    v->addr = addr;
+    v->offset = offset;
+    v->len += len;
+    v->nextfault = addr;
+    return addr;
+  }
+
+  if((v = vmaalloc()) == 0)
+    goto bad;
+  v->addr = addr;
+  v->len = len;
+  v->prot = prot;
+  v->flags = flags;
+  v->offset = offset;
+  v->nextfault = addr;
+  v->window = 1;
+  if(vmainsert(p, v) < 0){
+    vmafree(v);
+    goto bad;
   }
+  if(f)
+    v->f = filedup(f);
+  return addr;
+
+bad:
+  uvmunmap(p->mm->pagetable, addr, len / PGSIZE, 1);
   return -1;
 }
 
-uint64
-munmap(uint64 addr, int len){
-  struct proc *p = myproc();
-  struct vma *pvma;
-  int i = 0;
-  for(; i < MAXVMA; i++){
-    pvma = &p->vma_table[i];
-    if(pvma->mapped == 1 && addr >= pvma->addr && ((addr + len) < (pvma->addr + pvma->len))){
+// Are v's pages mapped straight from the page cache?
+// Only writable private mappings need copies of their own,
+// and anonymous regions have no file to cache.
+static int
+vmacached(struct vma *v)
+{
+  return v->f != 0 && (v->flags == MAP_SHARED || (v->prot & PROT_WRITE) == 0);
+}
+
+// Do stores to v's pages go back to its file?
+static int
+vmawritesback(struct vma *v)
+{
+  return v->f != 0 && v->flags == MAP_SHARED && (v->prot & PROT_WRITE);
+}
+
+// After a fault at va in page-cache-backed region v, also map
+// some of the following pages that aren't present yet, so that
+// a sequential scan takes fewer faults. The window doubles, up to
+// FAULTAROUND pages, while faults stay sequential, and shrinks
+// back to just the faulting page when they don't.
+// madvise() can say the region is always scanned sequentially,
+// for the whole window and a prefetch of the next one, or is
+// never, for no fault-around at all.
+// Caller must hold v->f->ip->lock, perhaps shared.
+static void
+faultaround(struct proc *p, struct vma *v, uint64 va)
+{
+  struct inode *ip = v->f->ip;
+  struct page *pg;
+  pte_t *pte;
+  uint64 a, end;
+  uint off;
+
+  if(v->advice == MADV_RANDOM)
+    return;
+  if(v->advice == MADV_SEQUENTIAL)
+    v->window = FAULTAROUND;
+  else if(va == v->nextfault)
+    v->window = min(v->window * 2, FAULTAROUND);
+  else
+    v->window = 1;
+  end = min(va + v->window*PGSIZE, v->addr + v->len);
+  v->nextfault = va + v->window*PGSIZE;
+
+  for(a = va + PGSIZE; a < end; a += PGSIZE){
+    off = v->offset + (a - v->addr);
+    if(off >= ip->size)
       break;
+    if((pte = walk(p->mm->pagetable, a, 0)) != 0 && (*pte & PTE_V))
+      continue;
+    if((pg = pcget(ip, off / PGSIZE)) == 0)
+      break;
+    // not PTE_A: the page hasn't been used yet.
+    if(mappages(p->mm->pagetable, a, PGSIZE, (uint64)pg->data, (v->prot << 1) | PTE_U) != 0){
+      pcput((uint64)pg->data);
+      break;
+    }
+  }
+  if(v->advice == MADV_SEQUENTIAL && v->nextfault < v->addr + v->len)
+    pcprefetch(ip, (v->offset + (v->nextfault - v->addr)) / PGSIZE,
+               (min(v->nextfault + FAULTAROUND*PGSIZE, v->addr + v->len) - v->nextfault) / PGSIZE);
+}
+
+// Handle a page fault at va in one of the calling process's
+// mapped regions: map the file's page from the page cache,
+// or a private copy of it for a writable private mapping.
+// write is 1 for a store fault.
+// Returns 0 on success, -1 if va isn't mapped or the access
+// isn't allowed, or -2 if out of memory or page-cache slots.
+int
+mmapfault(uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  struct page *pg;
+  pte_t *pte;
+  uint64 a, pa;
+  char *mem;
+  int perm;
+
+  va = PGROUNDDOWN(va);
+  if((v = vmalookup(p, va)) == 0)
+    return -1;
+  if((pte = walk(p->mm->pagetable, va, 0)) != 0 && (*pte & PTE_V)){
+    // the page is already there. hardware that doesn't update
+    // the accessed and dirty bits itself faults to let us do it.
+    if(write && (*pte & PTE_W)){
+      *pte |= PTE_A | PTE_D;
+      uvmstale(p->mm->pagetable, va, 1);
+      return 0;
+    }
+    if(!write && (*pte & PTE_R) && (*pte & PTE_A) == 0){
+      *pte |= PTE_A;
+      uvmstale(p->mm->pagetable, va, 1);
+      return 0;
     }
+    // otherwise the access violates the page's protection.
+    return -1;
   }
-  // not found
-  if(i > MAXVMA){
-    return -1;
-  }
-  int end = addr + len;
-  int _addr = addr;
-  //readonly file can be MAP_SHARED, so need another condition f->writable
-  if((pvma->flags == MAP_SHARED) && pvma->f->writable){
-  //steal from filewritei()
-    while(addr < end){
-       int size = min(end-addr, PGSIZE);
-       begin_op();
-       ilock(pvma->f->ip);
-       if(writei(pvma->f->ip, 1, addr, addr - pvma->addr, size) != size){
-         return -1;
-       }
-       iunlock(pvma->f->ip);
-       end_op();
-       uvmunmap(p->pagetable, addr, 1, 1);
-       addr += PGSIZE;
+  if(write && (v->prot & PROT_WRITE) == 0)
+    return -1;
+  if((v->prot & (PROT_READ|PROT_WRITE|PROT_EXEC)) == 0)
+    return -1;
+  //PTE_R (1L << 1), so prot also needs to move left one bit
+  perm = (v->prot << 1) | PTE_U | PTE_A | (write ? PTE_D : 0);
+
+  if(v->f == 0){
+    // anonymous: a zero-filled page, or a whole megapage
+    // if va's 2-megabyte block lies inside the region.
+    a = MEGAPGROUNDDOWN(va);
+    if(a >= v->addr && a + MEGAPGSIZE <= v->addr + v->len &&
+       uvmmega(p->mm->pagetable, a, perm) == 0)
+      return 0;
+    if((mem = kalloc_zeroed()) == 0)
+      return -2;
+    if(mappages(p->mm->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+      kfree(mem);
+      return -2;
     }
+    return 0;
   }
 
-  if(_addr == pvma->addr){
+  ilockshared(v->f->ip);
+  pg = pcget(v->f->ip, (v->offset + (va - v->addr)) / PGSIZE);
+  if(pg == 0)
+    goto bad;
+  pa = (uint64)pg->data;
+
+  if(!vmacached(v)){
+    if((mem = kalloc()) == 0){
+      pcput(pa);
+      goto bad;
+    }
+    memmove(mem, pg->data, PGSIZE);
+    pcput(pa);
+    pa = (uint64)mem;
+  }
+
+  if(mappages(p->mm->pagetable, va, PGSIZE, pa, perm) != 0){
+    if(vmacached(v))
+      pcput(pa);
+    else
+      kfree((void*)pa);
+    goto bad;
+  }
+
+  if(vmacached(v))
+    faultaround(p, v, va);
+  iunlockshared(v->f->ip);
+  return 0;
+
+bad:
+  iunlockshared(v->f->ip);
+  return -2;
+}
+
+// Write the dirty pages of shared mapping v in [addr, addr+len)
+// back to v's file, and clean them. Pages that were never faulted
+// in or never stored to are skipped. Writes are grouped into as
+// few log transactions as MAXOPBLOCKS allows. Doesn't extend the file.
+static int
+mmapwriteback(struct vma *v, uint64 addr, uint64 len)
+{
+  struct inode *ip = v->f->ip;
+  pte_t *pte;
+  uint64 a;
+  uint off, n;
+  int npages = 0, r = 0;
+
+  for(a = addr; a < addr + len; a += PGSIZE){
+    pte = walk(myproc()->mm->pagetable, a, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_D) == 0)
+      continue;
+    if(npages == 0){
+      begin_op();
+      ilock(ip);
+    }
+    off = v->offset + (a - v->addr);
+    if(off < ip->size){
+      n = min(ip->size - off, PGSIZE);
+      if(writei(ip, 0, PTE2PA(*pte), off, n) != n)
+        r = -1;
+    }
+    // the TLB must forget the dirty bit too, or the next
+    // store won't set it.
+    *pte &= ~PTE_D;
+    uvmstale(myproc()->mm->pagetable, a, 1);
+    if(++npages == MMAPBATCH){
+      iunlock(ip);
+      end_op();
+      npages = 0;
+    }
+  }
+  if(npages > 0){
+    iunlock(ip);
+    end_op();
+  }
+  return r;
+}
+
+// Remove the pages of region v in [a, a+n) from pagetable,
+// dropping their page cache references or freeing them.
+static void
+mmapunmappages(pagetable_t pagetable, struct vma *v, uint64 a, uint64 n)
+{
+  pte_t *pte;
+  uint64 va, pa;
+
+  if(!vmacached(v)){
+    uvmunmap(pagetable, a, n / PGSIZE, 1);
+    return;
+  }
+  // keep the pages until no TLB can reach them: invalidate
+  // the PTEs, flush, then drop the references they hold.
+  for(va = a; va < a + n; va += PGSIZE)
+    if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V))
+      *pte &= ~PTE_V;
+  uvmstale(pagetable, a, n / PGSIZE);
+  for(va = a; va < a + n; va += PGSIZE){
+    if((pte = walk(pagetable, va, 0)) == 0 || *pte == 0)
+      continue;
+    pa = PTE2PA(*pte);
+    pcput(pa);
+    *pte = 0;
+  }
+}
+
+// Under memory pressure, evict some of the current process's
+// mapped pages that can be read back from their files. A clock
+// sweep over its page-cache-backed regions gives a page whose
+// accessed bit is set a second chance, clearing the bit, and
+// unmaps the others, writing dirty shared ones back first.
+// Then the memory of cached pages no one maps is freed.
+// Only the current process's page table is swept, since other
+// processes change theirs without locking.
+// Returns the number of pages evicted or freed, 0 if none.
+int
+mmapreclaim(void)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  pte_t *pte;
+  uint64 a = p->mm->clockhand;
+  int n = 0, wraps = 0;
+
+  while(n < RECLAIMBATCH){
+    if((v = vmanext(p, a)) == 0){
+      // two full turns find any page that wasn't touched.
+      if(++wraps > 2)
+        break;
+      a = 0;
+      continue;
+    }
+    if(!vmacached(v)){
+      a = v->addr + v->len;
+      continue;
+    }
+    if(a < v->addr)
+      a = v->addr;
+    for(; a < v->addr + v->len && n < RECLAIMBATCH; a += PGSIZE){
+      pte = walk(p->mm->pagetable, a, 0);
+      if(pte == 0 || (*pte & PTE_V) == 0)
+        continue;
+      if(*pte & PTE_A){
+        *pte &= ~PTE_A;
+        uvmstale(p->mm->pagetable, a, 1);
+        continue;
+      }
+      if((*pte & PTE_D) && vmawritesback(v) && mmapwriteback(v, a, PGSIZE) < 0)
+        continue;
+      mmapunmappages(p->mm->pagetable, v, a, PGSIZE);
+      n++;
+    }
+  }
+  p->mm->clockhand = a;
+  return n + pcshrink();
+}
+
+// Unmap [a, a+n) of p's region v, which must be at the start or
+// the end of v, or all of it. Pages of shared writable mappings are
+// written back to the file first.
+static int
+vmaunmap(struct proc *p, struct vma *v, uint64 a, uint64 n)
+{
+  struct file *f;
+  int r = 0;
+
+  // anonymous regions may have megapages across a or a+n.
+  if(!vmacached(v) && (uvmsplit(p->mm->pagetable, a) < 0 || uvmsplit(p->mm->pagetable, a + n) < 0))
+    return -1;
+  if(vmawritesback(v))
+    r = mmapwriteback(v, a, n);
+  mmapunmappages(p->mm->pagetable, v, a, n);
+
+  if(a == v->addr && n == v->len){
+    f = v->f;
+    vmaremove(p, v);
+    if(f)
+      fileclose(f);
+  } else if(a == v->addr){
     //head
-    pvma->addr += len;
-    pvma->len -= len;
-  }else if(_addr + len == pvma->addr + pvma->len){
+    v->addr += n;
+    v->offset += n;
+    v->len -= n;
+  } else {
     //tail
-    pvma->len -= len;
+    v->len -= n;
+  }
+  return r;
+}
+
+// Unmap [addr, addr+len) from the calling process, which may
+// span several regions or punch a hole in the middle of one.
+// Fails if no part of the range is mapped.
+uint64
+munmap(uint64 addr, int len){
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 a, end, n;
+  int r = 0, found = 0;
+
+  if(addr % PGSIZE != 0 || len <= 0)
+    return -1;
+  end = addr + PGROUNDUP(len);
+
+  for(a = addr; (v = vmanext(p, a)) != 0 && v->addr < end; a += n){
+    if(a < v->addr)
+      a = v->addr;
+    n = min(end, v->addr + v->len) - a;
+    // unmapping a hole splits v in two.
+    if(a > v->addr && a + n < v->addr + v->len && vmasplit(p, v, a + n) == 0)
+      return -1;
+    if(vmaunmap(p, v, a, n) < 0)
+      r = -1;
+    found = 1;
+  }
+  return found ? r : -1;
+}
+
+// Unmap all of the calling process's mapped regions,
+// for exit() and exec().
+void
+munmapall(void)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  while(p->mm->nvma > 0){
+    v = p->mm->vmas[p->mm->nvma-1];
+    vmaunmap(p, v, v->addr, v->len);
+  }
+}
+
+// Map the present pages of page-cache-backed region v into
+// the new page table too, each with a page cache reference
+// of its own, so that both see the same physical pages.
+// Returns 0 on success, -1 if out of memory.
+static int
+mmapshare(pagetable_t old, pagetable_t new, struct vma *v)
+{
+  pte_t *pte;
+  uint64 a;
+
+  for(a = v->addr; a < v->addr + v->len; a += PGSIZE){
+    if((pte = walk(old, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    // the parent is the one that dirtied it.
+    if(mappages(new, a, PGSIZE, PTE2PA(*pte), PTE_FLAGS(*pte) & ~PTE_D) != 0)
+      return -1;
+    pcdup(PTE2PA(*pte));
   }
+  return 0;
+}
 
-  if(pvma->len == 0 && pvma->mapped == 1){
-    fileundup(pvma->f);
-    pvma->mapped = 0;
+// Give child np copies of p's mapped regions. The child maps
+// the same pages of shared and page-cache-backed regions as p,
+// so that the two stay coherent without re-faulting, and shares
+// the pages of writable private regions copy-on-write.
+// Returns 0 on success, -1 if out of memory.
+int
+mmapfork(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+  int i, r;
+
+  if(vmacopy(p, np) < 0)
+    return -1;
+  for(i = 0; i < p->mm->nvma; i++){
+    v = p->mm->vmas[i];
+    if(vmacached(v))
+      r = mmapshare(p->mm->pagetable, np->mm->pagetable, v);
+    else if(v->flags == MAP_SHARED)
+      r = uvmshare(p->mm->pagetable, np->mm->pagetable, v->addr, v->addr + v->len);
+    else
+      r = uvmcopy(p->mm->pagetable, np->mm->pagetable, v->addr, v->addr + v->len);
+    if(r < 0)
+      goto bad;
+  }
+  for(i = 0; i < np->mm->nvma; i++)
+    if(np->mm->vmas[i]->f)
+      filedup(np->mm->vmas[i]->f);
+  return 0;
+
+bad:
+  for(; i >= 0; i--)
+    mmapunmappages(np->mm->pagetable, p->mm->vmas[i], p->mm->vmas[i]->addr, p->mm->vmas[i]->len);
+  while(np->mm->nvma > 0)
+    vmafree(np->mm->vmas[--np->mm->nvma]);
+  return -1;
+}
+
+// Queue the dirty pages of shared mapping v in [addr, addr+len)
+// for writeback by the page cache's flusher, and clean them.
+static void
+mmapqueue(struct vma *v, uint64 addr, uint64 len)
+{
+  pte_t *pte;
+  uint64 a;
+
+  for(a = addr; a < addr + len; a += PGSIZE){
+    pte = walk(myproc()->mm->pagetable, a, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_D) == 0)
+      continue;
+    pcqueue(v->f->ip, PTE2PA(*pte));
+    *pte &= ~PTE_D;
+    uvmstale(myproc()->mm->pagetable, a, 1);
+  }
+}
+
+uint64
+sys_msync(void)
+{
+  uint64 addr;
+  int len, flags;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &flags) < 0)
+    return -1;
+  return msync(addr, len, flags);
+}
+
+// Write back the shared pages of [addr, addr+len) that have
+// been written, at once with MS_SYNC, waiting for the log to
+// commit them, or else by queueing them for the pcflush kernel
+// process. Caller must hold the process's vmlock.
+int
+msync(uint64 addr, int len, int flags)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 a, end, n;
+  int r = 0;
+
+  if(addr % PGSIZE != 0 || len <= 0)
+    return -1;
+  if((flags & (MS_SYNC|MS_ASYNC)) == (MS_SYNC|MS_ASYNC))
+    return -1;
+
+  end = addr + PGROUNDUP(len);
+  for(a = addr; a < end; a += n){
+    // every page of the range must be mapped.
+    if((v = vmalookup(p, a)) == 0)
+      return -1;
+    n = min(end, v->addr + v->len) - a;
+    if(!vmawritesback(v))
+      continue;
+    if(flags & MS_ASYNC)
+      mmapqueue(v, a, n);
+    else if(mmapwriteback(v, a, n) < 0)
+      r = -1;
+  }
+  // commits are asynchronous, see log.c.
+  if(flags & MS_SYNC)
+    log_sync();
+  return r;
+}
+
+// Record how the calling process will use [addr, addr+len),
+// or act on it: MADV_NORMAL, MADV_RANDOM and MADV_SEQUENTIAL
+// set how much fault-around the range gets, MADV_WILLNEED starts
+// reading its file pages into the page cache, and MADV_DONTNEED
+// drops its pages, writing back dirty shared ones first, so that
+// they're faulted in afresh. Every page of the range must be
+// mapped.
+uint64
+sys_madvise(void)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 addr, a, end, n;
+  int len, advice;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &advice) < 0)
+    return -1;
+  if(addr % PGSIZE != 0 || len <= 0)
+    return -1;
+  if(advice < MADV_NORMAL || advice > MADV_DONTNEED)
+    return -1;
+
+  end = addr + PGROUNDUP(len);
+  for(a = addr; a < end; a = v->addr + v->len)
+    if((v = vmalookup(p, a)) == 0)
+      return -1;
+
+  for(a = addr; a < end; a += n){
+    v = vmalookup(p, a);
+    switch(advice){
+    case MADV_NORMAL:
+    case MADV_RANDOM:
+    case MADV_SEQUENTIAL:
+      // the advice applies to just the range.
+      if(a > v->addr && (v = vmasplit(p, v, a)) == 0)
+        return -1;
+      if(end < v->addr + v->len && vmasplit(p, v, end) == 0)
+        return -1;
+      v->advice = advice;
+      v->window = 1;
+      v->nextfault = v->addr;
+      n = v->len;
+      break;
+    case MADV_WILLNEED:
+      n = min(end, v->addr + v->len) - a;
+      if(v->f)
+        pcprefetch(v->f->ip, (v->offset + (a - v->addr)) / PGSIZE, n / PGSIZE);
+      break;
+    case MADV_DONTNEED:
+      n = min(end, v->addr + v->len) - a;
+      // a shared anonymous region's pages are all there is of it.
+      if(v->f == 0 && v->flags == MAP_SHARED)
+        break;
+      if(!vmacached(v) && (uvmsplit(p->mm->pagetable, a) < 0 || uvmsplit(p->mm->pagetable, a + n) < 0))
+        return -1;
+      if(vmawritesback(v) && mmapwriteback(v, a, n) < 0)
+        return -1;
+      mmapunmappages(p->mm->pagetable, v, a, n);
+      break;
+    }
   }
   return 0;
 }
@@ -580,5 +1380,91 @@ sys_munmap(void)
     return -1;
   }
   return munmap(addr, len);
-  return 0;
+}
+
+// Grow, shrink or move the mapping [addr, addr+oldlen), which
+// must lie inside one region, to be newlen bytes. Shrinking
+// unmaps the tail. Growing extends the mapping in place if the
+// address space after it is free, or else, with MREMAP_MAYMOVE,
+// moves its page table entries to a new range that fits,
+// without copying any pages.
+// Returns the mapping's address, or -1.
+uint64
+sys_mremap(void)
+{
+  struct proc *p = myproc();
+  struct vma *v, *w;
+  uint64 addr, newaddr, limit;
+  int oldlen, newlen, flags;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &oldlen) < 0 ||
+     argint(2, &newlen) < 0 || argint(3, &flags) < 0)
+    return -1;
+  if(addr % PGSIZE != 0 || oldlen <= 0 || newlen <= 0 || (flags & ~MREMAP_MAYMOVE))
+    return -1;
+  oldlen = PGROUNDUP(oldlen);
+  newlen = PGROUNDUP(newlen);
+  if(oldlen <= 0 || newlen <= 0)
+    return -1;
+  if((v = vmalookup(p, addr)) == 0 || addr + oldlen > v->addr + v->len)
+    return -1;
+
+  if(newlen <= oldlen){
+    if(newlen < oldlen && munmap(addr + newlen, oldlen - newlen) < 0)
+      return -1;
+    return addr;
+  }
+
+  // make the mapping a region of its own.
+  if(addr > v->addr && (v = vmasplit(p, v, addr)) == 0)
+    return -1;
+  if(addr + oldlen < v->addr + v->len && vmasplit(p, v, addr + oldlen) == 0)
+    return -1;
+
+  w = vmanext(p, addr + oldlen);
+  limit = w ? w->addr : USERTOP;
+  if(addr + newlen <= limit){
+    // room to grow in place.
+    if(v->f == 0 && v->flags == MAP_SHARED &&
+       anonpopulate(p->mm->pagetable, addr + oldlen, newlen - oldlen, v->prot) < 0)
+      return -1;
+    v->len = newlen;
+    return addr;
+  }
+  if((flags & MREMAP_MAYMOVE) == 0)
+    return -1;
+
+  if((newaddr = mmapplace(p, newlen, v->f == 0)) == 0)
+    return -1;
+  if(v->f == 0 && v->flags == MAP_SHARED &&
+     anonpopulate(p->mm->pagetable, newaddr + oldlen, newlen - oldlen, v->prot) < 0)
+    return -1;
+  if(uvmmove(p->mm->pagetable, addr, newaddr, oldlen / PGSIZE) < 0){
+    if(v->f == 0 && v->flags == MAP_SHARED)
+      uvmunmap(p->mm->pagetable, newaddr + oldlen, (newlen - oldlen) / PGSIZE, 1);
+    return -1;
+  }
+  vmamove(p, v, newaddr);
+  v->len = newlen;
+  return newaddr;
+}
+
+// Map a ring for batched system calls into the calling
+// process, and return its address; see uring.c.
+uint64
+sys_uringsetup(void)
+{
+  return uringsetup();
+}
+
+// Do up to n of the ring's requests, then wait for wait
+// completions; returns how many requests it took.
+uint64
+sys_uringenter(void)
+{
+  int n, wait;
+
+  if(argint(0, &n) < 0 || argint(1, &wait) < 0)
+    return -1;
+  return uringenter(n, wait);
 }
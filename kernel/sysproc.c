@@ -5,7 +5,11 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
+#include "memstat.h"
+#include "cpustat.h"
+#include "fcntl.h"
 
 uint64
 sys_exit(void)
@@ -23,6 +27,14 @@ sys_getpid(void)
   return myproc()->pid;
 }
 
+// give up the CPU to whatever else is runnable.
+uint64
+sys_yield(void)
+{
+  yield();
+  return 0;
+}
+
 uint64
 sys_fork(void)
 {
@@ -41,12 +53,12 @@ sys_wait(void)
 uint64
 sys_sbrk(void)
 {
-  int addr;
+  uint64 addr;
   int n;
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
+  addr = myproc()->mm->sz;
   if(growproc(n) < 0)
     return -1;
   return addr;
@@ -56,21 +68,36 @@ uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   if(argint(0, &n) < 0)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  if(n <= 0)
+    return 0;
+  return sleepuntil(r_time() + (uint64)n * TICKCYCLES);
+}
+
+// Sleep for the given number of nanoseconds.
+uint64
+sys_nanosleep(void)
+{
+  uint64 ns, now, n;
+
+  if(argaddr(0, &ns) < 0)
+    return -1;
+  now = r_time();
+  n = ns / (1000000000 / CLINT_FREQ);
+  // a sleep that would outlast the clock lasts until killed,
+  // rather than wrapping round to end at once.
+  if(n > ~(uint64)0 - now)
+    n = ~(uint64)0 - now;
+  return sleepuntil(now + n);
+}
+
+// return the time since boot in nanoseconds.
+uint64
+sys_nanotime(void)
+{
+  return r_time() * (1000000000 / CLINT_FREQ);
 }
 
 uint64
@@ -83,15 +110,196 @@ sys_kill(void)
   return kill(pid);
 }
 
-// return how many clock tick interrupts have occurred
+uint64
+sys_setpriority(void)
+{
+  int pid, prio;
+
+  if(argint(0, &pid) < 0 || argint(1, &prio) < 0)
+    return -1;
+  if(prio < 0 || prio >= NPRIO)
+    return -1;
+  return setpriority(pid, prio);
+}
+
+// Start a thread of the calling process at fn(arg), with
+// its stack pointer at stack; see clone().
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  if(argaddr(0, &fn) < 0 || argaddr(1, &arg) < 0 || argaddr(2, &stack) < 0)
+    return -1;
+  if(stack % 16 != 0)
+    return -1;
+  return clone(fn, arg, stack);
+}
+
+// futex(addr, FUTEX_WAIT, val) sleeps if the int at addr
+// still holds val, until woken. futex(addr, FUTEX_WAKE, n)
+// wakes up to n of those sleeping on addr and returns how
+// many. Threads, and processes sharing the page, meet on the
+// word's physical address. Both look it up as for a store, so
+// that a copy-on-write page is copied first rather than under
+// a waiter, and hold the page meanwhile, so that an unmap
+// can't free it while a waiter looks at the word.
+uint64
+sys_futex(void)
+{
+  uint64 addr, pa;
+  int op, val, r = -1;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &op) < 0 || argint(2, &val) < 0)
+    return -1;
+  if(addr % sizeof(int) != 0)
+    return -1;
+  if((pa = uvmhold(myproc()->mm->pagetable, addr, 1)) == 0)
+    return -1;
+  switch(op){
+  case FUTEX_WAIT:
+    r = futexwait(pa, val);
+    break;
+  case FUTEX_WAKE:
+    r = futexwake(pa, val);
+    break;
+  }
+  kfree((void*)PGROUNDDOWN(pa));
+  return r;
+}
+
+// Copy out a struct cpustat for each of up to n CPUs
+// that have started. Returns how many.
+uint64
+sys_cpustat(void)
+{
+  uint64 addr;
+  int i, n;
+  struct cpu *c;
+  struct cpustat cs;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  for(i = 0; i < n && i < NCPU; i++){
+    c = &cpus[i];
+    if(c->start == 0)
+      break;
+    cs.uptime = r_time() - c->start;
+    cs.idle = c->idletime;
+    cs.nipi = c->nipi;
+    if(copyout(myproc()->mm->pagetable, addr + i*sizeof(cs), (char*)&cs, sizeof(cs)) < 0)
+      return -1;
+  }
+  return i;
+}
+
+// Copy out the counts for up to n lock names, and return
+// how many; see lockstat.h. lockstat(0, 0) zeroes them.
+uint64
+sys_lockstat(void)
+{
+  uint64 addr;
+  int n;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  if(addr == 0 && n == 0){
+    lockstatreset();
+    return 0;
+  }
+  return lockstatcopy(addr, n);
+}
+
+// Record the classes of event in the mask, or with -1 leave
+// them be, and return those recorded before; see trace.h.
+uint64
+sys_trace(void)
+{
+  int mask;
+
+  if(argint(0, &mask) < 0)
+    return -1;
+  return traceset(mask);
+}
+
+// Move up to n of the oldest trace events to the
+// user's buffer, and return how many.
+uint64
+sys_traceread(void)
+{
+  uint64 addr;
+  int n;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return tracecopy(addr, n);
+}
+
+// Sample where each busy CPU is hz times a second, or stop
+// if hz is 0, and return how many samples were dropped since
+// the last call for want of room; see prof.c.
+uint64
+sys_prof(void)
+{
+  int hz;
+
+  if(argint(0, &hz) < 0)
+    return -1;
+  return profset(hz);
+}
+
+// Move up to n profiling samples to the user's buffer, and
+// return how many; see prof.h.
+uint64
+sys_profread(void)
+{
+  uint64 addr;
+  int n;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return profcopy(addr, n);
+}
+
+// Copy out the counts of system calls 0 up to n, and return
+// how many; see sysstat.h. sysstat(0, 0) zeroes them.
+uint64
+sys_sysstat(void)
+{
+  uint64 addr;
+  int n;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  if(addr == 0 && n == 0){
+    sysstatreset();
+    return 0;
+  }
+  return sysstatcopy(addr, n);
+}
+
+// return how many clock ticks' worth of time has passed
 // since start.
 uint64
 sys_uptime(void)
 {
-  uint xticks;
+  return r_time() / TICKCYCLES;
+}
+
+// memory use of the lowest-numbered process whose
+// pid is at least the first argument.
+uint64
+sys_memstat(void)
+{
+  int pid;
+  uint64 addr;
+  struct memstat ms;
 
-  acquire(&tickslock);
-  xticks = ticks;
-  release(&tickslock);
-  return xticks;
+  if(argint(0, &pid) < 0 || argaddr(1, &addr) < 0)
+    return -1;
+  if(procmemstat(pid, &ms) < 0)
+    return -1;
+  if(copyout(myproc()->mm->pagetable, addr, (char*)&ms, sizeof(ms)) < 0)
+    return -1;
+  return 0;
 }
@@ -0,0 +1,11 @@
+// Filled in by sysstat(), one for each system call number.
+// Times are in CLINT_MTIME cycles. hist[b] counts the calls
+// that took from 2^b up to 2^(b+1) cycles; the last bucket
+// counts everything longer.
+#define NSYSHIST 24
+
+struct sysstat {
+  uint64 calls;
+  uint64 time;        // total time taken
+  uint64 hist[NSYSHIST];
+};
@@ -0,0 +1,266 @@
+// Kernel timers.
+//
+// Pending timers wait in a hashed timing wheel: NWHEEL slots
+// each SLOTCYCLES wide, a timer going in the slot its expiry
+// falls in, so adding or removing one is quick. A slot holds
+// the timers of every turn of the wheel; those due on a later
+// turn are passed over until it comes round.
+//
+// Rather than interrupting at a fixed rate, each CPU's timer
+// is set for the next thing it has to do: its next scheduling
+// tick or profiling sample (see prof.c) while it runs a
+// process, and on CPU 0, which runs the wheel, the earliest
+// pending timer. An idle CPU sets no tick,
+// so an idle system is interrupted only when a timer is due.
+//
+// The kernel sets the CLINT's MTIMECMP registers itself;
+// timervec in kernelvec.S, which takes the machine-mode timer
+// interrupt, just turns it off and passes it on.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "timer.h"
+
+#define NWHEEL      256
+#define SLOTCYCLES  (CLINT_FREQ/1000)  // a millisecond
+#define NEVER       (~(uint64)0)
+
+struct {
+  struct spinlock lock;
+  struct timer *slot[NWHEEL];
+  uint64 done;    // timers due by this time have gone off
+  uint64 next;    // no pending timer is due before this
+  uint64 armed;   // what CPU 0's MTIMECMP is set to
+} wheel;
+
+uint ticks;
+
+void
+timersinit(void)
+{
+  initlock(&wheel.lock, "timer");
+  wheel.next = NEVER;
+  wheel.armed = NEVER;
+}
+
+// Set CPU id's timer to interrupt at when.
+static void
+setmtimecmp(int id, uint64 when)
+{
+  *(volatile uint64*)CLINT_MTIMECMP(id) = when;
+}
+
+// Put t in its slot. A timer already due goes in the slot
+// that the wheel will look at next.
+// Caller must hold wheel.lock.
+static void
+wheelinsert(struct timer *t)
+{
+  uint64 at = t->when > wheel.done ? t->when : wheel.done;
+  struct timer **pp;
+
+  t->slot = at / SLOTCYCLES % NWHEEL;
+  pp = &wheel.slot[t->slot];
+  t->next = *pp;
+  *pp = t;
+  t->pending = 1;
+  if(t->when < wheel.next)
+    wheel.next = t->when;
+  if(t->when < wheel.armed){
+    wheel.armed = t->when;
+    setmtimecmp(0, t->when);
+  }
+}
+
+// Caller must hold wheel.lock.
+static void
+wheelremove(struct timer *t)
+{
+  struct timer **pp;
+
+  for(pp = &wheel.slot[t->slot]; *pp != t; pp = &(*pp)->next)
+    ;
+  *pp = t->next;
+  t->pending = 0;
+}
+
+// Start timer t, which must not be pending.
+void
+timeradd(struct timer *t)
+{
+  acquire(&wheel.lock);
+  if(t->pending)
+    panic("timeradd");
+  wheelinsert(t);
+  release(&wheel.lock);
+}
+
+// Stop timer t if it is pending.
+void
+timerdel(struct timer *t)
+{
+  acquire(&wheel.lock);
+  if(t->pending)
+    wheelremove(t);
+  release(&wheel.lock);
+}
+
+// Set off the timers due by now, on CPU 0. Their functions
+// run holding wheel.lock, so must not add or delete timers.
+static void
+timerrun(uint64 now)
+{
+  struct timer *t, **pp;
+  uint64 s, first, last;
+
+  acquire(&wheel.lock);
+  if(now < wheel.next){
+    release(&wheel.lock);
+    return;
+  }
+  first = wheel.done / SLOTCYCLES;
+  last = now / SLOTCYCLES;
+  if(last - first >= NWHEEL)
+    last = first + NWHEEL - 1;
+  for(s = first; s <= last; s++){
+    for(pp = &wheel.slot[s % NWHEEL]; (t = *pp) != 0; ){
+      if(t->when > now){
+        pp = &t->next;
+        continue;
+      }
+      *pp = t->next;
+      t->pending = 0;
+      if(t->fn)
+        t->fn(t->arg);
+      else
+        wakeup(t);
+      if(t->period){
+        t->when += t->period;
+        if(t->when <= now)
+          t->when = now + t->period;
+        wheelinsert(t);
+      }
+    }
+  }
+  wheel.done = now;
+
+  // find the next timer due.
+  wheel.next = NEVER;
+  for(s = 0; s < NWHEEL; s++)
+    for(t = wheel.slot[s]; t; t = t->next)
+      if(t->when < wheel.next)
+        wheel.next = t->when;
+  release(&wheel.lock);
+}
+
+// Set this CPU's timer for its next scheduling tick or
+// profiling sample, or on CPU 0 for the next timer if that's
+// sooner. Interrupts must be off.
+void
+timerarm(void)
+{
+  struct cpu *c = mycpu();
+  uint64 when = c->tickdue ? c->tickdue : NEVER;
+
+  if(c->profdue && c->profdue < when)
+    when = c->profdue;
+
+  if(cpuid() == 0){
+    acquire(&wheel.lock);
+    if(wheel.next < when)
+      when = wheel.next;
+    wheel.armed = when;
+    setmtimecmp(0, when);
+    release(&wheel.lock);
+  } else {
+    setmtimecmp(cpuid(), when);
+  }
+}
+
+// Handle a timer interrupt on this CPU. Returns 2 if it's
+// time for the running process's scheduling tick, 1 if not.
+int
+timerintr(void)
+{
+  struct cpu *c = mycpu();
+  uint64 now = r_time();
+  uint old, t;
+  int r = 1;
+
+  // ticks counts scheduling ticks' worth of time since boot,
+  // brought up to date by whichever CPU is interrupted.
+  t = now / TICKCYCLES;
+  old = __atomic_load_n(&ticks, __ATOMIC_RELAXED);
+  while(old < t && !__atomic_compare_exchange_n(&ticks, &old, t, 0,
+                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+
+  if(cpuid() == 0)
+    timerrun(now);
+  if(c->tickdue && now >= c->tickdue){
+    c->tickdue = c->proc ? now + TICKCYCLES : 0;
+    r = 2;
+  }
+  if(c->profdue && now >= c->profdue){
+    profsample();
+    c->profdue = 0;
+  }
+  if(profcycles && c->profdue == 0 && c->proc)
+    c->profdue = now + profcycles;
+  timerarm();
+  return r;
+}
+
+// Called by scheduler() before it runs a process on this CPU,
+// to start its scheduling ticks, and profiling samples if on,
+// if they stopped while it idled. Interrupts must be off.
+void
+timertick(void)
+{
+  struct cpu *c = mycpu();
+  int arm = 0;
+
+  if(c->tickdue == 0){
+    c->tickdue = r_time() + TICKCYCLES;
+    arm = 1;
+  }
+  if(profcycles && c->profdue == 0){
+    c->profdue = r_time() + profcycles;
+    arm = 1;
+  }
+  if(arm)
+    timerarm();
+}
+
+// Sleep until r_time() reaches when.
+// Returns 0, or -1 if the process has been killed.
+int
+sleepuntil(uint64 when)
+{
+  struct timer t;
+  int r = 0;
+
+  t.when = when;
+  t.period = 0;
+  t.fn = 0;
+  t.arg = 0;
+  t.pending = 0;
+  acquire(&wheel.lock);
+  if(when > r_time()){
+    wheelinsert(&t);
+    while(t.pending && !myproc()->killed)
+      sleep(&t, &wheel.lock);
+    if(t.pending){
+      wheelremove(&t);
+      r = -1;
+    }
+  }
+  release(&wheel.lock);
+  return r;
+}
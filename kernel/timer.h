@@ -0,0 +1,13 @@
+// A kernel timer. timeradd() arranges for fn(arg) to be
+// called at time when, in r_time() cycles, or if fn is 0,
+// for whoever sleeps on the timer to be woken. A timer with
+// a period goes off again every period cycles after that.
+struct timer {
+  uint64 when;
+  uint64 period;
+  void (*fn)(void*);
+  void *arg;
+  int pending;        // waiting in the wheel?
+  uint slot;          // which slot it waits in
+  struct timer *next; // in that slot
+};
@@ -0,0 +1,147 @@
+// Kernel event tracing.
+//
+// Each CPU records events into its own ring, with interrupts
+// off, so recording takes no lock. When a ring is full the
+// newest event overwrites the oldest. Which classes of event
+// are recorded is set at run time by trace(); call sites check
+// tracemask first, so a class that is off costs one load.
+//
+// traceread() drains the rings, merging them into time order.
+// A reader may copy a slot just as its CPU overwrites it, so
+// each slot carries the sequence number of the event in it,
+// cleared while the CPU writes it and set once it's done. The
+// reader checks the number before and after copying the event,
+// the way a seqlock reader does.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "trace.h"
+
+struct tslot {
+  uint64 seq;    // 1 + the event's index, or 0 while written
+  struct traceev ev;
+};
+
+struct tring {
+  struct tslot s[NTRACE];
+  uint64 r;      // next to read
+  uint64 w;      // next to fill; written only by its CPU
+};
+
+static struct tring tring[NCPU];
+static struct sleeplock tracelock;  // serializes readers
+uint tracemask;
+
+void
+traceinit(void)
+{
+  initsleeplock(&tracelock, "trace");
+}
+
+// Record an event of the given type on this CPU.
+// Callers check tracemask for its class first.
+void
+traceev(int type, uint64 a0, uint64 a1)
+{
+  struct tring *t;
+  struct tslot *s;
+  struct traceev *e;
+  struct proc *p;
+
+  push_off();
+  t = &tring[cpuid()];
+  p = mycpu()->proc;
+  s = &t->s[t->w % NTRACE];
+  // a reader must see the slot as being written before it
+  // can see any of the new event.
+  __atomic_store_n(&s->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  e = &s->ev;
+  e->time = r_time();
+  e->pid = p ? p->pid : 0;
+  e->type = type;
+  e->cpu = cpuid();
+  e->a0 = a0;
+  e->a1 = a1;
+  // publish the event only once all of it is in the slot.
+  __atomic_store_n(&s->seq, t->w + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&t->w, t->w + 1, __ATOMIC_RELEASE);
+  pop_off();
+}
+
+// Copy ring t's oldest unread event into *e, skipping any that
+// have been overwritten. Returns 0 if t has none. The caller
+// moves t->r on once it has used the event.
+// Caller holds tracelock.
+static int
+tpeek(struct tring *t, struct traceev *e)
+{
+  struct tslot *s;
+  uint64 w;
+
+  for(;;){
+    w = __atomic_load_n(&t->w, __ATOMIC_ACQUIRE);
+    if(w - t->r >= NTRACE)
+      t->r = w - NTRACE + 1;
+    if(t->r == w)
+      return 0;
+    s = &t->s[t->r % NTRACE];
+    if(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) == t->r + 1){
+      *e = s->ev;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if(__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == t->r + 1)
+        return 1;
+    }
+    // the CPU has come round to the slot again; skip ahead.
+    t->r++;
+  }
+}
+
+// Set the classes of event to record, if mask isn't -1,
+// and return those recorded before.
+int
+traceset(int mask)
+{
+  int old = tracemask;
+
+  if(mask != -1)
+    __atomic_store_n(&tracemask, mask & TR_ALL, __ATOMIC_RELAXED);
+  return old;
+}
+
+// Move up to n of the oldest recorded events, in time order,
+// to user address addr. Returns how many, or -1.
+int
+tracecopy(uint64 addr, int n)
+{
+  struct traceev e, best;
+  struct tring *t, *bt;
+  int i;
+
+  acquiresleep(&tracelock);
+  for(i = 0; i < n; i++){
+    bt = 0;
+    for(t = tring; t < tring + NCPU; t++){
+      if(tpeek(t, &e) && (bt == 0 || e.time < best.time)){
+        best = e;
+        bt = t;
+      }
+    }
+    if(bt == 0)
+      break;
+    if(copyout(myproc()->mm->pagetable, addr + i*sizeof(best), (char*)&best, sizeof(best)) < 0){
+      releasesleep(&tracelock);
+      return -1;
+    }
+    // the event is the caller's now.
+    bt->r++;
+  }
+  releasesleep(&tracelock);
+  return i;
+}
@@ -0,0 +1,31 @@
+// Kernel event tracing; see trace.c.
+
+// event classes, for trace()'s mask.
+#define TR_SYSCALL  0x01
+#define TR_FAULT    0x02
+#define TR_SWITCH   0x04
+#define TR_DISK     0x08
+#define TR_LOG      0x10
+#define TR_ALL      0x1f
+
+// event types.
+#define TE_SYSENTER   1  // a0 = syscall number
+#define TE_SYSEXIT    2  // a0 = syscall number, a1 = return value
+#define TE_FAULT      3  // a0 = address, a1 = 1 for a store
+#define TE_RUN        4  // pid is switched to
+#define TE_SWITCH     5  // pid gives up the CPU; a0 = its new state
+#define TE_DISKREAD   6  // a0 = first block, a1 = how many
+#define TE_DISKWRITE  7  // a0 = first block, a1 = how many
+#define TE_DISKDONE   8  // a0 = first block, a1 = how many
+#define TE_LOGCOMMIT  9  // a0 = transaction, a1 = blocks in it
+#define TE_LOGDONE   10  // a0 = transaction
+
+// Filled in by traceread(). Times are in CLINT_MTIME cycles.
+struct traceev {
+  uint64 time;
+  int pid;            // 0 if no process was running
+  short type;
+  short cpu;
+  uint64 a0;
+  uint64 a1;
+};
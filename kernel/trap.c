@@ -3,14 +3,14 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
-#include "sleeplock.h"
 #include "fs.h"
 #include "file.h"
+#include "trace.h"
 
-struct spinlock tickslock;
-uint ticks;
+extern uint64 timer_scratch[NCPU][7]; // start.c
 
 extern char trampoline[], uservec[], userret[];
 
@@ -19,12 +19,6 @@ void kernelvec();
 
 extern int devintr();
 
-void
-trapinit(void)
-{
-  initlock(&tickslock, "time");
-}
-
 // set up to take exceptions and traps while in the kernel.
 void
 trapinithart(void)
@@ -32,6 +26,23 @@ trapinithart(void)
   w_stvec((uint64)kernelvec);
 }
 
+// Handle a page fault at va: a store to a copy-on-write page,
+// or the first touch of a heap page or a mapped page.
+// Caller must hold p->mm->vmlock.
+// Returns 0 if the process can go on, -1 if it can't, or -2
+// if it could once some memory or page-cache slots are free.
+static int
+pagefault(struct proc *p, uint64 va, int write)
+{
+  int r;
+
+  if(write && (r = cowfault(p->mm->pagetable, va)) != -1)
+    return r;
+  if((r = lazyalloc(p->mm->pagetable, va)) != -1)
+    return r;
+  return mmapfault(va, write);
+}
+
 //
 // handle an interrupt, exception, or system call from user space.
 // called from trampoline.S
@@ -39,7 +50,7 @@ trapinithart(void)
 void
 usertrap(void)
 {
-  int which_dev = 0;
+  int which_dev = 0, r;
 
   if((r_sstatus() & SSTATUS_SPP) != 0)
     panic("usertrap: not from user mode");
@@ -69,41 +80,18 @@ usertrap(void)
 
     syscall();
   } else if(r_scause() == 13 || r_scause() == 15){
-    uint64 va = r_stval();
-    struct vma *pvma;
-    int i = 0;
-    //p->sz point to the top of heap(i.e. bottom of trapframe)
-    //p->trapframe->sp point to the top of stack
-    if((va >= p->sz) || (va < PGROUNDDOWN(p->trapframe->sp))){
+    // a page fault. if memory is too short to handle it,
+    // evict some mapped pages and try once more.
+    if(tracemask & TR_FAULT)
+      traceev(TE_FAULT, r_stval(), r_scause() == 15);
+    acquiresleep(&p->mm->vmlock);
+    p->mm->nfault++;
+    r = pagefault(p, r_stval(), r_scause() == 15);
+    if(r == -2 && mmapreclaim() > 0)
+      r = pagefault(p, r_stval(), r_scause() == 15);
+    if(r < 0)
       p->killed = 1;
-    } else{
-      va = PGROUNDDOWN(va);
-      for(; i < MAXVMA; i++){
-	pvma = &p->vma_table[i];
-        if(pvma->mapped && (va >= pvma->addr) && (va < (pvma->addr + pvma->len))){
-          char *mem;
-	  mem = kalloc();
-	  if(mem == 0){
-	    p->killed = 1;
-	    break;
-	  }
-	  memset(mem, 0, PGSIZE);
-	  //PTE_R (1L << 1), so prot also needs to move left one bit
-	  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, (pvma->prot << 1) | PTE_U) != 0){
-	    kfree(mem);
-	    p->killed = 1;
-	    break;
-	  }
-	  break;
-	}
-      }
-    }
-
-    if(p->killed != 1 && i <= MAXVMA){
-      ilock(pvma->f->ip);
-      readi(pvma->f->ip, 1, va, va - pvma->addr, PGSIZE);
-      iunlock(pvma->f->ip);
-    }
+    releasesleep(&p->mm->vmlock);
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -115,8 +103,8 @@ usertrap(void)
   if(p->killed)
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  // give up the CPU if this timer interrupt ends its slice.
+  if(which_dev == 2 && schedtick())
     yield();
 
   usertrapret();
@@ -158,13 +146,13 @@ usertrapret(void)
   w_sepc(p->trapframe->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = MAKE_SATP(p->mm->pagetable) | SATP_ASID(uvmasid(p));
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 fn = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64,uint64))fn)(TRAPFRAME, satp);
+  ((void (*)(uint64,uint64))fn)(THREADFRAME(p->tfslot), satp);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -188,8 +176,8 @@ kerneltrap()
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  // give up the CPU if this timer interrupt ends its slice.
+  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING && schedtick())
     yield();
 
   // the yield() may have caused some traps to occur,
@@ -198,15 +186,6 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
-void
-clockintr()
-{
-  acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
-  release(&tickslock);
-}
-
 // check if it's an external interrupt or software interrupt,
 // and handle it.
 // returns 2 if timer interrupt,
@@ -241,17 +220,22 @@ devintr()
     return 1;
   } else if(scause == 0x8000000000000001L){
     // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // or from another CPU, forwarded by timervec in kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
+    // the SSIP bit in sip, before looking at what it was
+    // for, so as not to lose one raised meanwhile.
     w_sip(r_sip() & ~2);
+    tlbpoll();
+
+    if(__atomic_exchange_n(&timer_scratch[cpuid()][6], 0, __ATOMIC_RELAXED) == 0){
+      // another CPU woke this one from scheduler()'s wfi,
+      // or asked it to flush its TLB.
+      mycpu()->nipi++;
+      return 1;
+    }
 
-    return 2;
+    return timerintr();
   } else {
     return 0;
   }
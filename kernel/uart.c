@@ -7,6 +7,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 
@@ -131,35 +132,68 @@ uartputc_sync(int c)
 }
 
 // if the UART is idle, and a character is waiting
-// in the transmit buffer, send it.
+// in the transmit buffer or kernel printf()'s buffers,
+// send it.
 // caller must hold uart_tx_lock.
 // called from both the top- and bottom-half.
 void
 uartstart()
 {
+  int c;
+
   while(1){
-    if(uart_tx_w == uart_tx_r){
-      // transmit buffer is empty.
-      return;
-    }
-    
     if((ReadReg(LSR) & LSR_TX_IDLE) == 0){
       // the UART transmit holding register is full,
       // so we cannot give it another byte.
       // it will interrupt when it's ready for a new byte.
       return;
     }
-    
-    int c = uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE];
-    uart_tx_r += 1;
-    
-    // maybe uartputc() is waiting for space in the buffer.
-    wakeup(&uart_tx_r);
-    
+
+    if(uart_tx_w != uart_tx_r){
+      c = uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE];
+      uart_tx_r += 1;
+
+      // maybe uartputc() is waiting for space in the buffer.
+      wakeup(&uart_tx_r);
+    } else if((c = klogget()) < 0){
+      // nothing to send.
+      return;
+    }
+
     WriteReg(THR, c);
   }
 }
 
+// start sending kernel printf() output, if the UART is idle.
+// if write()'s output is waiting, the UART is busy with it,
+// and its interrupts will send printf()'s after; leaving it
+// to them means printf() never calls wakeup(), so it can
+// be called with any lock held.
+void
+uartkick(void)
+{
+  acquire(&uart_tx_lock);
+  if(uart_tx_w == uart_tx_r)
+    uartstart();
+  release(&uart_tx_lock);
+}
+
+// wait, spinning, until the UART can take another character,
+// and send one of printf()'s. for when printf()'s buffer is
+// full, perhaps because interrupts are not on yet.
+void
+uartdrain(void)
+{
+  int c;
+
+  acquire(&uart_tx_lock);
+  while((ReadReg(LSR) & LSR_TX_IDLE) == 0)
+    ;
+  if((c = klogget()) >= 0)
+    WriteReg(THR, c);
+  release(&uart_tx_lock);
+}
+
 // read one input character from the UART.
 // return -1 if none is waiting.
 int
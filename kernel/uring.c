@@ -0,0 +1,356 @@
+// Batched system calls.
+//
+// A process that calls uringsetup() gets a page, struct uring,
+// mapped at URING as USYSCALL is, in which it queues requests
+// for reads, writes, closes and the like. One uringenter() then
+// does a batch of them, for the price of one trap, through the
+// same file.c and sysfile.c code as the system calls.
+//
+// uringenter() does most requests itself, one after another. A
+// read or write flagged URF_ASYNC instead goes to a queue that
+// NURWORKER kernel processes serve, so that uringenter() may
+// return while it waits on a pipe or the disk. A worker acts
+// for the process by taking its mm for the time being, as the
+// process's threads do, so that copyin() and copyout() use the
+// process's page table. uringfree() waits for a process's
+// requests to be done before its memory goes.
+//
+// The kernel keeps its own copies of sqhead and cqtail in the
+// process, and reads only sqtail, cqhead and the requests
+// from the page, which the program may change at any time.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+#include "uring.h"
+
+// an asynchronous request.
+struct urwork {
+  struct proc *mm;        // whose
+  struct file *f;         // a reference of its own
+  struct ursqe e;
+  struct urwork *next;
+};
+
+struct {
+  struct spinlock lock;   // protects the rings' indices too
+  struct urwork work[NURWORK];
+  struct urwork *free;
+  struct urwork *head;    // queued, oldest first
+  struct urwork **tail;
+  struct proc *worker[NURWORKER];
+  struct proc *busy[NURWORKER];  // whom each worker acts for, or 0
+  int nworker;
+} ur;
+
+static void uringworker(void);
+
+void
+uringinit(void)
+{
+  int i;
+
+  initlock(&ur.lock, "uring");
+  for(i = 0; i < NURWORK; i++){
+    ur.work[i].next = ur.free;
+    ur.free = &ur.work[i];
+  }
+  ur.tail = &ur.head;
+  for(i = 0; i < NURWORKER; i++)
+    kproc("uring", uringworker);
+}
+
+// Give the calling process a ring. Returns URING, where the
+// ring is mapped, or -1 if it has one already.
+// Caller must hold p->mm->vmlock.
+uint64
+uringsetup(void)
+{
+  struct proc *mm = myproc()->mm;
+  struct uring *r;
+
+  if(sizeof(struct uring) > PGSIZE)
+    panic("uringsetup");
+  if(mm->uring != 0 || (r = (struct uring*)kalloc()) == 0)
+    return -1;
+  memset(r, 0, PGSIZE);
+  if(mappages(mm->pagetable, URING, PGSIZE, (uint64)r,
+              PTE_R | PTE_W | PTE_U) < 0){
+    kfree((void*)r);
+    return -1;
+  }
+  acquire(&ur.lock);
+  mm->uring = r;
+  mm->ursqhead = 0;
+  mm->urcqtail = 0;
+  mm->urpending = 0;
+  release(&ur.lock);
+  return URING;
+}
+
+// Post result res of a request of mm's, with data as given,
+// to its ring. uringenter() set aside the room for it.
+// Caller must hold ur.lock.
+static void
+post(struct proc *mm, uint64 data, int res)
+{
+  struct urcqe *c = &mm->uring->cq[mm->urcqtail % NURCQ];
+
+  c->data = data;
+  c->res = res;
+  mm->urcqtail++;
+  mm->urpending--;
+  __sync_synchronize();
+  mm->uring->cqtail = mm->urcqtail;
+  wakeup(&mm->uring);
+}
+
+// Do read or write request e on f.
+static int
+uringio(struct file *f, struct ursqe *e)
+{
+  switch(e->op){
+  case UR_READ:
+    return fileread(f, e->addr, e->len);
+  case UR_WRITE:
+    return filewrite(f, e->addr, e->len);
+  case UR_PREAD:
+    return e->off < 0 ? -1 : filepread(f, e->addr, e->len, e->off);
+  case UR_PWRITE:
+    return e->off < 0 ? -1 : filepwrite(f, e->addr, e->len, e->off);
+  }
+  return -1;
+}
+
+static int
+isio(int op)
+{
+  return op == UR_READ || op == UR_WRITE || op == UR_PREAD || op == UR_PWRITE;
+}
+
+// The calling process's file fd, with a reference of its
+// own, so that a close() meanwhile leaves it be; or 0.
+static struct file*
+fdget(int fd)
+{
+  struct proc *mm = myproc()->mm;
+  struct file *f;
+
+  if(fd < 0 || fd >= NOFILE)
+    return 0;
+  acquire(&mm->lock);
+  if((f = mm->ofile[fd]) != 0)
+    filedup(f);
+  release(&mm->lock);
+  return f;
+}
+
+// Do request e for the calling process, as the system call
+// would, and return its result.
+static int
+uringdo(struct ursqe *e)
+{
+  struct proc *mm = myproc()->mm;
+  struct file *f;
+  int r;
+
+  switch(e->op){
+  case UR_NOP:
+    return 0;
+  case UR_CLOSE:
+    return fdclose(e->fd);
+  case UR_MSYNC:
+  case UR_MUNMAP:
+    // as for the system calls, see vmcalls in syscall.c.
+    acquiresleep(&mm->vmlock);
+    if(e->op == UR_MSYNC)
+      r = msync(e->addr, e->len, e->off);
+    else
+      r = munmap(e->addr, e->len);
+    releasesleep(&mm->vmlock);
+    return r;
+  }
+  if((f = fdget(e->fd)) == 0)
+    return -1;
+  if(e->op == UR_FSYNC)
+    r = filesync(f);
+  else
+    r = uringio(f, e);
+  fileclose(f);
+  return r;
+}
+
+// Queue asynchronous request e of the calling process's, on
+// f. Returns 0, or -1 if the queue is full.
+static int
+uringqueue(struct file *f, struct ursqe *e)
+{
+  struct urwork *w;
+
+  acquire(&ur.lock);
+  if((w = ur.free) == 0){
+    release(&ur.lock);
+    return -1;
+  }
+  ur.free = w->next;
+  w->mm = myproc()->mm;
+  w->f = f;
+  w->e = *e;
+  w->next = 0;
+  *ur.tail = w;
+  ur.tail = &w->next;
+  wakeupn(&ur.head, 1);
+  release(&ur.lock);
+  return 0;
+}
+
+// Do up to n of the calling process's queued requests, then
+// wait until it has at least wait completions to take, or
+// none are still to come. Returns how many requests were
+// taken, or -1.
+int
+uringenter(int n, int wait)
+{
+  struct proc *p = myproc(), *mm = p->mm;
+  struct uring *r = mm->uring;
+  struct ursqe e;
+  struct file *f;
+  int done, res;
+  uint queued;
+
+  if(r == 0 || n < 0 || wait < 0 || wait > NURCQ)
+    return -1;
+  for(done = 0; done < n; done++){
+    acquire(&ur.lock);
+    queued = r->sqtail - mm->ursqhead;
+    if(queued > NURSQ){
+      release(&ur.lock);
+      return -1;
+    }
+    // stop when there's no request, or no room for its completion.
+    if(queued == 0 || mm->urcqtail + mm->urpending - r->cqhead >= NURCQ){
+      release(&ur.lock);
+      break;
+    }
+    __sync_synchronize();
+    e = r->sq[mm->ursqhead % NURSQ];
+    mm->ursqhead++;
+    r->sqhead = mm->ursqhead;
+    mm->urpending++;
+    release(&ur.lock);
+
+    if((e.flags & URF_ASYNC) && isio(e.op)){
+      if((f = fdget(e.fd)) != 0 && uringqueue(f, &e) == 0)
+        continue;
+      // no room in the queue: do it now.
+      res = f ? uringio(f, &e) : -1;
+      if(f)
+        fileclose(f);
+    } else {
+      res = uringdo(&e);
+    }
+    acquire(&ur.lock);
+    post(mm, e.data, res);
+    release(&ur.lock);
+  }
+
+  acquire(&ur.lock);
+  while(mm->urcqtail - r->cqhead < wait && mm->urpending > 0 && !p->killed)
+    sleep(&mm->uring, &ur.lock);
+  release(&ur.lock);
+  return done;
+}
+
+// Body of a uring kernel process: do queued asynchronous
+// requests, one at a time.
+static void
+uringworker(void)
+{
+  struct proc *p = myproc();
+  struct urwork *w;
+  int id, res, write;
+
+  acquire(&ur.lock);
+  id = ur.nworker++;
+  ur.worker[id] = p;
+  for(;;){
+    while((w = ur.head) == 0)
+      sleep(&ur.head, &ur.lock);
+    if((ur.head = w->next) == 0)
+      ur.tail = &ur.head;
+    // uringfree() kills us to cut short a wait on a pipe for
+    // a process going away, but only while we act for it.
+    ur.busy[id] = w->mm;
+    p->killed = 0;
+    p->mm = w->mm;
+    release(&ur.lock);
+
+    // a thread of the process may hold its vmlock, which
+    // comes before the inode lock the I/O takes, so fault
+    // the buffer in first, as a thread would.
+    write = w->e.op == UR_READ || w->e.op == UR_PREAD;
+    if(w->e.len > 0)
+      uvmprefault(w->e.addr, w->e.len, write);
+    res = uringio(w->f, &w->e);
+    fileclose(w->f);
+    p->mm = p;
+
+    acquire(&ur.lock);
+    ur.busy[id] = 0;
+    post(w->mm, w->e.data, res);
+    w->next = ur.free;
+    ur.free = w;
+  }
+}
+
+// Free process p's ring, for exit() and exec(), once its
+// requests are done: those not yet begun fail, and those that
+// are waiting on a pipe are cut short. p's other threads must
+// have exited.
+void
+uringfree(struct proc *p)
+{
+  struct urwork *w, **pp, *dead = 0;
+  int i;
+
+  if(p->uring == 0)
+    return;
+  acquire(&ur.lock);
+  for(pp = &ur.head; (w = *pp) != 0; ){
+    if(w->mm == p){
+      *pp = w->next;
+      w->next = dead;
+      dead = w;
+    } else {
+      pp = &w->next;
+    }
+  }
+  ur.tail = pp;
+  release(&ur.lock);
+  for(w = dead; w; w = w->next)
+    fileclose(w->f);
+
+  acquire(&ur.lock);
+  while((w = dead) != 0){
+    dead = w->next;
+    post(p, w->e.data, -1);
+    w->next = ur.free;
+    ur.free = w;
+  }
+  while(p->urpending > 0){
+    for(i = 0; i < ur.nworker; i++)
+      if(ur.busy[i] == p)
+        kill(ur.worker[i]->pid);
+    sleep(&p->uring, &ur.lock);
+  }
+  release(&ur.lock);
+  uvmunmap(p->pagetable, URING, 1, 1);
+  p->uring = 0;
+}
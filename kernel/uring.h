@@ -0,0 +1,49 @@
+// A ring of system call requests that a process shares with
+// the kernel, mapped at URING by uringsetup(). The program
+// fills in sq[sqtail % NURSQ] and advances sqtail; uringenter()
+// takes requests from sqhead on, and posts the result of each
+// in cq[cqtail % NURCQ]. The program takes completions from
+// cqhead on. The kernel doesn't post more completions than
+// there is room for, and leaves requests queued until there is.
+
+#define NURSQ 64   // request slots
+#define NURCQ 64   // completion slots
+
+// requests
+#define UR_NOP     0
+#define UR_READ    1   // read(fd, addr, len)
+#define UR_WRITE   2   // write(fd, addr, len)
+#define UR_PREAD   3   // pread(fd, addr, len, off)
+#define UR_PWRITE  4   // pwrite(fd, addr, len, off)
+#define UR_CLOSE   5   // close(fd)
+#define UR_FSYNC   6   // fsync(fd)
+#define UR_MSYNC   7   // msync(addr, len, off), off holding the flags
+#define UR_MUNMAP  8   // munmap(addr, len)
+
+// request flags
+#define URF_ASYNC  0x1 // a read or write may complete later
+
+struct ursqe {
+  short op;
+  short flags;
+  int fd;
+  uint64 addr;
+  int len;
+  int off;
+  uint64 data;     // handed back in the completion
+};
+
+struct urcqe {
+  uint64 data;     // the request's
+  int res;         // what the system call would have returned
+  int pad;
+};
+
+struct uring {
+  uint sqhead;     // written by the kernel
+  uint sqtail;     // written by the program
+  uint cqhead;     // written by the program
+  uint cqtail;     // written by the kernel
+  struct ursqe sq[NURSQ];
+  struct urcqe cq[NURCQ];
+};
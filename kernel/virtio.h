@@ -44,8 +44,12 @@
 #define VIRTIO_RING_F_EVENT_IDX     29
 
 // this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// must be a power of two, and small enough that the
+// descriptors and avail ring fit in the first page.
+#define NUM 64
+
+// most blocks in one request.
+#define MAXSEG 16
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -62,7 +66,7 @@ struct virtq_avail {
   uint16 flags; // always zero
   uint16 idx;   // driver will write ring[idx] next
   uint16 ring[NUM]; // descriptor numbers of chain heads
-  uint16 unused;
+  uint16 used_event; // with EVENT_IDX, interrupt once used idx passes this
 };
 
 // one entry in the "used" ring, with which the
@@ -76,6 +80,7 @@ struct virtq_used {
   uint16 flags; // always zero
   uint16 idx;   // device increments when it adds a ring[] entry
   struct virtq_used_elem ring[NUM];
+  uint16 avail_event; // with EVENT_IDX, notify once avail idx passes this
 };
 
 // these are specific to virtio block devices, e.g. disks,
@@ -16,10 +16,30 @@
 #include "fs.h"
 #include "buf.h"
 #include "virtio.h"
+#include "trace.h"
 
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
+// requests wait in a queue sorted by block number, and go to the
+// device a few at a time in elevator order, sweeping up the disk
+// from where the last one ended, unless one has waited past its
+// deadline, which goes first. a request that continues a queued
+// one is merged into it.
+#define NREQ        64  // requests that can wait in the queue
+#define QDEPTH       8  // requests given to the device at once
+#define SYNCEXPIRE   1  // ticks a request someone is waiting for may wait
+#define ASYNCEXPIRE 100 // ticks any other request may wait
+
+struct ioreq {
+  struct buf *b;      // first buf; the rest follow through b->ionext
+  struct buf *last;
+  int n;              // number of bufs
+  int write;
+  uint deadline;      // ticks by which it should go to the device
+  struct ioreq *next; // queue, or free list
+};
+
 static struct disk {
   // the virtio driver and device mostly communicate through a set of
   // structures in RAM. pages[] allocates that memory. pages[] is a
@@ -55,13 +75,21 @@ static struct disk {
 
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
+  int nfree;       // how many are
   uint16 used_idx; // we've looked this far in used[2..NUM].
 
+  // requests waiting for the device.
+  struct ioreq reqs[NREQ];
+  struct ioreq *freereq;
+  struct ioreq *queue;  // sorted by block number
+  uint head;            // block after the last request given to the device
+  int inflight;         // requests the device has
+
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b; // the first; the rest follow through b->ionext
     char status;
   } info[NUM];
 
@@ -70,6 +98,15 @@ static struct disk {
   struct virtio_blk_req ops[NUM];
   
   struct spinlock vdisk_lock;
+
+  int eventidx;   // negotiated VIRTIO_RING_F_EVENT_IDX?
+  uint16 notified; // avail->idx when we last notified the device
+
+  // counters, for procdump().
+  uint64 nreq;    // requests submitted
+  uint64 nintr;   // interrupts taken
+  uint64 npoll;   // requests completed by polling
+  uint64 nmerge;  // requests merged into queued ones
   
 } __attribute__ ((aligned (PGSIZE))) disk;
 
@@ -100,9 +137,9 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
   features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.eventidx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -136,6 +173,11 @@ virtio_disk_init(void)
   // all NUM descriptors start out unused.
   for(int i = 0; i < NUM; i++)
     disk.free[i] = 1;
+  disk.nfree = NUM;
+  for(int i = 0; i < NREQ; i++){
+    disk.reqs[i].next = disk.freereq;
+    disk.freereq = &disk.reqs[i];
+  }
 
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
@@ -147,6 +189,7 @@ alloc_desc()
   for(int i = 0; i < NUM; i++){
     if(disk.free[i]){
       disk.free[i] = 0;
+      disk.nfree--;
       return i;
     }
   }
@@ -166,7 +209,7 @@ free_desc(int i)
   disk.desc[i].flags = 0;
   disk.desc[i].next = 0;
   disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  disk.nfree++;
 }
 
 // free a chain of descriptors.
@@ -184,12 +227,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -200,27 +242,28 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// Give the device request r: read (write = 0) or write its
+// n bufs, which are consecutive blocks of the disk, chained
+// from r->b through ionext. There must be n + 2 free
+// descriptors. Caller must hold disk.vdisk_lock.
+static void
+submit(struct ioreq *r)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
+  uint64 sector = r->b->blockno * (BSIZE / 512);
+  int idx[MAXSEG+2];
+  int i, n = r->n, write = r->write;
+  struct buf *b;
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
-
-  // format the three descriptors.
+  // a descriptor for type/reserved/sector, then the data, then
+  // one for a 1-byte status result. the data may be split over
+  // as many descriptors as we like; each block gets its own.
+  if(alloc_descs(idx, n + 2) < 0)
+    panic("virtio submit");
+  if(tracemask & TR_DISK)
+    traceev(write ? TE_DISKWRITE : TE_DISKREAD, r->b->blockno, n);
+
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -237,24 +280,25 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(i = 0, b = r->b; i < n; i++, b = b->ionext){
+    disk.desc[idx[i+1]].addr = (uint64) b->data;
+    disk.desc[idx[i+1]].len = BSIZE;
+    if(write)
+      disk.desc[idx[i+1]].flags = 0; // device reads b->data
+    else
+      disk.desc[idx[i+1]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[idx[i+1]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i+1]].next = idx[i+2];
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // record the bufs for virtio_disk_intr().
+  disk.info[idx[0]].b = r->b;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -263,36 +307,178 @@ virtio_disk_rw(struct buf *b, int write)
 
   // tell the device another avail ring entry is available.
   disk.avail->idx += 1; // not % NUM ...
+  disk.nreq++;
+  disk.inflight++;
+}
+
+static int complete(void);
+
+// Tell the device about the requests submit() has added since
+// the last call, and ask for an interrupt once they are all
+// done. With EVENT_IDX, the device says (avail_event) when it
+// wants to be told, and interrupts only when the used ring
+// passes used_event, so a batch costs one notification and
+// one interrupt. Returns 1 if it found them already done and
+// completed them itself. Caller must hold disk.vdisk_lock.
+static int
+kick(void)
+{
+  uint16 old = disk.notified, new = disk.avail->idx;
+
+  if(old == new)
+    return 0;
+  disk.notified = new;
+  if(disk.eventidx)
+    disk.avail->used_event = new - 1;
 
   __sync_synchronize();
 
+  if(disk.eventidx && disk.used->idx == new){
+    // the device finished the lot before it could have seen
+    // used_event, so it won't interrupt for them.
+    complete();
+    return 1;
+  }
+  if(disk.eventidx && (uint16)(new - disk.used->avail_event - 1) >= (uint16)(new - old))
+    return 0;   // the device is still working through the ring
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  return 0;
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+// Return the queued request to give the device next: the one
+// longest past its deadline if any is, else the first at or
+// after the head, going round to the lowest block at the top.
+// Caller must hold disk.vdisk_lock.
+static struct ioreq**
+pick(void)
+{
+  struct ioreq **pp, **best = 0;
+
+  for(pp = &disk.queue; *pp; pp = &(*pp)->next)
+    if((int)(ticks - (*pp)->deadline) >= 0 &&
+       (best == 0 || (int)((*pp)->deadline - (*best)->deadline) < 0))
+      best = pp;
+  if(best)
+    return best;
+  for(pp = &disk.queue; *pp; pp = &(*pp)->next)
+    if((*pp)->b->blockno >= disk.head)
+      return pp;
+  return &disk.queue;
+}
+
+// Give the device queued requests while it has fewer than
+// QDEPTH and there are descriptors for them, and tell it.
+// Caller must hold disk.vdisk_lock.
+static void
+dispatch(void)
+{
+  struct ioreq **pp, *r;
+
+  do {
+    while(disk.queue && disk.inflight < QDEPTH){
+      pp = pick();
+      r = *pp;
+      if(disk.nfree < r->n + 2)
+        break;
+      *pp = r->next;
+      submit(r);
+      disk.head = r->last->blockno + 1;
+      r->next = disk.freereq;
+      disk.freereq = r;
+      wakeup(&disk.freereq);
+    }
+  } while(kick());
+}
+
+// Queue a request for the n bufs chained from b through
+// ionext to last, consecutive blocks of the disk, to go to
+// the device within expire ticks. Merges it into a queued
+// request that ends just before it, if there's room.
+// Caller must hold disk.vdisk_lock.
+static void
+enqueue(struct buf *b, struct buf *last, int n, int write, int expire)
+{
+  struct ioreq *r, **pp, *prev = 0;
+  uint deadline = ticks + expire;
+
+  for(pp = &disk.queue; *pp && (*pp)->b->blockno <= b->blockno; pp = &(*pp)->next)
+    prev = *pp;
+  if(prev && prev->write == write && prev->last->blockno + 1 == b->blockno &&
+     prev->n + n <= MAXSEG){
+    prev->last->ionext = b;
+    prev->last = last;
+    prev->n += n;
+    if((int)(deadline - prev->deadline) < 0)
+      prev->deadline = deadline;
+    disk.nmerge++;
+    return;
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  while((r = disk.freereq) == 0){
+    dispatch();
+    sleep(&disk.freereq, &disk.vdisk_lock);
+  }
+  disk.freereq = r->next;
+  r->b = b;
+  r->last = last;
+  r->n = n;
+  r->write = write;
+  r->deadline = deadline;
+  // the queue may have changed while we slept.
+  for(pp = &disk.queue; *pp && (*pp)->b->blockno <= b->blockno; pp = &(*pp)->next)
+    ;
+  r->next = *pp;
+  *pp = r;
+}
 
+// Queue the blocks of the n bufs at bs as few requests as
+// possible, each run of consecutive blocks up to MAXSEG long
+// as one, and start the device on what it can take.
+static void
+queue(struct buf **bs, int n, int write, int expire)
+{
+  int i, j, k;
+
+  acquire(&disk.vdisk_lock);
+  for(i = 0; i < n; i = j){
+    for(j = i + 1; j < n && j - i < MAXSEG; j++)
+      if(bs[j]->dev != bs[i]->dev || bs[j]->blockno != bs[j-1]->blockno + 1)
+        break;
+    for(k = i; k < j; k++){
+      bs[k]->disk = 1;
+      bs[k]->ionext = k + 1 < j ? bs[k+1] : 0;
+    }
+    enqueue(bs[i], bs[j-1], j - i, write, expire);
+  }
+  dispatch();
   release(&disk.vdisk_lock);
 }
 
+// Start reading or writing the blocks of the n bufs at bs,
+// and return without waiting unless the queue is full. When
+// the disk is done, virtio_disk_intr() clears each buf's disk
+// flag, calls its iodone if set, and wakes up virtio_disk_wait()
+// on it. The bufs must stay put until then.
 void
-virtio_disk_intr()
+virtio_disk_submitv(struct buf **bs, int n, int write)
 {
-  acquire(&disk.vdisk_lock);
+  queue(bs, n, write, ASYNCEXPIRE);
+}
 
-  // the device won't raise another interrupt until we tell it
-  // we've seen this interrupt, which the following line does.
-  // this may race with the device writing new entries to
-  // the "used" ring, in which case we may process the new
-  // completion entries in this interrupt, and have nothing to do
-  // in the next interrupt, which is harmless.
-  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+// Start reading (write = 0) or writing b's block, and return
+// without waiting unless the queue is full.
+void
+virtio_disk_submit(struct buf *b, int write)
+{
+  virtio_disk_submitv(&b, 1, write);
+}
 
-  __sync_synchronize();
+// Complete the requests the device has finished.
+// Returns how many. Caller must hold disk.vdisk_lock.
+static int
+complete(void)
+{
+  int n = 0;
 
   // the device increments disk.used->idx when it
   // adds an entry to the used ring.
@@ -304,12 +490,97 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    struct buf *b = disk.info[id].b, *nb;
+    uint first = b->blockno;
+    int nblk = 0;
+    disk.info[id].b = 0;
+    free_chain(id);
+    disk.inflight--;
+    for(; b; b = nb){
+      nb = b->ionext;
+      nblk++;
+      b->ionext = 0;
+      b->disk = 0;   // disk is done with buf
+      if(b->iodone)
+        b->iodone(b);
+      wakeup(b);
+    }
+    if(tracemask & TR_DISK)
+      traceev(TE_DISKDONE, first, nblk);
 
     disk.used_idx += 1;
+    n++;
+  }
+  return n;
+}
+
+// Wait for b's request to finish.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  while(b->disk == 1) {
+    sleep(b, &disk.vdisk_lock);
+  }
+  release(&disk.vdisk_lock);
+}
+
+// Wait for b's request to finish by watching the used ring
+// rather than sleeping until the interrupt, which saves a
+// trip through the scheduler for a reader that can do
+// nothing else meanwhile.
+static void
+poll(struct buf *b)
+{
+  for(;;){
+    acquire(&disk.vdisk_lock);
+    disk.npoll += complete();
+    dispatch();
+    if(b->disk == 0){
+      release(&disk.vdisk_lock);
+      return;
+    }
+    release(&disk.vdisk_lock);
   }
+}
+
+// Read or write b's block and wait for it. Someone is waiting,
+// so it goes to the device ahead of requests that aren't urgent.
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  queue(&b, 1, write, SYNCEXPIRE);
+  if(DISKPOLL && !write)
+    poll(b);
+  else
+    virtio_disk_wait(b);
+}
+
+void
+virtio_disk_intr()
+{
+  acquire(&disk.vdisk_lock);
+  disk.nintr++;
+
+  // the device won't raise another interrupt until we tell it
+  // we've seen this interrupt, which the following line does.
+  // this may race with the device writing new entries to
+  // the "used" ring, in which case we may process the new
+  // completion entries in this interrupt, and have nothing to do
+  // in the next interrupt, which is harmless.
+  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+
+  __sync_synchronize();
+
+  complete();
+  dispatch();
 
   release(&disk.vdisk_lock);
 }
+
+void
+virtio_disk_stats(void)
+{
+  printf("disk: %d requests, %d interrupts, %d polled, %d merged\n",
+         (int)disk.nreq, (int)disk.nintr, (int)disk.npoll, (int)disk.nmerge);
+}
@@ -3,6 +3,9 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -11,6 +14,29 @@
  */
 pagetable_t kernel_pagetable;
 
+static pte_t *walkto(pagetable_t, uint64, int, int*);
+
+// User page tables run with address-space IDs, so the TLB can
+// keep their entries, and the kernel's (ASID 0), across traps
+// and context switches. ASIDs are handed out in generations:
+// when they run out, a new generation starts, each hart
+// flushes its whole TLB before running a process of the new
+// generation, and processes get fresh ASIDs as they next run.
+int nasid; // ASIDs the hardware has; fewer than 2 means none.
+
+struct {
+  struct spinlock lock;
+  int next;
+  uint64 gen;
+} asids;
+
+// past this many pages, flush a whole ASID rather than each page.
+#define TLBPAGES 32
+
+// uvmunmap() frees pages this many at a time, once no TLB
+// can reach them.
+#define UNMAPBATCH 32
+
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
@@ -33,6 +59,9 @@ kvmmake(void)
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
+  // CLINT, to wake other CPUs and set timers
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
@@ -54,6 +83,9 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  initlock(&asids.lock, "asid");
+  asids.next = 1;
+  asids.gen = 1;
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -61,10 +93,117 @@ kvminit(void)
 void
 kvminithart()
 {
+  // the ASID bits the hardware implements read back as ones.
+  w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID(0xffff));
+  nasid = SATP_GETASID(r_satp()) + 1;
   w_satp(MAKE_SATP(kernel_pagetable));
   sfence_vma();
 }
 
+// Return the ASID p should run with on this hart, flushing
+// anything the hart's TLB holds under it that p must not see.
+// Called by usertrapret() with interrupts off.
+int
+uvmasid(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 bit = 1L << cpuid();
+
+  if(nasid < 2)
+    return 0;
+  if(p->mm->asidgen != c->asidgen){
+    acquire(&asids.lock);
+    if(p->mm->asidgen != asids.gen){
+      if(asids.next >= nasid){
+        asids.gen++;
+        asids.next = 1;
+      }
+      // no hart in this generation has used the new ASID.
+      p->mm->asid = asids.next++;
+      p->mm->asidgen = asids.gen;
+      p->mm->tlbstale = 0;
+    }
+    if(c->asidgen != asids.gen){
+      // entries from the last generation could collide.
+      sfence_vma();
+      c->asidgen = asids.gen;
+    }
+    release(&asids.lock);
+  }
+  // threads of p's process on other harts may mark this one
+  // stale meanwhile, so clear the bit before flushing.
+  if(__atomic_fetch_and(&p->mm->tlbstale, ~bit, __ATOMIC_SEQ_CST) & bit)
+    sfence_vma_asid(p->mm->asid);
+  return p->mm->asid;
+}
+
+// The PTEs for npages pages starting at va in pagetable have
+// changed or gone away; see that no TLB uses the old ones.
+// Only the current process's page table can be in a TLB
+// (exec and freeproc() retire a page table's ASID with it),
+// so flush this hart now, and the others the next time the
+// process returns to user space on them. Harts running it now
+// are interrupted to flush, and waited for, so
+// that the caller may free or share the old pages once this
+// returns: a copy to or from them that such a hart is making
+// in the kernel has finished too, see copypa().
+void
+uvmstale(pagetable_t pagetable, uint64 va, uint64 npages)
+{
+  struct proc *p = myproc(), *q;
+  uint want[NCPU];
+  uint64 a, harts = 0;
+  int i;
+
+  if(p == 0 || p->mm->pagetable != pagetable)
+    return;
+  push_off();
+  // without ASIDs, entering the kernel flushed this hart.
+  if(nasid >= 2 && p->mm->asidgen != 0){
+    if(npages > TLBPAGES){
+      sfence_vma_asid(p->mm->asid);
+    } else {
+      for(a = PGROUNDDOWN(va); a < va + npages*PGSIZE; a += PGSIZE)
+        sfence_vma_page(a, p->mm->asid);
+    }
+    __atomic_fetch_or(&p->mm->tlbstale, ~(1L << cpuid()), __ATOMIC_SEQ_CST);
+  }
+  // the caller may be a uring worker acting for a process
+  // with just one thread, so look for any hart running it.
+  for(i = 0; i < NCPU; i++){
+    q = __atomic_load_n(&cpus[i].proc, __ATOMIC_SEQ_CST);
+    if(i == cpuid() || q == 0 || q->mm != p->mm)
+      continue;
+    want[i] = __atomic_add_fetch(&cpus[i].tlbreq, 1, __ATOMIC_SEQ_CST);
+    harts |= 1L << i;
+    ipi(i);
+  }
+  for(i = 0; i < NCPU; i++){
+    if((harts & (1L << i)) == 0)
+      continue;
+    // the hart may be waiting for this one to flush.
+    while((int)(__atomic_load_n(&cpus[i].tlback, __ATOMIC_ACQUIRE) - want[i]) < 0)
+      tlbpoll();
+  }
+  pop_off();
+}
+
+// Flush this hart's TLB if uvmstale() on another hart asked.
+// Called on an interrupt from another hart, and by code that
+// spins with interrupts off, so that two harts can't wait on
+// each other.
+void
+tlbpoll(void)
+{
+  struct cpu *c = mycpu();
+  uint req = __atomic_load_n(&c->tlbreq, __ATOMIC_ACQUIRE);
+
+  if(req != c->tlback){
+    sfence_vma();
+    __atomic_store_n(&c->tlback, req, __ATOMIC_RELEASE);
+  }
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -77,24 +216,42 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A leaf PTE can also sit in a level-1 page-table page, mapping
+// a 2-megabyte megapage; walk() returns that PTE for any va in
+// the megapage.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  int level = 0;
+
+  return walkto(pagetable, va, alloc, &level);
+}
+
+// Like walk(), but stop at the PTE in the *level page-table
+// page, or at a leaf PTE further up. Sets *level to the level
+// of the returned PTE.
+static pte_t *
+walkto(pagetable_t pagetable, uint64 va, int alloc, int *level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > *level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(*pte & (PTE_R|PTE_W|PTE_X)){
+        *level = l;
+        return pte;
+      }
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(*level, va)];
 }
 
 // Look up a virtual address, return the physical address,
@@ -105,11 +262,12 @@ walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level = 0;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walkto(pagetable, va, 0, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
@@ -117,6 +275,8 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if(level == 1)
+    pa += PGROUNDDOWN(va) & (MEGAPGSIZE-1);
   return pa;
 }
 
@@ -132,13 +292,16 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. Parts of the range that cover a whole aligned
+// 2-megabyte block, with nothing mapped in it yet, get a single
+// megapage PTE. Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
   uint64 a, last;
   pte_t *pte;
+  int level;
 
   if(size == 0)
     panic("mappages: size");
@@ -146,6 +309,19 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
+    if(a % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 && last - a >= MEGAPGSIZE - PGSIZE){
+      level = 1;
+      if((pte = walkto(pagetable, a, 1, &level)) == 0)
+        return -1;
+      if(level == 1 && *pte == 0){
+        *pte = PA2PTE(pa) | perm | PTE_V;
+        if(a + MEGAPGSIZE - PGSIZE == last)
+          break;
+        a += MEGAPGSIZE;
+        pa += MEGAPGSIZE;
+        continue;
+      }
+    }
     if((pte = walk(pagetable, a, 1)) == 0)
       return -1;
     if(*pte & PTE_V)
@@ -156,35 +332,188 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
     a += PGSIZE;
     pa += PGSIZE;
   }
+  // the hardware may remember that the pages weren't there.
+  uvmstale(pagetable, va, (last - PGROUNDDOWN(va)) / PGSIZE + 1);
   return 0;
 }
 
+// Flush [va, end) of pagetable from every TLB, then free
+// the n unmapped pages in pas; a megapage's has bit 0 set.
+static void
+unmapfree(pagetable_t pagetable, uint64 va, uint64 end, uint64 *pas, int n)
+{
+  int i;
+
+  if(va < end)
+    uvmstale(pagetable, va, (end - va) / PGSIZE);
+  for(i = 0; i < n; i++){
+    if(pas[i] & 1)
+      kfreemega((void*)(pas[i] & ~1L));
+    else
+      kfree((void*)pas[i]);
+  }
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Missing mappings are skipped, since
+// mapped files (see sys_mmap()) leave holes of pages
+// that were never faulted in, and so does lazy sbrk().
+// Megapages in the range must lie wholly inside it;
+// see uvmsplit().
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, pa, end, start, pas[UNMAPBATCH];
   pte_t *pte;
+  int level, n = 0;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+  end = va + npages*PGSIZE;
+  start = va;
+  for(a = va; a < end; a += PGSIZE){
+    level = 0;
+    if((pte = walkto(pagetable, a, 0, &level)) == 0)
+      continue;
     if((*pte & PTE_V) == 0)
       continue;
-      //panic("uvmunmap: not mapped");
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
-    if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+    pa = PTE2PA(*pte);
+    if(level == 1){
+      if(a % MEGAPGSIZE != 0 || a + MEGAPGSIZE > end)
+        panic("uvmunmap: part of a megapage");
+      pa |= 1;
+      a += MEGAPGSIZE - PGSIZE;
     }
     *pte = 0;
+    // another thread's TLB may still hold the page.
+    if(do_free)
+      pas[n++] = pa;
+    if(n == UNMAPBATCH){
+      unmapfree(pagetable, start, a + PGSIZE, pas, n);
+      start = a + PGSIZE;
+      n = 0;
+    }
+  }
+  unmapfree(pagetable, start, end, pas, n);
+}
+
+// Turn megapage PTE pte into a page-table page of 512 ordinary
+// PTEs for the same memory. A megapage holds a reference to each
+// of its pages, so the new PTEs just take those over.
+// Returns 0 on success, -1 if out of memory.
+static int
+splitmega(pte_t *pte)
+{
+  pagetable_t pt;
+  uint64 pa;
+  int i;
+
+  if((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  for(i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | PTE_FLAGS(*pte);
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
+}
+
+// If va lies inside, but not at the start of, a megapage,
+// split the megapage into ordinary pages, so that the range
+// starting (or ending) at va can be unmapped.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  int level = 1;
+
+  if(va >= MAXVA || va % MEGAPGSIZE == 0)
+    return 0;
+  pte = walkto(pagetable, va, 0, &level);
+  if(pte == 0 || level != 1 || (*pte & PTE_V) == 0 || PTE_FLAGS(*pte) == PTE_V)
+    return 0;
+  return splitmega(pte);
+}
+
+// Move the mappings of the npages pages at from to the same
+// number of pages at to, where nothing may be mapped, without
+// copying the pages. A megapage moves whole if it lines up at
+// to, and is split otherwise. Returns 0 on success, or -1 if
+// out of memory, in which case nothing has moved.
+int
+uvmmove(pagetable_t pagetable, uint64 from, uint64 to, uint64 npages)
+{
+  uint64 a, end = from + npages*PGSIZE;
+  pte_t *pte, *npte;
+  int level, nlevel, pass;
+
+  if(from % PGSIZE != 0 || to % PGSIZE != 0)
+    panic("uvmmove: not aligned");
+
+  // the first pass splits and makes the page-table pages at
+  // to; the second, which can't fail, moves the PTEs.
+  for(pass = 0; pass < 2; pass++){
+    for(a = from; a < end; a += PGSIZE){
+      level = 0;
+      if((pte = walkto(pagetable, a, 0, &level)) == 0 || (*pte & PTE_V) == 0)
+        continue;
+      if(level == 1){
+        nlevel = 1;
+        npte = 0;
+        if(a % MEGAPGSIZE == 0 && a + MEGAPGSIZE <= end && (to - from) % MEGAPGSIZE == 0)
+          npte = walkto(pagetable, to + (a - from), 1, &nlevel);
+        if(npte == 0 || nlevel != 1 || *npte != 0){
+          if(pass == 1)
+            panic("uvmmove: split");
+          if(splitmega(pte) < 0)
+            return -1;
+          pte = walk(pagetable, a, 0);
+          level = 0;
+        }
+      }
+      if(level == 0 && (npte = walk(pagetable, to + (a - from), 1)) == 0)
+        return -1;
+      if(*npte & PTE_V)
+        panic("uvmmove: remap");
+      if(pass == 1){
+        *npte = *pte;
+        *pte = 0;
+      }
+      if(level == 1)
+        a += MEGAPGSIZE - PGSIZE;
+    }
   }
+  uvmstale(pagetable, from, npages);
+  uvmstale(pagetable, to, npages);
+  return 0;
+}
+
+// Back the whole 2-megabyte block containing va with a zeroed
+// megapage, if nothing in the block is mapped yet and there is
+// physically contiguous memory for it.
+// Returns 0 on success, -1 if not.
+int
+uvmmega(pagetable_t pagetable, uint64 va, int perm)
+{
+  pte_t *pte;
+  char *mem;
+  int level = 1;
+
+  va = MEGAPGROUNDDOWN(va);
+  if((pte = walkto(pagetable, va, 0, &level)) != 0 && *pte != 0)
+    return -1;
+  if((mem = kallocmega()) == 0)
+    return -1;
+  memset(mem, 0, MEGAPGSIZE);
+  if(mappages(pagetable, va, MEGAPGSIZE, (uint64)mem, perm) != 0){
+    kfreemega(mem);
+    return -1;
+  }
+  return 0;
 }
 
 // create an empty user page table.
@@ -193,10 +522,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -229,12 +557,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -292,43 +619,177 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
-// returns 0 on success, -1 on failure.
-// frees any allocated pages on failure.
-int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+// Return how many pages of [start, end) are present
+// in pagetable.
+uint64
+uvmresident(pagetable_t pagetable, uint64 start, uint64 end)
+{
+  uint64 a, top, n = 0;
+  pte_t *pte;
+  int level;
+
+  for(a = PGROUNDDOWN(start); a < end; a += PGSIZE){
+    level = 0;
+    if((pte = walkto(pagetable, a, 0, &level)) == 0){
+      // no page-table page: skip the rest of its 2 megabytes.
+      a = MEGAPGROUNDUP(a + 1) - PGSIZE;
+      continue;
+    }
+    if((*pte & PTE_V) == 0)
+      continue;
+    if(level == 1){
+      // the rest of the megapage, up to end.
+      top = MEGAPGROUNDDOWN(a) + MEGAPGSIZE;
+      if(top > end)
+        top = PGROUNDUP(end);
+      n += (top - a) / PGSIZE;
+      a = top - PGSIZE;
+    } else {
+      n++;
+    }
+  }
+  return n;
+}
+
+// Map the pages of old in [start, end) into new as well, with
+// a reference each, copy-on-write if cow is set. Megapages stay
+// megapages. returns 0 on success, -1 on failure.
+// unmaps any shared pages on failure.
+static int
+uvmdup(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int cow)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
+  int level, j;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+  for(i = start; i < end; i += PGSIZE){
+    level = 0;
+    if((pte = walkto(old, i, 0, &level)) == 0)
+      continue;
     if((*pte & PTE_V) == 0)
       continue;
-      //panic("uvmcopy: page not present");
+    if(cow && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
+    if(level == 1){
+      if(mappages(new, i, MEGAPGSIZE, pa, flags) != 0)
+        goto err;
+      for(j = 0; j < 512; j++)
+        kdup((void*)(pa + j*PGSIZE));
+      i += MEGAPGSIZE - PGSIZE;
+      continue;
     }
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
+      goto err;
+    kdup((void*)pa);
   }
+  if(cow)
+    uvmstale(old, start, (end - start) / PGSIZE);
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  if(cow)
+    uvmstale(old, start, (end - start) / PGSIZE);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// Given a parent process's page table, share its memory
+// in [start, end) with a child's page table, copy-on-write:
+// writable pages become read-only and PTE_COW in both page
+// tables, and are copied by cowfault() on the first store.
+// returns 0 on success, -1 on failure.
+// unmaps any shared pages on failure.
+int
+uvmcopy(pagetable_t old, pagetable_t new, uint64 start, uint64 end)
+{
+  return uvmdup(old, new, start, end, 1);
+}
+
+// Like uvmcopy(), but for memory that stays shared:
+// both page tables map the same pages, still writable.
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 start, uint64 end)
+{
+  return uvmdup(old, new, start, end, 0);
+}
+
+// Handle a store to va, if it's a copy-on-write page:
+// give the page table a private, writable copy of the page,
+// or just make the page writable if no one else shares it.
+// Returns 0 on success, -1 if va isn't copy-on-write, or -2
+// if out of memory.
+int
+cowfault(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+  int level = 0;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walkto(pagetable, va, 0, &level);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  // copy just the page that's stored to.
+  if(level == 1){
+    if(splitmega(pte) < 0)
+      return -2;
+    pte = walk(pagetable, va, 0);
+  }
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W | PTE_D;
+
+  if(krefcnt((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    uvmstale(pagetable, va, 1);
+    return 0;
+  }
+  if((mem = kalloc()) == 0)
+    return -2;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  uvmstale(pagetable, va, 1);
+  kfree((void*)pa);
+  return 0;
+}
+
+// growproc() only reserves address space, and exec() only notes
+// where the program goes, so give the current process a page for
+// address va on first touch: a page of the program file, see
+// execfault(), or else a zeroed page.
+// pagetable must be the current process's.
+// Returns 0 on success, -1 if va isn't an unallocated heap page,
+// or -2 if out of memory or page-cache slots.
+int
+lazyalloc(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  char *mem;
+  int r;
+
+  if(p == 0 || pagetable != p->mm->pagetable || va >= p->mm->sz)
+    return -1;
+  va = PGROUNDDOWN(va);
+  // the stack guard page is present, just not PTE_U.
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V))
+    return -1;
+  if((r = execfault(p, va)) <= 0)
+    return r < 0 ? -2 : 0;
+  if((mem = kalloc_zeroed()) == 0)
+    return -2;
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return -2;
+  }
+  return 0;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -342,23 +803,182 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Fault in page va0 of pagetable for a copy to (write = 1) or
+// from user memory: a heap or text page on first touch, or a
+// private copy of a copy-on-write page. If pagetable is the
+// current process's, hold its vmlock, so as not to race with
+// faults taken by its other threads.
+// Returns 0 on success, -1 if va0 can't be faulted in.
+static int
+copyfault(pagetable_t pagetable, uint64 va0, int write)
+{
+  struct proc *p = myproc();
+  struct sleeplock *lk = 0;
+  pte_t *pte;
+  int r = 0, held;
+
+  // waiting for vmlock, or reading the program file, may
+  // sleep, which a copy made holding a spinlock can't; its
+  // caller uses uvmfault() once it has released the lock.
+  push_off();
+  held = mycpu()->noff > 1;
+  pop_off();
+  if(held)
+    return -1;
+  // a system call that changes the address space holds it.
+  if(p && p->mm->pagetable == pagetable && !holdingsleep(&p->mm->vmlock)){
+    lk = &p->mm->vmlock;
+    acquiresleep(lk);
+  }
+  if(walkaddr(pagetable, va0) == 0 && lazyalloc(pagetable, va0) < 0)
+    r = -1;
+  else if(write && (pte = walk(pagetable, va0, 0)) != 0 && (*pte & PTE_COW) &&
+          cowfault(pagetable, va0) < 0)
+    r = -1;
+  if(lk)
+    releasesleep(lk);
+  return r;
+}
+
+// Fault in the pages of pagetable's [va, va+len) for a copy
+// to (write = 1) or from them, as copyout() or copyin() would.
+// A copy made holding a spinlock can't fault, since faulting
+// may sleep, and fails instead; its caller releases the lock,
+// calls this, and tries again.
+// Returns 0 on success, -1 if a page can't be faulted in.
+int
+uvmfault(pagetable_t pagetable, uint64 va, uint64 len, int write)
+{
+  uint64 a;
+
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE)
+    if(a >= MAXVA || copyfault(pagetable, a, write) < 0)
+      return -1;
+  return 0;
+}
+
+// Fault in the pages of the current process's [va, va+len)
+// for a copy to (write = 1) or from them made while holding
+// an inode lock. copyfault() would take the process's vmlock,
+// which comes before inode locks, so with threads, which may
+// hold vmlock meanwhile, or in a uring worker acting for the
+// process, fault first.
+void
+uvmprefault(uint64 va, uint64 len, int write)
+{
+  struct proc *p = myproc();
+  uint64 a;
+
+  if(p->mm == p && p->nthread < 2)
+    return;
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE)
+    if(uvmpa(p->mm->pagetable, a, write) == 0)
+      break;
+}
+
+// Where a copy to or from user memory has got to: the PTE
+// of the page it last used, so that the next page's can
+// usually be found beside it rather than by another walk.
+struct ucursor {
+  uint64 va;     // the page
+  pte_t *pte;    // its PTE, or 0 if none yet
+  int level;     // of pte
+};
+
+// The PTE of user page va0 for a copy to (write = 1) or from
+// it, if one can be had without faulting, and the page may be
+// written if it's a copy to it; else 0. A copy
+// moving on to the next page in the same page-table page, or
+// the same megapage, takes the PTE from c, without a walk.
+static pte_t*
+copypte(pagetable_t pagetable, uint64 va0, int write, struct ucursor *c)
+{
+  pte_t *pte = 0;
+  int level = 0;
+
+  if(c->pte && va0 == c->va + PGSIZE){
+    if(c->level == 0 && PX(0, va0) != 0)
+      pte = c->pte + 1;
+    else if(c->level == 1 && MEGAPGROUNDDOWN(va0) == MEGAPGROUNDDOWN(c->va)){
+      pte = c->pte;
+      level = 1;
+    }
+  }
+  if(pte == 0 && (pte = walkto(pagetable, va0, 0, &level)) == 0)
+    return 0;
+  if((*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+    return 0;
+  if(write){
+    // break copy-on-write sharing before storing.
+    if(*pte & PTE_COW)
+      return 0;
+    if((*pte & PTE_W) == 0)
+      return 0;
+    // the store doesn't go through the PTE, so mark it dirty,
+    // for writeback of a shared mapping to see.
+    if((*pte & PTE_D) == 0)
+      __atomic_fetch_or(pte, PTE_A|PTE_D, __ATOMIC_SEQ_CST);
+  }
+  c->va = va0;
+  c->pte = pte;
+  c->level = level;
+  return pte;
+}
+
+// Return the physical address of user page va0 for a copy to
+// (write = 1) or from it, faulting the page in if need be, or
+// 0 if it can't be had.
+// Another thread of the process may unmap the page at any time,
+// but frees it only once uvmstale() has heard from every hart
+// running the process, which this one can't answer with
+// interrupts off. So the caller must have called push_off(),
+// and may use the page until it calls pop_off(). Interrupts
+// are turned back on while faulting.
+static uint64
+copypa(pagetable_t pagetable, uint64 va0, int write, struct ucursor *c)
+{
+  pte_t *pte;
+  uint64 pa;
+  int r;
+
+  if(va0 >= MAXVA)
+    return 0;
+  if((pte = copypte(pagetable, va0, write, c)) == 0){
+    // the fault may change the page table under c.
+    c->pte = 0;
+    pop_off();
+    r = copyfault(pagetable, va0, write);
+    push_off();
+    if(r < 0 || (pte = copypte(pagetable, va0, write, c)) == 0)
+      return 0;
+  }
+  pa = PTE2PA(*pte);
+  if(c->level == 1)
+    pa += va0 & (MEGAPGSIZE-1);
+  return pa;
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
+  struct ucursor c = { 0 };
   uint64 n, va0, pa0;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    push_off();
+    if((pa0 = copypa(pagetable, va0, 1, &c)) == 0){
+      pop_off();
       return -1;
+    }
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
     memmove((void *)(pa0 + (dstva - va0)), src, n);
+    pop_off();
 
     len -= n;
     src += n;
@@ -367,23 +987,69 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   return 0;
 }
 
+// The physical address of user virtual address va, faulting
+// its page in as copyout() (write = 1) or copyin() would, with
+// a reference to the page taken if hold is set; see uvmpa()
+// and uvmhold().
+static uint64
+uvmpage(pagetable_t pagetable, uint64 va, int write, int hold)
+{
+  struct ucursor c = { 0 };
+  uint64 va0 = PGROUNDDOWN(va), pa0;
+
+  push_off();
+  pa0 = copypa(pagetable, va0, write, &c);
+  if(pa0 && hold)
+    kdup((void*)pa0);
+  pop_off();
+  if(pa0 == 0)
+    return 0;
+  return pa0 + (va - va0);
+}
+
+// Return the physical address of user virtual address va,
+// faulting its page in as copyout() (write = 1) or copyin()
+// would. Returns 0 on error, or if the page can't be written.
+// With threads, the page may be gone by the time the caller
+// looks; use uvmhold() to read or write it.
+uint64
+uvmpa(pagetable_t pagetable, uint64 va, int write)
+{
+  return uvmpage(pagetable, va, write, 0);
+}
+
+// Like uvmpa(), but take a reference to the page, so that it
+// stays the caller's to use even if another thread unmaps it,
+// until the caller kfree()s PGROUNDDOWN of the address: for
+// the disk to move data straight to or from user memory, say,
+// or for futex() to look at a word.
+uint64
+uvmhold(pagetable_t pagetable, uint64 va, int write)
+{
+  return uvmpage(pagetable, va, write, 1);
+}
+
 // Copy from user to kernel.
 // Copy len bytes to dst from virtual address srcva in a given page table.
 // Return 0 on success, -1 on error.
 int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
+  struct ucursor c = { 0 };
   uint64 n, va0, pa0;
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    push_off();
+    if((pa0 = copypa(pagetable, va0, 0, &c)) == 0){
+      pop_off();
       return -1;
+    }
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
     memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    pop_off();
 
     len -= n;
     dst += n;
@@ -392,6 +1058,30 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   return 0;
 }
 
+// The length of the string at s, or n if there is no '\0'
+// in its first n bytes. Looks at a word at a time once s is
+// aligned: a word has a zero byte if subtracting one from
+// each byte borrows into a byte whose top bit was clear.
+static uint64
+strnlen(const char *s, uint64 n)
+{
+  const char *p = s;
+  uint64 w;
+
+  for(; n > 0 && ((uint64)p & 7) != 0; n--, p++)
+    if(*p == '\0')
+      return p - s;
+  for(; n >= 8; n -= 8, p += 8){
+    w = *(uint64*)p;
+    if((w - 0x0101010101010101UL) & ~w & 0x8080808080808080UL)
+      break;
+  }
+  for(; n > 0; n--, p++)
+    if(*p == '\0')
+      break;
+  return p - s;
+}
+
 // Copy a null-terminated string from user to kernel.
 // Copy bytes to dst from virtual address srcva in a given page table,
 // until a '\0', or max.
@@ -399,38 +1089,34 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
-  int got_null = 0;
+  struct ucursor c = { 0 };
+  uint64 n, len, va0, pa0;
+  char *p;
 
-  while(got_null == 0 && max > 0){
+  while(max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    push_off();
+    if((pa0 = copypa(pagetable, va0, 0, &c)) == 0){
+      pop_off();
       return -1;
+    }
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
 
-    char *p = (char *) (pa0 + (srcva - va0));
-    while(n > 0){
-      if(*p == '\0'){
-        *dst = '\0';
-        got_null = 1;
-        break;
-      } else {
-        *dst = *p;
-      }
-      --n;
-      --max;
-      p++;
-      dst++;
+    p = (char *) (pa0 + (srcva - va0));
+    len = strnlen(p, n);
+    if(len < n){
+      memmove(dst, p, len + 1);
+      pop_off();
+      return 0;
     }
+    memmove(dst, p, n);
+    pop_off();
 
+    max -= n;
+    dst += n;
     srcva = va0 + PGSIZE;
   }
-  if(got_null){
-    return 0;
-  } else {
-    return -1;
-  }
+  return -1;
 }
@@ -0,0 +1,190 @@
+// Mapped regions.
+//
+// Each process keeps its mapped regions (see sys_mmap()) in
+// p->mm->vmas, an array of pointers sorted by address, so that the
+// region containing an address is found by binary search.
+// The array lives in a page allocated on first use.
+//
+// The struct vma records themselves come from a slab cache.
+// A process's regions are private to it, so they need no lock.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "slab.h"
+
+struct slabcache vmacache;
+
+void
+vmainit(void)
+{
+  slabinit(&vmacache, "vma", sizeof(struct vma));
+}
+
+// Allocate a zeroed region record.
+// Returns 0 if out of memory.
+struct vma*
+vmaalloc(void)
+{
+  struct vma *v;
+
+  if((v = slaballoc(&vmacache)) == 0)
+    return 0;
+  memset(v, 0, sizeof(*v));
+  return v;
+}
+
+void
+vmafree(struct vma *v)
+{
+  slabfree(&vmacache, v);
+}
+
+// Return the index of the first of p's regions
+// that ends above va, or p->mm->nvma if there is none.
+static int
+vmaindex(struct proc *p, uint64 va)
+{
+  int lo = 0, hi = p->mm->nvma, mid;
+
+  while(lo < hi){
+    mid = (lo + hi) / 2;
+    if(p->mm->vmas[mid]->addr + p->mm->vmas[mid]->len <= va)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Return the lowest of p's regions that ends above va, or 0.
+struct vma*
+vmanext(struct proc *p, uint64 va)
+{
+  int i = vmaindex(p, va);
+
+  return i < p->mm->nvma ? p->mm->vmas[i] : 0;
+}
+
+// Return p's region containing va, or 0.
+struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v = vmanext(p, va);
+
+  if(v && v->addr <= va)
+    return v;
+  return 0;
+}
+
+// Add region v, which must not overlap any of p's others.
+// Returns 0 on success, -1 if p has too many regions or
+// out of memory.
+int
+vmainsert(struct proc *p, struct vma *v)
+{
+  int i;
+
+  if(p->mm->vmas == 0 && (p->mm->vmas = (struct vma**)kalloc()) == 0)
+    return -1;
+  if(p->mm->nvma >= MAXVMA)
+    return -1;
+  i = vmaindex(p, v->addr);
+  memmove(&p->mm->vmas[i+1], &p->mm->vmas[i], (p->mm->nvma - i) * sizeof(struct vma*));
+  p->mm->vmas[i] = v;
+  p->mm->nvma++;
+  return 0;
+}
+
+// Take region v out of p's regions and free it.
+// Doesn't touch the region's pages or file.
+void
+vmaremove(struct proc *p, struct vma *v)
+{
+  int i = vmaindex(p, v->addr);
+
+  if(i >= p->mm->nvma || p->mm->vmas[i] != v)
+    panic("vmaremove");
+  p->mm->nvma--;
+  memmove(&p->mm->vmas[i], &p->mm->vmas[i+1], (p->mm->nvma - i) * sizeof(struct vma*));
+  vmafree(v);
+}
+
+// Move p's region v to start at addr, keeping p->mm->vmas sorted.
+// [addr, addr + v->len) must not overlap p's other regions.
+// Doesn't touch the region's pages.
+void
+vmamove(struct proc *p, struct vma *v, uint64 addr)
+{
+  int i = vmaindex(p, v->addr);
+
+  if(i >= p->mm->nvma || p->mm->vmas[i] != v)
+    panic("vmamove");
+  p->mm->nvma--;
+  memmove(&p->mm->vmas[i], &p->mm->vmas[i+1], (p->mm->nvma - i) * sizeof(struct vma*));
+  v->nextfault += addr - v->addr;
+  v->addr = addr;
+  i = vmaindex(p, addr);
+  memmove(&p->mm->vmas[i+1], &p->mm->vmas[i], (p->mm->nvma - i) * sizeof(struct vma*));
+  p->mm->vmas[i] = v;
+  p->mm->nvma++;
+}
+
+// Split p's region v at page-aligned address addr, which must
+// lie strictly inside v. v keeps [v->addr, addr); returns the
+// new region for the rest, or 0 if out of memory.
+struct vma*
+vmasplit(struct proc *p, struct vma *v, uint64 addr)
+{
+  struct vma *w;
+
+  if(addr <= v->addr || addr >= v->addr + v->len)
+    panic("vmasplit");
+  if((w = vmaalloc()) == 0)
+    return 0;
+  *w = *v;
+  w->addr = addr;
+  w->len = v->len - (addr - v->addr);
+  w->offset = v->offset + (addr - v->addr);
+  w->nextfault = addr;
+  w->window = 1;
+  v->len = addr - v->addr;
+  if(vmainsert(p, w) < 0){
+    v->len += w->len;
+    vmafree(w);
+    return 0;
+  }
+  if(w->f)
+    filedup(w->f);
+  return w;
+}
+
+// Give child np a copy of each of p's regions. The caller
+// takes the child's references to the mapped files.
+// Returns 0 on success, -1 if out of memory.
+int
+vmacopy(struct proc *p, struct proc *np)
+{
+  struct vma *w;
+  int i;
+
+  if(p->mm->nvma == 0)
+    return 0;
+  if(np->mm->vmas == 0 && (np->mm->vmas = (struct vma**)kalloc()) == 0)
+    return -1;
+  for(i = 0; i < p->mm->nvma; i++){
+    if((w = vmaalloc()) == 0){
+      while(np->mm->nvma > 0)
+        vmafree(np->mm->vmas[--np->mm->nvma]);
+      return -1;
+    }
+    *w = *p->mm->vmas[i];
+    np->mm->vmas[np->mm->nvma++] = w;
+  }
+  return 0;
+}
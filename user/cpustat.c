@@ -0,0 +1,25 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/cpustat.h"
+#include "user/user.h"
+
+// print how much of its time each CPU has spent idle.
+
+int
+main(int argc, char *argv[])
+{
+  struct cpustat cs[NCPU];
+  int i, n;
+
+  if((n = cpustat(cs, NCPU)) < 0){
+    fprintf(2, "cpustat: failed\n");
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    printf("cpu %d: up %d ms, idle %d ms (%d%%), %d wakeups\n", i,
+           (int)(cs[i].uptime / 10000), (int)(cs[i].idle / 10000),
+           cs[i].uptime ? (int)(cs[i].idle * 100 / cs[i].uptime) : 0,
+           (int)cs[i].nipi);
+  }
+  exit(0);
+}
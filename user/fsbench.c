@@ -0,0 +1,293 @@
+#include "kernel/param.h"
+#include "kernel/fcntl.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+// measure file system operations, each run by 1, 2, ... up to
+// nproc processes at once, each in a directory of its own.
+//   fsbench [nproc]
+// nproc is 4 by default. Each result is printed on a line of
+// its own as
+//   fsbench <test> <nproc> <ops> <ops/s> <us/op> <KB/s>
+// where ops counts all the processes' operations and the time
+// is from when they start together until the last finishes.
+// A clock tick is 10 ms, too coarse to time one operation, so
+// per-operation costs are in microseconds.
+
+#define NFILES   200       // files created, looked up, removed
+#define NLOOKUP  1000      // lookups among them
+#define SMALL    1024      // bytes in each small file
+#define CHUNK    (4*BSIZE) // bytes per large read or write
+#define LARGE    128       // chunks in the large file
+#define NRAND    256       // random-offset reads or writes
+#define MAXPROCS 8
+
+static char buf[CHUNK];
+
+static void
+fail(char *why)
+{
+  fprintf(2, "fsbench: %s failed\n", why);
+  exit(1);
+}
+
+// Set path to "fsb<id>/<prefix><i>".
+static void
+mkname(char *path, int id, char *prefix, int i)
+{
+  char *p = path;
+  int d;
+
+  *p++ = 'f'; *p++ = 's'; *p++ = 'b';
+  *p++ = '0' + id;
+  *p++ = '/';
+  while(*prefix)
+    *p++ = *prefix++;
+  for(d = 1000; d > 0; d /= 10)
+    *p++ = '0' + (i / d) % 10;
+  *p = 0;
+}
+
+// a number below n drawn from the sequence seeded by *seed.
+static int
+rnd(uint *seed, int n)
+{
+  *seed = *seed * 1103515245 + 12345;
+  return (*seed >> 8) % n;
+}
+
+static void
+create(int id)
+{
+  char path[32];
+  int i, fd;
+
+  for(i = 0; i < NFILES; i++){
+    mkname(path, id, "f", i);
+    if((fd = open(path, O_CREATE|O_RDWR)) < 0)
+      fail("create");
+    close(fd);
+  }
+}
+
+static void
+lookup(int id)
+{
+  char path[32];
+  struct stat st;
+  uint seed = id + 1;
+  int i;
+
+  for(i = 0; i < NLOOKUP; i++){
+    mkname(path, id, "f", rnd(&seed, NFILES));
+    if(stat(path, &st) < 0)
+      fail("lookup");
+  }
+}
+
+static void
+remove(int id)
+{
+  char path[32];
+  int i;
+
+  for(i = 0; i < NFILES; i++){
+    mkname(path, id, "f", i);
+    if(unlink(path) < 0)
+      fail("unlink");
+  }
+}
+
+static void
+smallwrite(int id)
+{
+  char path[32];
+  int i, fd;
+
+  for(i = 0; i < NFILES; i++){
+    mkname(path, id, "s", i);
+    if((fd = open(path, O_CREATE|O_RDWR)) < 0)
+      fail("create small");
+    if(write(fd, buf, SMALL) != SMALL)
+      fail("write small");
+    close(fd);
+  }
+}
+
+static void
+smallread(int id)
+{
+  char path[32];
+  int i, fd;
+
+  for(i = 0; i < NFILES; i++){
+    mkname(path, id, "s", i);
+    if((fd = open(path, O_RDONLY)) < 0)
+      fail("open small");
+    if(read(fd, buf, SMALL) != SMALL)
+      fail("read small");
+    close(fd);
+  }
+}
+
+static void
+largewrite(int id)
+{
+  char path[32];
+  int i, fd;
+
+  mkname(path, id, "large", 0);
+  if((fd = open(path, O_CREATE|O_RDWR)) < 0)
+    fail("create large");
+  for(i = 0; i < LARGE; i++)
+    if(write(fd, buf, CHUNK) != CHUNK)
+      fail("write large");
+  close(fd);
+}
+
+static void
+largeread(int id)
+{
+  char path[32];
+  int i, fd;
+
+  mkname(path, id, "large", 0);
+  if((fd = open(path, O_RDONLY)) < 0)
+    fail("open large");
+  for(i = 0; i < LARGE; i++)
+    if(read(fd, buf, CHUNK) != CHUNK)
+      fail("read large");
+  close(fd);
+}
+
+static void
+randio(int id, int wr)
+{
+  char path[32];
+  uint seed = id + 1;
+  int i, fd, off;
+
+  mkname(path, id, "large", 0);
+  if((fd = open(path, O_RDWR)) < 0)
+    fail("open large");
+  for(i = 0; i < NRAND; i++){
+    off = rnd(&seed, LARGE * CHUNK / BSIZE) * BSIZE;
+    if(wr){
+      if(pwrite(fd, buf, BSIZE, off) != BSIZE)
+        fail("pwrite");
+    } else if(pread(fd, buf, BSIZE, off) != BSIZE)
+      fail("pread");
+  }
+  close(fd);
+}
+
+static void randwrite(int id) { randio(id, 1); }
+static void randread(int id) { randio(id, 0); }
+
+// in the order they run, since each uses what the one
+// before it left.
+struct test {
+  char *name;
+  void (*fn)(int);
+  int ops;     // per process
+  int bytes;   // per operation, or 0
+} tests[] = {
+  { "create",     create,     NFILES,  0 },
+  { "lookup",     lookup,     NLOOKUP, 0 },
+  { "unlink",     remove,     NFILES,  0 },
+  { "smallwrite", smallwrite, NFILES,  SMALL },
+  { "smallread",  smallread,  NFILES,  SMALL },
+  { "largewrite", largewrite, LARGE,   CHUNK },
+  { "largeread",  largeread,  LARGE,   CHUNK },
+  { "randwrite",  randwrite,  NRAND,   BSIZE },
+  { "randread",   randread,   NRAND,   BSIZE },
+};
+
+// Run t in nproc processes at once, and print how it went.
+static void
+run(struct test *t, int nproc)
+{
+  int fds[2], i, pid, xstatus;
+  uint64 ns, ops;
+  char c;
+
+  if(pipe(fds) < 0)
+    fail("pipe");
+  for(i = 0; i < nproc; i++){
+    if((pid = fork()) < 0)
+      fail("fork");
+    if(pid == 0){
+      close(fds[1]);
+      // start together, when the parent closes the pipe.
+      read(fds[0], &c, 1);
+      t->fn(i);
+      exit(0);
+    }
+  }
+  close(fds[0]);
+  sleep(1);
+  ns = nanotime();
+  close(fds[1]);
+  for(i = 0; i < nproc; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  ns = nanotime() - ns;
+  if(ns == 0)
+    ns = 1;
+
+  ops = (uint64)t->ops * nproc;
+  printf("fsbench %s %d %d %d %d %d\n", t->name, nproc, (int)ops,
+         (int)(ops * 1000000000 / ns), (int)(ns / 1000 / ops),
+         (int)(ops * t->bytes * (1000000000 / 1024) / ns));
+}
+
+// Remove directory fsb<id> and whatever the tests left in it.
+static void
+cleanup(int id)
+{
+  char path[32];
+  int i;
+
+  for(i = 0; i < NFILES; i++){
+    mkname(path, id, "s", i);
+    unlink(path);
+  }
+  mkname(path, id, "large", 0);
+  unlink(path);
+  path[4] = 0;
+  if(unlink(path) < 0)
+    fail("unlink directory");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, maxproc = 4;
+  char dir[] = "fsb0";
+
+  if(argc > 1)
+    maxproc = atoi(argv[1]);
+  if(maxproc < 1 || maxproc > MAXPROCS){
+    fprintf(2, "usage: fsbench [nproc], nproc at most %d\n", MAXPROCS);
+    exit(1);
+  }
+  memset(buf, 'x', sizeof(buf));
+
+  printf("fsbench test nproc ops ops/s us/op KB/s\n");
+  for(n = 1; n <= maxproc; n *= 2){
+    for(i = 0; i < n; i++){
+      dir[3] = '0' + i;
+      if(mkdir(dir) < 0)
+        fail("mkdir");
+    }
+    for(i = 0; i < sizeof(tests)/sizeof(tests[0]); i++)
+      run(&tests[i], n);
+    for(i = 0; i < n; i++)
+      cleanup(i);
+  }
+  exit(0);
+}
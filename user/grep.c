@@ -1,36 +1,136 @@
 // Simple grep.  Only supports ^ . * $ operators.
+//
+// A file is mapped with mmap() and scanned in place; standard
+// input, or a file that can't be mapped, is read a buffer at a
+// time. Rather than try the pattern at every byte of every
+// line, grep looks for the longest run of plain characters
+// that any match must contain, with memchr() and memcmp(),
+// and runs the matcher only on the lines that have it.
 
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/fcntl.h"
 #include "user/user.h"
 
+#define MAP_FAILED ((char *) -1)
+
 char buf[1024];
-int match(char*, char*);
+char *lit;     // characters every match contains
+int nlit;      // how many of them; 0 if none
+int match(char*, char*, char*);
 
+// Set lit to the longest run of characters in re that match
+// only themselves: not '.', not followed by '*', and not a
+// '$' at the end.
 void
-grep(char *pattern, int fd)
+findlit(char *re)
 {
-  int n, m;
-  char *p, *q;
+  int n = 0;
 
-  m = 0;
-  while((n = read(fd, buf+m, sizeof(buf)-m-1)) > 0){
-    m += n;
-    buf[m] = '\0';
-    p = buf;
-    while((q = strchr(p, '\n')) != 0){
-      *q = 0;
-      if(match(pattern, p)){
-        *q = '\n';
-        write(1, p, q+1 - p);
+  nlit = 0;
+  if(re[0] == '^')
+    re++;
+  for(; *re; re++){
+    if(re[1] == '*'){
+      re++;   // c* may match nothing
+      n = 0;
+    } else if(re[0] == '.' || (re[0] == '$' && re[1] == '\0')){
+      n = 0;
+    } else if(++n > nlit){
+      nlit = n;
+      lit = re - n + 1;
+    }
+  }
+}
+
+// The first occurrence of lit in [p, end), or 0.
+char*
+findin(char *p, char *end)
+{
+  for(; end - p >= nlit; p++){
+    if((p = memchr(p, lit[0], end - p - nlit + 1)) == 0)
+      return 0;
+    if(memcmp(p, lit, nlit) == 0)
+      return p;
+  }
+  return 0;
+}
+
+// Print the lines in [p, end) that match pattern. Unless
+// last is set, a line not ended by '\n' may go on past end,
+// so is left alone. Returns where the lines left alone start.
+char*
+scan(char *pattern, char *p, char *end, int last)
+{
+  char *q, *eol;
+
+  while(p < end){
+    if(nlit > 0){
+      // skip to the line holding the next occurrence of lit.
+      if((q = findin(p, end)) == 0){
+        if(last)
+          return end;
+        for(q = end; q > p && q[-1] != '\n'; q--)
+          ;
+        return q;
       }
-      p = q+1;
+      eol = memchr(q, '\n', end - q);
+      while(q > p && q[-1] != '\n')
+        q--;
+      p = q;
+    } else {
+      eol = memchr(p, '\n', end - p);
     }
-    if(m > 0){
-      m -= p - buf;
-      memmove(buf, p, m);
+    if(eol == 0){
+      if(!last)
+        return p;
+      if(match(pattern, p, end)){
+        write(1, p, end - p);
+        write(1, "\n", 1);
+      }
+      return end;
     }
+    if(match(pattern, p, eol))
+      write(1, p, eol+1 - p);
+    p = eol+1;
   }
+  return p;
+}
+
+// grep fd by reading it into buf.
+void
+grepread(char *pattern, int fd)
+{
+  int n, m;
+  char *p;
+
+  m = 0;
+  while((n = read(fd, buf+m, sizeof(buf)-m)) > 0){
+    m += n;
+    p = scan(pattern, buf, buf+m, 0);
+    if(p == buf && m == sizeof(buf))
+      p = scan(pattern, buf, buf+m, 1);  // a line longer than buf
+    m -= p - buf;
+    memmove(buf, p, m);
+  }
+  if(m > 0)
+    scan(pattern, buf, buf+m, 1);
+}
+
+void
+grep(char *pattern, int fd)
+{
+  struct stat st;
+  char *p;
+
+  if(fstat(fd, &st) == 0 && st.type == T_FILE && st.size > 0 &&
+     (p = mmap(0, st.size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED){
+    madvise(p, st.size, MADV_SEQUENTIAL);
+    scan(pattern, p, p + st.size, 1);
+    munmap(p, st.size);
+    return;
+  }
+  grepread(pattern, fd);
 }
 
 int
@@ -44,6 +144,7 @@ main(int argc, char *argv[])
     exit(1);
   }
   pattern = argv[1];
+  findlit(pattern);
 
   if(argc <= 2){
     grep(pattern, 0);
@@ -62,44 +163,44 @@ main(int argc, char *argv[])
 }
 
 // Regexp matcher from Kernighan & Pike,
-// The Practice of Programming, Chapter 9.
+// The Practice of Programming, Chapter 9,
+// on the text in [text, end) rather than up to a '\0'.
 
-int matchhere(char*, char*);
-int matchstar(int, char*, char*);
+int matchhere(char*, char*, char*);
+int matchstar(int, char*, char*, char*);
 
 int
-match(char *re, char *text)
+match(char *re, char *text, char *end)
 {
   if(re[0] == '^')
-    return matchhere(re+1, text);
+    return matchhere(re+1, text, end);
   do{  // must look at empty string
-    if(matchhere(re, text))
+    if(matchhere(re, text, end))
       return 1;
-  }while(*text++ != '\0');
+  }while(text++ < end);
   return 0;
 }
 
 // matchhere: search for re at beginning of text
-int matchhere(char *re, char *text)
+int matchhere(char *re, char *text, char *end)
 {
   if(re[0] == '\0')
     return 1;
   if(re[1] == '*')
-    return matchstar(re[0], re+2, text);
+    return matchstar(re[0], re+2, text, end);
   if(re[0] == '$' && re[1] == '\0')
-    return *text == '\0';
-  if(*text!='\0' && (re[0]=='.' || re[0]==*text))
-    return matchhere(re+1, text+1);
+    return text == end;
+  if(text < end && (re[0]=='.' || re[0]==*text))
+    return matchhere(re+1, text+1, end);
   return 0;
 }
 
 // matchstar: search for c*re at beginning of text
-int matchstar(int c, char *re, char *text)
+int matchstar(int c, char *re, char *text, char *end)
 {
   do{  // a * matches zero or more instances
-    if(matchhere(re, text))
+    if(matchhere(re, text, end))
       return 1;
-  }while(*text!='\0' && (*text++==c || c=='.'));
+  }while(text < end && (*text++==c || c=='.'));
   return 0;
 }
-
@@ -0,0 +1,255 @@
+#include "kernel/param.h"
+#include "kernel/fcntl.h"
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+// measure what it costs to start processes, to talk between
+// them through pipes and futexes, and to switch between them.
+//   ipcbench
+// Each result is printed on a line of its own as
+//   ipcbench <test> <value> <unit>
+
+#define NELEM(x) (sizeof(x)/sizeof((x)[0]))
+
+#define NFORK    100      // forks timed in each fork test
+#define NRTT     1000     // round trips timed
+#define PIPEBYTES (4*1024*1024)
+#define NYIELD   1000     // yields by each process
+#define MAXPROCS 4
+
+static char buf[PGSIZE];
+static char *self;        // our own path, to exec
+
+static void
+report(char *test, uint64 value, char *unit)
+{
+  printf("ipcbench %s %d %s\n", test, (int)value, unit);
+}
+
+static void
+fail(char *why)
+{
+  fprintf(2, "ipcbench: %s failed\n", why);
+  exit(1);
+}
+
+static void
+waitok(void)
+{
+  int xstatus;
+
+  if(wait(&xstatus) < 0 || xstatus != 0)
+    fail("child");
+}
+
+static void
+forkexit(void)
+{
+  uint64 t;
+  int i, pid;
+
+  t = nanotime();
+  for(i = 0; i < NFORK; i++){
+    if((pid = fork()) < 0)
+      fail("fork");
+    if(pid == 0)
+      exit(0);
+    waitok();
+  }
+  t = nanotime() - t;
+  report("fork-exit-wait", t / NFORK / 1000, "us");
+}
+
+// fork and exec ourselves, to exit at once, with kb of
+// touched heap in the parent.
+static void
+forkexec(int kb)
+{
+  static char *names[] = { "fork-exec-0k", "fork-exec-1024k", "fork-exec-4096k" };
+  static int sizes[] = { 0, 1024, 4096 };
+  char *argv[] = { self, "-x", 0 };
+  char *p = 0;
+  uint64 t;
+  int i, pid;
+
+  if(kb > 0){
+    if((p = sbrk(kb * 1024)) == (char*)-1)
+      fail("sbrk");
+    for(i = 0; i < kb * 1024; i += PGSIZE)
+      p[i] = 1;
+  }
+  t = nanotime();
+  for(i = 0; i < NFORK; i++){
+    if((pid = fork()) < 0)
+      fail("fork");
+    if(pid == 0){
+      exec(self, argv);
+      fail("exec");
+    }
+    waitok();
+  }
+  t = nanotime() - t;
+  if(kb > 0)
+    sbrk(-kb * 1024);
+  for(i = 0; i < NELEM(sizes); i++)
+    if(sizes[i] == kb)
+      report(names[i], t / NFORK / 1000, "us");
+}
+
+static void
+pipertt(void)
+{
+  int to[2], from[2], i, pid;
+  uint64 t;
+  char c = 0;
+
+  if(pipe(to) < 0 || pipe(from) < 0)
+    fail("pipe");
+  if((pid = fork()) < 0)
+    fail("fork");
+  if(pid == 0){
+    close(to[1]);
+    close(from[0]);
+    while(read(to[0], &c, 1) == 1)
+      write(from[1], &c, 1);
+    exit(0);
+  }
+  close(to[0]);
+  close(from[1]);
+  t = nanotime();
+  for(i = 0; i < NRTT; i++){
+    if(write(to[1], &c, 1) != 1 || read(from[0], &c, 1) != 1)
+      fail("pipe round trip");
+  }
+  t = nanotime() - t;
+  close(to[1]);
+  close(from[0]);
+  waitok();
+  report("pipe-rtt", t / NRTT / 1000, "us");
+}
+
+static void
+pipebw(void)
+{
+  int fds[2], n, pid, total = 0;
+  uint64 t;
+
+  if(pipe(fds) < 0)
+    fail("pipe");
+  if((pid = fork()) < 0)
+    fail("fork");
+  if(pid == 0){
+    close(fds[0]);
+    for(n = 0; n < PIPEBYTES; n += sizeof(buf))
+      if(write(fds[1], buf, sizeof(buf)) != sizeof(buf))
+        fail("pipe write");
+    exit(0);
+  }
+  close(fds[1]);
+  t = nanotime();
+  while((n = read(fds[0], buf, sizeof(buf))) > 0)
+    total += n;
+  t = nanotime() - t;
+  close(fds[0]);
+  waitok();
+  if(total != PIPEBYTES)
+    fail("pipe bandwidth");
+  report("pipe-bw", (uint64)PIPEBYTES * (1000000000 / 1024) / t, "KB/s");
+}
+
+// Two threads take turns: each waits for turn to be its
+// own number, then hands it to the other.
+static int turn;
+
+static void
+pass(int me)
+{
+  int t;
+
+  while((t = __atomic_load_n(&turn, __ATOMIC_SEQ_CST)) != me)
+    futex(&turn, FUTEX_WAIT, t);
+  __atomic_store_n(&turn, !me, __ATOMIC_SEQ_CST);
+  futex(&turn, FUTEX_WAKE, 1);
+}
+
+static void
+futexpartner(void *arg)
+{
+  int i;
+
+  for(i = 0; i < NRTT; i++)
+    pass(1);
+  exit(0);
+}
+
+static void
+futexrtt(void)
+{
+  static char stack[PGSIZE] __attribute__((aligned(16)));
+  uint64 t;
+  int i;
+
+  turn = 0;
+  if(clone(futexpartner, 0, stack + sizeof(stack)) < 0)
+    fail("clone");
+  t = nanotime();
+  for(i = 0; i < NRTT; i++)
+    pass(0);
+  t = nanotime() - t;
+  waitok();
+  report("futex-rtt", t / NRTT / 1000, "us");
+}
+
+// nproc processes, started together, each yield NYIELD times.
+static void
+yields(int nproc)
+{
+  static char *names[] = { 0, "yield-1", "yield-2", 0, "yield-4" };
+  int fds[2], i, pid;
+  uint64 t;
+  char c;
+
+  if(pipe(fds) < 0)
+    fail("pipe");
+  for(i = 0; i < nproc; i++){
+    if((pid = fork()) < 0)
+      fail("fork");
+    if(pid == 0){
+      close(fds[1]);
+      read(fds[0], &c, 1);
+      for(i = 0; i < NYIELD; i++)
+        yield();
+      exit(0);
+    }
+  }
+  close(fds[0]);
+  sleep(1);
+  t = nanotime();
+  close(fds[1]);
+  for(i = 0; i < nproc; i++)
+    waitok();
+  t = nanotime() - t;
+  report(names[nproc], t / NYIELD, "ns");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n;
+
+  if(argc > 1 && strcmp(argv[1], "-x") == 0)
+    exit(0);
+  self = argv[0];
+
+  forkexit();
+  forkexec(0);
+  forkexec(1024);
+  forkexec(4096);
+  pipertt();
+  pipebw();
+  futexrtt();
+  for(n = 1; n <= MAXPROCS; n *= 2)
+    yields(n);
+  exit(0);
+}
@@ -0,0 +1,50 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/lockstat.h"
+#include "user/user.h"
+
+// print the most contended locks, or with -r zero the counts.
+//   lockstat [-r] [n]
+
+struct lockstat ls[NLOCKSTAT];
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, n, top = 10;
+  struct lockstat t;
+
+  if(argc > 1 && strcmp(argv[1], "-r") == 0){
+    if(lockstat(0, 0) < 0){
+      fprintf(2, "lockstat: reset failed\n");
+      exit(1);
+    }
+    exit(0);
+  }
+  if(argc > 1)
+    top = atoi(argv[1]);
+  if((n = lockstat(ls, NLOCKSTAT)) < 0){
+    fprintf(2, "lockstat: failed\n");
+    exit(1);
+  }
+
+  // most contended first, then longest held.
+  for(i = 1; i < n; i++){
+    t = ls[i];
+    for(j = i; j > 0 && (ls[j-1].contended < t.contended ||
+        (ls[j-1].contended == t.contended && ls[j-1].held < t.held)); j--)
+      ls[j] = ls[j-1];
+    ls[j] = t;
+  }
+
+  printf("name             kind  locks acquires contended spins held-ms\n");
+  for(i = 0; i < n && i < top; i++){
+    printf("%s", ls[i].name);
+    for(j = strlen(ls[i].name); j < LOCKNAME+1; j++)
+      printf(" ");
+    printf("%s %d %l %l %l %l\n", ls[i].sleep ? "sleep" : "spin ",
+           ls[i].nlock, ls[i].acquires, ls[i].contended, ls[i].spins,
+           ls[i].held / 10000);
+  }
+  exit(0);
+}
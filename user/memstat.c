@@ -0,0 +1,58 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+// print memory use of the given processes, or of all of them.
+
+static void
+show(struct memstat *ms)
+{
+  int i;
+  struct vmastat *v;
+
+  printf("%d %s: sz %d text %d stack %d heap %d faults %d\n",
+         ms->pid, ms->name, (int)ms->sz, (int)ms->text, (int)ms->stack,
+         (int)ms->heap, (int)ms->faults);
+  for(i = 0; i < ms->nvma && i < MSNVMA; i++){
+    v = &ms->vma[i];
+    printf("  %p %d %c%c%c %s%s resident %d\n", v->addr, (int)v->len,
+           (v->prot & PROT_READ) ? 'r' : '-',
+           (v->prot & PROT_WRITE) ? 'w' : '-',
+           (v->prot & PROT_EXEC) ? 'x' : '-',
+           (v->flags & MAP_SHARED) ? "shared" : "private",
+           (v->flags & MAP_ANONYMOUS) ? " anon" : "",
+           (int)v->resident);
+  }
+  if(ms->nvma > MSNVMA)
+    printf("  ... %d more\n", ms->nvma - MSNVMA);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct memstat ms;
+  int i, pid;
+
+  if(memstat(0, &ms) < 0){
+    fprintf(2, "memstat: failed\n");
+    exit(1);
+  }
+  printf("pages: %d total, %d free\n", (int)ms.total, (int)ms.free);
+
+  if(argc < 2){
+    for(pid = 0; memstat(pid, &ms) == 0; pid = ms.pid + 1)
+      show(&ms);
+    exit(0);
+  }
+  for(i = 1; i < argc; i++){
+    pid = atoi(argv[i]);
+    if(memstat(pid, &ms) < 0 || ms.pid != pid){
+      fprintf(2, "memstat: no process %d\n", pid);
+      continue;
+    }
+    show(&ms);
+  }
+  exit(0);
+}
@@ -0,0 +1,298 @@
+#include "kernel/param.h"
+#include "kernel/fcntl.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+// measure reading a file through mmap against read(), the cost
+// of page faults and of munmap() writing back, and how mapped
+// reads scale with processes.
+//   mmapbench [kb]
+// kb is the size of the test file, 1024 by default. Each result
+// is printed on a line of its own as
+//   mmapbench <test> <value> <unit>
+
+#define MAP_FAILED ((char *) -1)
+#define FILE "mmapbench.dat"
+#define MAXPROCS 4
+
+static char buf[PGSIZE];
+static int size;     // of the test file, in bytes
+static int npages;
+static uint64 sink;  // keeps the sums from being optimized away
+
+static void
+report(char *test, uint64 value, char *unit)
+{
+  printf("mmapbench %s %d %s\n", test, (int)value, unit);
+}
+
+static void
+fail(char *why)
+{
+  fprintf(2, "mmapbench: %s failed\n", why);
+  unlink(FILE);
+  exit(1);
+}
+
+// KB per second for n bytes in ns nanoseconds.
+static uint64
+kbps(uint64 n, uint64 ns)
+{
+  return ns ? n * (1000000000 / 1024) / ns : 0;
+}
+
+static uint64
+faults(void)
+{
+  struct memstat ms;
+
+  if(memstat(getpid(), &ms) < 0)
+    fail("memstat");
+  return ms.faults;
+}
+
+// The sum of the n bytes at p, a word at a time.
+static uint64
+sum(char *p, int n)
+{
+  uint64 *w = (uint64*)p, s = 0;
+  int i;
+
+  for(i = 0; i < n / sizeof(uint64); i++)
+    s += w[i];
+  return s;
+}
+
+// a page number drawn from a fixed sequence.
+static uint rnd = 1;
+static int
+randpage(void)
+{
+  rnd = rnd * 1103515245 + 12345;
+  return (rnd >> 8) % npages;
+}
+
+static void
+makefile(void)
+{
+  int fd, i, j;
+
+  if((fd = open(FILE, O_RDWR|O_CREATE|O_TRUNC)) < 0)
+    fail("create");
+  for(i = 0; i < npages; i++){
+    for(j = 0; j < PGSIZE; j++)
+      buf[j] = i + j;
+    if(write(fd, buf, PGSIZE) != PGSIZE)
+      fail("write");
+  }
+  close(fd);
+}
+
+static char*
+mapfile(int prot, int *fdp)
+{
+  int fd;
+  char *p;
+
+  if((fd = open(FILE, prot & PROT_WRITE ? O_RDWR : O_RDONLY)) < 0)
+    fail("open");
+  if((p = mmap(0, size, prot, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    fail("mmap");
+  if(fdp)
+    *fdp = fd;
+  else
+    close(fd);
+  return p;
+}
+
+static void
+seqread(void)
+{
+  uint64 t;
+  char *p;
+  int fd, n;
+
+  if((fd = open(FILE, O_RDONLY)) < 0)
+    fail("open");
+  t = nanotime();
+  while((n = read(fd, buf, PGSIZE)) > 0)
+    sink += sum(buf, n);
+  t = nanotime() - t;
+  close(fd);
+  report("seqread-read", kbps(size, t), "KB/s");
+
+  p = mapfile(PROT_READ, 0);
+  t = nanotime();
+  sink += sum(p, size);
+  t = nanotime() - t;
+  munmap(p, size);
+  report("seqread-mmap", kbps(size, t), "KB/s");
+}
+
+static void
+randread(void)
+{
+  uint64 t;
+  char *p;
+  int fd, i, pg;
+
+  if((fd = open(FILE, O_RDONLY)) < 0)
+    fail("open");
+  rnd = 1;
+  t = nanotime();
+  for(i = 0; i < npages; i++){
+    pg = randpage();
+    if(pread(fd, buf, PGSIZE, pg * PGSIZE) != PGSIZE)
+      fail("pread");
+    sink += sum(buf, PGSIZE);
+  }
+  t = nanotime() - t;
+  close(fd);
+  report("randread-read", kbps(size, t), "KB/s");
+
+  p = mapfile(PROT_READ, 0);
+  madvise(p, size, MADV_RANDOM);
+  rnd = 1;
+  t = nanotime();
+  for(i = 0; i < npages; i++){
+    pg = randpage();
+    sink += sum(p + pg * PGSIZE, PGSIZE);
+  }
+  t = nanotime() - t;
+  munmap(p, size);
+  report("randread-mmap", kbps(size, t), "KB/s");
+}
+
+// time touching one byte of each page of a fresh mapping of
+// the file, and of fresh anonymous memory.
+static void
+faultlat(void)
+{
+  uint64 t, f;
+  char *p;
+  int i;
+
+  p = mapfile(PROT_READ, 0);
+  f = faults();
+  t = nanotime();
+  for(i = 0; i < size; i += PGSIZE)
+    sink += p[i];
+  t = nanotime() - t;
+  f = faults() - f;
+  munmap(p, size);
+  report("fault-file-pages", npages, "pages");
+  report("fault-file-faults", f, "faults");
+  report("fault-file-page", t / npages, "ns");
+  report("fault-file-fault", f ? t / f : 0, "ns");
+
+  p = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED)
+    fail("mmap anonymous");
+  f = faults();
+  t = nanotime();
+  for(i = 0; i < size; i += PGSIZE)
+    p[i] = 1;
+  t = nanotime() - t;
+  f = faults() - f;
+  munmap(p, size);
+  report("fault-anon-faults", f, "faults");
+  report("fault-anon-page", t / npages, "ns");
+}
+
+// time munmap() of a shared mapping whose pages have all been
+// read, and of one whose pages have all been written.
+static void
+unmapcost(void)
+{
+  uint64 t;
+  char *p;
+  int i;
+
+  p = mapfile(PROT_READ|PROT_WRITE, 0);
+  for(i = 0; i < size; i += PGSIZE)
+    sink += p[i];
+  t = nanotime();
+  if(munmap(p, size) < 0)
+    fail("munmap");
+  t = nanotime() - t;
+  report("munmap-clean", t / 1000, "us");
+
+  p = mapfile(PROT_READ|PROT_WRITE, 0);
+  for(i = 0; i < size; i += PGSIZE)
+    p[i]++;
+  t = nanotime();
+  if(munmap(p, size) < 0)
+    fail("munmap");
+  t = nanotime() - t;
+  report("munmap-dirty", t / 1000, "us");
+  report("munmap-dirty-page", t / npages, "ns");
+}
+
+// nproc processes each map the file and read all of it.
+// Returns the aggregate KB per second.
+static uint64
+scaling(int nproc)
+{
+  int fds[2], i, xstatus;
+  uint64 t;
+  char *p, c;
+
+  if(pipe(fds) < 0)
+    fail("pipe");
+  for(i = 0; i < nproc; i++){
+    int pid = fork();
+    if(pid < 0)
+      fail("fork");
+    if(pid == 0){
+      close(fds[1]);
+      p = mapfile(PROT_READ, 0);
+      // start together, when the parent closes the pipe.
+      read(fds[0], &c, 1);
+      sink += sum(p, size);
+      munmap(p, size);
+      exit(0);
+    }
+  }
+  close(fds[0]);
+  sleep(1);
+  t = nanotime();
+  close(fds[1]);
+  for(i = 0; i < nproc; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      fail("scaling child");
+  }
+  t = nanotime() - t;
+  return kbps((uint64)size * nproc, t);
+}
+
+int
+main(int argc, char *argv[])
+{
+  static char *scalename[] = { "scale-mmap-1", "scale-mmap-2", "scale-mmap-4" };
+  int i, n;
+
+  size = 1024 * 1024;
+  if(argc > 1)
+    size = atoi(argv[1]) * 1024;
+  size = PGROUNDUP(size);
+  if(size <= 0){
+    fprintf(2, "usage: mmapbench [kb]\n");
+    exit(1);
+  }
+  npages = size / PGSIZE;
+
+  makefile();
+  report("file", size / 1024, "KB");
+  seqread();
+  randread();
+  faultlat();
+  unmapcost();
+  for(i = 0, n = 1; n <= MAXPROCS; i++, n *= 2)
+    report(scalename[i], scaling(n), "KB/s");
+  unlink(FILE);
+  exit(0);
+}
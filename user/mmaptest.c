@@ -4,10 +4,20 @@
 #include "kernel/stat.h"
 #include "kernel/riscv.h"
 #include "kernel/fs.h"
+#include "kernel/syscall.h"
+#include "kernel/trace.h"
 #include "user/user.h"
 
 void mmap_test();
 void fork_test();
+void shared_test();
+void msync_test();
+void hole_test();
+void anon_test();
+void mega_test();
+void madvise_test();
+void reclaim_test();
+void mremap_test();
 char buf[BSIZE];
 
 #define MAP_FAILED ((char *) -1)
@@ -17,6 +27,14 @@ main(int argc, char *argv[])
 {
   mmap_test();
   fork_test();
+  shared_test();
+  msync_test();
+  hole_test();
+  anon_test();
+  mega_test();
+  madvise_test();
+  reclaim_test();
+  mremap_test();
   printf("mmaptest: all tests succeeded\n");
   exit(0);
 }
@@ -295,3 +313,481 @@ fork_test(void)
   printf("fork_test OK\n");
 }
 
+
+//
+// two processes map the same file MAP_SHARED.
+// check that each sees the other's stores, and
+// write()s to the file, without unmapping.
+//
+void
+shared_test(void)
+{
+  int fd;
+  int pid;
+  const char * const f = "mmap.dur";
+
+  printf("shared_test starting\n");
+  testname = "shared_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  char *p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (6)");
+  _v1(p);
+
+  if((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0) {
+    char *q = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (q == MAP_FAILED)
+      err("mmap (7)");
+    q[PGSIZE] = 'B';
+    // the inherited mapping shares the parent's pages.
+    p[1] = 'D';
+    exit(0);
+  }
+
+  int status = -1;
+  wait(&status);
+  if(status != 0){
+    printf("shared_test failed\n");
+    exit(1);
+  }
+
+  if (p[PGSIZE] != 'B')
+    err("child's store not visible");
+  if (p[1] != 'D')
+    err("store to inherited mapping not visible");
+
+  if (write(fd, "C", 1) != 1)
+    err("write");
+  if (p[0] != 'C')
+    err("write() not visible");
+
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap (5)");
+  if (close(fd) == -1)
+    err("close");
+  unlink(f);
+
+  printf("shared_test OK\n");
+}
+
+//
+// check that the file contains c for its first n bytes.
+//
+void
+checkfile(const char *f, char c, int n)
+{
+  int fd, i;
+  char b;
+
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  for (i = 0; i < n; i++){
+    if (read(fd, &b, 1) != 1)
+      err("read (2)");
+    if (b != c)
+      err("file does not contain msync()ed modifications");
+  }
+  close(fd);
+}
+
+//
+// check that msync() writes a shared mapping back to the
+// file without unmapping it, both synchronously and not.
+//
+void
+msync_test(void)
+{
+  static struct traceev ev[64];
+  int fd, i, t, n, old, state, pid = getpid();
+  const char * const f = "mmap.dur";
+
+  printf("msync_test starting\n");
+  testname = "msync_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  char *p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (8)");
+  close(fd);
+
+  for (i = 0; i < PGSIZE + PGSIZE/2; i++)
+    p[i] = 'S';
+  if (msync(p, PGSIZE*2, MS_SYNC) == -1)
+    err("msync (1)");
+  checkfile(f, 'S', PGSIZE + PGSIZE/2);
+
+  // log commits are asynchronous, so MS_SYNC must wait for
+  // one to finish before msync() returns.
+  for (i = 0; i < PGSIZE; i++)
+    p[i] = 'S';
+  old = trace(0);
+  while (traceread(ev, 64) > 0)
+    ;
+  trace(TR_SYSCALL | TR_LOG);
+  if (msync(p, PGSIZE, MS_SYNC) == -1)
+    err("msync (3)");
+  trace(old);
+  state = 0;
+  while ((n = traceread(ev, 64)) > 0){
+    for (i = 0; i < n; i++){
+      if (state == 0 && ev[i].type == TE_SYSENTER &&
+          ev[i].pid == pid && ev[i].a0 == SYS_msync)
+        state = 1;
+      else if (state == 1 && ev[i].type == TE_LOGDONE)
+        state = 2;
+      else if (state == 2 && ev[i].type == TE_SYSEXIT &&
+               ev[i].pid == pid && ev[i].a0 == SYS_msync)
+        state = 3;
+    }
+  }
+  if (n < 0)
+    err("traceread");
+  if (state != 3)
+    err("msync(MS_SYNC) returned before the log committed");
+
+  // MS_ASYNC returns before the pages are written,
+  // so give the kernel a little while.
+  for (i = 0; i < PGSIZE + PGSIZE/2; i++)
+    p[i] = 'T';
+  if (msync(p, PGSIZE*2, MS_ASYNC) == -1)
+    err("msync (2)");
+  for (t = 0; t < 50; t++){
+    if ((fd = open(f, O_RDONLY)) == -1)
+      err("open");
+    if (read(fd, buf, BSIZE) != BSIZE)
+      err("read (3)");
+    close(fd);
+    if (buf[0] == 'T')
+      break;
+    sleep(1);
+  }
+  sleep(1);
+  checkfile(f, 'T', PGSIZE + PGSIZE/2);
+
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap (6)");
+  if (msync(p, PGSIZE, MS_SYNC) != -1)
+    err("msync of unmapped memory should have failed");
+  unlink(f);
+
+  printf("msync_test OK\n");
+}
+
+//
+// unmap a page from the middle of a mapping, and check that
+// the pages on either side stay mapped and are written back.
+// also check that a process can have many mappings at once.
+//
+void
+hole_test(void)
+{
+  int fd, i;
+  char *q[32];
+  const char * const f = "mmap.dur";
+
+  printf("hole_test starting\n");
+  testname = "hole_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  char *p = mmap(0, PGSIZE*3, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (9)");
+  close(fd);
+
+  if (munmap(p + PGSIZE, PGSIZE) == -1)
+    err("munmap of middle page");
+  p[0] = 'H';
+  if (p[PGSIZE*2] != 0)
+    err("third page should be zero");
+
+  // more mappings than the old fixed-size table had room for.
+  for (i = 0; i < 32; i++){
+    if ((fd = open(f, O_RDONLY)) == -1)
+      err("open");
+    q[i] = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (q[i] == MAP_FAILED)
+      err("mmap (10)");
+    close(fd);
+  }
+  for (i = 0; i < 32; i++){
+    if (q[i][0] != 'H')
+      err("mapping doesn't see store to shared mapping");
+    if (munmap(q[i], PGSIZE) == -1)
+      err("munmap (7)");
+  }
+
+  if (munmap(p, PGSIZE*3) == -1)
+    err("munmap of both sides");
+  if (munmap(p, PGSIZE) != -1)
+    err("munmap of unmapped page should have failed");
+  checkfile(f, 'H', 1);
+  unlink(f);
+
+  printf("hole_test OK\n");
+}
+
+//
+// anonymous mappings: zero-filled on demand, private ones
+// copied on write across fork, shared ones shared.
+//
+void
+anon_test(void)
+{
+  char *p, *q;
+  int i, pid, status;
+
+  printf("anon_test starting\n");
+  testname = "anon_test";
+
+  p = mmap(0, PGSIZE*64, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap private");
+  q = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (q == MAP_FAILED)
+    err("mmap shared");
+  for (i = 0; i < PGSIZE*64; i += PGSIZE)
+    if (p[i] != 0)
+      err("private page not zero");
+  if (q[0] != 0 || q[PGSIZE*2-1] != 0)
+    err("shared page not zero");
+  p[0] = 'A';
+  p[PGSIZE*63] = 'B';
+
+  if ((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0) {
+    if (p[0] != 'A' || p[PGSIZE*63] != 'B')
+      err("child doesn't see parent's stores");
+    p[0] = 'X';
+    q[PGSIZE] = 'S';
+    exit(0);
+  }
+  status = -1;
+  wait(&status);
+  if (status != 0) {
+    printf("anon_test failed\n");
+    exit(1);
+  }
+  if (p[0] != 'A')
+    err("child's store to private page visible");
+  if (q[PGSIZE] != 'S')
+    err("child's store to shared page not visible");
+
+  if (munmap(p, PGSIZE*64) == -1 || munmap(q, PGSIZE*2) == -1)
+    err("munmap");
+
+  printf("anon_test OK\n");
+}
+
+//
+// anonymous regions big enough for the kernel to back with
+// 2-megabyte megapages: fork, and unmap part of one.
+//
+void
+mega_test(void)
+{
+  enum { N = 1024 };
+  char *p;
+  int i, pid, status;
+
+  printf("mega_test starting\n");
+  testname = "mega_test";
+
+  p = mmap(0, PGSIZE*N, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+  for (i = 0; i < N; i++)
+    p[i*PGSIZE] = i;
+
+  if ((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0) {
+    for (i = 0; i < N; i++)
+      if (p[i*PGSIZE] != (char)i)
+        err("child sees wrong data");
+    p[700*PGSIZE] = 'C';
+    exit(0);
+  }
+  status = -1;
+  wait(&status);
+  if (status != 0) {
+    printf("mega_test failed\n");
+    exit(1);
+  }
+  if (p[700*PGSIZE] != 'C')
+    err("child's store not visible");
+
+  if (munmap(p + PGSIZE, PGSIZE) == -1)
+    err("munmap of one page");
+  if (p[0] != 0 || p[2*PGSIZE] != 2 || p[(N-1)*PGSIZE] != (char)(N-1))
+    err("wrong data after partial munmap");
+  if (munmap(p, PGSIZE*N) == -1)
+    err("munmap");
+
+  printf("mega_test OK\n");
+}
+
+//
+// madvise(): the fault-around hints don't change what's
+// mapped, and MADV_DONTNEED drops pages, writing back
+// shared ones and discarding private copies.
+//
+void
+madvise_test(void)
+{
+  int fd;
+  char *p, *q;
+  const char * const f = "mmap.dur";
+
+  printf("madvise_test starting\n");
+  testname = "madvise_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (1)");
+  q = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (q == MAP_FAILED)
+    err("mmap (2)");
+
+  if (madvise(p, PGSIZE*2, MADV_SEQUENTIAL) == -1)
+    err("madvise sequential");
+  if (madvise(q + PGSIZE, PGSIZE, MADV_RANDOM) == -1)
+    err("madvise random");
+  if (madvise(p, PGSIZE*2, MADV_WILLNEED) == -1)
+    err("madvise willneed");
+  _v1(p);
+  _v1(q);
+  if (madvise(p + PGSIZE*2, PGSIZE, MADV_NORMAL) != -1)
+    err("madvise of unmapped page should have failed");
+  if (madvise(p, PGSIZE, 99) != -1)
+    err("madvise with bad advice should have failed");
+
+  p[0] = 'D';
+  q[0] = 'P';
+  if (madvise(p, PGSIZE, MADV_DONTNEED) == -1 || madvise(q, PGSIZE, MADV_DONTNEED) == -1)
+    err("madvise dontneed");
+  checkfile(f, 'D', 1);
+  if (p[0] != 'D')
+    err("shared page lost store");
+  if (q[0] != 'D')
+    err("private page kept its copy");
+
+  if (munmap(p, PGSIZE*2) == -1 || munmap(q, PGSIZE*2) == -1)
+    err("munmap");
+  close(fd);
+  unlink(f);
+
+  printf("madvise_test OK\n");
+}
+
+//
+// map more pages of a file than the page cache holds, so that
+// touching them all only works if the process's own untouched
+// pages are evicted, and a dirty shared page must be written
+// back before it is.
+//
+void
+reclaim_test(void)
+{
+  enum { N = 2*NPCACHE };
+  int fd, i;
+  char *p;
+  const char * const f = "mmap.dur";
+
+  printf("reclaim_test starting\n");
+  testname = "reclaim_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  // pages past the end of the file read as zeros.
+  p = mmap(0, PGSIZE*N, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+  p[0] = 'R';
+  for (i = 1; i < N; i++)
+    if (p[i*PGSIZE] != (i == 1 ? 'A' : 0))
+      err("wrong contents");
+  if (p[0] != 'R')
+    err("evicted page lost its store");
+  if (munmap(p, PGSIZE*N) == -1)
+    err("munmap");
+  checkfile(f, 'R', 1);
+  close(fd);
+  unlink(f);
+
+  printf("reclaim_test OK\n");
+}
+
+//
+// mremap(): grow a mapping in place into free address space,
+// move one that has no room, keeping its pages, and shrink one.
+//
+void
+mremap_test(void)
+{
+  int fd;
+  char *p, *q;
+  const char * const f = "mmap.dur";
+
+  printf("mremap_test starting\n");
+  testname = "mremap_test";
+
+  p = mmap(0, PGSIZE*3, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    err("mmap (1)");
+  if (munmap(p + PGSIZE, PGSIZE*2) == -1)
+    err("munmap (1)");
+  p[0] = 'a';
+  if (mremap(p, PGSIZE, PGSIZE*3, 0) != p)
+    err("grow in place");
+  if (p[0] != 'a' || p[PGSIZE*2] != 0)
+    err("grown mapping's contents");
+  p[PGSIZE*2] = 'b';
+
+  q = mremap(p, PGSIZE*3, PGSIZE*1024, MREMAP_MAYMOVE);
+  if (q == MAP_FAILED)
+    err("move");
+  if (q[0] != 'a' || q[PGSIZE*2] != 'b' || q[PGSIZE*1023] != 0)
+    err("moved mapping's contents");
+  if (mremap(q, PGSIZE*1024, PGSIZE, 0) != q)
+    err("shrink");
+  if (q[0] != 'a')
+    err("shrunk mapping's contents");
+  if (munmap(q, PGSIZE) == -1)
+    err("munmap (2)");
+  if (mremap(q, PGSIZE, PGSIZE*2, MREMAP_MAYMOVE) != MAP_FAILED)
+    err("mremap of unmapped memory should have failed");
+
+  // a shared file mapping still writes back after moving.
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (2)");
+  p[0] = 'M';
+  if ((q = mremap(p, PGSIZE, PGSIZE*2, MREMAP_MAYMOVE)) == MAP_FAILED)
+    err("move file mapping");
+  if (q[0] != 'M' || q[1] != 'A' || q[PGSIZE + PGSIZE/2 - 1] != 'A')
+    err("moved file mapping's contents");
+  if (munmap(q, PGSIZE*2) == -1)
+    err("munmap (3)");
+  checkfile(f, 'M', 1);
+  close(fd);
+  unlink(f);
+
+  printf("mremap_test OK\n");
+}
@@ -0,0 +1,34 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// nice level command [args...]: run command at priority
+// level (0 highest), or with no command, set the level of
+// process pid: nice level -p pid.
+
+int
+main(int argc, char **argv)
+{
+  int prio;
+
+  if(argc < 3){
+    fprintf(2, "usage: nice level command [args...]\n");
+    fprintf(2, "       nice level -p pid\n");
+    exit(1);
+  }
+  prio = atoi(argv[1]);
+  if(strcmp(argv[2], "-p") == 0){
+    if(argc < 4 || setpriority(atoi(argv[3]), prio) < 0){
+      fprintf(2, "nice: cannot set priority\n");
+      exit(1);
+    }
+    exit(0);
+  }
+  if(setpriority(0, prio) < 0){
+    fprintf(2, "nice: bad level %s\n", argv[1]);
+    exit(1);
+  }
+  exec(argv[2], argv + 2);
+  fprintf(2, "nice: exec %s failed\n", argv[2]);
+  exit(1);
+}
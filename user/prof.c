@@ -0,0 +1,291 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/prof.h"
+#include "user/user.h"
+
+// run a command with the profiler on, and print the functions
+// the CPUs were most often found in, named from kernel.sym, or
+// for user code from the program's own <name>.sym.
+//   prof [-r hz] [-n top] cmd [arg ...]
+// hz is 1000 by default, and top 20.
+
+#define NSYMTAB 32
+#define CHUNK   256
+
+struct symtab {
+  char name[16];    // program, or "kernel"
+  int n;
+  uint64 *addr;     // sorted
+  char **sym;
+};
+
+struct hit {
+  struct symtab *tab;
+  char *fn;
+  int count;
+};
+
+static struct symtab symtabs[NSYMTAB];
+static int nsymtab;
+static struct symtab other = { "other" };  // once symtabs is full
+
+static struct profsample *samples;
+static int nsample, maxsample;
+
+static struct hit *hits;
+static int nhit;
+
+static void
+fail(char *why)
+{
+  fprintf(2, "prof: %s\n", why);
+  exit(1);
+}
+
+static void*
+grow(void *old, int n, int size)
+{
+  char *p;
+
+  if((p = malloc(n * size)) == 0)
+    fail("out of memory");
+  if(old){
+    memmove(p, old, (n / 2) * size);
+    free(old);
+  }
+  return p;
+}
+
+// Read the samples the kernel has for us.
+static void
+drain(void)
+{
+  int n;
+
+  for(;;){
+    if(nsample + CHUNK > maxsample){
+      maxsample = maxsample ? 2 * maxsample : 4 * CHUNK;
+      samples = grow(samples, maxsample, sizeof(struct profsample));
+    }
+    if((n = profread(samples + nsample, CHUNK)) < 0)
+      fail("profread failed");
+    if(n == 0)
+      return;
+    nsample += n;
+  }
+}
+
+static uint64
+hex(char *s)
+{
+  uint64 x = 0;
+
+  for(;; s++){
+    if(*s >= '0' && *s <= '9')
+      x = x * 16 + *s - '0';
+    else if(*s >= 'a' && *s <= 'f')
+      x = x * 16 + *s - 'a' + 10;
+    else
+      return x;
+  }
+}
+
+// Is sym the name of a function or variable, rather than of
+// a section, a source file, or a local label?
+static int
+isfunc(char *sym)
+{
+  int n = strlen(sym);
+
+  if(n == 0 || sym[0] == '.' || sym[0] == '$')
+    return 0;
+  if(n > 2 && sym[n-2] == '.' && (sym[n-1] == 'c' || sym[n-1] == 'S'))
+    return 0;
+  return 1;
+}
+
+// Load the symbols in file, lines of "address name" as the
+// Makefile writes them, into t. Leaves t empty if it can't.
+static void
+loadsyms(struct symtab *t, char *file)
+{
+  struct stat st;
+  char *buf, *p, *nl, *sp;
+  int fd, n, j, max;
+  uint64 a;
+  char *s;
+
+  if((fd = open(file, O_RDONLY)) < 0)
+    return;
+  if(fstat(fd, &st) < 0 || (buf = malloc(st.size + 1)) == 0){
+    close(fd);
+    return;
+  }
+  n = read(fd, buf, st.size);
+  close(fd);
+  if(n < 0)
+    n = 0;
+  buf[n] = 0;
+
+  max = 0;
+  for(p = buf; *p; p++)
+    if(*p == '\n')
+      max++;
+  t->addr = malloc((max + 1) * sizeof(uint64));
+  t->sym = malloc((max + 1) * sizeof(char*));
+  if(t->addr == 0 || t->sym == 0)
+    fail("out of memory");
+
+  for(p = buf; *p; p = nl){
+    if((nl = strchr(p, '\n')) != 0)
+      *nl++ = 0;
+    else
+      nl = p + strlen(p);
+    if((sp = strchr(p, ' ')) == 0)
+      continue;
+    *sp = 0;
+    if(!isfunc(sp + 1))
+      continue;
+    // insert, keeping the table sorted.
+    a = hex(p);
+    s = sp + 1;
+    for(j = t->n; j > 0 && t->addr[j-1] > a; j--){
+      t->addr[j] = t->addr[j-1];
+      t->sym[j] = t->sym[j-1];
+    }
+    t->addr[j] = a;
+    t->sym[j] = s;
+    t->n++;
+  }
+  // buf stays allocated: the table points into it.
+}
+
+// Return the symbol table for the kernel, or for
+// user program name, loading it if need be.
+static struct symtab*
+symtabof(int user, char *name)
+{
+  char file[32];
+  struct symtab *t;
+  int i;
+
+  if(!user)
+    name = "kernel";
+  for(i = 0; i < nsymtab; i++)
+    if(strcmp(symtabs[i].name, name) == 0)
+      return &symtabs[i];
+  if(nsymtab == NSYMTAB)
+    return &other;
+  t = &symtabs[nsymtab++];
+  strcpy(t->name, name);
+  strcpy(file, "/");
+  strcpy(file + 1, name);
+  strcpy(file + 1 + strlen(name), ".sym");
+  loadsyms(t, file);
+  return t;
+}
+
+// The name of the function in t containing pc, or "?".
+static char*
+lookup(struct symtab *t, uint64 pc)
+{
+  int lo = 0, hi = t->n, mid;
+
+  // find the last symbol at or below pc.
+  while(lo < hi){
+    mid = (lo + hi) / 2;
+    if(t->addr[mid] <= pc)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo > 0 ? t->sym[lo-1] : "?";
+}
+
+static void
+count(struct profsample *s)
+{
+  struct symtab *t;
+  char *fn;
+  int i;
+
+  t = symtabof(s->user, s->name);
+  fn = lookup(t, s->pc);
+  for(i = 0; i < nhit; i++){
+    if(hits[i].tab == t && hits[i].fn == fn){
+      hits[i].count++;
+      return;
+    }
+  }
+  if((nhit & (nhit - 1)) == 0)
+    hits = grow(hits, nhit ? 2 * nhit : 1, sizeof(struct hit));
+  hits[nhit].tab = t;
+  hits[nhit].fn = fn;
+  hits[nhit].count = 1;
+  nhit++;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int hz = 1000, top = 20, i, j, pid, dropped, nuser = 0;
+  struct hit h;
+
+  while(argc > 2 && argv[1][0] == '-'){
+    if(strcmp(argv[1], "-r") == 0)
+      hz = atoi(argv[2]);
+    else if(strcmp(argv[1], "-n") == 0)
+      top = atoi(argv[2]);
+    else
+      break;
+    argc -= 2;
+    argv += 2;
+  }
+  if(argc < 2 || argv[1][0] == '-'){
+    fprintf(2, "usage: prof [-r hz] [-n top] cmd [arg ...]\n");
+    exit(1);
+  }
+
+  // forget samples from before.
+  prof(0);
+  drain();
+  nsample = 0;
+
+  if(prof(hz) < 0)
+    fail("bad rate");
+  if((pid = fork()) < 0)
+    fail("fork failed");
+  if(pid == 0){
+    exec(argv[1], argv + 1);
+    fprintf(2, "prof: exec %s failed\n", argv[1]);
+    exit(1);
+  }
+  wait(0);
+  dropped = prof(0);
+  drain();
+
+  for(i = 0; i < nsample; i++){
+    count(&samples[i]);
+    nuser += samples[i].user;
+  }
+  // most samples first.
+  for(i = 1; i < nhit; i++){
+    h = hits[i];
+    for(j = i; j > 0 && hits[j-1].count < h.count; j--)
+      hits[j] = hits[j-1];
+    hits[j] = h;
+  }
+
+  printf("prof: %d samples, %d in user code, %d dropped\n", nsample, nuser, dropped);
+  if(dropped)
+    printf("prof: lower the rate with -r to keep them all\n");
+  printf("samples    %%  program          function\n");
+  for(i = 0; i < nhit && i < top; i++){
+    printf("%d\t%d\t%s", hits[i].count, hits[i].count * 100 / nsample, hits[i].tab->name);
+    for(j = strlen(hits[i].tab->name); j < 16; j++)
+      printf(" ");
+    printf(" %s\n", hits[i].fn);
+  }
+  exit(0);
+}
@@ -52,6 +52,7 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+int gettoken(char**, char*, char**, char**);
 
 // Execute cmd.  Never returns.
 void
@@ -130,6 +131,65 @@ runcmd(struct cmd *cmd)
   exit(0);
 }
 
+// Is command line s a single command, perhaps with
+// redirections, that parses without error? parsecmd()
+// exits on errors, so it only runs in the shell itself
+// for a line that passes.
+int
+spawnable(char *s)
+{
+  char *es, *q, *eq;
+  int tok, argc = 0;
+
+  es = s + strlen(s);
+  while((tok = gettoken(&s, es, &q, &eq)) != 0){
+    if(tok == '<' || tok == '>' || tok == '+'){
+      if(gettoken(&s, es, &q, &eq) != 'a')
+        return 0;
+    } else if(tok != 'a' || ++argc >= MAXARGS)
+      return 0;
+  }
+  return argc > 0;
+}
+
+// Run cmd, a spawnable() command, with spawn() rather than
+// fork() and exec(), wait for it, and free it.
+void
+spawncmd(struct cmd *cmd)
+{
+  struct redircmd *rcmd;
+  struct execcmd *ecmd;
+  struct cmd *next;
+  int fds[3] = { -1, -1, -1 };
+  int i, ok = 1;
+
+  // outer redirections come first, so inner ones win.
+  for(; cmd->type == REDIR; cmd = next){
+    rcmd = (struct redircmd*)cmd;
+    if(ok){
+      if(fds[rcmd->fd] >= 0)
+        close(fds[rcmd->fd]);
+      if((fds[rcmd->fd] = open(rcmd->file, rcmd->mode)) < 0){
+        fprintf(2, "open %s failed\n", rcmd->file);
+        ok = 0;
+      }
+    }
+    next = rcmd->cmd;
+    free(rcmd);
+  }
+  ecmd = (struct execcmd*)cmd;
+  if(ok){
+    if(spawn(ecmd->argv[0], ecmd->argv, fds) < 0)
+      fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+    else
+      wait(0);
+  }
+  free(ecmd);
+  for(i = 0; i < 3; i++)
+    if(fds[i] >= 0)
+      close(fds[i]);
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -164,6 +224,10 @@ main(void)
         fprintf(2, "cannot cd %s\n", buf+3);
       continue;
     }
+    if(spawnable(buf)){
+      spawncmd(parsecmd(buf));
+      continue;
+    }
     if(fork1() == 0)
       runcmd(parsecmd(buf));
     wait(0);
@@ -0,0 +1,177 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/syscall.h"
+#include "kernel/sysstat.h"
+#include "user/user.h"
+
+// print how often each system call was made and how long it
+// took, most time first; or one call's latency histogram; or
+// with -r zero the counts.
+//   sysstat [-r | name]
+
+#define NELEM(x) (sizeof(x)/sizeof((x)[0]))
+#define NSYS 64
+
+static char *sysname[] = {
+  [SYS_fork]      "fork",
+  [SYS_exit]      "exit",
+  [SYS_wait]      "wait",
+  [SYS_pipe]      "pipe",
+  [SYS_read]      "read",
+  [SYS_kill]      "kill",
+  [SYS_exec]      "exec",
+  [SYS_fstat]     "fstat",
+  [SYS_chdir]     "chdir",
+  [SYS_dup]       "dup",
+  [SYS_getpid]    "getpid",
+  [SYS_sbrk]      "sbrk",
+  [SYS_sleep]     "sleep",
+  [SYS_uptime]    "uptime",
+  [SYS_open]      "open",
+  [SYS_write]     "write",
+  [SYS_mknod]     "mknod",
+  [SYS_unlink]    "unlink",
+  [SYS_link]      "link",
+  [SYS_mkdir]     "mkdir",
+  [SYS_close]     "close",
+  [SYS_mmap]      "mmap",
+  [SYS_munmap]    "munmap",
+  [SYS_msync]     "msync",
+  [SYS_madvise]   "madvise",
+  [SYS_memstat]   "memstat",
+  [SYS_mremap]    "mremap",
+  [SYS_fsync]     "fsync",
+  [SYS_fdatasync] "fdatasync",
+  [SYS_pread]     "pread",
+  [SYS_pwrite]    "pwrite",
+  [SYS_readv]     "readv",
+  [SYS_writev]    "writev",
+  [SYS_sendfile]  "sendfile",
+  [SYS_fcntl]     "fcntl",
+  [SYS_setpriority]"setpriority",
+  [SYS_cpustat]   "cpustat",
+  [SYS_clone]     "clone",
+  [SYS_futex]     "futex",
+  [SYS_lockstat]  "lockstat",
+  [SYS_spawn]     "spawn",
+  [SYS_nanosleep] "nanosleep",
+  [SYS_nanotime]  "nanotime",
+  [SYS_trace]     "trace",
+  [SYS_traceread] "traceread",
+  [SYS_sysstat]   "sysstat",
+  [SYS_yield]     "yield",
+  [SYS_prof]      "prof",
+  [SYS_profread]  "profread",
+  [SYS_uringsetup] "uringsetup",
+  [SYS_uringenter] "uringenter",
+};
+
+static struct sysstat ss[NSYS];
+
+// print a time in CLINT_MTIME cycles as microseconds.
+static void
+usecs(uint64 t)
+{
+  printf("%d.%d", (int)(t / 10), (int)(t % 10));
+}
+
+// Return the upper bound, in cycles, of the bucket holding
+// the call at fraction pct/100 of s's calls.
+static uint64
+percentile(struct sysstat *s, int pct)
+{
+  uint64 n = 0, want = (s->calls * pct + 99) / 100;
+  int b;
+
+  for(b = 0; b < NSYSHIST-1; b++){
+    n += s->hist[b];
+    if(n >= want)
+      break;
+  }
+  return 2L << b;
+}
+
+static void
+histogram(struct sysstat *s, char *name)
+{
+  uint64 most = 0;
+  int b, i, first = -1, last = 0;
+
+  for(b = 0; b < NSYSHIST; b++){
+    if(s->hist[b]){
+      if(first < 0)
+        first = b;
+      last = b;
+    }
+    if(s->hist[b] > most)
+      most = s->hist[b];
+  }
+  printf("%s: %d calls, ", name, (int)s->calls);
+  usecs(s->calls ? s->time / s->calls : 0);
+  printf(" us each\n");
+  for(b = first; b >= 0 && b <= last; b++){
+    printf("  < ");
+    usecs(2L << b);
+    printf(" us%s\t%d\t", b == NSYSHIST-1 ? "+" : "", (int)s->hist[b]);
+    for(i = 0; i < s->hist[b] * 40 / most; i++)
+      printf("#");
+    printf("\n");
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, n, order[NSYS], t;
+
+  if(argc > 1 && strcmp(argv[1], "-r") == 0){
+    if(sysstat(0, 0) < 0){
+      fprintf(2, "sysstat: reset failed\n");
+      exit(1);
+    }
+    exit(0);
+  }
+  if((n = sysstat(ss, NSYS)) < 0){
+    fprintf(2, "sysstat: failed\n");
+    exit(1);
+  }
+  if(n > NELEM(sysname))
+    n = NELEM(sysname);
+
+  if(argc > 1){
+    for(i = 1; i < n; i++){
+      if(sysname[i] && strcmp(sysname[i], argv[1]) == 0){
+        histogram(&ss[i], argv[1]);
+        exit(0);
+      }
+    }
+    fprintf(2, "sysstat: no system call %s\n", argv[1]);
+    exit(1);
+  }
+
+  // most time first.
+  for(i = 0; i < n; i++){
+    t = i;
+    for(j = i; j > 0 && ss[order[j-1]].time < ss[t].time; j--)
+      order[j] = order[j-1];
+    order[j] = t;
+  }
+
+  printf("name         calls    total-ms  avg-us  p50-us  p99-us\n");
+  for(i = 0; i < n; i++){
+    struct sysstat *s = &ss[order[i]];
+    if(s->calls == 0 || sysname[order[i]] == 0)
+      continue;
+    printf("%s", sysname[order[i]]);
+    for(j = strlen(sysname[order[i]]); j < 13; j++)
+      printf(" ");
+    printf("%d\t%d\t", (int)s->calls, (int)(s->time / 10000));
+    usecs(s->time / s->calls);
+    printf("\t");
+    usecs(percentile(s, 50));
+    printf("\t");
+    usecs(percentile(s, 99));
+    printf("\n");
+  }
+  exit(0);
+}
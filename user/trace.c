@@ -0,0 +1,211 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/syscall.h"
+#include "kernel/trace.h"
+#include "user/user.h"
+
+// record kernel events and print them as a timeline.
+//   trace [-e classes] cmd [arg ...]   trace while cmd runs
+//   trace -e classes                   start recording
+//   trace                              stop, and print what was recorded
+// classes are letters: s syscalls, f page faults, w context
+// switches, d disk, l log commits. the default is all of them.
+
+#define NELEM(x) (sizeof(x)/sizeof((x)[0]))
+
+static char *sysname[] = {
+  [SYS_fork]      "fork",
+  [SYS_exit]      "exit",
+  [SYS_wait]      "wait",
+  [SYS_pipe]      "pipe",
+  [SYS_read]      "read",
+  [SYS_kill]      "kill",
+  [SYS_exec]      "exec",
+  [SYS_fstat]     "fstat",
+  [SYS_chdir]     "chdir",
+  [SYS_dup]       "dup",
+  [SYS_getpid]    "getpid",
+  [SYS_sbrk]      "sbrk",
+  [SYS_sleep]     "sleep",
+  [SYS_uptime]    "uptime",
+  [SYS_open]      "open",
+  [SYS_write]     "write",
+  [SYS_mknod]     "mknod",
+  [SYS_unlink]    "unlink",
+  [SYS_link]      "link",
+  [SYS_mkdir]     "mkdir",
+  [SYS_close]     "close",
+  [SYS_mmap]      "mmap",
+  [SYS_munmap]    "munmap",
+  [SYS_msync]     "msync",
+  [SYS_madvise]   "madvise",
+  [SYS_memstat]   "memstat",
+  [SYS_mremap]    "mremap",
+  [SYS_fsync]     "fsync",
+  [SYS_fdatasync] "fdatasync",
+  [SYS_pread]     "pread",
+  [SYS_pwrite]    "pwrite",
+  [SYS_readv]     "readv",
+  [SYS_writev]    "writev",
+  [SYS_sendfile]  "sendfile",
+  [SYS_fcntl]     "fcntl",
+  [SYS_setpriority]"setpriority",
+  [SYS_cpustat]   "cpustat",
+  [SYS_clone]     "clone",
+  [SYS_futex]     "futex",
+  [SYS_lockstat]  "lockstat",
+  [SYS_spawn]     "spawn",
+  [SYS_nanosleep] "nanosleep",
+  [SYS_nanotime]  "nanotime",
+  [SYS_trace]     "trace",
+  [SYS_traceread] "traceread",
+  [SYS_sysstat]   "sysstat",
+  [SYS_yield]     "yield",
+  [SYS_prof]      "prof",
+  [SYS_profread]  "profread",
+  [SYS_uringsetup] "uringsetup",
+  [SYS_uringenter] "uringenter",
+};
+
+static char *statename[] = { "unused", "used", "sleeping", "runnable", "running", "zombie" };
+
+static struct traceev ev[64];
+
+static int
+classes(char *s)
+{
+  int mask = 0;
+
+  for(; *s; s++){
+    switch(*s){
+    case 's': mask |= TR_SYSCALL; break;
+    case 'f': mask |= TR_FAULT; break;
+    case 'w': mask |= TR_SWITCH; break;
+    case 'd': mask |= TR_DISK; break;
+    case 'l': mask |= TR_LOG; break;
+    default:
+      fprintf(2, "trace: unknown class %c\n", *s);
+      exit(1);
+    }
+  }
+  return mask;
+}
+
+static char*
+name(uint64 num)
+{
+  if(num < NELEM(sysname) && sysname[num])
+    return sysname[num];
+  return "?";
+}
+
+// print a time in CLINT_MTIME cycles as microseconds.
+static void
+usecs(uint64 t)
+{
+  printf("%d.%d", (int)(t / 10), (int)(t % 10));
+}
+
+// The time each pid entered its current system call.
+#define NENTER 64
+static struct {
+  int pid;
+  uint64 time;
+} enter[NENTER];
+
+static void
+show(struct traceev *e, uint64 t0)
+{
+  int i = e->pid % NENTER;
+
+  usecs(e->time - t0);
+  printf(" cpu%d pid %d ", e->cpu, e->pid);
+  switch(e->type){
+  case TE_SYSENTER:
+    enter[i].pid = e->pid;
+    enter[i].time = e->time;
+    printf("%s\n", name(e->a0));
+    break;
+  case TE_SYSEXIT:
+    printf("%s = %d", name(e->a0), (int)e->a1);
+    if(enter[i].pid == e->pid){
+      printf(" (");
+      usecs(e->time - enter[i].time);
+      printf(" us)");
+      enter[i].pid = 0;
+    }
+    printf("\n");
+    break;
+  case TE_FAULT:
+    printf("fault %p %s\n", e->a0, e->a1 ? "store" : "load");
+    break;
+  case TE_RUN:
+    printf("run\n");
+    break;
+  case TE_SWITCH:
+    printf("switch %s\n", e->a0 < NELEM(statename) ? statename[e->a0] : "?");
+    break;
+  case TE_DISKREAD:
+  case TE_DISKWRITE:
+  case TE_DISKDONE:
+    printf("disk %s %d+%d\n", e->type == TE_DISKREAD ? "read" :
+           e->type == TE_DISKWRITE ? "write" : "done", (int)e->a0, (int)e->a1);
+    break;
+  case TE_LOGCOMMIT:
+    printf("log commit %d, %d blocks\n", (int)e->a0, (int)e->a1);
+    break;
+  case TE_LOGDONE:
+    printf("log done %d\n", (int)e->a0);
+    break;
+  default:
+    printf("event %d\n", e->type);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, mask = TR_ALL, pid;
+  uint64 t0 = 0;
+
+  if(argc > 2 && strcmp(argv[1], "-e") == 0){
+    mask = classes(argv[2]);
+    argv += 2;
+    argc -= 2;
+    if(argc == 1){
+      trace(mask);
+      exit(0);
+    }
+  }
+
+  if(argc > 1){
+    // forget what was recorded before.
+    trace(0);
+    while(traceread(ev, NELEM(ev)) > 0)
+      ;
+    trace(mask);
+    if((pid = fork()) < 0){
+      fprintf(2, "trace: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      exec(argv[1], argv + 1);
+      fprintf(2, "trace: exec %s failed\n", argv[1]);
+      exit(1);
+    }
+    wait(0);
+  }
+  trace(0);
+
+  while((n = traceread(ev, NELEM(ev))) > 0){
+    if(t0 == 0)
+      t0 = ev[0].time;
+    for(i = 0; i < n; i++)
+      show(&ev[i], t0);
+  }
+  if(n < 0){
+    fprintf(2, "trace: traceread failed\n");
+    exit(1);
+  }
+  exit(0);
+}
@@ -1,8 +1,19 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
+#include "kernel/param.h"
+#include "kernel/riscv.h"
+#include "kernel/memlayout.h"
 #include "user/user.h"
 
+// the system call behind getpid().
+int _getpid(void);
+
+// memset, memcmp and memmove work a word at a time once the
+// pointers are aligned, as the kernel's do; see kernel/string.c.
+#define WORD sizeof(uint64)
+#define ALIGNED(p) (((uint64)(p) & (WORD-1)) == 0)
+
 char*
 strcpy(char *s, const char *t)
 {
@@ -36,10 +47,19 @@ void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uint64 w, *wdst;
+
+  for(; n > 0 && !ALIGNED(cdst); n--)
+    *cdst++ = c;
+  w = (uchar)c * 0x0101010101010101UL;
+  for(wdst = (uint64*)cdst; n >= 8*WORD; n -= 8*WORD, wdst += 8){
+    wdst[0] = w; wdst[1] = w; wdst[2] = w; wdst[3] = w;
+    wdst[4] = w; wdst[5] = w; wdst[6] = w; wdst[7] = w;
   }
+  for(; n >= WORD; n -= WORD)
+    *wdst++ = w;
+  for(cdst = (char*)wdst; n > 0; n--)
+    *cdst++ = c;
   return dst;
 }
 
@@ -52,6 +72,30 @@ strchr(const char *s, char c)
   return 0;
 }
 
+// Find byte c a word at a time once s is aligned: xored with
+// a word of c's, a word holding c has a zero byte, and then
+// taking one from each byte borrows into a byte whose top
+// bit was clear.
+void*
+memchr(const void *s, int c, uint n)
+{
+  const uchar *p = s;
+  uint64 w, cw = (uchar)c * 0x0101010101010101UL;
+
+  for(; n > 0 && !ALIGNED(p); n--, p++)
+    if(*p == (uchar)c)
+      return (void*)p;
+  for(; n >= WORD; n -= WORD, p += WORD){
+    w = *(uint64*)p ^ cw;
+    if((w - 0x0101010101010101UL) & ~w & 0x8080808080808080UL)
+      break;
+  }
+  for(; n > 0; n--, p++)
+    if(*p == (uchar)c)
+      return (void*)p;
+  return 0;
+}
+
 char*
 gets(char *buf, int max)
 {
@@ -100,15 +144,50 @@ memmove(void *vdst, const void *vsrc, int n)
 {
   char *dst;
   const char *src;
+  const uint64 *ws;
+  uint64 *wd;
+  int words;
 
+  if(n <= 0)
+    return vdst;
   dst = vdst;
   src = vsrc;
+  words = ((uint64)src & (WORD-1)) == ((uint64)dst & (WORD-1));
   if (src > dst) {
+    if(words){
+      for(; n > 0 && !ALIGNED(dst); n--)
+        *dst++ = *src++;
+      ws = (const uint64*)src;
+      wd = (uint64*)dst;
+      for(; n >= 8*WORD; n -= 8*WORD, ws += 8, wd += 8){
+        wd[0] = ws[0]; wd[1] = ws[1]; wd[2] = ws[2]; wd[3] = ws[3];
+        wd[4] = ws[4]; wd[5] = ws[5]; wd[6] = ws[6]; wd[7] = ws[7];
+      }
+      for(; n >= WORD; n -= WORD)
+        *wd++ = *ws++;
+      src = (const char*)ws;
+      dst = (char*)wd;
+    }
     while(n-- > 0)
       *dst++ = *src++;
   } else {
     dst += n;
     src += n;
+    if(words){
+      for(; n > 0 && !ALIGNED(dst); n--)
+        *--dst = *--src;
+      ws = (const uint64*)src;
+      wd = (uint64*)dst;
+      for(; n >= 8*WORD; n -= 8*WORD){
+        ws -= 8, wd -= 8;
+        wd[7] = ws[7]; wd[6] = ws[6]; wd[5] = ws[5]; wd[4] = ws[4];
+        wd[3] = ws[3]; wd[2] = ws[2]; wd[1] = ws[1]; wd[0] = ws[0];
+      }
+      for(; n >= WORD; n -= WORD)
+        *--wd = *--ws;
+      src = (const char*)ws;
+      dst = (char*)wd;
+    }
     while(n-- > 0)
       *--dst = *--src;
   }
@@ -119,6 +198,15 @@ int
 memcmp(const void *s1, const void *s2, uint n)
 {
   const char *p1 = s1, *p2 = s2;
+
+  if(((uint64)p1 & (WORD-1)) == ((uint64)p2 & (WORD-1))){
+    for(; n > 0 && !ALIGNED(p1); n--, p1++, p2++)
+      if(*p1 != *p2)
+        return *p1 - *p2;
+    // skip the words that match; the bytes find the difference.
+    for(; n >= WORD && *(uint64*)p1 == *(uint64*)p2; n -= WORD)
+      p1 += WORD, p2 += WORD;
+  }
   while (n-- > 0) {
     if (*p1 != *p2) {
       return *p1 - *p2;
@@ -134,3 +222,31 @@ memcpy(void *dst, const void *src, uint n)
 {
   return memmove(dst, src, n);
 }
+
+// These don't need to enter the kernel: getpid() reads the
+// page the kernel maps at USYSCALL, which says who the process
+// is, and uptime() and nanotime() read the time CSR, which the
+// kernel lets user space read.
+
+int
+getpid(void)
+{
+  struct usyscall *u = (struct usyscall*)USYSCALL;
+
+  // each of the process's threads has its own pid.
+  if(u->nthread > 1)
+    return _getpid();
+  return u->pid;
+}
+
+int
+uptime(void)
+{
+  return r_time() / TICKCYCLES;
+}
+
+uint64
+nanotime(void)
+{
+  return r_time() * (1000000000 / CLINT_FREQ);
+}
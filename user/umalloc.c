@@ -1,10 +1,27 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/riscv.h"
 #include "user/user.h"
 #include "kernel/param.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator.
+//
+// Small requests come from per-size bins: each bin is a list
+// of free blocks of one power-of-two size, so malloc and free
+// are a push or pop. Bins are refilled a chunk at a time from
+// the general allocator below and never give memory back.
+//
+// Medium requests use the first-fit free list of Kernighan and
+// Ritchie, The C programming Language, 2nd ed.  Section 8.7.
+//
+// Large requests get their own anonymous mapping, which free
+// hands straight back to the kernel.
+//
+// Every block starts with a Header whose size, in units,
+// says which of the three it came from; a large block that
+// had to fall back to the free list is told apart from a
+// mapped one by the mapped one's header pointing to itself.
 
 typedef long Align;
 
@@ -18,15 +35,31 @@ union header {
 
 typedef union header Header;
 
+#define NBIN     8                      // bins of 1, 2, 4, ... 128 units
+#define BINMAX   (1 << (NBIN-1))        // largest small block, in units
+#define CHUNK    (PGSIZE/sizeof(Header)) // least units per bin refill
+#define LARGE    (8*PGSIZE/sizeof(Header)) // units from which to mmap
+
 static Header base;
 static Header *freep;
+static Header *bins[NBIN];
 
-void
-free(void *ap)
+// Return the bin for blocks of nunits, which must be at most BINMAX.
+static int
+binof(uint nunits)
 {
-  Header *bp, *p;
+  int b = 0;
+
+  while((1 << b) < nunits)
+    b++;
+  return b;
+}
+
+static void
+krfree(Header *bp)
+{
+  Header *p;
 
-  bp = (Header*)ap - 1;
   for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
     if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
       break;
@@ -43,6 +76,27 @@ free(void *ap)
   freep = p;
 }
 
+void
+free(void *ap)
+{
+  Header *bp;
+  int b;
+
+  if(ap == 0)
+    return;
+  bp = (Header*)ap - 1;
+  if(bp->s.size <= BINMAX){
+    b = binof(bp->s.size);
+    bp->s.ptr = bins[b];
+    bins[b] = bp;
+#ifdef LAB_MMAP
+  } else if(bp->s.size >= LARGE && bp->s.ptr == bp){
+    munmap(bp, PGROUNDUP(bp->s.size * sizeof(Header)));
+#endif
+  } else
+    krfree(bp);
+}
+
 static Header*
 morecore(uint nu)
 {
@@ -56,17 +110,18 @@ morecore(uint nu)
     return 0;
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  krfree(hp);
   return freep;
 }
 
-void*
-malloc(uint nbytes)
+// First-fit allocation of nunits, header included, from the
+// free list. Returns a pointer to the block's first unit
+// after the header, or 0.
+static void*
+kralloc(uint nunits)
 {
   Header *p, *prevp;
-  uint nunits;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
   if((prevp = freep) == 0){
     base.s.ptr = freep = prevp = &base;
     base.s.size = 0;
@@ -81,6 +136,7 @@ malloc(uint nbytes)
         p->s.size = nunits;
       }
       freep = prevp;
+      p->s.ptr = 0;
       return (void*)(p + 1);
     }
     if(p == freep)
@@ -88,3 +144,55 @@ malloc(uint nbytes)
         return 0;
   }
 }
+
+// Carve a chunk from the general allocator into free
+// blocks of bin b. Returns 0 if out of memory.
+static int
+binrefill(int b)
+{
+  Header *p, *end;
+  uint n = 1 << b, m = CHUNK;
+
+  if(m < 16*n)
+    m = 16*n;
+  if((p = kralloc(m)) == 0)
+    return -1;
+  // the chunk keeps its own header, so it is never freed.
+  for(end = p + m - 1; p + n <= end; p += n){
+    p->s.size = n;
+    p->s.ptr = bins[b];
+    bins[b] = p;
+  }
+  return 0;
+}
+
+void*
+malloc(uint nbytes)
+{
+  Header *p;
+  uint nunits;
+  int b;
+
+  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
+  if(nunits <= BINMAX){
+    b = binof(nunits);
+    if(bins[b] == 0 && binrefill(b) < 0)
+      return 0;
+    p = bins[b];
+    bins[b] = p->s.ptr;
+    return (void*)(p + 1);
+  }
+#ifdef LAB_MMAP
+  if(nunits >= LARGE){
+    p = mmap(0, PGROUNDUP(nunits * sizeof(Header)), PROT_READ|PROT_WRITE,
+             MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(p != (Header*)-1){
+      p->s.size = nunits;
+      p->s.ptr = p;
+      return (void*)(p + 1);
+    }
+    // out of regions: fall back to the heap.
+  }
+#endif
+  return kralloc(nunits);
+}
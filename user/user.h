@@ -1,5 +1,13 @@
 struct stat;
 struct rtcdate;
+struct memstat;
+struct cpustat;
+struct lockstat;
+struct traceev;
+struct sysstat;
+struct profsample;
+struct uring;
+struct iovec;
 
 // system calls
 int fork(void);
@@ -19,12 +27,37 @@ int link(const char*, const char*);
 int mkdir(const char*);
 int chdir(const char*);
 int dup(int);
-int getpid(void);
 char* sbrk(int);
 int sleep(int);
-int uptime(void);
 void* mmap(void*, int, int, int, int, int);
 int munmap(void*, int);
+int msync(void*, int, int);
+int madvise(void*, int, int);
+int memstat(int, struct memstat*);
+void* mremap(void*, int, int, int);
+int fsync(int);
+int fdatasync(int);
+int pread(int, void*, int, int);
+int pwrite(int, const void*, int, int);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
+int sendfile(int, int, int, int);
+int fcntl(int, int, int);
+int setpriority(int, int);
+int cpustat(struct cpustat*, int);
+int clone(void (*)(void*), void*, void*);
+int futex(int*, int, int);
+int lockstat(struct lockstat*, int);
+int spawn(const char*, char**, int*);
+int nanosleep(uint64);
+int trace(int);
+int traceread(struct traceev*, int);
+int sysstat(struct sysstat*, int);
+int yield(void);
+int prof(int);
+int profread(struct profsample*, int);
+struct uring* uringsetup(void);
+int uringenter(int, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -41,4 +74,8 @@ void* malloc(uint);
 void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
+void* memchr(const void*, int, uint);
 void *memcpy(void *, const void *, uint);
+int getpid(void);
+int uptime(void);
+uint64 nanotime(void);
@@ -7,6 +7,11 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/memstat.h"
+#include "kernel/cpustat.h"
+#include "kernel/trace.h"
+#include "kernel/sysstat.h"
+#include "kernel/uring.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -1012,10 +1017,10 @@ forkforkfork(char *s)
     exit(0);
   }
 
-  sleep(20); // two seconds
+  sleep(200); // two seconds
   close(open("stopforking", O_CREATE|O_RDWR));
   wait(0);
-  sleep(10); // one second
+  sleep(100); // one second
 }
 
 // regression test. does reparent() violate the parent-then-child
@@ -1865,6 +1870,1007 @@ bigfile(char *s)
   unlink("bigfile.dat");
 }
 
+// two files growing a block at a time, by turns, each
+// into the run of blocks reserved for it.
+void
+interleave(char *s)
+{
+  enum { N = 300 };
+  char *names[2] = { "ileave0", "ileave1" };
+  int fd[2], i, j;
+
+  for(j = 0; j < 2; j++){
+    unlink(names[j]);
+    if((fd[j] = open(names[j], O_CREATE|O_RDWR)) < 0){
+      printf("%s: cannot create %s\n", s, names[j]);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    for(j = 0; j < 2; j++){
+      ((int*)buf)[0] = i;
+      ((int*)buf)[1] = j;
+      if(write(fd[j], buf, BSIZE) != BSIZE){
+        printf("%s: write %s failed\n", s, names[j]);
+        exit(1);
+      }
+    }
+  }
+  for(j = 0; j < 2; j++){
+    close(fd[j]);
+    if((fd[j] = open(names[j], O_RDONLY)) < 0){
+      printf("%s: cannot open %s\n", s, names[j]);
+      exit(1);
+    }
+    for(i = 0; i < N; i++){
+      if(read(fd[j], buf, BSIZE) != BSIZE){
+        printf("%s: read %s failed\n", s, names[j]);
+        exit(1);
+      }
+      if(((int*)buf)[0] != i || ((int*)buf)[1] != j){
+        printf("%s: %s block %d is wrong\n", s, names[j], i);
+        exit(1);
+      }
+    }
+    if(read(fd[j], buf, BSIZE) != 0){
+      printf("%s: %s too long\n", s, names[j]);
+      exit(1);
+    }
+    close(fd[j]);
+    unlink(names[j]);
+  }
+}
+
+// create and delete more files than there are inodes,
+// so that ialloc()'s cursor wraps around.
+void
+inodewrap(char *s)
+{
+  enum { N = 500 };
+  int i, fd;
+
+  for(i = 0; i < N; i++){
+    fd = open("iwrap", O_CREATE|O_RDWR);
+    if(fd < 0){
+      printf("%s: create %d failed\n", s, i);
+      exit(1);
+    }
+    if(write(fd, "x", 1) != 1){
+      printf("%s: write %d failed\n", s, i);
+      exit(1);
+    }
+    close(fd);
+    if(unlink("iwrap") < 0){
+      printf("%s: unlink %d failed\n", s, i);
+      exit(1);
+    }
+  }
+}
+
+// names that come and go, looked up before and after, so
+// that cached lookups, missing names included, go stale
+// if unlink, create or rmdir fail to keep them right.
+void
+namecache(char *s)
+{
+  struct stat st, root;
+  int fd, i;
+
+  if(stat("/", &root) < 0){
+    printf("%s: stat / failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 3; i++){
+    if(mkdir("ncdir") < 0){
+      printf("%s: mkdir ncdir failed\n", s);
+      exit(1);
+    }
+    if(open("ncdir/a", O_RDONLY) >= 0){
+      printf("%s: ncdir/a exists before create\n", s);
+      exit(1);
+    }
+    if((fd = open("ncdir/a", O_CREATE|O_RDWR)) < 0){
+      printf("%s: create ncdir/a failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if((fd = open("ncdir/a", O_RDONLY)) < 0){
+      printf("%s: ncdir/a missing after create\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(stat("ncdir/..", &st) < 0 || st.ino != root.ino){
+      printf("%s: ncdir/.. is not /\n", s);
+      exit(1);
+    }
+    if(unlink("ncdir/a") < 0){
+      printf("%s: unlink ncdir/a failed\n", s);
+      exit(1);
+    }
+    if(open("ncdir/a", O_RDONLY) >= 0){
+      printf("%s: ncdir/a exists after unlink\n", s);
+      exit(1);
+    }
+    if(unlink("ncdir") < 0){
+      printf("%s: unlink ncdir failed\n", s);
+      exit(1);
+    }
+    if(open("ncdir", O_RDONLY) >= 0){
+      printf("%s: ncdir exists after unlink\n", s);
+      exit(1);
+    }
+  }
+}
+
+void
+fsynctest(char *s)
+{
+  int fd, fds[2], i;
+
+  fd = open("fsyncf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create fsyncf failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 20; i++){
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write fsyncf failed\n", s);
+      exit(1);
+    }
+    if((i % 2 ? fdatasync(fd) : fsync(fd)) != 0){
+      printf("%s: fsync fsyncf failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  if(unlink("fsyncf") < 0){
+    printf("%s: unlink fsyncf failed\n", s);
+    exit(1);
+  }
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(fsync(fds[0]) != -1){
+    printf("%s: fsync of a pipe succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  if(fsync(fds[0]) != -1){
+    printf("%s: fsync of a closed fd succeeded\n", s);
+    exit(1);
+  }
+}
+
+// O_DIRECT reads and writes of whole blocks, and the
+// buffered fallback for the rest, see the same data as
+// ordinary reads and writes.
+void
+directio(char *s)
+{
+  enum { N = 8 };
+  char *p;
+  int fd, i, j;
+
+  p = sbrk((N+1)*BSIZE);
+  if(p == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  p = (char*)(((uint64)p + BSIZE-1) & ~(uint64)(BSIZE-1));
+
+  fd = open("directf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create directf failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf, 'a' + i, BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write directf failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fd = open("directf", O_RDWR|O_DIRECT);
+  if(fd < 0){
+    printf("%s: open directf O_DIRECT failed\n", s);
+    exit(1);
+  }
+  if(read(fd, p, N*BSIZE) != N*BSIZE){
+    printf("%s: direct read failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    for(j = 0; j < BSIZE; j++)
+      if(p[i*BSIZE + j] != 'a' + i){
+        printf("%s: direct read got the wrong data\n", s);
+        exit(1);
+      }
+  // overwrite in place, then append past the end,
+  // which has to go through the cache.
+  close(fd);
+  memset(p, 'z', N*BSIZE);
+  fd = open("directf", O_WRONLY|O_DIRECT);
+  if(fd < 0 || write(fd, p, N*BSIZE) != N*BSIZE ||
+     write(fd, p, 10) != 10){
+    printf("%s: direct write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("directf", O_RDONLY);
+  for(i = 0; i < N; i++){
+    if(read(fd, buf, BSIZE) != BSIZE){
+      printf("%s: read directf failed\n", s);
+      exit(1);
+    }
+    for(j = 0; j < BSIZE; j++)
+      if(buf[j] != 'z'){
+        printf("%s: direct write not seen\n", s);
+        exit(1);
+      }
+  }
+  if(read(fd, buf, BSIZE) != 10){
+    printf("%s: appended bytes missing\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("directf");
+}
+
+// pread/pwrite don't use or move the file offset, and
+// readv/writev move a list of buffers in one call.
+void
+preadv(char *s)
+{
+  struct iovec iov[3];
+  char a[8], b[8];
+  int fd, fds[2];
+
+  fd = open("preadf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create preadf failed\n", s);
+    exit(1);
+  }
+  if(write(fd, "0123456789", 10) != 10){
+    printf("%s: write preadf failed\n", s);
+    exit(1);
+  }
+  if(pwrite(fd, "ab", 2, 4) != 2){
+    printf("%s: pwrite failed\n", s);
+    exit(1);
+  }
+  memset(a, 0, sizeof(a));
+  if(pread(fd, a, 4, 3) != 4 || memcmp(a, "3ab6", 4) != 0){
+    printf("%s: pread got the wrong data\n", s);
+    exit(1);
+  }
+  // the offset is still at the end.
+  if(read(fd, a, 1) != 0){
+    printf("%s: pread/pwrite moved the offset\n", s);
+    exit(1);
+  }
+
+  iov[0].iov_base = "xy";
+  iov[0].iov_len = 2;
+  iov[1].iov_base = "";
+  iov[1].iov_len = 0;
+  iov[2].iov_base = "zzz";
+  iov[2].iov_len = 3;
+  if(writev(fd, iov, 3) != 5){
+    printf("%s: writev failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("preadf", O_RDONLY);
+  memset(a, 0, sizeof(a));
+  memset(b, 0, sizeof(b));
+  iov[0].iov_base = a;
+  iov[0].iov_len = 8;
+  iov[1].iov_base = b;
+  iov[1].iov_len = 8;
+  if(readv(fd, iov, 2) != 15 || memcmp(a, "0123ab67", 8) != 0 ||
+     memcmp(b, "89xyzzz", 7) != 0){
+    printf("%s: readv got the wrong data\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("preadf");
+
+  // pipes have no offset.
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(pwrite(fds[1], "x", 1, 0) != -1 || pread(fds[0], a, 1, 0) != -1){
+    printf("%s: pread/pwrite of a pipe succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// sendfile() from a file into a pipe, between files,
+// and from a pipe into a file.
+void
+sendfiletest(char *s)
+{
+  enum { N = 3000 };
+  int fd, fd2, fds[2], i, n, pid, xstatus;
+
+  fd = open("sendf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create sendf failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    buf[i] = i % 251;
+  if(write(fd, buf, N) != N){
+    printf("%s: write sendf failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[1]);
+    for(i = 0; (n = read(fds[0], buf, sizeof(buf))) > 0; ){
+      for(int j = 0; j < n; j++, i++)
+        if((uchar)buf[j] != i % 251){
+          printf("%s: wrong byte from pipe\n", s);
+          exit(1);
+        }
+    }
+    exit(i == N ? 0 : 1);
+  }
+  close(fds[0]);
+  fd = open("sendf", O_RDONLY);
+  if(sendfile(fds[1], fd, -1, N+100) != N){
+    printf("%s: sendfile to a pipe failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+
+  // at an offset: fd's own offset stays at the end.
+  fd2 = open("sendf2", O_CREATE|O_RDWR);
+  if(fd2 < 0 || sendfile(fd2, fd, 100, 50) != 50 || read(fd, buf, 1) != 0){
+    printf("%s: sendfile to a file failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], "tail", 4) != 4 || sendfile(fd2, fds[0], -1, 100) != 4){
+    printf("%s: sendfile from a pipe failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  close(fd2);
+
+  fd2 = open("sendf2", O_RDONLY);
+  if(read(fd2, buf, sizeof(buf)) != 54 || memcmp(buf+50, "tail", 4) != 0){
+    printf("%s: sendf2 has the wrong data\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 50; i++)
+    if((uchar)buf[i] != (100 + i) % 251){
+      printf("%s: sendf2 has the wrong data\n", s);
+      exit(1);
+    }
+  close(fd2);
+  unlink("sendf");
+  unlink("sendf2");
+}
+
+// a pipe's buffer can grow with F_SETPIPE_SZ, keeping the
+// data in it, but not shrink below the data.
+void
+piperesize(char *s)
+{
+  int fds[2], i, n, sz;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if((sz = fcntl(fds[0], F_GETPIPE_SZ, 0)) < 512){
+    printf("%s: F_GETPIPE_SZ failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < BUFSZ; i++)
+    buf[i] = i % 253;
+  if(write(fds[1], buf, sz) != sz){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if(fcntl(fds[1], F_SETPIPE_SZ, sz/2) != -1){
+    printf("%s: pipe shrank below its data\n", s);
+    exit(1);
+  }
+  if(fcntl(fds[1], F_SETPIPE_SZ, sz + BUFSZ) < sz + BUFSZ){
+    printf("%s: F_SETPIPE_SZ failed\n", s);
+    exit(1);
+  }
+  // this fits now, so doesn't wait for a reader.
+  if(write(fds[1], buf + sz % 253, BUFSZ - 253) != BUFSZ - 253){
+    printf("%s: write after resize failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  for(i = 0; (n = read(fds[0], buf, 1000)) > 0; i += n)
+    for(int j = 0; j < n; j++)
+      if((uchar)buf[j] != (i + j) % 253){
+        printf("%s: wrong byte %d\n", s, i + j);
+        exit(1);
+      }
+  if(i != sz + BUFSZ - 253){
+    printf("%s: read %d bytes\n", s, i);
+    exit(1);
+  }
+  close(fds[0]);
+
+  fds[0] = open("echo", O_RDONLY);
+  if(fds[0] < 0 || fcntl(fds[0], F_GETPIPE_SZ, 0) != -1){
+    printf("%s: F_GETPIPE_SZ of a file succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+}
+
+// /tmp is a separate, RAM-backed file system.
+void
+tmpfs(char *s)
+{
+  struct stat st, rst;
+  int fd;
+
+  if(stat("/", &rst) < 0 || stat("/tmp", &st) < 0 || st.type != T_DIR){
+    printf("%s: stat /tmp failed\n", s);
+    exit(1);
+  }
+  if(st.dev == rst.dev){
+    printf("%s: /tmp is on the root device\n", s);
+    exit(1);
+  }
+
+  fd = open("/tmp/tmpf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create /tmp/tmpf failed\n", s);
+    exit(1);
+  }
+  memset(buf, 't', BUFSZ);
+  if(write(fd, buf, BUFSZ) != BUFSZ){
+    printf("%s: write /tmp/tmpf failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // into and back out of the mount.
+  if(chdir("/tmp") < 0 || stat("tmpf", &st) < 0 || chdir("..") < 0 ||
+     (fd = open("tmp/tmpf", O_RDONLY)) < 0){
+    printf("%s: path through /tmp failed\n", s);
+    exit(1);
+  }
+  memset(buf, 0, BUFSZ);
+  if(read(fd, buf, BUFSZ) != BUFSZ || buf[0] != 't' || buf[BUFSZ-1] != 't'){
+    printf("%s: read /tmp/tmpf failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(stat("/tmp/..", &st) < 0 || st.dev != rst.dev || st.ino != rst.ino){
+    printf("%s: /tmp/.. isn't /\n", s);
+    exit(1);
+  }
+
+  if(link("/tmp/tmpf", "tmplink") == 0){
+    printf("%s: link across file systems succeeded\n", s);
+    exit(1);
+  }
+  if(unlink("/tmp") == 0){
+    printf("%s: unlink of the mount point succeeded\n", s);
+    exit(1);
+  }
+  if(unlink("/tmp/tmpf") < 0){
+    printf("%s: unlink /tmp/tmpf failed\n", s);
+    exit(1);
+  }
+}
+
+// setpriority() checks its arguments, and a process at the
+// top level that sleeps a lot gets the CPU promptly while
+// lower-level processes compute.
+void
+priority(char *s)
+{
+  int i, pid, pids[4], t0;
+
+  if(setpriority(0, NPRIO) >= 0 || setpriority(0, -1) >= 0){
+    printf("%s: setpriority accepted a bad level\n", s);
+    exit(1);
+  }
+  if(setpriority(0x7fffffff, 0) >= 0){
+    printf("%s: setpriority of a missing pid succeeded\n", s);
+    exit(1);
+  }
+  if(setpriority(0, 1) != 0 || setpriority(getpid(), 0) != 1){
+    printf("%s: setpriority didn't return the old level\n", s);
+    exit(1);
+  }
+
+  for(i = 0; i < 4; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pids[i] == 0){
+      setpriority(0, NPRIO-1);
+      for(;;)
+        ;
+    }
+  }
+  t0 = uptime();
+  for(i = 0; i < 20; i++)
+    sleep(1);
+  t0 = uptime() - t0;
+  for(i = 0; i < 4; i++){
+    kill(pids[i]);
+    wait(&pid);
+  }
+  if(t0 > 200){
+    printf("%s: 20 sleeps took %d ticks behind busy processes\n", s, t0);
+    exit(1);
+  }
+}
+
+// cpustat() reports each running CPU, with no more idle time
+// than time, and a CPU that had nothing to run has some idle.
+void
+cpustattest(char *s)
+{
+  struct cpustat cs[NCPU];
+  int i, n;
+  uint64 idle = 0;
+
+  sleep(10);
+  if((n = cpustat(cs, NCPU)) < 1){
+    printf("%s: cpustat returned %d\n", s, n);
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    if(cs[i].idle > cs[i].uptime){
+      printf("%s: cpu %d idle longer than up\n", s, i);
+      exit(1);
+    }
+    idle += cs[i].idle;
+  }
+  if(idle == 0){
+    printf("%s: no cpu was ever idle\n", s);
+    exit(1);
+  }
+}
+
+// threads made by clone() share memory, so they see one
+// another's counts, futex() wakes a waiter, and sbrk() in
+// one thread grows them all.
+static int tcount, tflag;
+static char *tbrk;
+
+static void
+threadinc(void *arg)
+{
+  int i;
+
+  for(i = 0; i < 1000; i++)
+    __atomic_fetch_add(&tcount, 1, __ATOMIC_SEQ_CST);
+  exit(0);
+}
+
+static void
+threadwaiter(void *arg)
+{
+  while(__atomic_load_n(&tflag, __ATOMIC_SEQ_CST) == 0)
+    futex(&tflag, FUTEX_WAIT, 0);
+  tbrk = sbrk(PGSIZE);
+  if(tbrk != (char*)-1)
+    tbrk[0] = 'x';
+  exit(0);
+}
+
+void
+threadtest(char *s)
+{
+  char *stacks[5];
+  int i, xstatus;
+
+  for(i = 0; i < 5; i++){
+    if((stacks[i] = malloc(PGSIZE)) == 0){
+      printf("%s: malloc failed\n", s);
+      exit(1);
+    }
+  }
+  tcount = 0;
+  for(i = 0; i < 4; i++){
+    if(clone(threadinc, 0, stacks[i] + PGSIZE) < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < 4; i++){
+    if(wait(&xstatus) < 0 || xstatus != 0){
+      printf("%s: thread failed\n", s);
+      exit(1);
+    }
+  }
+  if(tcount != 4000){
+    printf("%s: count %d, not 4000\n", s, tcount);
+    exit(1);
+  }
+
+  tflag = 0;
+  tbrk = 0;
+  if(clone(threadwaiter, 0, stacks[4] + PGSIZE) < 0){
+    printf("%s: clone failed\n", s);
+    exit(1);
+  }
+  sleep(2);
+  __atomic_store_n(&tflag, 1, __ATOMIC_SEQ_CST);
+  futex(&tflag, FUTEX_WAKE, 1);
+  if(wait(&xstatus) < 0 || xstatus != 0){
+    printf("%s: waiter failed\n", s);
+    exit(1);
+  }
+  if(tbrk == 0 || tbrk == (char*)-1 || tbrk[0] != 'x'){
+    printf("%s: thread's sbrk not shared\n", s);
+    exit(1);
+  }
+  if(futex(&tflag, FUTEX_WAIT, 0) != -1){
+    printf("%s: futex waited on a changed word\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 5; i++)
+    free(stacks[i]);
+}
+
+// several processes reading, and faulting in a mapping of,
+// the same file at once all see its content.
+void
+sharedread(char *s)
+{
+  int fd, i, j, k, pid, xstatus;
+  char *m;
+  static char sbuf[1024];
+
+  unlink("sharedread");
+  if((fd = open("sharedread", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 16; i++){
+    memset(sbuf, 'a' + i, sizeof(sbuf));
+    if(write(fd, sbuf, sizeof(sbuf)) != sizeof(sbuf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  for(k = 0; k < 4; k++){
+    if((pid = fork()) < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(j = 0; j < 10; j++){
+        if((fd = open("sharedread", O_RDONLY)) < 0)
+          exit(1);
+        for(i = 0; i < 16; i++)
+          if(read(fd, sbuf, sizeof(sbuf)) != sizeof(sbuf) ||
+             sbuf[0] != 'a' + i || sbuf[sizeof(sbuf)-1] != 'a' + i)
+            exit(1);
+        m = mmap(0, 16*sizeof(sbuf), PROT_READ, MAP_SHARED, fd, 0);
+        if(m == (char*)-1)
+          exit(1);
+        for(i = 0; i < 16; i++)
+          if(m[i*sizeof(sbuf)] != 'a' + i)
+            exit(1);
+        munmap(m, 16*sizeof(sbuf));
+        close(fd);
+      }
+      exit(0);
+    }
+  }
+  for(k = 0; k < 4; k++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: a reader saw the wrong data\n", s);
+      exit(1);
+    }
+  }
+  unlink("sharedread");
+}
+
+// nanosleep() sleeps at least as long as asked, and not
+// a great deal longer.
+void
+nanosleeptest(char *s)
+{
+  uint64 t0, t1;
+
+  t0 = nanotime();
+  if(nanosleep(5000000) < 0){
+    printf("%s: nanosleep failed\n", s);
+    exit(1);
+  }
+  t1 = nanotime();
+  if(t1 - t0 < 5000000){
+    printf("%s: woke after %d ns, not 5 ms\n", s, (int)(t1 - t0));
+    exit(1);
+  }
+  if(t1 - t0 > 1000000000){
+    printf("%s: slept %d ms for 5\n", s, (int)((t1 - t0) / 1000000));
+    exit(1);
+  }
+}
+
+// getpid() and uptime() read the USYSCALL page and the
+// time without a system call; they must still be right,
+// and the page must be read-only.
+void
+usyscalltest(char *s)
+{
+  int pid, xstatus, t0;
+
+  t0 = uptime();
+  sleep(2);
+  if(uptime() < t0 + 2){
+    printf("%s: uptime went from %d to %d over sleep(2)\n", s, t0, uptime());
+    exit(1);
+  }
+
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(getpid() & 0x7f);
+  wait(&xstatus);
+  if(xstatus != (pid & 0x7f)){
+    printf("%s: child's getpid() was wrong\n", s);
+    exit(1);
+  }
+
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    *(int*)USYSCALL = 0;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: wrote the usyscall page\n", s);
+    exit(1);
+  }
+}
+
+// with system calls traced, a failing close() should show
+// up as an entry and an exit, in time order.
+void
+tracetest(char *s)
+{
+  static struct traceev ev[64];
+  int i, n, old, pid = getpid(), found = 0;
+  uint64 last = 0;
+
+  old = trace(0);
+  while(traceread(ev, 64) > 0)
+    ;
+  trace(TR_SYSCALL);
+  close(-1);
+  trace(old);
+
+  while((n = traceread(ev, 64)) > 0){
+    for(i = 0; i < n; i++){
+      if(ev[i].time < last){
+        printf("%s: events out of order\n", s);
+        exit(1);
+      }
+      last = ev[i].time;
+      if(ev[i].pid != pid || ev[i].a0 != SYS_close)
+        continue;
+      if(ev[i].type == TE_SYSENTER && found == 0)
+        found = 1;
+      else if(ev[i].type == TE_SYSEXIT && found == 1 && (int)ev[i].a1 == -1)
+        found = 2;
+    }
+  }
+  if(n < 0){
+    printf("%s: traceread failed\n", s);
+    exit(1);
+  }
+  if(found != 2){
+    printf("%s: close() wasn't traced\n", s);
+    exit(1);
+  }
+}
+
+// each system call should be counted, once in its
+// histogram for each call.
+void
+sysstattest(char *s)
+{
+  static struct sysstat before[SYS_close+1], after[SYS_close+1];
+  uint64 n;
+  int i;
+
+  if(sysstat(before, SYS_close+1) != SYS_close+1){
+    printf("%s: sysstat failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 10; i++)
+    close(-1);
+  if(sysstat(after, SYS_close+1) != SYS_close+1){
+    printf("%s: sysstat failed\n", s);
+    exit(1);
+  }
+  if(after[SYS_close].calls < before[SYS_close].calls + 10){
+    printf("%s: close() counted %d times, not 10\n", s,
+           (int)(after[SYS_close].calls - before[SYS_close].calls));
+    exit(1);
+  }
+  for(n = 0, i = 0; i < NSYSHIST; i++)
+    n += after[SYS_close].hist[i];
+  if(n != after[SYS_close].calls){
+    printf("%s: histogram holds %d calls, not %d\n", s, (int)n,
+           (int)after[SYS_close].calls);
+    exit(1);
+  }
+}
+
+// queue request op on ring r, to be handed back as data.
+void
+urqueue(struct uring *r, int op, int flags, int fd, char *addr, int len, int off, uint64 data)
+{
+  struct ursqe *e = &r->sq[r->sqtail % NURSQ];
+
+  e->op = op;
+  e->flags = flags;
+  e->fd = fd;
+  e->addr = (uint64)addr;
+  e->len = len;
+  e->off = off;
+  e->data = data;
+  __sync_synchronize();
+  r->sqtail++;
+}
+
+// take ring r's completions, filling in res[] by their data.
+void
+urreap(struct uring *r, int *res)
+{
+  struct urcqe *c;
+
+  while(r->cqhead != r->cqtail){
+    __sync_synchronize();
+    c = &r->cq[r->cqhead % NURCQ];
+    res[c->data] = c->res;
+    r->cqhead++;
+  }
+}
+
+// a batch of requests should be done by one uringenter(), and
+// an asynchronous read should wait on its pipe without holding
+// up the rest, or exit().
+void
+uringtest(char *s)
+{
+  static char buf[32];
+  struct uring *r;
+  int fds[2], res[8], fd, i, pid, xstatus;
+
+  if((r = uringsetup()) != (struct uring*)URING){
+    printf("%s: uringsetup failed\n", s);
+    exit(1);
+  }
+  if(uringsetup() != (struct uring*)-1){
+    printf("%s: second uringsetup succeeded\n", s);
+    exit(1);
+  }
+
+  // the read waits for the write after it.
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  urqueue(r, UR_READ, URF_ASYNC, fds[0], buf, 5, 0, 0);
+  urqueue(r, UR_WRITE, 0, fds[1], "hello", 5, 0, 1);
+  urqueue(r, UR_READ, 0, 99, buf, 1, 0, 2);
+  for(i = 0; i < 3; i++)
+    res[i] = -2;
+  if(uringenter(3, 3) != 3){
+    printf("%s: uringenter failed\n", s);
+    exit(1);
+  }
+  urreap(r, res);
+  if(res[0] != 5 || res[1] != 5 || res[2] != -1 || memcmp(buf, "hello", 5) != 0){
+    printf("%s: pipe requests gave %d %d %d\n", s, res[0], res[1], res[2]);
+    exit(1);
+  }
+
+  // positioned writes, then a close, in one batch.
+  if((fd = open("uringfile", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  urqueue(r, UR_PWRITE, 0, fd, "cc", 2, 4, 0);
+  urqueue(r, UR_PWRITE, URF_ASYNC, fd, "bb", 2, 2, 1);
+  urqueue(r, UR_PWRITE, 0, fd, "aa", 2, 0, 2);
+  if(uringenter(3, 3) != 3){
+    printf("%s: uringenter failed\n", s);
+    exit(1);
+  }
+  urqueue(r, UR_CLOSE, 0, fd, 0, 0, 0, 3);
+  if(uringenter(1, 1) != 1){
+    printf("%s: uringenter failed\n", s);
+    exit(1);
+  }
+  urreap(r, res);
+  for(i = 0; i < 4; i++){
+    if(res[i] != (i < 3 ? 2 : 0)){
+      printf("%s: request %d gave %d\n", s, i, res[i]);
+      exit(1);
+    }
+  }
+  if((fd = open("uringfile", O_RDONLY)) < 0 || read(fd, buf, sizeof(buf)) != 6 ||
+     memcmp(buf, "aabbcc", 6) != 0){
+    printf("%s: file doesn't hold what was written\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("uringfile");
+
+  // a read on a pipe no one writes to mustn't keep exit() waiting.
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if((r = uringsetup()) == (struct uring*)-1 || pipe(fds) < 0)
+      exit(1);
+    urqueue(r, UR_READ, URF_ASYNC, fds[0], buf, 1, 0, 0);
+    if(uringenter(1, 0) != 1)
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child failed\n", s);
+    exit(1);
+  }
+}
+
 void
 fourteen(char *s)
 {
@@ -2080,6 +3086,178 @@ forktest(char *s)
   }
 }
 
+// fork a process holding more than half of physical memory,
+// which only works if fork shares pages copy-on-write, and
+// check that stores in the child don't show up in the parent.
+void
+cowfork(char *s)
+{
+  enum { SZ = 70*1024*1024 };
+  int pid, ppid, xstatus;
+  char *a, *b;
+
+  a = sbrk(SZ);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  ppid = getpid();
+  for(b = a; b < a+SZ; b += 4096)
+    *(int*)b = ppid;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(b = a; b < a+SZ; b += 4096*64){
+      if(*(int*)b != ppid)
+        exit(1);
+      *(int*)b = getpid();
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong data\n", s);
+    exit(1);
+  }
+  for(b = a; b < a+SZ; b += 4096){
+    if(*(int*)b != ppid){
+      printf("%s: child's store showed up in parent\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-SZ);
+}
+
+// sbrk() more than physical memory, which only works if
+// pages are allocated on first touch, and check that
+// system calls can read and write untouched heap pages.
+void
+sbrklazy(char *s)
+{
+  enum { SZ = 512*1024*1024 };
+  char *a;
+  int fds[2];
+
+  a = sbrk(SZ);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  if(a[0] != 0 || a[SZ-1] != 0){
+    printf("%s: heap not zero\n", s);
+    exit(1);
+  }
+  a[SZ/2] = 'x';
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], a + SZ/2, 1) != 1 || read(fds[0], a + SZ/4, 1) != 1){
+    printf("%s: read/write of heap failed\n", s);
+    exit(1);
+  }
+  if(a[SZ/4] != 'x'){
+    printf("%s: wrong data\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-SZ);
+}
+
+// memstat() should see heap pages appear as they are touched,
+// and count the faults that brought them in.
+void
+memstattest(char *s)
+{
+  enum { N = 10 };
+  struct memstat before, after;
+  char *a;
+  int i;
+
+  a = sbrk(N*PGSIZE);
+  if(memstat(getpid(), &before) < 0 || before.pid != getpid()){
+    printf("%s: memstat failed\n", s);
+    exit(1);
+  }
+  if(before.sz != (uint64)a + N*PGSIZE || before.free > before.total){
+    printf("%s: bad memstat\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    a[i*PGSIZE] = 1;
+  if(memstat(getpid(), &after) < 0){
+    printf("%s: memstat failed\n", s);
+    exit(1);
+  }
+  if(after.heap < before.heap + N || after.faults < before.faults + N){
+    printf("%s: heap %d -> %d, faults %d -> %d\n", s, (int)before.heap,
+           (int)after.heap, (int)before.faults, (int)after.faults);
+    exit(1);
+  }
+  sbrk(-N*PGSIZE);
+  if(memstat(0x7fffffff, &after) == 0){
+    printf("%s: memstat of missing pid succeeded\n", s);
+    exit(1);
+  }
+}
+
+// blocks of every size class, including ones big enough to be
+// mapped, must not overlap and must survive being freed and
+// reused; freeing a big block should give its memory back.
+void
+malloctest(char *s)
+{
+  enum { N = 64, BIG = 256*1024 };
+  char *p[N];
+  struct memstat before, after;
+  int i, j, n;
+
+  for(i = 0; i < N; i++){
+    n = (i % 16) * 97 + 1;
+    if((p[i] = malloc(n)) == 0){
+      printf("%s: malloc(%d) failed\n", s, n);
+      exit(1);
+    }
+    memset(p[i], i, n);
+  }
+  for(i = 0; i < N; i += 2)
+    free(p[i]);
+  for(i = 0; i < N; i += 2)
+    p[i] = malloc((i % 16) * 97 + 1);
+  for(i = 1; i < N; i += 2){
+    n = (i % 16) * 97 + 1;
+    for(j = 0; j < n; j++)
+      if(p[i][j] != (char)i){
+        printf("%s: block %d corrupted\n", s, i);
+        exit(1);
+      }
+  }
+  for(i = 0; i < N; i++)
+    free(p[i]);
+
+  memstat(0, &before);
+  for(i = 0; i < 4; i++){
+    if((p[i] = malloc(BIG)) == 0){
+      printf("%s: malloc(%d) failed\n", s, BIG);
+      exit(1);
+    }
+    memset(p[i], i, BIG);
+  }
+  for(i = 0; i < 4; i++)
+    free(p[i]);
+  memstat(0, &after);
+  if(after.free + 4*BIG/PGSIZE/2 < before.free){
+    printf("%s: big blocks not returned (%d -> %d free)\n", s,
+           (int)before.free, (int)after.free);
+    exit(1);
+  }
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2877,9 +4055,31 @@ main(int argc, char *argv[])
     {rmdot, "rmdot"},
     {fourteen, "fourteen"},
     {bigfile, "bigfile"},
+    {interleave, "interleave"},
+    {inodewrap, "inodewrap"},
+    {namecache, "namecache"},
+    {fsynctest, "fsynctest"},
+    {directio, "directio"},
+    {preadv, "preadv"},
+    {sendfiletest, "sendfiletest"},
+    {piperesize, "piperesize"},
+    {tmpfs, "tmpfs"},
+    {priority, "priority"},
+    {cpustattest, "cpustattest"},
+    {threadtest, "threadtest"},
+    {sharedread, "sharedread"},
+    {nanosleeptest, "nanosleeptest"},
+    {usyscalltest, "usyscalltest"},
+    {tracetest, "tracetest"},
+    {sysstattest, "sysstattest"},
+    {uringtest, "uringtest"},
     {dirfile, "dirfile"},
     {iref, "iref"},
     {forktest, "forktest"},
+    {cowfork, "cowfork"},
+    {sbrklazy, "sbrklazy"},
+    {memstattest, "memstattest"},
+    {malloctest, "malloctest"},
     {bigdir, "bigdir"}, // slow
     { 0, 0},
   };
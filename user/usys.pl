@@ -6,10 +6,13 @@ print "# generated by usys.pl - do not edit\n";
 
 print "#include \"kernel/syscall.h\"\n";
 
+# entry("name", "stub") names the stub for system call
+# name, when a library function stands in front of it.
 sub entry {
     my $name = shift;
-    print ".global $name\n";
-    print "${name}:\n";
+    my $stub = shift || $name;
+    print ".global $stub\n";
+    print "${stub}:\n";
     print " li a7, SYS_${name}\n";
     print " ecall\n";
     print " ret\n";
@@ -32,9 +35,35 @@ entry("link");
 entry("mkdir");
 entry("chdir");
 entry("dup");
-entry("getpid");
+entry("getpid", "_getpid");
 entry("sbrk");
 entry("sleep");
-entry("uptime");
 entry("mmap");
 entry("munmap");
+entry("msync");
+entry("madvise");
+entry("memstat");
+entry("mremap");
+entry("fsync");
+entry("fdatasync");
+entry("pread");
+entry("pwrite");
+entry("readv");
+entry("writev");
+entry("sendfile");
+entry("fcntl");
+entry("setpriority");
+entry("cpustat");
+entry("clone");
+entry("futex");
+entry("lockstat");
+entry("spawn");
+entry("nanosleep");
+entry("trace");
+entry("traceread");
+entry("sysstat");
+entry("yield");
+entry("prof");
+entry("profread");
+entry("uringsetup");
+entry("uringenter");